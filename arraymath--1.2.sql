@@ -0,0 +1,1034 @@
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION arraymath" to load this file. \quit
+
+CREATE OR REPLACE FUNCTION array_compare_value(arr1 ANYARRAY, elt2 ANYELEMENT, op TEXT)
+	RETURNS boolean[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+	
+CREATE OR REPLACE FUNCTION array_equals_value(arr1 ANYARRAY, elt2 ANYELEMENT)
+	RETURNS boolean[]
+	AS 'SELECT array_compare_value($1,$2,''='')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_gt_value(arr1 ANYARRAY, elt2 ANYELEMENT)
+	RETURNS boolean[]
+	AS 'SELECT array_compare_value($1,$2,''>'')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_lt_value(arr1 ANYARRAY, elt2 ANYELEMENT)
+	RETURNS boolean[]
+	AS 'SELECT array_compare_value($1,$2,''<'')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_gte_value(arr1 ANYARRAY, elt2 ANYELEMENT)
+	RETURNS boolean[]
+	AS 'SELECT array_compare_value($1,$2,''>='')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_lte_value(arr1 ANYARRAY, elt2 ANYELEMENT)
+	RETURNS boolean[]
+	AS 'SELECT array_compare_value($1,$2,''<='')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+
+CREATE OR REPLACE FUNCTION value_equals_array(elt2 ANYELEMENT, arr1 ANYARRAY)
+	RETURNS boolean[]
+	AS 'SELECT array_compare_value($2,$1,''='')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION value_gt_array(elt2 ANYELEMENT, arr1 ANYARRAY)
+	RETURNS boolean[]
+	AS 'SELECT array_compare_value($2,$1,''>'')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION value_lt_array(elt2 ANYELEMENT, arr1 ANYARRAY)
+	RETURNS boolean[]
+	AS 'SELECT array_compare_value($2,$1,''<'')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION value_gte_array(elt2 ANYELEMENT, arr1 ANYARRAY)
+	RETURNS boolean[]
+	AS 'SELECT array_compare_value($2,$1,''>='')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION value_lte_array(elt2 ANYELEMENT, arr1 ANYARRAY)
+	RETURNS boolean[]
+	AS 'SELECT array_compare_value($2,$1,''<='')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+	
+	
+
+CREATE OPERATOR @= (
+    LEFTARG = anyarray, 
+    RIGHTARG = anyelement, 
+    PROCEDURE = array_equals_value
+);
+
+CREATE OPERATOR @< (
+    LEFTARG = anyarray, 
+    RIGHTARG = anyelement, 
+    PROCEDURE = array_lt_value
+);
+
+CREATE OPERATOR @<= (
+    LEFTARG = anyarray, 
+    RIGHTARG = anyelement, 
+    PROCEDURE = array_lte_value
+);
+
+CREATE OPERATOR @> (
+    LEFTARG = anyarray, 
+    RIGHTARG = anyelement, 
+    PROCEDURE = array_gt_value
+);
+
+CREATE OPERATOR @>= (
+    LEFTARG = anyarray, 
+    RIGHTARG = anyelement, 
+    PROCEDURE = array_gte_value
+);
+
+
+
+CREATE OPERATOR @= (
+    LEFTARG = anyelement, 
+    RIGHTARG = anyarray, 
+    PROCEDURE = value_equals_array
+);
+
+CREATE OPERATOR @< (
+    LEFTARG = anyelement, 
+    RIGHTARG = anyarray, 
+    PROCEDURE = value_lt_array
+);
+
+CREATE OPERATOR @<= (
+    LEFTARG = anyelement, 
+    RIGHTARG = anyarray, 
+    PROCEDURE = value_lte_array
+);
+
+CREATE OPERATOR @> (
+    LEFTARG = anyelement, 
+    RIGHTARG = anyarray, 
+    PROCEDURE = value_gt_array
+);
+
+CREATE OPERATOR @>= (
+    LEFTARG = anyelement, 
+    RIGHTARG = anyarray, 
+    PROCEDURE = value_gte_array
+);
+
+
+
+
+CREATE OR REPLACE FUNCTION array_math_support(internal)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_math_value(arr1 ANYARRAY, elt2 ANYELEMENT, op TEXT)
+	RETURNS anyarray
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT
+	SUPPORT array_math_support;
+
+
+
+CREATE OR REPLACE FUNCTION array_plus_value(arr1 ANYARRAY, elt2 ANYELEMENT)
+	RETURNS anyarray
+	AS 'SELECT array_math_value($1,$2,''+'')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION value_plus_array(elt2 ANYELEMENT, arr1 ANYARRAY)
+	RETURNS anyarray
+	AS 'SELECT array_math_value($2,$1,''+'')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OPERATOR @+ (
+    LEFTARG = anyarray, 
+    RIGHTARG = anyelement, 
+    PROCEDURE = array_plus_value
+);
+
+CREATE OPERATOR @+ (
+    LEFTARG = anyelement, 
+    RIGHTARG = anyarray, 
+    PROCEDURE = value_plus_array
+);
+
+
+CREATE OR REPLACE FUNCTION array_minus_value(arr1 ANYARRAY, elt2 ANYELEMENT)
+	RETURNS anyarray
+	AS 'SELECT array_math_value($1,$2,''-'')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION value_minus_array(elt2 ANYELEMENT, arr1 ANYARRAY)
+	RETURNS anyarray
+	AS 'SELECT array_math_value($2,$1,''-'')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OPERATOR @- (
+    LEFTARG = anyarray, 
+    RIGHTARG = anyelement, 
+    PROCEDURE = array_minus_value
+);
+
+CREATE OPERATOR @- (
+    LEFTARG = anyelement, 
+    RIGHTARG = anyarray, 
+    PROCEDURE = value_minus_array
+);
+
+
+CREATE OR REPLACE FUNCTION array_times_value(arr1 ANYARRAY, elt2 ANYELEMENT)
+	RETURNS anyarray
+	AS 'SELECT array_math_value($1,$2,''*'')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION value_times_array(elt2 ANYELEMENT, arr1 ANYARRAY)
+	RETURNS anyarray
+	AS 'SELECT array_math_value($2,$1,''*'')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OPERATOR @* (
+    LEFTARG = anyarray, 
+    RIGHTARG = anyelement, 
+    PROCEDURE = array_times_value
+);
+
+CREATE OPERATOR @* (
+    LEFTARG = anyelement, 
+    RIGHTARG = anyarray, 
+    PROCEDURE = value_times_array
+);
+
+
+CREATE OR REPLACE FUNCTION array_div_value(arr1 ANYARRAY, elt2 ANYELEMENT)
+	RETURNS anyarray
+	AS 'SELECT array_math_value($1,$2,''/'')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION value_div_array(elt2 ANYELEMENT, arr1 ANYARRAY)
+	RETURNS anyarray
+	AS 'SELECT array_math_value($2,$1,''/'')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OPERATOR @/ (
+    LEFTARG = anyarray, 
+    RIGHTARG = anyelement, 
+    PROCEDURE = array_div_value
+);
+
+CREATE OPERATOR @/ (
+    LEFTARG = anyelement, 
+    RIGHTARG = anyarray, 
+    PROCEDURE = value_div_array
+);
+
+
+
+CREATE OR REPLACE FUNCTION array_compare_array(arr1 ANYARRAY, arr2 ANYARRAY, op TEXT)
+	RETURNS boolean[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_equals_array(arr1 ANYARRAY, arr2 ANYARRAY)
+	RETURNS boolean[]
+	AS 'SELECT array_compare_array($1,$2,''='')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OPERATOR @= (
+    LEFTARG = anyarray, 
+    RIGHTARG = anyarray, 
+    PROCEDURE = array_equals_array
+);
+
+CREATE OR REPLACE FUNCTION array_lt_array(arr1 ANYARRAY, arr2 ANYARRAY)
+	RETURNS boolean[]
+	AS 'SELECT array_compare_array($1,$2,''<'')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OPERATOR @< (
+    LEFTARG = anyarray, 
+    RIGHTARG = anyarray, 
+    PROCEDURE = array_lt_array
+);
+
+CREATE OR REPLACE FUNCTION array_gt_array(arr1 ANYARRAY, arr2 ANYARRAY)
+	RETURNS boolean[]
+	AS 'SELECT array_compare_array($1,$2,''>'')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OPERATOR @> (
+    LEFTARG = anyarray, 
+    RIGHTARG = anyarray, 
+    PROCEDURE = array_gt_array
+);
+
+CREATE OR REPLACE FUNCTION array_lte_array(arr1 ANYARRAY, arr2 ANYARRAY)
+	RETURNS boolean[]
+	AS 'SELECT array_compare_array($1,$2,''<='')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OPERATOR @<= (
+    LEFTARG = anyarray, 
+    RIGHTARG = anyarray, 
+    PROCEDURE = array_lte_array
+);
+
+CREATE OR REPLACE FUNCTION array_gte_array(arr1 ANYARRAY, arr2 ANYARRAY)
+	RETURNS boolean[]
+	AS 'SELECT array_compare_array($1,$2,''>='')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OPERATOR @>= (
+    LEFTARG = anyarray, 
+    RIGHTARG = anyarray, 
+    PROCEDURE = array_gte_array
+);
+
+
+CREATE OR REPLACE FUNCTION array_math_array(arr1 ANYARRAY, arr2 ANYARRAY, op TEXT)
+	RETURNS anyarray
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT
+	SUPPORT array_math_support;
+
+CREATE OR REPLACE FUNCTION array_plus_array(arr1 ANYARRAY, arr2 ANYARRAY)
+	RETURNS anyarray
+	AS 'SELECT array_math_array($1,$2,''+'')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OPERATOR @+ (
+    LEFTARG = anyarray, 
+    RIGHTARG = anyarray, 
+    PROCEDURE = array_plus_array
+);
+
+CREATE OR REPLACE FUNCTION array_minus_array(arr1 ANYARRAY, arr2 ANYARRAY)
+	RETURNS anyarray
+	AS 'SELECT array_math_array($1,$2,''-'')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OPERATOR @- (
+    LEFTARG = anyarray, 
+    RIGHTARG = anyarray, 
+    PROCEDURE = array_minus_array
+);
+
+CREATE OR REPLACE FUNCTION array_times_array(arr1 ANYARRAY, arr2 ANYARRAY)
+	RETURNS anyarray
+	AS 'SELECT array_math_array($1,$2,''*'')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+
+CREATE OPERATOR @* (
+    LEFTARG = anyarray, 
+    RIGHTARG = anyarray, 
+    PROCEDURE = array_times_array
+);
+
+CREATE OR REPLACE FUNCTION array_div_array(arr1 ANYARRAY, arr2 ANYARRAY)
+	RETURNS anyarray
+	AS 'SELECT array_math_array($1,$2,''/'')'
+	LANGUAGE 'sql'
+	IMMUTABLE STRICT;
+	
+CREATE OPERATOR @/ (
+    LEFTARG = anyarray, 
+    RIGHTARG = anyarray, 
+    PROCEDURE = array_div_array
+);
+
+
+CREATE OR REPLACE FUNCTION array_sum(arr anyarray)
+	RETURNS ANYELEMENT
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_avg(arr anyarray)
+	RETURNS float8
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_median(arr anyarray)
+	RETURNS float8
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_min(arr anyarray)
+	RETURNS ANYELEMENT
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_max(arr anyarray)
+	RETURNS ANYELEMENT
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_sort(arr anyarray, reverse boolean DEFAULT false)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_sum_wide(arr int2[])
+	RETURNS int8
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_sum_wide(arr int4[])
+	RETURNS int8
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_sum_wide(arr int8[])
+	RETURNS numeric
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_sum_wide(arr float4[])
+	RETURNS float8
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_sum_wide(arr float8[])
+	RETURNS float8
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_sum_wide(arr numeric[])
+	RETURNS numeric
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_percentile(arr anyarray, percentiles float8[])
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_sort(arr anyarray, reverse boolean, nulls_first boolean)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_vsum_accum(state internal, arr anyarray)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION array_vavg_accum(state internal, arr anyarray)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION array_vmin_accum(state internal, arr anyarray)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION array_vmax_accum(state internal, arr anyarray)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION array_vagg_combine(state1 internal, state2 internal)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION array_vagg_serialize(state internal)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION array_vagg_deserialize(state bytea, dummy internal)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION array_vagg_final(state internal, arr anyarray)
+	RETURNS anyarray
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION array_vavg_final(state internal)
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE array_vsum(anyarray) (
+	SFUNC = array_vsum_accum,
+	STYPE = internal,
+	FINALFUNC = array_vagg_final,
+	FINALFUNC_EXTRA,
+	COMBINEFUNC = array_vagg_combine,
+	SERIALFUNC = array_vagg_serialize,
+	DESERIALFUNC = array_vagg_deserialize,
+	PARALLEL = SAFE
+);
+
+CREATE AGGREGATE array_vavg(anyarray) (
+	SFUNC = array_vavg_accum,
+	STYPE = internal,
+	FINALFUNC = array_vavg_final,
+	COMBINEFUNC = array_vagg_combine,
+	SERIALFUNC = array_vagg_serialize,
+	DESERIALFUNC = array_vagg_deserialize,
+	PARALLEL = SAFE
+);
+
+CREATE AGGREGATE array_vmin(anyarray) (
+	SFUNC = array_vmin_accum,
+	STYPE = internal,
+	FINALFUNC = array_vagg_final,
+	FINALFUNC_EXTRA,
+	COMBINEFUNC = array_vagg_combine,
+	SERIALFUNC = array_vagg_serialize,
+	DESERIALFUNC = array_vagg_deserialize,
+	PARALLEL = SAFE
+);
+
+CREATE AGGREGATE array_vmax(anyarray) (
+	SFUNC = array_vmax_accum,
+	STYPE = internal,
+	FINALFUNC = array_vagg_final,
+	FINALFUNC_EXTRA,
+	COMBINEFUNC = array_vagg_combine,
+	SERIALFUNC = array_vagg_serialize,
+	DESERIALFUNC = array_vagg_deserialize,
+	PARALLEL = SAFE
+);
+
+CREATE OR REPLACE FUNCTION array_eval(expr text, VARIADIC arrs anyarray)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_sum(arr anyarray, axis int4)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME', 'array_sum_axis'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_avg(arr anyarray, axis int4)
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME', 'array_avg_axis'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_min(arr anyarray, axis int4)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME', 'array_min_axis'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_max(arr anyarray, axis int4)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME', 'array_max_axis'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_median(arr anyarray, axis int4)
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME', 'array_median_axis'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_dot(arr1 anyarray, arr2 anyarray)
+	RETURNS float8
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_negative_dot(arr1 anyarray, arr2 anyarray)
+	RETURNS float8
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_l1_distance(arr1 anyarray, arr2 anyarray)
+	RETURNS float8
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_l2_distance(arr1 anyarray, arr2 anyarray)
+	RETURNS float8
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_cosine_similarity(arr1 anyarray, arr2 anyarray)
+	RETURNS float8
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_cosine_distance(arr1 anyarray, arr2 anyarray)
+	RETURNS float8
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_norm(arr anyarray)
+	RETURNS float8
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OPERATOR <-> (
+    LEFTARG = anyarray,
+    RIGHTARG = anyarray,
+    PROCEDURE = array_l2_distance,
+    COMMUTATOR = <->
+);
+
+CREATE OPERATOR <#> (
+    LEFTARG = anyarray,
+    RIGHTARG = anyarray,
+    PROCEDURE = array_negative_dot,
+    COMMUTATOR = <#>
+);
+
+CREATE OPERATOR <=> (
+    LEFTARG = anyarray,
+    RIGHTARG = anyarray,
+    PROCEDURE = array_cosine_distance,
+    COMMUTATOR = <=>
+);
+
+CREATE OPERATOR <+> (
+    LEFTARG = anyarray,
+    RIGHTARG = anyarray,
+    PROCEDURE = array_l1_distance,
+    COMMUTATOR = <+>
+);
+
+CREATE OR REPLACE FUNCTION array_topk(arr anyarray, k int4)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_bottomk(arr anyarray, k int4)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_argtopk(arr anyarray, k int4)
+	RETURNS int4[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_argbottomk(arr anyarray, k int4)
+	RETURNS int4[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_stats(arr anyarray,
+	OUT count int8, OUT nulls int8, OUT sum anyelement,
+	OUT min anyelement, OUT max anyelement,
+	OUT mean float8, OUT variance float8, OUT stddev float8)
+	RETURNS record
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_cumsum(arr anyarray)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_cumprod(arr anyarray)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_diff(arr anyarray, lag int4 DEFAULT 1)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_moving_sum(arr anyarray, width int4)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_moving_avg(arr anyarray, width int4)
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_moving_min(arr anyarray, width int4)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_moving_max(arr anyarray, width int4)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_abs(arr anyarray)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_round(arr anyarray, digits int4 DEFAULT 0)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_clamp(arr anyarray, lo anyelement, hi anyelement)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_sqrt(arr int2[])
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_sqrt(arr int4[])
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_sqrt(arr int8[])
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_sqrt(arr float4[])
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_sqrt(arr float8[])
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_sqrt(arr numeric[])
+	RETURNS numeric[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_exp(arr int2[])
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_exp(arr int4[])
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_exp(arr int8[])
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_exp(arr float4[])
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_exp(arr float8[])
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_exp(arr numeric[])
+	RETURNS numeric[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_ln(arr int2[])
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_ln(arr int4[])
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_ln(arr int8[])
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_ln(arr float4[])
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_ln(arr float8[])
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_ln(arr numeric[])
+	RETURNS numeric[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_pow(arr int2[], p float8)
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_pow(arr int4[], p float8)
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_pow(arr int8[], p float8)
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_pow(arr float4[], p float8)
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_pow(arr float8[], p float8)
+	RETURNS float8[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_pow(arr numeric[], p numeric)
+	RETURNS numeric[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_count(arr anyarray, op text, value anyelement)
+	RETURNS int8
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_any(arr anyarray, op text, value anyelement)
+	RETURNS boolean
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_all(arr anyarray, op text, value anyelement)
+	RETURNS boolean
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_where(arr anyarray, op text, value anyelement)
+	RETURNS int4[]
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_select(arr anyarray, op text, value anyelement)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_select(vals anycompatiblearray, arr anyarray, op text, value anyelement)
+	RETURNS anycompatiblearray
+	AS 'MODULE_PATHNAME', 'array_select_values'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_matmul(a anyarray, b anyarray)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_matvec(a anyarray, v anyarray)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_transpose(a anyarray)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_outer(a anyarray, b anyarray)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_searchsorted(sorted anyarray, value anyelement, rightmost boolean DEFAULT false)
+	RETURNS int4
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_searchsorted(sorted anyarray, vals anyarray, rightmost boolean DEFAULT false)
+	RETURNS int4[]
+	AS 'MODULE_PATHNAME', 'array_searchsorted_array'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_merge_sorted(a anyarray, b anyarray)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_intersect_sorted(a anyarray, b anyarray)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_except_sorted(a anyarray, b anyarray)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_uniq(arr anyarray)
+	RETURNS ANYARRAY
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_count_distinct(arr anyarray)
+	RETURNS int8
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_mode(arr anyarray)
+	RETURNS ANYELEMENT
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION array_value_counts(arr anyarray,
+	OUT vals anyarray, OUT counts int8[])
+	RETURNS record
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION arraymath_stats(
+	OUT kind text, OUT name text, OUT calls int8,
+	OUT elements int8, OUT nulls int8,
+	OUT bytes_detoasted int8, OUT total_ns int8)
+	RETURNS SETOF record
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	VOLATILE STRICT;
+
+CREATE OR REPLACE VIEW arraymath_stats AS
+	SELECT * FROM arraymath_stats();
+
+CREATE OR REPLACE FUNCTION arraymath_stats_reset()
+	RETURNS void
+	AS 'MODULE_PATHNAME'
+	LANGUAGE 'c'
+	VOLATILE STRICT;
+
+REVOKE ALL ON FUNCTION arraymath_stats_reset() FROM PUBLIC;
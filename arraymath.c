@@ -27,7 +27,7 @@
  *
  ***********************************************************************/
 
-#define ARRAYMATH_VERSION "1.1"
+#define ARRAYMATH_VERSION "1.2"
 
 
 /* PostgreSQL */
@@ -35,6 +35,7 @@
 #include <pg_config.h>
 #include <fmgr.h>
 #include <funcapi.h>
+#include <lib/stringinfo.h>
 
 /* Include for VARATT_EXTERNAL_GET_POINTER */
 #if PG_VERSION_NUM < 130000
@@ -43,16 +44,43 @@
 #  include <access/detoast.h>
 #endif
 
+#include <access/htup_details.h>
 #include <catalog/namespace.h>
 #include <catalog/pg_operator.h>
 #include <catalog/pg_type.h>
 #include <catalog/pg_cast.h>
+#include <libpq/pqformat.h>
+#include <miscadmin.h>
+#include <nodes/primnodes.h>
+#include <nodes/supportnodes.h>
 #include <nodes/value.h>
+#include <port/atomics.h>
+#include <port/pg_bitutils.h>
+#include <portability/instr_time.h>
+#include <storage/ipc.h>
+#include <storage/lwlock.h>
+#include <storage/shmem.h>
 #include <utils/array.h>
 #include <utils/builtins.h>
+#include <utils/datum.h>
+#include <utils/expandeddatum.h>
+#include <utils/float.h>
+#include <utils/fmgroids.h>
+#include <utils/guc.h>
+#include <utils/lsyscache.h>
+#include <utils/memutils.h>
 #include <utils/syscache.h>
 #include <utils/typcache.h>
 #include <utils/numeric.h>
+#include <utils/sortsupport.h>
+
+/* System */
+#include <limits.h>
+#include <ctype.h>
+#include <math.h>
+
+/* Native kernels */
+#include "arraymath_kernels.h"
 
 
 /**********************************************************************
@@ -62,11 +90,24 @@
 /* Set up PgSQL */
 PG_MODULE_MAGIC;
 
+static void arraymath_simd_init(void);
+static void arraymath_track_init(void);
+static void arraymath_parallel_init(void);
+
 /* Startup */
 void _PG_init(void);
 void _PG_init(void)
 {
     elog(NOTICE, "Hello from ArrayMath %s", ARRAYMATH_VERSION);
+
+    arraymath_simd_init();
+    arraymath_track_init();
+    arraymath_parallel_init();
+#if PG_VERSION_NUM >= 150000
+    MarkGUCPrefixReserved("arraymath");
+#else
+    EmitWarningsOnPlaceholders("arraymath");
+#endif
 }
 
 /* Tear-down */
@@ -95,822 +136,6997 @@ void _PG_fini(void)
 #define BITMAP_ISNULL(bitmap, bitmask) (bitmap && (*bitmap & bitmask) == 0)
 
 /**********************************************************************
-* Functions
+* Per-call-site cache
 */
 
-static void
-arraymath_check_type(Oid elmtype)
+/*
+* Storage details of an element type, copied out of the typcache
+* so the per-row code does not need to go back and ask.
+*/
+typedef struct ArrayMathTypeInfo
 {
-    /* Initialize result value */
-    if (elmtype != INT2OID   &&
-        elmtype != INT4OID   &&
-        elmtype != INT8OID   &&
-        elmtype != FLOAT4OID &&
-        elmtype != FLOAT8OID &&
-        elmtype != NUMERICOID)
+    Oid   type;
+    int16 typlen;
+    bool  typbyval;
+    char  typalign;
+} ArrayMathTypeInfo;
+
+/* Compiled array_eval() expression, see arraymath_plan_get() */
+typedef struct ArrayMathPlan ArrayMathPlan;
+
+/*
+* Everything the SQL-callable functions resolve from the catalog,
+* hung off flinfo->fn_extra and allocated in fn_mcxt. Each section
+* carries its own lookup key, so a call site that sees a different
+* operator or element type simply re-resolves that section.
+*/
+typedef struct ArrayMathCache
+{
+    MemoryContext mcxt;
+
+    /* Operator, keyed by (opname, element_type1, element_type2) */
+    bool oper_valid;
+    char opname[NAMEDATALEN];
+    FmgrInfo operfmgrinfo;
+    ArrayMathTypeInfo info1;
+    ArrayMathTypeInfo info2;
+    ArrayMathTypeInfo rinfo;
+    /* Native kernel for the operator, if there is one */
+    bool oper_native;
+    ArrayMathKernelOp native_op;
+    ArrayMathKernelType native_type;
+
+    /* Cast, keyed by (cast_src, cast_dst) */
+    bool cast_valid;
+    Oid cast_src;
+    Oid cast_dst;
+    FmgrInfo castfmgrinfo;
+
+    /* Comparison support, keyed by cmpinfo.type */
+    bool cmp_valid;
+    ArrayMathTypeInfo cmpinfo;
+    FmgrInfo cmpfmgrinfo;
+
+    /* Hash support, keyed by hash_type */
+    bool hash_valid;
+    Oid hash_type;
+    FmgrInfo hashfmgrinfo;
+    FmgrInfo eqfmgrinfo;
+
+    /* Expression plan, keyed by (expression, element type) */
+    ArrayMathPlan *plan;
+} ArrayMathCache;
+
+/**********************************************************************
+* Native kernels
+*/
+
+/* Kernels in use */
+static const ArrayMathKernels *arraymath_kernels = &arraymath_kernels_scalar;
+
+/*
+* The arraymath.simd setting picks which build of the kernels runs:
+* the best one the CPU supports, or a given one, for testing and
+* comparison. A build that the CPU cannot run is refused.
+*/
+typedef enum
+{
+    ARRAYMATH_SIMD_AUTO = 0,
+    ARRAYMATH_SIMD_SCALAR,
+    ARRAYMATH_SIMD_AVX2,
+    ARRAYMATH_SIMD_AVX512
+} ArrayMathSimd;
+
+static const struct config_enum_entry arraymath_simd_options[] = {
+    {"auto", ARRAYMATH_SIMD_AUTO, false},
+    {"scalar", ARRAYMATH_SIMD_SCALAR, false},
+    {"avx2", ARRAYMATH_SIMD_AVX2, false},
+    {"avx512", ARRAYMATH_SIMD_AVX512, false},
+    {NULL, 0, false}
+};
+
+static int arraymath_simd = ARRAYMATH_SIMD_AUTO;
+
+/*
+* Kernels for a setting, or NULL if this build or CPU has none.
+*/
+static const ArrayMathKernels *
+arraymath_simd_kernels(int simd)
+{
+#ifdef ARRAYMATH_X86_KERNELS
+    __builtin_cpu_init();
+#endif
+
+    switch (simd)
     {
-        ereport(ERROR, (
-            errmsg(
-                "Array type must be NUMERIC, SMALLINT, INTEGER, BIGINT, REAL, or DOUBLE PRECISION"
-                )));
+        case ARRAYMATH_SIMD_AUTO:
+            if (arraymath_simd_kernels(ARRAYMATH_SIMD_AVX512))
+                return arraymath_simd_kernels(ARRAYMATH_SIMD_AVX512);
+            if (arraymath_simd_kernels(ARRAYMATH_SIMD_AVX2))
+                return arraymath_simd_kernels(ARRAYMATH_SIMD_AVX2);
+            return &arraymath_kernels_scalar;
+
+        case ARRAYMATH_SIMD_SCALAR:
+            return &arraymath_kernels_scalar;
+
+#ifdef ARRAYMATH_X86_KERNELS
+        case ARRAYMATH_SIMD_AVX2:
+            if (__builtin_cpu_supports("avx2"))
+                return &arraymath_kernels_avx2;
+            break;
+
+        case ARRAYMATH_SIMD_AVX512:
+            if (__builtin_cpu_supports("avx512f") &&
+                __builtin_cpu_supports("avx512bw") &&
+                __builtin_cpu_supports("avx512dq") &&
+                __builtin_cpu_supports("avx512vl"))
+                return &arraymath_kernels_avx512;
+            break;
+#endif
+
+        default:
+            break;
     }
+    return NULL;
 }
 
-static ArrayIterator
-arraymath_create_iterator(ArrayType *arr)
+static bool
+arraymath_simd_check(int *newval, void **extra, GucSource source)
 {
-#if PG_VERSION_NUM >= 90500
-    return array_create_iterator(arr, 0, NULL);
-#else
-    return array_create_iterator(arr, 0);
-#endif
+    if (arraymath_simd_kernels(*newval))
+        return true;
+
+    GUC_check_errdetail("The %s kernels are not available on this CPU.",
+        arraymath_simd_options[*newval].name);
+    return false;
 }
 
-static Numeric
-arraymath_int64_to_numeric(int64 i)
+static void
+arraymath_simd_assign(int newval, void *extra)
 {
-#if PG_VERSION_NUM >= 140000
-    return int64_to_numeric(i);
-#else
-    return DatumGetNumeric(Int64GetDatum(i));
-#endif
+    arraymath_kernels = arraymath_simd_kernels(newval);
 }
 
+static void
+arraymath_simd_init(void)
+{
+    DefineCustomEnumVariable("arraymath.simd",
+                             "Selects the instruction set of the array kernels.",
+                             "auto uses the widest one the CPU supports.",
+                             &arraymath_simd,
+                             ARRAYMATH_SIMD_AUTO,
+                             arraymath_simd_options,
+                             PGC_USERSET,
+                             0,
+                             arraymath_simd_check,
+                             arraymath_simd_assign,
+                             NULL);
+}
 
 /*
-* Given an operator symbol ("+", "-", "=" etc) and type element types,
-* try to look up the appropriate function to do element level operations of
-* that type.
+* Native kernels over at least arraymath.parallel_threshold elements
+* are shared out among up to arraymath.max_threads threads, the
+* backend's own included. The work is cut into parts of a fixed
+* number of elements, and the results of the parts are combined in
+* order, so an answer depends only on the input, never on how many
+* threads there were or which of them finished first.
 */
-static void
-arraymath_fmgrinfo_from_optype(const char *opstr, Oid element_type1,
-                               Oid element_type2, FmgrInfo *operfmgrinfo, Oid *return_type)
-{
-    Oid operator_oid;
-    HeapTuple opertup;
-    Form_pg_operator operform;
+#define ARRAYMATH_PARALLEL_PART 65536
+#define ARRAYMATH_MAX_THREADS 64
 
-    /* Look up the operator Oid that corresponds to this combination */
-    /* of symbol and data types */
-    operator_oid = OpernameGetOprid(list_make1(makeString(pstrdup(opstr))), element_type1, element_type2);
-    if ( ! (operator_oid && OperatorIsVisible(operator_oid)) )
-    {
-        elog(ERROR, "operator does not exist");
-    }
+static int arraymath_parallel_threshold = 1000000;
+static int arraymath_max_threads = 1;
 
-    /* Lookup the function associated with the operator Oid */
-    opertup = SearchSysCache1(OPEROID, ObjectIdGetDatum(operator_oid));
-    if (! HeapTupleIsValid(opertup))
-    {
-        elog(ERROR, "cannot find operator heap tuple");
-    }
+static void
+arraymath_parallel_init(void)
+{
+    DefineCustomIntVariable("arraymath.parallel_threshold",
+                            "Sets the least number of elements for which the array kernels use worker threads.",
+                            NULL,
+                            &arraymath_parallel_threshold,
+                            1000000,
+                            ARRAYMATH_PARALLEL_PART,
+                            INT_MAX,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("arraymath.max_threads",
+                            "Sets the most threads, the backend included, that one array kernel can use.",
+                            "1 runs every kernel in the backend alone.",
+                            &arraymath_max_threads,
+                            1,
+                            1,
+                            ARRAYMATH_MAX_THREADS,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+}
 
-    operform = (Form_pg_operator) GETSTRUCT(opertup);
-    *return_type = operform->oprresult;
+/* Parts to cut n elements into */
+#define ARRAYMATH_PARALLEL_PARTS(n) \
+    (((n) + ARRAYMATH_PARALLEL_PART - 1) / ARRAYMATH_PARALLEL_PART)
 
-    fmgr_info(operform->oprcode, operfmgrinfo);
-    ReleaseSysCache(opertup);
+/* Elements in a part */
+#define ARRAYMATH_PARALLEL_COUNT(n, part) \
+    Min(ARRAYMATH_PARALLEL_PART, (n) - (part) * ARRAYMATH_PARALLEL_PART)
 
-    return;
+/* Threads to run a kernel over n elements on, 1 for none but our own */
+static int
+arraymath_parallel_threads(int n)
+{
+    if (arraymath_max_threads <= 1 || n < arraymath_parallel_threshold)
+        return 1;
+    return Min(arraymath_max_threads, ARRAYMATH_PARALLEL_PARTS(n));
 }
 
-
 /*
-* Given an a source and target type, look up the casting function.
+* A binary or unary kernel over n elements, cut into parts, each
+* writing its status to its own slot. A scalar side stays put.
 */
-static void
-arraymath_fmgrinfo_from_cast(Oid castSrcType, Oid castDstType, FmgrInfo *castfmgrinfo)
+typedef struct
 {
-    HeapTuple casttup;
-    Form_pg_cast castform;
+    ArrayMathBinaryKernel binary;
+    ArrayMathUnaryKernel unary;
+    ArrayMathKernelShape shape;
+    const char *a;
+    const char *b;
+    const ArrayMathUnaryArgs *args;
+    char *out;
+    int insize;
+    int outsize;
+    int n;
+    ArrayMathStatus *status;
+} ArrayMathParallelJob;
 
-    /* Lookup the function associated with the operator Oid */
-    casttup = SearchSysCache2(CASTSOURCETARGET,
-        ObjectIdGetDatum(castSrcType),
-        ObjectIdGetDatum(castDstType));
+static void
+arraymath_parallel_part(void *arg, int part)
+{
+    const ArrayMathParallelJob *job = (const ArrayMathParallelJob *) arg;
+    Size start = (Size) part * ARRAYMATH_PARALLEL_PART;
+    int count = ARRAYMATH_PARALLEL_COUNT(job->n, part);
+    const char *a = job->a;
+    const char *b = job->b;
 
-    if (! HeapTupleIsValid(casttup))
+    if (job->unary)
     {
-        elog(ERROR, "cannot find cast from %s to %s",
-            format_type_be(castSrcType),
-            format_type_be(castDstType));
+        job->status[part] = job->unary(a + start * job->insize, job->args,
+                                       job->out + start * job->outsize, count);
+        return;
     }
 
-    castform = (Form_pg_cast) GETSTRUCT(casttup);
-    fmgr_info(castform->castfunc, castfmgrinfo);
-    ReleaseSysCache(casttup);
-
-    return;
+    if (job->shape != AM_SHAPE_SCALAR_ARRAY)
+        a += start * job->insize;
+    if (job->shape != AM_SHAPE_ARRAY_SCALAR)
+        b += start * job->insize;
+    job->status[part] = job->binary(a, b, job->out + start * job->outsize, count);
 }
 
-
 /*
-* Read type information for a given element type.
+* Run a job on nthreads threads. Kernels fold the flags of all their
+* elements together, so the parts' statuses are too.
 */
-static TypeCacheEntry *
-arraymath_typentry_from_type(Oid element_type, int flags)
+static ArrayMathStatus
+arraymath_parallel_job(ArrayMathParallelJob *job, int nthreads)
 {
-    TypeCacheEntry *typentry;
-    typentry = lookup_type_cache(element_type, flags);
-    if (!typentry)
-    {
-        elog(ERROR, "unable to lookup element type info for %s",
-            format_type_be(element_type));
-    }
-    return typentry;
+    int nparts = ARRAYMATH_PARALLEL_PARTS(job->n);
+    ArrayMathStatus status = AM_OK;
+
+    job->status = palloc(sizeof(ArrayMathStatus) * nparts);
+    arraymath_parallel_run(arraymath_parallel_part, job, nparts, nthreads);
+    for (int i = 0; i < nparts; i++)
+        status |= job->status[i];
+    pfree(job->status);
+    return status;
 }
 
+static ArrayMathStatus
+arraymath_binary_run(ArrayMathKernelShape shape, ArrayMathKernelOp op, ArrayMathKernelType type,
+                     const void *a, const void *b, void *out, int n)
+{
+    ArrayMathBinaryKernel kernel = arraymath_kernels->binary[shape][op][type];
+    int nthreads = arraymath_parallel_threads(n);
+    ArrayMathParallelJob job = {0};
+
+    if (nthreads <= 1)
+        return kernel(a, b, out, n);
+
+    job.binary = kernel;
+    job.shape = shape;
+    job.a = a;
+    job.b = b;
+    job.out = out;
+    job.insize = arraymath_kernel_type_size[type];
+    job.outsize = arraymath_kernel_out_size(op, type);
+    job.n = n;
+    return arraymath_parallel_job(&job, nthreads);
+}
 
 /*
-* Apply an operator using an element over all the elements
-* of an array.
+* arraymath_kernel_apply(), which goes through the shapes above for
+* everything but the wrapping of two arrays of different lengths
 */
-static ArrayType *
-arraymath_array_oper_elem(ArrayType *array1, const char *opname, Datum element2, Oid element_type2)
+static ArrayMathStatus
+arraymath_apply_run(ArrayMathKernelOp op, ArrayMathKernelType type,
+                    const void *a, int na, const void *b, int nb, void *out)
 {
-    ArrayType *array_out;
-    int    dims[1];
-    int    lbs[1];
-    Datum *elems;
-    bool *nulls;
-
-    int ndims1 = ARR_NDIM(array1);
-    int *dims1 = ARR_DIMS(array1);
-    Oid element_type1 = ARR_ELEMTYPE(array1);
-    Oid rtype;
-    int nelems, n = 0;
-    FmgrInfo operfmgrinfo;
-    TypeCacheEntry *tinfo;
-    ArrayIterator iterator1;
-    Datum element1;
-    bool isnull1;
+    if (nb == 1)
+        return arraymath_binary_run(AM_SHAPE_ARRAY_SCALAR, op, type, a, b, out, na);
+    if (na == 1)
+        return arraymath_binary_run(AM_SHAPE_SCALAR_ARRAY, op, type, a, b, out, nb);
+    if (na == nb)
+        return arraymath_binary_run(AM_SHAPE_ARRAY_ARRAY, op, type, a, b, out, na);
+    return arraymath_kernel_apply(arraymath_kernels, op, type, a, na, b, nb, out);
+}
 
-    /* Only 1D arrays for now */
-    if (ndims1 != 1)
-    {
-        elog(ERROR, "only one-dimensional arrays are supported");
-        return NULL;
-    }
+static ArrayMathStatus
+arraymath_unary_run(ArrayMathUnaryOp op, ArrayMathKernelType type,
+                    const void *in, const ArrayMathUnaryArgs *args, void *out, int n)
+{
+    ArrayMathUnaryKernel kernel = arraymath_kernels->unary[op][type];
+    int nthreads = arraymath_parallel_threads(n);
+    ArrayMathParallelJob job = {0};
+
+    if (nthreads <= 1)
+        return kernel(in, args, out, n);
+
+    job.unary = kernel;
+    job.a = in;
+    job.args = args;
+    job.out = out;
+    job.insize = arraymath_kernel_type_size[type];
+    job.outsize = arraymath_unary_out_size(op, type);
+    job.n = n;
+    return arraymath_parallel_job(&job, nthreads);
+}
 
-    /* What function works for these input types? Populate operfmgrinfo. */
-    /* What data type will the output array be? */
-    arraymath_fmgrinfo_from_optype(opname, element_type1, element_type2, &operfmgrinfo, &rtype);
+/* A sum over n values, one state for each part */
+typedef struct
+{
+    const char *data;
+    int size;
+    int n;
+    ArrayMathSumState *parts;
+} ArrayMathParallelSum;
 
-    /* How big is the output array? */
-    nelems = ArrayGetNItems(ndims1, dims1);
+static void
+arraymath_parallel_sum_part(void *arg, int part)
+{
+    const ArrayMathParallelSum *job = (const ArrayMathParallelSum *) arg;
+    ArrayMathSumState *state = &job->parts[part];
 
-    /* If input is empty, return empty */
-    if (nelems == 0)
-    {
-        return construct_empty_array(rtype);
-    }
+    arraymath_sum_accum(state, job->data + (Size) part * ARRAYMATH_PARALLEL_PART * job->size,
+                        ARRAYMATH_PARALLEL_COUNT(job->n, part));
+}
 
-    iterator1 = arraymath_create_iterator(array1);
+/*
+* Add n values to a sum, with the parts merged in order. They are
+* cut up the same way with or without threads, since merging float
+* parts rounds differently from one running sum, and even a single
+* part is merged in, so that runs of whole parts fed in one after
+* another add up as they would all at once.
+*/
+static void
+arraymath_sum_run(ArrayMathSumState *state, const void *data, int n)
+{
+    int nthreads = arraymath_parallel_threads(n);
+    int nparts = ARRAYMATH_PARALLEL_PARTS(n);
+    ArrayMathParallelSum job;
 
-    /* Allocate space for output data */
-    elems = palloc(sizeof(Datum)*nelems);
-    nulls = palloc(sizeof(bool)*nelems);
+    job.data = data;
+    job.size = arraymath_kernel_type_size[state->type];
+    job.n = n;
 
-    while (array_iterate(iterator1, &element1, &isnull1))
+    if (nthreads <= 1)
     {
-        if (isnull1)
-        {
-            nulls[n] = true;
-            elems[n] = (Datum) 0;
-        }
-        else
+        for (int i = 0; i < nparts; i++)
         {
-            /* Apply the operator */
-            nulls[n] = false;
-            elems[n] = FunctionCall2(&operfmgrinfo, element1, element2);
+            ArrayMathSumState part;
+
+            arraymath_sum_init(&part, state->type);
+            arraymath_sum_accum(&part, job.data + (Size) i * ARRAYMATH_PARALLEL_PART * job.size,
+                                ARRAYMATH_PARALLEL_COUNT(n, i));
+            arraymath_sum_merge(state, &part);
         }
-        n++;
+        return;
     }
 
-    /* Build 1-d output array */
-    tinfo = arraymath_typentry_from_type(rtype, 0);
-    dims[0] = nelems;
-    lbs[0] = 1;
-    array_out = construct_md_array(elems, nulls, 1, dims, lbs, rtype, tinfo->typlen, tinfo->typbyval, tinfo->typalign);
+    job.parts = palloc(sizeof(ArrayMathSumState) * nparts);
+    for (int i = 0; i < nparts; i++)
+        arraymath_sum_init(&job.parts[i], state->type);
 
-    /* Output is supposed to be a copy, so free the inputs */
-    pfree(elems);
-    pfree(nulls);
+    arraymath_parallel_run(arraymath_parallel_sum_part, &job, nparts, nthreads);
+    for (int i = 0; i < nparts; i++)
+        arraymath_sum_merge(state, &job.parts[i]);
+    pfree(job.parts);
+}
 
-    /* Make sure we haven't been given garbage */
-    if (!array_out)
+/*
+* Built-in operator functions that have a native kernel. Matching
+* on the function (rather than the operator) means any operator that
+* resolves to something else takes the generic fmgr path.
+*/
+typedef struct
+{
+    Oid fnoid;
+    ArrayMathKernelOp op;
+    ArrayMathKernelType type;
+} ArrayMathNativeOper;
+
+static const ArrayMathNativeOper arraymath_native_opers[] = {
+    { F_INT2PL,    AM_OP_ADD, AM_TYPE_INT2 },
+    { F_INT2MI,    AM_OP_SUB, AM_TYPE_INT2 },
+    { F_INT2MUL,   AM_OP_MUL, AM_TYPE_INT2 },
+    { F_INT2DIV,   AM_OP_DIV, AM_TYPE_INT2 },
+    { F_INT2EQ,    AM_OP_EQ,  AM_TYPE_INT2 },
+    { F_INT2LT,    AM_OP_LT,  AM_TYPE_INT2 },
+    { F_INT2GT,    AM_OP_GT,  AM_TYPE_INT2 },
+    { F_INT2LE,    AM_OP_LE,  AM_TYPE_INT2 },
+    { F_INT2GE,    AM_OP_GE,  AM_TYPE_INT2 },
+    { F_INT4PL,    AM_OP_ADD, AM_TYPE_INT4 },
+    { F_INT4MI,    AM_OP_SUB, AM_TYPE_INT4 },
+    { F_INT4MUL,   AM_OP_MUL, AM_TYPE_INT4 },
+    { F_INT4DIV,   AM_OP_DIV, AM_TYPE_INT4 },
+    { F_INT4EQ,    AM_OP_EQ,  AM_TYPE_INT4 },
+    { F_INT4LT,    AM_OP_LT,  AM_TYPE_INT4 },
+    { F_INT4GT,    AM_OP_GT,  AM_TYPE_INT4 },
+    { F_INT4LE,    AM_OP_LE,  AM_TYPE_INT4 },
+    { F_INT4GE,    AM_OP_GE,  AM_TYPE_INT4 },
+    { F_INT8PL,    AM_OP_ADD, AM_TYPE_INT8 },
+    { F_INT8MI,    AM_OP_SUB, AM_TYPE_INT8 },
+    { F_INT8MUL,   AM_OP_MUL, AM_TYPE_INT8 },
+    { F_INT8DIV,   AM_OP_DIV, AM_TYPE_INT8 },
+    { F_INT8EQ,    AM_OP_EQ,  AM_TYPE_INT8 },
+    { F_INT8LT,    AM_OP_LT,  AM_TYPE_INT8 },
+    { F_INT8GT,    AM_OP_GT,  AM_TYPE_INT8 },
+    { F_INT8LE,    AM_OP_LE,  AM_TYPE_INT8 },
+    { F_INT8GE,    AM_OP_GE,  AM_TYPE_INT8 },
+    { F_FLOAT4PL,  AM_OP_ADD, AM_TYPE_FLOAT4 },
+    { F_FLOAT4MI,  AM_OP_SUB, AM_TYPE_FLOAT4 },
+    { F_FLOAT4MUL, AM_OP_MUL, AM_TYPE_FLOAT4 },
+    { F_FLOAT4DIV, AM_OP_DIV, AM_TYPE_FLOAT4 },
+    { F_FLOAT4EQ,  AM_OP_EQ,  AM_TYPE_FLOAT4 },
+    { F_FLOAT4LT,  AM_OP_LT,  AM_TYPE_FLOAT4 },
+    { F_FLOAT4GT,  AM_OP_GT,  AM_TYPE_FLOAT4 },
+    { F_FLOAT4LE,  AM_OP_LE,  AM_TYPE_FLOAT4 },
+    { F_FLOAT4GE,  AM_OP_GE,  AM_TYPE_FLOAT4 },
+    { F_FLOAT8PL,  AM_OP_ADD, AM_TYPE_FLOAT8 },
+    { F_FLOAT8MI,  AM_OP_SUB, AM_TYPE_FLOAT8 },
+    { F_FLOAT8MUL, AM_OP_MUL, AM_TYPE_FLOAT8 },
+    { F_FLOAT8DIV, AM_OP_DIV, AM_TYPE_FLOAT8 },
+    { F_FLOAT8EQ,  AM_OP_EQ,  AM_TYPE_FLOAT8 },
+    { F_FLOAT8LT,  AM_OP_LT,  AM_TYPE_FLOAT8 },
+    { F_FLOAT8GT,  AM_OP_GT,  AM_TYPE_FLOAT8 },
+    { F_FLOAT8LE,  AM_OP_LE,  AM_TYPE_FLOAT8 },
+    { F_FLOAT8GE,  AM_OP_GE,  AM_TYPE_FLOAT8 }
+};
+
+static const ArrayMathNativeOper *
+arraymath_native_oper_lookup(Oid fnoid)
+{
+    for (int i = 0; i < lengthof(arraymath_native_opers); i++)
     {
-        elog(ERROR, "unable to construct output array");
-        return NULL;
+        if (arraymath_native_opers[i].fnoid == fnoid)
+            return &arraymath_native_opers[i];
     }
-
-    return array_out;
+    return NULL;
 }
 
 /*
-* Apply an operator over all the elements of a pair of arrays
-* expanding to return an array of the same size as the largest
-* input array.
+* Raise the error a kernel has flagged, with the same message
+* the built-in operator would have used. The kernels run over the
+* whole array without stopping and only say which errors came up,
+* not where, so when there is more than one the one raised is the
+* first in the order below, not the one the built-in operator would
+* have met first going through the elements.
 */
-static ArrayType *
-arraymath_array_oper_array(ArrayType *array1, const char *opname, ArrayType *array2)
+static void
+arraymath_kernel_error(ArrayMathStatus status, ArrayMathKernelType type)
 {
-    ArrayType *array_out;
-    int    dims[1];
-    int    lbs[1];
-    Datum *elems;
-    bool *nulls;
-
-    int ndims1 = ARR_NDIM(array1);
-    int ndims2 = ARR_NDIM(array2);
-    int *dims1 = ARR_DIMS(array1);
-    int *dims2 = ARR_DIMS(array2);
-    char *ptr1 = NULL, *ptr2 = NULL;
-    Oid element_type1 = ARR_ELEMTYPE(array1);
-    Oid element_type2 = ARR_ELEMTYPE(array2);
-    Oid rtype;
-    int nitems1, nitems2;
-    int nelems, n;
-    bits8 *bitmap1 = NULL, *bitmap2 = NULL;
-    int bitmask1 = 0, bitmask2 = 0;
-    FmgrInfo operfmgrinfo;
-    TypeCacheEntry *info1, *info2, *tinfo;
-
-    if ( ndims1 == 0 && ndims2 == 1 )
+    if (status & AM_ERR_DIVIDE_BY_ZERO)
     {
-        return array2;
+        ereport(ERROR,
+            (errcode(ERRCODE_DIVISION_BY_ZERO),
+             errmsg("division by zero")));
     }
-    else if ( ndims1 == 1 && ndims2 == 0 )
+    else if (status & AM_ERR_SQRT_NEGATIVE)
     {
-        return array1;
+        ereport(ERROR,
+            (errcode(ERRCODE_INVALID_ARGUMENT_FOR_POWER_FUNCTION),
+             errmsg("cannot take square root of a negative number")));
     }
-    else if ( ndims1 == 0 && ndims2 == 0 )
+    else if (status & AM_ERR_LOG_ZERO)
     {
-        return construct_empty_array(element_type1);
+        ereport(ERROR,
+            (errcode(ERRCODE_INVALID_ARGUMENT_FOR_LOG),
+             errmsg("cannot take logarithm of zero")));
     }
-
-    /* Only 1D arrays for now */
-    if ( ndims1 != 1 || ndims2 != 1 )
+    else if (status & AM_ERR_LOG_NEGATIVE)
     {
-        elog(ERROR, "only 1-dimensional arrays supported");
-        return NULL;
+        ereport(ERROR,
+            (errcode(ERRCODE_INVALID_ARGUMENT_FOR_LOG),
+             errmsg("cannot take logarithm of a negative number")));
     }
-
-    /* What function works for these input types? Populate operfmgrinfo. */
-    /* What data type will the output array be? */
-    arraymath_fmgrinfo_from_optype(opname, element_type1, element_type2, &operfmgrinfo, &rtype);
-    tinfo = arraymath_typentry_from_type(rtype, 0);
-
-    /* How big is the output array? */
-    nitems1 = ArrayGetNItems(ndims1, dims1);
-    nitems2 = ArrayGetNItems(ndims2, dims2);
-    nelems = Max(nitems1, nitems2);
-
-    /* If either input is empty, return empty */
-    if ( nitems1 == 0 || nitems2 == 0 )
+    else if (status & AM_ERR_POWER_ZERO)
     {
-        return construct_empty_array(rtype);
+        ereport(ERROR,
+            (errcode(ERRCODE_INVALID_ARGUMENT_FOR_POWER_FUNCTION),
+             errmsg("zero raised to a negative power is undefined")));
     }
-
-    /* Allocate space for output data */
-    elems = palloc(sizeof(Datum)*nelems);
-    nulls = palloc(sizeof(bool)*nelems);
-
-    /* Learn more about the input arrays */
-    info1 = arraymath_typentry_from_type(element_type1, 0);
-    info2 = arraymath_typentry_from_type(element_type2, 0);
-
-    /* Loop over all the items, re-using items from the shorter */
-    /* array to apply to the longer */
-    for( n = 0; n < nelems; n++ )
+    else if (status & AM_ERR_POWER_COMPLEX)
     {
-        Datum elt1, elt2;
-        int i1 = n % nitems1;
-        int i2 = n % nitems2;
-        bool isnull1, isnull2;
-
-        /* Initialize array pointers at start of loop, and */
-        /* on wrap-around */
-        if ( i1 == 0 )
+        ereport(ERROR,
+            (errcode(ERRCODE_INVALID_ARGUMENT_FOR_POWER_FUNCTION),
+             errmsg("a negative number raised to a non-integer power yields a complex result")));
+    }
+    else if (status & AM_ERR_OVERFLOW)
+    {
+        switch (type)
         {
-            ptr1 = ARR_DATA_PTR(array1);
-            bitmap1 = ARR_NULLBITMAP(array1);
-            bitmask1 = 1;
+            case AM_TYPE_INT2:
+                ereport(ERROR,
+                    (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+                     errmsg("smallint out of range")));
+                break;
+            case AM_TYPE_INT4:
+                ereport(ERROR,
+                    (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+                     errmsg("integer out of range")));
+                break;
+            case AM_TYPE_INT8:
+                ereport(ERROR,
+                    (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+                     errmsg("bigint out of range")));
+                break;
+            default:
+                ereport(ERROR,
+                    (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+                     errmsg("value out of range: overflow")));
         }
+    }
+    else if (status & AM_ERR_UNDERFLOW)
+    {
+        ereport(ERROR,
+            (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+             errmsg("value out of range: underflow")));
+    }
+    else if (status != AM_OK)
+    {
+        elog(ERROR, "unexpected kernel status %d", status);
+    }
+}
+
+/*
+* Read a by-value Datum into the native representation a kernel
+* expects for a single operand.
+*/
+static void
+arraymath_native_value(Datum d, ArrayMathKernelType type, ArrayMathNativeValue *v)
+{
+    switch (type)
+    {
+        case AM_TYPE_INT2:   v->i2 = DatumGetInt16(d); break;
+        case AM_TYPE_INT4:   v->i4 = DatumGetInt32(d); break;
+        case AM_TYPE_INT8:   v->i8 = DatumGetInt64(d); break;
+        case AM_TYPE_FLOAT4: v->f4 = DatumGetFloat4(d); break;
+        case AM_TYPE_FLOAT8: v->f8 = DatumGetFloat8(d); break;
+        default:
+            elog(ERROR, "unexpected native type %d", type);
+    }
+}
 
-        if ( i2 == 0 )
+/*
+* Copy n pass-by-value Datums of a native type into a packed
+* C array, and back.
+*/
+static void
+arraymath_datums_to_native(const Datum *d, int n, ArrayMathKernelType type, void *out)
+{
+    for (int i = 0; i < n; i++)
+    {
+        switch (type)
         {
-            ptr2 = ARR_DATA_PTR(array2);
-            bitmap2 = ARR_NULLBITMAP(array2);
-            bitmask2 = 1;
+            case AM_TYPE_INT2:   ((int16 *) out)[i] = DatumGetInt16(d[i]); break;
+            case AM_TYPE_INT4:   ((int32 *) out)[i] = DatumGetInt32(d[i]); break;
+            case AM_TYPE_INT8:   ((int64 *) out)[i] = DatumGetInt64(d[i]); break;
+            case AM_TYPE_FLOAT4: ((float4 *) out)[i] = DatumGetFloat4(d[i]); break;
+            case AM_TYPE_FLOAT8: ((float8 *) out)[i] = DatumGetFloat8(d[i]); break;
+            default:
+                elog(ERROR, "unexpected native type %d", type);
         }
+    }
+}
 
-        /* Check null status */
-        isnull1 = BITMAP_ISNULL(bitmap1, bitmask1);
-        isnull2 = BITMAP_ISNULL(bitmap2, bitmask2);
-
-        /* Start with NULL values */
-        elt1 = elt2 = (Datum) 0;
-
-        if ( ! isnull1 )
+static void
+arraymath_native_to_datums(const void *in, int n, ArrayMathKernelType type, Datum *d)
+{
+    for (int i = 0; i < n; i++)
+    {
+        switch (type)
         {
-            /* Read the element value */
-            elt1 = fetch_att(ptr1, info1->typbyval, info1->typlen);
-
-            /* Move the pointer forward */
-            ptr1 = att_addlength_pointer(ptr1, info1->typlen, ptr1);
-            ptr1 = (char *) att_align_nominal(ptr1, info1->typalign);
+            case AM_TYPE_INT2:   d[i] = Int16GetDatum(((const int16 *) in)[i]); break;
+            case AM_TYPE_INT4:   d[i] = Int32GetDatum(((const int32 *) in)[i]); break;
+            case AM_TYPE_INT8:   d[i] = Int64GetDatum(((const int64 *) in)[i]); break;
+            case AM_TYPE_FLOAT4: d[i] = Float4GetDatum(((const float4 *) in)[i]); break;
+            case AM_TYPE_FLOAT8: d[i] = Float8GetDatum(((const float8 *) in)[i]); break;
+            default:
+                elog(ERROR, "unexpected native type %d", type);
         }
+    }
+}
+
+/*
+* Native kernel type for an element type, false if there is none.
+*/
+static bool
+arraymath_native_type(Oid elmtype, ArrayMathKernelType *type)
+{
+    switch (elmtype)
+    {
+        case INT2OID:   *type = AM_TYPE_INT2; return true;
+        case INT4OID:   *type = AM_TYPE_INT4; return true;
+        case INT8OID:   *type = AM_TYPE_INT8; return true;
+        case FLOAT4OID: *type = AM_TYPE_FLOAT4; return true;
+        case FLOAT8OID: *type = AM_TYPE_FLOAT8; return true;
+        default:
+            return false;
+    }
+}
+
+
+/**********************************************************************
+* Instrumentation
+*/
+
+/*
+* With arraymath in shared_preload_libraries, a block of shared
+* memory counts the calls, elements, null elements, detoasted bytes
+* and time of each tracked function and native kernel, while
+* arraymath.track is on. The counters are atomics, so backends
+* add to them without taking any lock. With tracking off each
+* tracked call costs one test of a flag.
+*/
+#define ARRAYMATH_TRACKED_FUNCTIONS(X) \
+    X(array_math_array) \
+    X(array_math_value) \
+    X(array_compare_array) \
+    X(array_compare_value) \
+    X(array_sum) \
+    X(array_sum_wide) \
+    X(array_avg) \
+    X(array_min) \
+    X(array_max) \
+    X(array_median) \
+    X(array_percentile) \
+    X(array_stats) \
+    X(array_sort) \
+    X(array_topk) \
+    X(array_bottomk) \
+    X(array_argtopk) \
+    X(array_argbottomk) \
+    X(array_searchsorted) \
+    X(array_searchsorted_array) \
+    X(array_merge_sorted) \
+    X(array_intersect_sorted) \
+    X(array_except_sorted) \
+    X(array_uniq) \
+    X(array_count_distinct) \
+    X(array_mode) \
+    X(array_value_counts) \
+    X(array_sum_axis) \
+    X(array_avg_axis) \
+    X(array_min_axis) \
+    X(array_max_axis) \
+    X(array_median_axis) \
+    X(array_dot) \
+    X(array_negative_dot) \
+    X(array_l1_distance) \
+    X(array_l2_distance) \
+    X(array_cosine_similarity) \
+    X(array_cosine_distance) \
+    X(array_norm) \
+    X(array_vsum_accum) \
+    X(array_vavg_accum) \
+    X(array_vmin_accum) \
+    X(array_vmax_accum) \
+    X(array_eval) \
+    X(array_cumsum) \
+    X(array_cumprod) \
+    X(array_diff) \
+    X(array_moving_sum) \
+    X(array_moving_avg) \
+    X(array_moving_min) \
+    X(array_moving_max) \
+    X(array_abs) \
+    X(array_round) \
+    X(array_clamp) \
+    X(array_sqrt) \
+    X(array_exp) \
+    X(array_ln) \
+    X(array_pow) \
+    X(array_count) \
+    X(array_any) \
+    X(array_all) \
+    X(array_where) \
+    X(array_select) \
+    X(array_select_values) \
+    X(array_matmul) \
+    X(array_matvec) \
+    X(array_transpose) \
+    X(array_outer)
+
+#define ARRAYMATH_TRACK_ID(fn) ARRAYMATH_TRACK_##fn,
+#define ARRAYMATH_TRACK_NAME(fn) #fn,
+
+/*
+* Counter slots: the functions, then a kernel slot for each binary
+* operator, vector reduction, unary function and the matrix product
+* of each native type.
+*/
+enum
+{
+    ARRAYMATH_TRACKED_FUNCTIONS(ARRAYMATH_TRACK_ID)
+    ARRAYMATH_TRACK_NFUNCTIONS
+};
+
+#define ARRAYMATH_TRACK_BINARY(op, type) \
+    (ARRAYMATH_TRACK_NFUNCTIONS + (op) * AM_TYPE_COUNT + (type))
+#define ARRAYMATH_TRACK_VECTOR(op, type) \
+    ARRAYMATH_TRACK_BINARY(AM_OP_COUNT + (op), (type))
+#define ARRAYMATH_TRACK_UNARY(op, type) \
+    ARRAYMATH_TRACK_VECTOR(AM_VEC_COUNT + (op), (type))
+#define ARRAYMATH_TRACK_MATMUL(type) \
+    ARRAYMATH_TRACK_UNARY(AM_UNARY_COUNT, (type))
+#define ARRAYMATH_TRACK_COUNT \
+    ARRAYMATH_TRACK_MATMUL(AM_TYPE_COUNT)
+
+static const char *const arraymath_track_functions[] = {
+    ARRAYMATH_TRACKED_FUNCTIONS(ARRAYMATH_TRACK_NAME)
+};
+
+static const char *const arraymath_track_kernels[] = {
+    "add", "sub", "mul", "div", "eq", "lt", "gt", "le", "ge",
+    "dot", "l1", "l2", "cosine", "norm",
+    "abs", "round", "clamp", "sqrt", "exp", "ln", "pow",
+    "matmul"
+};
+
+static const char *const arraymath_track_types[] = {
+    "int2", "int4", "int8", "float4", "float8"
+};
+
+StaticAssertDecl(lengthof(arraymath_track_kernels) == AM_OP_COUNT + AM_VEC_COUNT + AM_UNARY_COUNT + 1,
+    "a name is needed for each kernel");
+StaticAssertDecl(lengthof(arraymath_track_types) == AM_TYPE_COUNT,
+    "a name is needed for each native type");
+
+typedef struct ArrayMathTrackCounters
+{
+    pg_atomic_uint64 calls;
+    pg_atomic_uint64 elements;
+    pg_atomic_uint64 nulls;
+    pg_atomic_uint64 bytes;
+    pg_atomic_uint64 nanoseconds;
+} ArrayMathTrackCounters;
+
+typedef struct ArrayMathTrackShared
+{
+    ArrayMathTrackCounters counters[ARRAYMATH_TRACK_COUNT];
+} ArrayMathTrackShared;
+
+/* What a tracked function has read so far */
+typedef struct ArrayMathTrackCall
+{
+    uint64 elements;
+    uint64 nulls;
+    uint64 bytes;
+} ArrayMathTrackCall;
+
+static bool arraymath_track = false;
+static ArrayMathTrackShared *arraymath_track_shared = NULL;
+
+/*
+* The call being tracked, saved and put back around each tracked
+* call, so one that errors out leaves them as they were before it.
+*/
+static ArrayMathTrackCall arraymath_track_call;
+static bool arraymath_track_active = false;
+
+#define ARRAYMATH_TRACKING() (arraymath_track && arraymath_track_shared)
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+#if PG_VERSION_NUM >= 150000
+static void
+arraymath_shmem_request(void)
+{
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+
+    RequestAddinShmemSpace(sizeof(ArrayMathTrackShared));
+}
+#endif
+
+static void
+arraymath_shmem_startup(void)
+{
+    bool found;
 
-        if ( ! isnull2 )
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    arraymath_track_shared = ShmemInitStruct("arraymath",
+        sizeof(ArrayMathTrackShared), &found);
+    if (!found)
+    {
+        for (int i = 0; i < ARRAYMATH_TRACK_COUNT; i++)
         {
-            /* Read the element value */
-            elt2 = fetch_att(ptr2, info2->typbyval, info2->typlen);
+            ArrayMathTrackCounters *c = &arraymath_track_shared->counters[i];
+
+            pg_atomic_init_u64(&c->calls, 0);
+            pg_atomic_init_u64(&c->elements, 0);
+            pg_atomic_init_u64(&c->nulls, 0);
+            pg_atomic_init_u64(&c->bytes, 0);
+            pg_atomic_init_u64(&c->nanoseconds, 0);
+        }
+    }
+    LWLockRelease(AddinShmemInitLock);
+}
+
+static void
+arraymath_track_init(void)
+{
+    DefineCustomBoolVariable("arraymath.track",
+                             "Collects call counts and timings of array functions.",
+                             "Needs arraymath in shared_preload_libraries.",
+                             &arraymath_track,
+                             false,
+                             PGC_SUSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+#if PG_VERSION_NUM >= 150000
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = arraymath_shmem_request;
+#else
+    RequestAddinShmemSpace(sizeof(ArrayMathTrackShared));
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = arraymath_shmem_startup;
+}
+
+static uint64
+arraymath_track_elapsed(instr_time start)
+{
+    instr_time now;
+
+    INSTR_TIME_SET_CURRENT(now);
+    INSTR_TIME_SUBTRACT(now, start);
+#ifdef INSTR_TIME_GET_NANOSEC
+    return INSTR_TIME_GET_NANOSEC(now);
+#else
+    return INSTR_TIME_GET_MICROSEC(now) * 1000;
+#endif
+}
+
+static void
+arraymath_track_add(int slot, uint64 elements, uint64 nulls, uint64 bytes, uint64 ns)
+{
+    ArrayMathTrackCounters *c = &arraymath_track_shared->counters[slot];
+
+    pg_atomic_fetch_add_u64(&c->calls, 1);
+    pg_atomic_fetch_add_u64(&c->elements, elements);
+    pg_atomic_fetch_add_u64(&c->nulls, nulls);
+    pg_atomic_fetch_add_u64(&c->bytes, bytes);
+    pg_atomic_fetch_add_u64(&c->nanoseconds, ns);
+}
+
+/*
+* Run a tracked function. Calls nested inside it are counted on
+* their own, and not again in this one. A call that errors out is
+* not counted, though the kernels it had already run are; the call
+* around it, if any, carries on counting from where it was, for
+* when the error is caught short of the top level.
+*/
+static Datum
+arraymath_track_function(int slot, PGFunction body, FunctionCallInfo fcinfo)
+{
+    ArrayMathTrackCall outer = arraymath_track_call;
+    bool outer_active = arraymath_track_active;
+    instr_time start;
+    Datum result;
+
+    memset(&arraymath_track_call, 0, sizeof(arraymath_track_call));
+    arraymath_track_active = true;
+
+    INSTR_TIME_SET_CURRENT(start);
+    PG_TRY();
+    {
+        result = body(fcinfo);
+    }
+    PG_CATCH();
+    {
+        arraymath_track_call = outer;
+        arraymath_track_active = outer_active;
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    arraymath_track_add(slot, arraymath_track_call.elements,
+        arraymath_track_call.nulls, arraymath_track_call.bytes,
+        arraymath_track_elapsed(start));
+
+    arraymath_track_call = outer;
+    arraymath_track_active = outer_active;
+    return result;
+}
+
+/*
+* Define a tracked SQL-callable function, whose body follows as a
+* plain function of fcinfo.
+*/
+#define ARRAYMATH_TRACKED_FUNCTION(fn) \
+    static Datum fn##_body(PG_FUNCTION_ARGS); \
+    Datum fn(PG_FUNCTION_ARGS); \
+    PG_FUNCTION_INFO_V1(fn); \
+    Datum fn(PG_FUNCTION_ARGS) \
+    { \
+        if (likely(!ARRAYMATH_TRACKING())) \
+            return fn##_body(fcinfo); \
+        return arraymath_track_function(ARRAYMATH_TRACK_##fn, fn##_body, fcinfo); \
+    } \
+    static Datum fn##_body(PG_FUNCTION_ARGS)
+
+/*
+* Count an array argument of the tracked call: its elements, its
+* nulls, and its size if it had to be detoasted from d.
+*/
+static void
+arraymath_track_array(Datum d, ArrayType *arr)
+{
+    Pointer ptr = DatumGetPointer(d);
+    int nitems;
+
+    if (likely(!arraymath_track_active) || !ARRAYMATH_TRACKING())
+        return;
+
+    nitems = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+    arraymath_track_call.elements += nitems;
+    if (ARR_HASNULL(arr))
+        arraymath_track_call.nulls += nitems - arraymath_bitmap_count(ARR_NULLBITMAP(arr), nitems);
+    if (VARATT_IS_EXTENDED(ptr) && !VARATT_IS_EXTERNAL_EXPANDED(ptr))
+        arraymath_track_call.bytes += VARSIZE(arr);
+}
+
+/*
+* The native kernels, as called from everywhere else, counting
+* each call in the slot of its operator and type.
+*/
+static ArrayMathStatus
+arraymath_apply(ArrayMathKernelOp op, ArrayMathKernelType type,
+                const void *a, int na, const void *b, int nb, void *out)
+{
+    ArrayMathStatus status;
+    instr_time start;
+
+    if (likely(!ARRAYMATH_TRACKING()))
+        return arraymath_apply_run(op, type, a, na, b, nb, out);
+
+    INSTR_TIME_SET_CURRENT(start);
+    status = arraymath_apply_run(op, type, a, na, b, nb, out);
+    arraymath_track_add(ARRAYMATH_TRACK_BINARY(op, type), Max(na, nb), 0, 0,
+        arraymath_track_elapsed(start));
+    return status;
+}
+
+static ArrayMathStatus
+arraymath_binary(ArrayMathKernelShape shape, ArrayMathKernelOp op, ArrayMathKernelType type,
+                 const void *a, const void *b, void *out, int n)
+{
+    ArrayMathStatus status;
+    instr_time start;
+
+    if (likely(!ARRAYMATH_TRACKING()))
+        return arraymath_binary_run(shape, op, type, a, b, out, n);
+
+    INSTR_TIME_SET_CURRENT(start);
+    status = arraymath_binary_run(shape, op, type, a, b, out, n);
+    arraymath_track_add(ARRAYMATH_TRACK_BINARY(op, type), n, 0, 0,
+        arraymath_track_elapsed(start));
+    return status;
+}
+
+static void
+arraymath_vector(ArrayMathVectorOp op, ArrayMathKernelType type,
+                 const void *a, const void *b, int n, float8 *sums)
+{
+    instr_time start;
+
+    if (likely(!ARRAYMATH_TRACKING()))
+    {
+        arraymath_kernels->vector[op][type](a, b, n, sums);
+        return;
+    }
+
+    INSTR_TIME_SET_CURRENT(start);
+    arraymath_kernels->vector[op][type](a, b, n, sums);
+    arraymath_track_add(ARRAYMATH_TRACK_VECTOR(op, type), n, 0, 0,
+        arraymath_track_elapsed(start));
+}
+
+static ArrayMathStatus
+arraymath_unary(ArrayMathUnaryOp op, ArrayMathKernelType type,
+                const void *in, const ArrayMathUnaryArgs *args, void *out, int n)
+{
+    ArrayMathStatus status;
+    instr_time start;
+
+    if (likely(!ARRAYMATH_TRACKING()))
+        return arraymath_unary_run(op, type, in, args, out, n);
+
+    INSTR_TIME_SET_CURRENT(start);
+    status = arraymath_unary_run(op, type, in, args, out, n);
+    arraymath_track_add(ARRAYMATH_TRACK_UNARY(op, type), n, 0, 0,
+        arraymath_track_elapsed(start));
+    return status;
+}
+
+static int
+arraymath_mask(ArrayMathKernelOp op, ArrayMathKernelType type,
+               const void *a, const void *b, uint64 *bits, int n)
+{
+    int count;
+    instr_time start;
+
+    if (likely(!ARRAYMATH_TRACKING()))
+        return arraymath_kernels->mask[op - AM_OP_EQ][type](a, b, bits, n);
+
+    INSTR_TIME_SET_CURRENT(start);
+    count = arraymath_kernels->mask[op - AM_OP_EQ][type](a, b, bits, n);
+    arraymath_track_add(ARRAYMATH_TRACK_BINARY(op, type), n, 0, 0,
+        arraymath_track_elapsed(start));
+    return count;
+}
+
+static ArrayMathStatus
+arraymath_matmul(ArrayMathKernelType type, const void *a, const void *b, void *out,
+                 int m, int k, int n)
+{
+    bool *inf = palloc(sizeof(bool) * ((Size) m + n));
+    ArrayMathStatus status;
+    instr_time start;
+
+    if (likely(!ARRAYMATH_TRACKING()))
+        status = arraymath_kernels->matmul[type](a, b, out, m, k, n, inf);
+    else
+    {
+        INSTR_TIME_SET_CURRENT(start);
+        status = arraymath_kernels->matmul[type](a, b, out, m, k, n, inf);
+        arraymath_track_add(ARRAYMATH_TRACK_MATMUL(type), (uint64) m * n, 0, 0,
+            arraymath_track_elapsed(start));
+    }
+    pfree(inf);
+    return status;
+}
+
+static ArrayMathTrackShared *
+arraymath_track_get_shared(void)
+{
+    if (!arraymath_track_shared)
+    {
+        ereport(ERROR,
+            (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+             errmsg("arraymath must be loaded via \"shared_preload_libraries\"")));
+    }
+    return arraymath_track_shared;
+}
+
+#define ARRAYMATH_TRACK_NATTS 7
+
+/*
+* Report the counters of every function and kernel that has been
+* called since the last reset.
+*/
+Datum arraymath_stats(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(arraymath_stats);
+Datum arraymath_stats(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    ArrayMathTrackShared *shared = arraymath_track_get_shared();
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            elog(ERROR, "return type must be a row type");
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        funcctx->max_calls = ARRAYMATH_TRACK_COUNT;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    while (funcctx->call_cntr < funcctx->max_calls)
+    {
+        int slot = funcctx->call_cntr;
+        ArrayMathTrackCounters *c = &shared->counters[slot];
+        Datum values[ARRAYMATH_TRACK_NATTS];
+        bool nulls[ARRAYMATH_TRACK_NATTS] = {false};
+        uint64 calls = pg_atomic_read_u64(&c->calls);
 
-            /* Move the pointer forward */
-            ptr2 = att_addlength_pointer(ptr2, info2->typlen, ptr2);
-            ptr2 = (char *) att_align_nominal(ptr2, info2->typalign);
+        if (calls == 0)
+        {
+            funcctx->call_cntr++;
+            continue;
         }
 
-        /* NULL on either side of operator yields output NULL */
-        if ( isnull1 || isnull2 )
+        if (slot < ARRAYMATH_TRACK_NFUNCTIONS)
         {
-            nulls[n] = true;
-            elems[n] = (Datum) 0;
+            values[0] = CStringGetTextDatum("function");
+            values[1] = CStringGetTextDatum(arraymath_track_functions[slot]);
         }
         else
         {
-            nulls[n] = false;
-            elems[n] = FunctionCall2(&operfmgrinfo, elt1, elt2);
+            int k = slot - ARRAYMATH_TRACK_NFUNCTIONS;
+
+            values[0] = CStringGetTextDatum("kernel");
+            values[1] = CStringGetTextDatum(psprintf("%s_%s",
+                arraymath_track_kernels[k / AM_TYPE_COUNT],
+                arraymath_track_types[k % AM_TYPE_COUNT]));
         }
+        values[2] = Int64GetDatum((int64) calls);
+        values[3] = Int64GetDatum((int64) pg_atomic_read_u64(&c->elements));
+        values[4] = Int64GetDatum((int64) pg_atomic_read_u64(&c->nulls));
+        values[5] = Int64GetDatum((int64) pg_atomic_read_u64(&c->bytes));
+        values[6] = Int64GetDatum((int64) pg_atomic_read_u64(&c->nanoseconds));
+
+        SRF_RETURN_NEXT(funcctx,
+            HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+/*
+* Zero all the counters.
+*/
+Datum arraymath_stats_reset(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(arraymath_stats_reset);
+Datum arraymath_stats_reset(PG_FUNCTION_ARGS)
+{
+    ArrayMathTrackShared *shared = arraymath_track_get_shared();
+
+    for (int i = 0; i < ARRAYMATH_TRACK_COUNT; i++)
+    {
+        ArrayMathTrackCounters *c = &shared->counters[i];
 
-        BITMAP_INCREMENT(bitmap1, bitmask1);
-        BITMAP_INCREMENT(bitmap2, bitmask2);
+        pg_atomic_write_u64(&c->calls, 0);
+        pg_atomic_write_u64(&c->elements, 0);
+        pg_atomic_write_u64(&c->nulls, 0);
+        pg_atomic_write_u64(&c->bytes, 0);
+        pg_atomic_write_u64(&c->nanoseconds, 0);
     }
 
-    /* Build 1-d output array */
-    dims[0] = nelems;
-    lbs[0] = 1;
-    array_out = construct_md_array(elems, nulls, 1, dims, lbs, rtype, tinfo->typlen, tinfo->typbyval, tinfo->typalign);
+    PG_RETURN_VOID();
+}
 
-    /* Output is supposed to be a copy, so free the inputs */
-    pfree(elems);
-    pfree(nulls);
+/**********************************************************************
+* Functions
+*/
 
-    /* Make sure we haven't been given garbage */
-    if ( ! array_out )
+static void
+arraymath_check_type(Oid elmtype)
+{
+    /* Initialize result value */
+    if (elmtype != INT2OID   &&
+        elmtype != INT4OID   &&
+        elmtype != INT8OID   &&
+        elmtype != FLOAT4OID &&
+        elmtype != FLOAT8OID &&
+        elmtype != NUMERICOID)
     {
-        elog(ERROR, "unable to construct output array");
-        return NULL;
+        ereport(ERROR, (
+            errmsg(
+                "Array type must be NUMERIC, SMALLINT, INTEGER, BIGINT, REAL, or DOUBLE PRECISION"
+                )));
     }
+}
 
-    return array_out;
+static ArrayIterator
+arraymath_create_iterator(ArrayType *arr, const ArrayMathTypeInfo *info)
+{
+#if PG_VERSION_NUM >= 90500
+    ArrayMetaState mstate;
+
+    /* Hand over the storage details we already have, */
+    /* to save the iterator a syscache lookup */
+    if (info)
+    {
+        memset(&mstate, 0, sizeof(mstate));
+        mstate.element_type = info->type;
+        mstate.typlen = info->typlen;
+        mstate.typbyval = info->typbyval;
+        mstate.typalign = info->typalign;
+        return array_create_iterator(arr, 0, &mstate);
+    }
+    return array_create_iterator(arr, 0, NULL);
+#else
+    return array_create_iterator(arr, 0);
+#endif
+}
+
+static Numeric
+arraymath_int64_to_numeric(int64 i)
+{
+#if PG_VERSION_NUM >= 140000
+    return int64_to_numeric(i);
+#else
+    return DatumGetNumeric(Int64GetDatum(i));
+#endif
 }
 
+#ifdef HAVE_INT128
 /*
-* Compare two arrays.
+* There is no int128 entry point into numeric, so build the value
+* from base 10^18 pieces that each fit an int64. All the pieces
+* carry the sign of the input, so they combine without borrowing.
 */
-Datum array_compare_array(PG_FUNCTION_ARGS);
-PG_FUNCTION_INFO_V1(array_compare_array);
-Datum array_compare_array(PG_FUNCTION_ARGS)
+static Numeric
+arraymath_int128_to_numeric(int128 v)
 {
-    ArrayType *array1 = PG_GETARG_ARRAYTYPE_P(0);
-    ArrayType *array2 = PG_GETARG_ARRAYTYPE_P(1);
-    text *operator = PG_GETARG_TEXT_P(2);
-    char *opname = text_to_cstring(operator);
-    ArrayType *arrayout;
+    const int64 base = INT64CONST(1000000000000000000);
+    Datum nbase, result;
+    int64 lo, mid;
+
+    if (v >= PG_INT64_MIN && v <= PG_INT64_MAX)
+        return arraymath_int64_to_numeric((int64) v);
+
+    lo = (int64) (v % base);
+    v /= base;
+    mid = (int64) (v % base);
+    v /= base;
+
+    nbase = NumericGetDatum(arraymath_int64_to_numeric(base));
+    result = NumericGetDatum(arraymath_int64_to_numeric((int64) v));
+    result = DirectFunctionCall2(numeric_mul, result, nbase);
+    result = DirectFunctionCall2(numeric_add, result,
+                NumericGetDatum(arraymath_int64_to_numeric(mid)));
+    result = DirectFunctionCall2(numeric_mul, result, nbase);
+    result = DirectFunctionCall2(numeric_add, result,
+                NumericGetDatum(arraymath_int64_to_numeric(lo)));
+    return DatumGetNumeric(result);
+}
+#endif
+
+
+/*
+* Given an operator symbol ("+", "-", "=" etc) and type element types,
+* try to look up the appropriate function to do element level operations of
+* that type. The FmgrInfo is built in the given memory context, so it can
+* outlive the current call when cached.
+*/
+static void
+arraymath_fmgrinfo_from_optype(const char *opstr, Oid element_type1,
+                               Oid element_type2, FmgrInfo *operfmgrinfo, Oid *return_type,
+                               MemoryContext mcxt)
+{
+    Oid operator_oid;
+    HeapTuple opertup;
+    Form_pg_operator operform;
+
+    /* Look up the operator Oid that corresponds to this combination */
+    /* of symbol and data types */
+    operator_oid = OpernameGetOprid(list_make1(makeString(pstrdup(opstr))), element_type1, element_type2);
+    if ( ! (operator_oid && OperatorIsVisible(operator_oid)) )
+    {
+        elog(ERROR, "operator does not exist");
+    }
+
+    /* Lookup the function associated with the operator Oid */
+    opertup = SearchSysCache1(OPEROID, ObjectIdGetDatum(operator_oid));
+    if (! HeapTupleIsValid(opertup))
+    {
+        elog(ERROR, "cannot find operator heap tuple");
+    }
+
+    operform = (Form_pg_operator) GETSTRUCT(opertup);
+    *return_type = operform->oprresult;
+
+    fmgr_info_cxt(operform->oprcode, operfmgrinfo, mcxt);
+    ReleaseSysCache(opertup);
+
+    return;
+}
+
+
+/*
+* Given an a source and target type, look up the casting function.
+*/
+static void
+arraymath_fmgrinfo_from_cast(Oid castSrcType, Oid castDstType, FmgrInfo *castfmgrinfo,
+                             MemoryContext mcxt)
+{
+    HeapTuple casttup;
+    Form_pg_cast castform;
 
-    arrayout = arraymath_array_oper_array(array1, opname, array2);
+    /* Lookup the function associated with the operator Oid */
+    casttup = SearchSysCache2(CASTSOURCETARGET,
+        ObjectIdGetDatum(castSrcType),
+        ObjectIdGetDatum(castDstType));
 
-    PG_FREE_IF_COPY(array1, 0);
-    PG_FREE_IF_COPY(array2, 1);
+    if (! HeapTupleIsValid(casttup))
+    {
+        elog(ERROR, "cannot find cast from %s to %s",
+            format_type_be(castSrcType),
+            format_type_be(castDstType));
+    }
+
+    castform = (Form_pg_cast) GETSTRUCT(casttup);
+    fmgr_info_cxt(castform->castfunc, castfmgrinfo, mcxt);
+    ReleaseSysCache(casttup);
+
+    return;
+}
+
+
+/*
+* Read type information for a given element type.
+*/
+static TypeCacheEntry *
+arraymath_typentry_from_type(Oid element_type, int flags)
+{
+    TypeCacheEntry *typentry;
+    typentry = lookup_type_cache(element_type, flags);
+    if (!typentry)
+    {
+        elog(ERROR, "unable to lookup element type info for %s",
+            format_type_be(element_type));
+    }
+    return typentry;
+}
+
+
+static void
+arraymath_typeinfo_from_type(Oid element_type, ArrayMathTypeInfo *info)
+{
+    TypeCacheEntry *typentry = arraymath_typentry_from_type(element_type, 0);
+    info->type = element_type;
+    info->typlen = typentry->typlen;
+    info->typbyval = typentry->typbyval;
+    info->typalign = typentry->typalign;
+}
+
+
+/*
+* Find (or create) the cache for this call site. Direct calls
+* with no flinfo get a throwaway cache in the current context.
+*/
+static ArrayMathCache *
+arraymath_cache_get(FunctionCallInfo fcinfo)
+{
+    FmgrInfo *flinfo = fcinfo->flinfo;
+    ArrayMathCache *cache;
+
+    if (!flinfo)
+    {
+        cache = palloc0(sizeof(ArrayMathCache));
+        cache->mcxt = CurrentMemoryContext;
+        return cache;
+    }
+
+    cache = (ArrayMathCache *) flinfo->fn_extra;
+    if (!cache)
+    {
+        cache = MemoryContextAllocZero(flinfo->fn_mcxt, sizeof(ArrayMathCache));
+        cache->mcxt = flinfo->fn_mcxt;
+        flinfo->fn_extra = cache;
+    }
+    return cache;
+}
+
+
+/*
+* Make sure the cache holds the operator function for the given
+* operator symbol and element types, looking it up only when the
+* key has changed since the last call.
+*/
+static void
+arraymath_cache_oper(ArrayMathCache *cache, const char *opstr, int oplen,
+                     Oid element_type1, Oid element_type2)
+{
+    const ArrayMathNativeOper *native;
+    Oid rtype;
+
+    if (cache->oper_valid &&
+        cache->info1.type == element_type1 &&
+        cache->info2.type == element_type2 &&
+        (int) strlen(cache->opname) == oplen &&
+        memcmp(cache->opname, opstr, oplen) == 0)
+    {
+        return;
+    }
+
+    /* No operator name can be this long */
+    if (oplen >= NAMEDATALEN)
+    {
+        elog(ERROR, "operator does not exist");
+    }
+
+    cache->oper_valid = false;
+    memcpy(cache->opname, opstr, oplen);
+    cache->opname[oplen] = '\0';
+
+    arraymath_fmgrinfo_from_optype(cache->opname, element_type1, element_type2,
+                                   &cache->operfmgrinfo, &rtype, cache->mcxt);
+    arraymath_typeinfo_from_type(element_type1, &cache->info1);
+    arraymath_typeinfo_from_type(element_type2, &cache->info2);
+    arraymath_typeinfo_from_type(rtype, &cache->rinfo);
+
+    /* Can we skip fmgr and run a native kernel? */
+    native = arraymath_native_oper_lookup(cache->operfmgrinfo.fn_oid);
+    cache->oper_native = (native != NULL);
+    if (native)
+    {
+        cache->native_op = native->op;
+        cache->native_type = native->type;
+    }
+    cache->oper_valid = true;
+}
+
+
+/*
+* Make sure the cache holds the cast function from one type
+* to another.
+*/
+static void
+arraymath_cache_cast(ArrayMathCache *cache, Oid castSrcType, Oid castDstType)
+{
+    if (cache->cast_valid &&
+        cache->cast_src == castSrcType &&
+        cache->cast_dst == castDstType)
+    {
+        return;
+    }
+
+    cache->cast_valid = false;
+    arraymath_fmgrinfo_from_cast(castSrcType, castDstType,
+                                 &cache->castfmgrinfo, cache->mcxt);
+    cache->cast_src = castSrcType;
+    cache->cast_dst = castDstType;
+    cache->cast_valid = true;
+}
+
+
+/*
+* Make sure the cache holds the btree comparison function and
+* storage details for the given element type.
+*/
+static void
+arraymath_cache_cmp(ArrayMathCache *cache, Oid element_type)
+{
+    TypeCacheEntry *typentry;
+
+    if (cache->cmp_valid && cache->cmpinfo.type == element_type)
+    {
+        return;
+    }
+
+    cache->cmp_valid = false;
+    typentry = arraymath_typentry_from_type(element_type, TYPECACHE_CMP_PROC_FINFO);
+    if (!OidIsValid(typentry->cmp_proc_finfo.fn_oid))
+    {
+        elog(ERROR, "could not identify a comparison function for type %s",
+            format_type_be(element_type));
+    }
+    fmgr_info_copy(&cache->cmpfmgrinfo, &typentry->cmp_proc_finfo, cache->mcxt);
+    cache->cmpinfo.type = element_type;
+    cache->cmpinfo.typlen = typentry->typlen;
+    cache->cmpinfo.typbyval = typentry->typbyval;
+    cache->cmpinfo.typalign = typentry->typalign;
+    cache->cmp_valid = true;
+}
+
+/*
+* Make sure the cache holds the hash and equality functions for
+* the given element type.
+*/
+static void
+arraymath_cache_hash(ArrayMathCache *cache, Oid element_type)
+{
+    TypeCacheEntry *typentry;
+
+    if (cache->hash_valid && cache->hash_type == element_type)
+    {
+        return;
+    }
+
+    cache->hash_valid = false;
+    typentry = arraymath_typentry_from_type(element_type,
+        TYPECACHE_HASH_PROC_FINFO | TYPECACHE_EQ_OPR_FINFO);
+    if (!OidIsValid(typentry->hash_proc_finfo.fn_oid) ||
+        !OidIsValid(typentry->eq_opr_finfo.fn_oid))
+    {
+        elog(ERROR, "could not identify a hash function for type %s",
+            format_type_be(element_type));
+    }
+    fmgr_info_copy(&cache->hashfmgrinfo, &typentry->hash_proc_finfo, cache->mcxt);
+    fmgr_info_copy(&cache->eqfmgrinfo, &typentry->eq_opr_finfo, cache->mcxt);
+    cache->hash_type = element_type;
+    cache->hash_valid = true;
+}
+
+
+/*
+* Does the array actually hold any nulls, as opposed to merely
+* carrying a null bitmap?
+*/
+static bool
+arraymath_has_nulls(ArrayType *array)
+{
+    return ARR_HASNULL(array) && array_contains_nulls(array);
+}
+
+/*
+* Fetch an array argument for reading only. An expanded array that
+* still holds a valid flat form is read from that directly, rather
+* than being flattened into a fresh copy on every call. Arrays
+* fetched this way must be released with ARRAYMATH_FREE_IF_COPY.
+*/
+static ArrayType *
+arraymath_getarg_array(FunctionCallInfo fcinfo, int argno)
+{
+    Datum d = PG_GETARG_DATUM(argno);
+    ArrayType *arr = NULL;
+
+    if (VARATT_IS_EXTERNAL_EXPANDED(DatumGetPointer(d)))
+    {
+        ExpandedArrayHeader *eah = (ExpandedArrayHeader *) DatumGetEOHP(d);
+
+        if (eah->ea_magic == EA_MAGIC && eah->fvalue)
+            arr = eah->fvalue;
+    }
+    if (!arr)
+        arr = PG_GETARG_ARRAYTYPE_P(argno);
+
+    arraymath_track_array(d, arr);
+    return arr;
+}
+
+/* The flat form of an expanded array belongs to the array */
+#define ARRAYMATH_FREE_IF_COPY(ptr, n) \
+    do { \
+        if (!VARATT_IS_EXTERNAL_EXPANDED(PG_GETARG_POINTER(n))) \
+            PG_FREE_IF_COPY(ptr, n); \
+    } while (0)
+
+/*
+* Allocate an array of the given shape with room for its fixed-width
+* elements, with a null bitmap (all null to start) only if asked
+* for. The header and bitmap are zeroed, the data area is left for
+* the caller to write straight into at ARR_DATA_PTR.
+*/
+static ArrayType *
+arraymath_new_md_array(const ArrayMathTypeInfo *info, int ndims, const int *dims,
+                       bool hasnulls)
+{
+    ArrayType *array;
+    Size elmsize, overhead, nbytes;
+    int nelems = ArrayGetNItems(ndims, dims);
+
+    Assert(info->typlen > 0);
+    elmsize = att_align_nominal(info->typlen, info->typalign);
+    overhead = hasnulls ? ARR_OVERHEAD_WITHNULLS(ndims, nelems) : ARR_OVERHEAD_NONULLS(ndims);
+    nbytes = overhead + (Size) nelems * elmsize;
+    if (!AllocSizeIsValid(nbytes))
+    {
+        ereport(ERROR,
+            (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+             errmsg("array size exceeds the maximum allowed (%d)",
+                (int) MaxAllocSize)));
+    }
+
+    array = palloc(nbytes);
+    memset(array, 0, overhead);
+    SET_VARSIZE(array, nbytes);
+    array->ndim = ndims;
+    array->dataoffset = hasnulls ? overhead : 0;
+    array->elemtype = info->type;
+    for (int d = 0; d < ndims; d++)
+    {
+        ARR_DIMS(array)[d] = dims[d];
+        ARR_LBOUND(array)[d] = 1;
+    }
+    return array;
+}
+
+/*
+* Allocate a 1-d array of nelems fixed-width elements, as above.
+*/
+static ArrayType *
+arraymath_new_array(const ArrayMathTypeInfo *info, int nelems, bool hasnulls)
+{
+    return arraymath_new_md_array(info, 1, &nelems, hasnulls);
+}
+
+/*
+* Allocate an array of the shape of arr, with the same nulls, for the
+* fixed-width results of a function taking each element to one new
+* element. There is only room for the non-null values, as many as
+* *nvalues is set to, so a kernel run over the packed values of arr
+* fills it exactly.
+*/
+static ArrayType *
+arraymath_new_array_like(ArrayType *arr, const ArrayMathTypeInfo *info, int *nvalues)
+{
+    int nelems = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+    bits8 *bitmap = arraymath_has_nulls(arr) ? ARR_NULLBITMAP(arr) : NULL;
+    ArrayType *arrOut = arraymath_new_md_array(info, ARR_NDIM(arr), ARR_DIMS(arr), bitmap != NULL);
+
+    *nvalues = nelems;
+    if (bitmap)
+    {
+        bits8 *bitmapOut = ARR_NULLBITMAP(arrOut);
+
+        for (int i = 0; i < (nelems + 7) / 8; i++)
+            bitmapOut[i] = bitmap[i];
+        *nvalues = arraymath_bitmap_count(bitmap, nelems);
+        SET_VARSIZE(arrOut, ARR_DATA_OFFSET(arrOut) + (Size) *nvalues * info->typlen);
+    }
+    return arrOut;
+}
+
+/*
+* Output array under construction, filled one element at a time.
+* Fixed-width results are written directly into a pre-sized array,
+* so there is no scratch copy; variable-width results have no size
+* to plan around and go through construct_md_array as before.
+*/
+typedef struct
+{
+    const ArrayMathTypeInfo *info;
+    int ndims;
+    int dims[MAXDIM];
+    int nelems;
+    int n;
+    /* Fixed-width results */
+    ArrayType *array;
+    char *dataptr;
+    bits8 *bitmap;
+    int bitmask;
+    /* Variable-width results */
+    Datum *elems;
+    bool *nulls;
+} ArrayMathBuilder;
+
+static void
+arraymath_builder_init_md(ArrayMathBuilder *builder, const ArrayMathTypeInfo *info,
+                          int ndims, const int *dims, bool hasnulls)
+{
+    int nelems = ArrayGetNItems(ndims, dims);
+
+    memset(builder, 0, sizeof(ArrayMathBuilder));
+    builder->info = info;
+    builder->ndims = ndims;
+    memcpy(builder->dims, dims, sizeof(int) * ndims);
+    builder->nelems = nelems;
+
+    if (info->typlen > 0)
+    {
+        builder->array = arraymath_new_md_array(info, ndims, dims, hasnulls);
+        builder->dataptr = ARR_DATA_PTR(builder->array);
+        builder->bitmap = ARR_NULLBITMAP(builder->array);
+        builder->bitmask = 1;
+    }
+    else
+    {
+        builder->elems = palloc(sizeof(Datum) * nelems);
+        builder->nulls = palloc(sizeof(bool) * nelems);
+    }
+}
+
+static void
+arraymath_builder_init(ArrayMathBuilder *builder, const ArrayMathTypeInfo *info,
+                       int nelems, bool hasnulls)
+{
+    arraymath_builder_init_md(builder, info, 1, &nelems, hasnulls);
+}
+
+static void
+arraymath_builder_add(ArrayMathBuilder *builder, Datum value, bool isnull)
+{
+    const ArrayMathTypeInfo *info = builder->info;
+
+    Assert(builder->n < builder->nelems);
+
+    if (!builder->array)
+    {
+        builder->elems[builder->n] = value;
+        builder->nulls[builder->n] = isnull;
+        builder->n++;
+        return;
+    }
+
+    if (isnull)
+    {
+        /* Bitmap starts out all null, so nothing to write */
+        if (!builder->bitmap)
+            elog(ERROR, "unexpected null in array without null bitmap");
+    }
+    else
+    {
+        if (builder->bitmap)
+            *builder->bitmap |= builder->bitmask;
+
+        if (info->typbyval)
+            store_att_byval(builder->dataptr, value, info->typlen);
+        else
+            memmove(builder->dataptr, DatumGetPointer(value), info->typlen);
+
+        builder->dataptr = att_addlength_pointer(builder->dataptr, info->typlen, builder->dataptr);
+        builder->dataptr = (char *) att_align_nominal(builder->dataptr, info->typalign);
+    }
+
+    BITMAP_INCREMENT(builder->bitmap, builder->bitmask);
+    builder->n++;
+}
+
+static ArrayType *
+arraymath_builder_finish(ArrayMathBuilder *builder)
+{
+    const ArrayMathTypeInfo *info = builder->info;
+    ArrayType *array_out;
+    int lbs[MAXDIM];
+
+    Assert(builder->n == builder->nelems);
+
+    /* Trim the space reserved for elements that came out null */
+    if (builder->array)
+    {
+        SET_VARSIZE(builder->array, builder->dataptr - (char *) builder->array);
+        return builder->array;
+    }
+
+    for (int d = 0; d < builder->ndims; d++)
+        lbs[d] = 1;
+    array_out = construct_md_array(builder->elems, builder->nulls,
+        builder->ndims, builder->dims, lbs,
+        info->type, info->typlen, info->typbyval, info->typalign);
+
+    /* Output is supposed to be a copy, so free the inputs */
+    pfree(builder->elems);
+    pfree(builder->nulls);
+
+    /* Make sure we haven't been given garbage */
+    if (!array_out)
+    {
+        elog(ERROR, "unable to construct output array");
+        return NULL;
+    }
+
+    return array_out;
+}
+
+/*
+* Run the native kernel for the cached operator over two null-free
+* arrays (or an array and a single value), returning a new array
+* of the given shape.
+*/
+static ArrayType *
+arraymath_native_oper(const ArrayMathCache *cache, int ndims, const int *dims,
+                      const void *data1, int nitems1,
+                      const void *data2, int nitems2)
+{
+    ArrayType *array_out = arraymath_new_md_array(&cache->rinfo, ndims, dims, false);
+    ArrayMathStatus status;
+
+    status = arraymath_apply(cache->native_op, cache->native_type,
+        data1, nitems1, data2, nitems2, ARR_DATA_PTR(array_out));
+
+    if (status != AM_OK)
+        arraymath_kernel_error(status, cache->native_type);
+
+    return array_out;
+}
+
+/*
+* As arraymath_native_oper, where some elements are null and both
+* inputs are 1-d (or one is a single value). The output null bitmap
+* is the AND of the input ones, built a word at a time. Both inputs
+* are then laid out in full, with a harmless 1 wherever the output
+* is null, the kernel runs straight over them, and the non-null
+* results are packed into the output array.
+*/
+static ArrayType *
+arraymath_native_oper_nulls(const ArrayMathCache *cache, int ndims, const int *dims,
+                            const void *data1, const bits8 *bitmap1, int nitems1,
+                            const void *data2, const bits8 *bitmap2, int nitems2)
+{
+    ArrayMathKernelType type = cache->native_type;
+    ArrayType *array_out = arraymath_new_md_array(&cache->rinfo, ndims, dims, true);
+    int nelems = ArrayGetNItems(ndims, dims);
+    int elsize = arraymath_kernel_type_size[type];
+    int outsize = arraymath_kernel_out_size(cache->native_op, type);
+    bits8 *valid = ARR_NULLBITMAP(array_out);
+    char *full1 = palloc((Size) nelems * elsize);
+    char *full2 = palloc((Size) nelems * elsize);
+    char *result = palloc((Size) nelems * outsize);
+    ArrayMathStatus status;
+    int nvalid;
+
+    arraymath_bitmap_and(bitmap1, nitems1, bitmap2, nitems2, valid, nelems);
+    arraymath_spread(type, data1, bitmap1, nitems1, valid, nelems, full1);
+    arraymath_spread(type, data2, bitmap2, nitems2, valid, nelems, full2);
+
+    status = arraymath_apply(cache->native_op, type, full1, nelems, full2, nelems, result);
+
+    if (status != AM_OK)
+        arraymath_kernel_error(status, type);
+
+    /* Trim the space reserved for elements that came out null */
+    nvalid = arraymath_compact(outsize, result, valid, nelems, ARR_DATA_PTR(array_out));
+    SET_VARSIZE(array_out, ARR_DATA_OFFSET(array_out) + (Size) nvalid * outsize);
+
+    pfree(full1);
+    pfree(full2);
+    pfree(result);
+    return array_out;
+}
+
+/*
+* Read the element at *ptr and move *ptr on past it.
+*/
+static inline Datum
+arraymath_next_elem(char **ptr, const ArrayMathTypeInfo *info)
+{
+    Datum elem = fetch_att(*ptr, info->typbyval, info->typlen);
+
+    *ptr = att_addlength_pointer(*ptr, info->typlen, *ptr);
+    *ptr = (char *) att_align_nominal(*ptr, info->typalign);
+    return elem;
+}
+
+/*
+* If the first argument is a read-write expanded array that the
+* operator result can simply overwrite, return it. That needs a
+* native operator whose result is the element type, a 1-d array
+* with no nulls, and no wrap-around past its end.
+*/
+static ExpandedArrayHeader *
+arraymath_inplace_target(FunctionCallInfo fcinfo, ArrayMathCache *cache,
+                         const text *opname, Oid element_type2, int nitems2)
+{
+    Datum d = PG_GETARG_DATUM(0);
+    ExpandedArrayHeader *eah;
+
+    if (!VARATT_IS_EXTERNAL_EXPANDED_RW(DatumGetPointer(d)))
+        return NULL;
+
+    eah = (ExpandedArrayHeader *) DatumGetEOHP(d);
+    if (eah->ea_magic != EA_MAGIC || eah->ndims != 1 ||
+        nitems2 < 1 || eah->nelems < nitems2)
+    {
+        return NULL;
+    }
+
+    arraymath_cache_oper(cache, VARDATA_ANY(opname), VARSIZE_ANY_EXHDR(opname),
+                         eah->element_type, element_type2);
+    if (!cache->oper_native || cache->rinfo.type != eah->element_type)
+        return NULL;
+
+    if (eah->dvalues)
+    {
+        if (eah->dnulls)
+        {
+            for (int i = 0; i < eah->nelems; i++)
+            {
+                if (eah->dnulls[i])
+                    return NULL;
+            }
+        }
+    }
+    else if (arraymath_has_nulls(eah->fvalue))
+    {
+        return NULL;
+    }
+    return eah;
+}
+
+/*
+* Run the native kernel for the cached operator with the result
+* written back over the elements of an expanded array. The result
+* goes to a scratch buffer first, so an error part way through
+* leaves the array as it was.
+*/
+static void
+arraymath_inplace_oper(ExpandedArrayHeader *eah, const ArrayMathCache *cache,
+                       const void *data2, int nitems2)
+{
+    ArrayMathKernelType type = cache->native_type;
+    int nitems1 = eah->nelems;
+    Size nbytes = (Size) nitems1 * arraymath_kernel_type_size[type];
+    char *vals = palloc(nbytes);
+    const void *data1;
+    ArrayMathStatus status;
+
+    /* Deconstructed elements are the current ones, if there are any */
+    if (eah->dvalues)
+    {
+        arraymath_datums_to_native(eah->dvalues, nitems1, type, vals);
+        data1 = vals;
+    }
+    else
+    {
+        data1 = ARR_DATA_PTR(eah->fvalue);
+    }
+
+    status = arraymath_apply(cache->native_op, type, data1, nitems1, data2, nitems2, vals);
+
+    if (status != AM_OK)
+        arraymath_kernel_error(status, type);
+
+    if (eah->dvalues)
+    {
+        arraymath_native_to_datums(vals, nitems1, type, eah->dvalues);
+        /* The flat form, if any, no longer matches */
+        eah->fvalue = NULL;
+    }
+    else
+    {
+        memcpy(ARR_DATA_PTR(eah->fvalue), vals, nbytes);
+    }
+    pfree(vals);
+}
+
+/*
+* Apply an operator using an element over all the elements
+* of an array.
+*/
+static ArrayType *
+arraymath_array_oper_elem(ArrayType *array1, ArrayMathCache *cache, const text *opname,
+                          Datum element2, Oid element_type2)
+{
+    ArrayMathBuilder builder;
+    bool hasnulls1;
+
+    int ndims1 = ARR_NDIM(array1);
+    int *dims1 = ARR_DIMS(array1);
+    Oid element_type1 = ARR_ELEMTYPE(array1);
+    Oid rtype;
+    int nelems, n;
+    char *ptr1;
+    bits8 *bitmap1;
+    int pos1 = 0;
+
+    /* What function works for these input types? Populate operfmgrinfo. */
+    /* What data type will the output array be? */
+    arraymath_cache_oper(cache, VARDATA_ANY(opname), VARSIZE_ANY_EXHDR(opname),
+                         element_type1, element_type2);
+    rtype = cache->rinfo.type;
+
+    /* How big is the output array? */
+    nelems = ArrayGetNItems(ndims1, dims1);
+
+    /* If input is empty, return empty */
+    if (nelems == 0)
+    {
+        return construct_empty_array(rtype);
+    }
+
+    /* Built-in operator on a built-in type: */
+    /* hand the raw data to the native kernel */
+    hasnulls1 = arraymath_has_nulls(array1);
+    if (cache->oper_native)
+    {
+        ArrayMathNativeValue value2;
+        arraymath_native_value(element2, cache->native_type, &value2);
+
+        if (!hasnulls1)
+            return arraymath_native_oper(cache, ndims1, dims1,
+                                         ARR_DATA_PTR(array1), nelems, &value2, 1);
+
+        return arraymath_native_oper_nulls(cache, ndims1, dims1,
+                                           ARR_DATA_PTR(array1), ARR_NULLBITMAP(array1), nelems,
+                                           &value2, NULL, 1);
+    }
+
+    /* Output has the shape of the input, and only needs */
+    /* a null bitmap if the input has nulls */
+    arraymath_builder_init_md(&builder, &cache->rinfo, ndims1, dims1, hasnulls1);
+    ptr1 = ARR_DATA_PTR(array1);
+
+    /* No nulls, nothing to check */
+    if (!hasnulls1)
+    {
+        for (n = 0; n < nelems; n++)
+        {
+            Datum element1 = arraymath_next_elem(&ptr1, &cache->info1);
+            arraymath_builder_add(&builder,
+                FunctionCall2(&cache->operfmgrinfo, element1, element2), false);
+        }
+        return arraymath_builder_finish(&builder);
+    }
+
+    /* Null bits come a word at a time */
+    bitmap1 = ARR_NULLBITMAP(array1);
+    for (n = 0; n < nelems; n += 64)
+    {
+        int chunk = Min(64, nelems - n);
+        uint64 valid1 = arraymath_bitmap_word(bitmap1, nelems, &pos1, chunk);
+
+        for (int j = 0; j < chunk; j++)
+        {
+            if ((valid1 >> j) & 1)
+            {
+                /* Apply the operator */
+                Datum element1 = arraymath_next_elem(&ptr1, &cache->info1);
+                arraymath_builder_add(&builder,
+                    FunctionCall2(&cache->operfmgrinfo, element1, element2), false);
+            }
+            else
+            {
+                arraymath_builder_add(&builder, (Datum) 0, true);
+            }
+        }
+    }
+
+    return arraymath_builder_finish(&builder);
+}
+
+/*
+* Array dimensions for error messages, as in "[2][3]".
+*/
+static char *
+arraymath_dims_string(ArrayType *array)
+{
+    StringInfoData buf;
+
+    initStringInfo(&buf);
+    for (int d = 0; d < ARR_NDIM(array); d++)
+        appendStringInfo(&buf, "[%d]", ARR_DIMS(array)[d]);
+    return buf.data;
+}
+
+/*
+* Work out the shape two arrays broadcast to, NumPy style. The
+* dimensions are lined up from the last one, missing leading
+* dimensions count as 1, and each pair must either match or have
+* a 1 that is stretched to fit the other. Along with the output
+* dimensions come the element strides of each input for every
+* output dimension, 0 where an input is stretched.
+*/
+static int
+arraymath_broadcast_shape(ArrayType *array1, ArrayType *array2,
+                          int *dims, int *strides1, int *strides2)
+{
+    int ndims1 = ARR_NDIM(array1);
+    int ndims2 = ARR_NDIM(array2);
+    int ndims = Max(ndims1, ndims2);
+    int stride1 = 1, stride2 = 1;
+
+    for (int d = ndims - 1; d >= 0; d--)
+    {
+        int d1 = d - (ndims - ndims1);
+        int d2 = d - (ndims - ndims2);
+        int len1 = d1 >= 0 ? ARR_DIMS(array1)[d1] : 1;
+        int len2 = d2 >= 0 ? ARR_DIMS(array2)[d2] : 1;
+
+        if (len1 != len2 && len1 != 1 && len2 != 1)
+        {
+            ereport(ERROR,
+                (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+                 errmsg("arrays with dimensions %s and %s cannot be broadcast together",
+                    arraymath_dims_string(array1), arraymath_dims_string(array2))));
+        }
+
+        dims[d] = Max(len1, len2);
+        strides1[d] = (len1 == 1) ? 0 : stride1;
+        strides2[d] = (len2 == 1) ? 0 : stride2;
+        stride1 *= len1;
+        stride2 *= len2;
+    }
+    return ndims;
+}
+
+/*
+* Step to the next row of a broadcast, counting over the outer
+* dimensions and keeping the input offsets in line.
+*/
+static void
+arraymath_broadcast_next(int nouter, const int *dims,
+                         const int *strides1, const int *strides2,
+                         int *idx, int *off1, int *off2)
+{
+    for (int d = nouter - 1; d >= 0; d--)
+    {
+        *off1 += strides1[d];
+        *off2 += strides2[d];
+        if (++idx[d] < dims[d])
+            return;
+
+        /* Wrapped, back to the start of this dimension */
+        *off1 -= strides1[d] * dims[d];
+        *off2 -= strides2[d] * dims[d];
+        idx[d] = 0;
+    }
+}
+
+/*
+* Apply the cached operator over two arrays of which at least one
+* has more than one dimension, broadcasting them to a common shape.
+* The work goes a row (last dimension) at a time, so the native
+* kernels see either a run of elements or a single repeated one
+* on each side.
+*/
+static ArrayType *
+arraymath_array_oper_broadcast(ArrayType *array1, ArrayMathCache *cache,
+                               ArrayType *array2)
+{
+    int dims[MAXDIM], strides1[MAXDIM], strides2[MAXDIM];
+    int idx[MAXDIM] = {0};
+    int ndims = arraymath_broadcast_shape(array1, array2, dims, strides1, strides2);
+    int nelems = ArrayGetNItems(ndims, dims);
+    int inner = dims[ndims - 1];
+    int step1 = strides1[ndims - 1];
+    int step2 = strides2[ndims - 1];
+    int nrows = nelems / inner;
+    int off1 = 0, off2 = 0;
+    bool hasnulls1 = arraymath_has_nulls(array1);
+    bool hasnulls2 = arraymath_has_nulls(array2);
+    const ArrayMathTypeInfo *info1 = &cache->info1;
+    const ArrayMathTypeInfo *info2 = &cache->info2;
+    ArrayMathBuilder builder;
+    Datum *elems1, *elems2;
+    bool *nulls1, *nulls2;
+    int n1, n2;
+
+    if (cache->oper_native && !hasnulls1 && !hasnulls2)
+    {
+        ArrayMathKernelType type = cache->native_type;
+        int elsize = arraymath_kernel_type_size[type];
+        int outsize = arraymath_kernel_out_size(cache->native_op, type);
+        ArrayType *array_out = arraymath_new_md_array(&cache->rinfo, ndims, dims, false);
+        const char *data1 = ARR_DATA_PTR(array1);
+        const char *data2 = ARR_DATA_PTR(array2);
+        char *out = ARR_DATA_PTR(array_out);
+
+        for (int r = 0; r < nrows; r++)
+        {
+            ArrayMathStatus status = arraymath_apply(cache->native_op, type,
+                data1 + (Size) off1 * elsize, step1 ? inner : 1,
+                data2 + (Size) off2 * elsize, step2 ? inner : 1,
+                out + (Size) r * inner * outsize);
+
+            if (status != AM_OK)
+                arraymath_kernel_error(status, type);
+
+            arraymath_broadcast_next(ndims - 1, dims, strides1, strides2,
+                                     idx, &off1, &off2);
+        }
+        return array_out;
+    }
+
+    /* Elements have to be reachable by position */
+    deconstruct_array(array1, info1->type, info1->typlen, info1->typbyval,
+        info1->typalign, &elems1, &nulls1, &n1);
+    deconstruct_array(array2, info2->type, info2->typlen, info2->typbyval,
+        info2->typalign, &elems2, &nulls2, &n2);
+
+    arraymath_builder_init_md(&builder, &cache->rinfo, ndims, dims,
+                              hasnulls1 || hasnulls2);
+
+    for (int r = 0; r < nrows; r++)
+    {
+        for (int i = 0; i < inner; i++)
+        {
+            int i1 = off1 + i * step1;
+            int i2 = off2 + i * step2;
+
+            /* NULL on either side of operator yields output NULL */
+            if (nulls1[i1] || nulls2[i2])
+            {
+                arraymath_builder_add(&builder, (Datum) 0, true);
+            }
+            else
+            {
+                arraymath_builder_add(&builder,
+                    FunctionCall2(&cache->operfmgrinfo, elems1[i1], elems2[i2]), false);
+            }
+        }
+        arraymath_broadcast_next(ndims - 1, dims, strides1, strides2,
+                                 idx, &off1, &off2);
+    }
+
+    pfree(elems1);
+    pfree(elems2);
+    pfree(nulls1);
+    pfree(nulls2);
+
+    return arraymath_builder_finish(&builder);
+}
+
+/*
+* Apply an operator over all the elements of a pair of arrays
+* expanding to return an array of the same size as the largest
+* input array. Pairs of 1-d arrays wrap the shorter one around,
+* other shapes broadcast.
+*/
+static ArrayType *
+arraymath_array_oper_array(ArrayType *array1, ArrayMathCache *cache, const text *opname,
+                           ArrayType *array2)
+{
+    ArrayMathBuilder builder;
+    bool hasnulls1, hasnulls2;
+
+    int ndims1 = ARR_NDIM(array1);
+    int ndims2 = ARR_NDIM(array2);
+    int *dims1 = ARR_DIMS(array1);
+    int *dims2 = ARR_DIMS(array2);
+    char *ptr1 = NULL, *ptr2 = NULL;
+    Oid element_type1 = ARR_ELEMTYPE(array1);
+    Oid element_type2 = ARR_ELEMTYPE(array2);
+    Oid rtype;
+    int nitems1, nitems2;
+    int nelems, n;
+    int i1 = 0, i2 = 0;
+    bits8 *bitmap1, *bitmap2;
+    int pos1 = 0, pos2 = 0;
+    const ArrayMathTypeInfo *info1, *info2;
+
+    if ( ndims1 == 0 && ndims2 > 0 )
+    {
+        return array2;
+    }
+    else if ( ndims1 > 0 && ndims2 == 0 )
+    {
+        return array1;
+    }
+    else if ( ndims1 == 0 && ndims2 == 0 )
+    {
+        return construct_empty_array(element_type1);
+    }
+
+    /* What function works for these input types? Populate operfmgrinfo. */
+    /* What data type will the output array be? */
+    arraymath_cache_oper(cache, VARDATA_ANY(opname), VARSIZE_ANY_EXHDR(opname),
+                         element_type1, element_type2);
+    rtype = cache->rinfo.type;
+
+    /* Pairs of 1-d arrays wrap around, anything with more */
+    /* dimensions broadcasts by shape */
+    if ( ndims1 != 1 || ndims2 != 1 )
+    {
+        return arraymath_array_oper_broadcast(array1, cache, array2);
+    }
+
+    /* How big is the output array? */
+    nitems1 = ArrayGetNItems(ndims1, dims1);
+    nitems2 = ArrayGetNItems(ndims2, dims2);
+    nelems = Max(nitems1, nitems2);
+
+    /* If either input is empty, return empty */
+    if ( nitems1 == 0 || nitems2 == 0 )
+    {
+        return construct_empty_array(rtype);
+    }
+
+    /* Built-in operator on a built-in type: */
+    /* hand the raw data to the native kernel */
+    hasnulls1 = arraymath_has_nulls(array1);
+    hasnulls2 = arraymath_has_nulls(array2);
+    if ( cache->oper_native )
+    {
+        if ( ! hasnulls1 && ! hasnulls2 )
+            return arraymath_native_oper(cache, 1, &nelems,
+                                         ARR_DATA_PTR(array1), nitems1,
+                                         ARR_DATA_PTR(array2), nitems2);
+
+        return arraymath_native_oper_nulls(cache, 1, &nelems,
+            ARR_DATA_PTR(array1), hasnulls1 ? ARR_NULLBITMAP(array1) : NULL, nitems1,
+            ARR_DATA_PTR(array2), hasnulls2 ? ARR_NULLBITMAP(array2) : NULL, nitems2);
+    }
+
+    /* Output only needs a null bitmap if an input has nulls */
+    arraymath_builder_init(&builder, &cache->rinfo, nelems, hasnulls1 || hasnulls2);
+
+    /* Learn more about the input arrays */
+    info1 = &cache->info1;
+    info2 = &cache->info2;
+
+    /* Loop over all the items, re-using items from the shorter */
+    /* array to apply to the longer. With no nulls on either */
+    /* side there is nothing to check. */
+    if ( ! hasnulls1 && ! hasnulls2 )
+    {
+        for ( n = 0; n < nelems; n++ )
+        {
+            Datum elt1, elt2;
+
+            /* Initialize array pointers at start of loop, and */
+            /* on wrap-around */
+            if ( i1 == 0 )
+                ptr1 = ARR_DATA_PTR(array1);
+            if ( i2 == 0 )
+                ptr2 = ARR_DATA_PTR(array2);
+
+            elt1 = arraymath_next_elem(&ptr1, info1);
+            elt2 = arraymath_next_elem(&ptr2, info2);
+            arraymath_builder_add(&builder,
+                FunctionCall2(&cache->operfmgrinfo, elt1, elt2), false);
+
+            if ( ++i1 == nitems1 ) i1 = 0;
+            if ( ++i2 == nitems2 ) i2 = 0;
+        }
+        return arraymath_builder_finish(&builder);
+    }
+
+    /* Otherwise the null bits of each input come a word */
+    /* at a time, all set for an input without nulls */
+    bitmap1 = hasnulls1 ? ARR_NULLBITMAP(array1) : NULL;
+    bitmap2 = hasnulls2 ? ARR_NULLBITMAP(array2) : NULL;
+
+    for ( n = 0; n < nelems; n += 64 )
+    {
+        int chunk = Min(64, nelems - n);
+        uint64 valid1 = arraymath_bitmap_word(bitmap1, nitems1, &pos1, chunk);
+        uint64 valid2 = arraymath_bitmap_word(bitmap2, nitems2, &pos2, chunk);
+
+        for ( int j = 0; j < chunk; j++ )
+        {
+            bool notnull1 = (valid1 >> j) & 1;
+            bool notnull2 = (valid2 >> j) & 1;
+            Datum elt1 = (Datum) 0, elt2 = (Datum) 0;
+
+            if ( i1 == 0 )
+                ptr1 = ARR_DATA_PTR(array1);
+            if ( i2 == 0 )
+                ptr2 = ARR_DATA_PTR(array2);
+
+            if ( notnull1 )
+                elt1 = arraymath_next_elem(&ptr1, info1);
+            if ( notnull2 )
+                elt2 = arraymath_next_elem(&ptr2, info2);
+
+            /* NULL on either side of operator yields output NULL */
+            if ( notnull1 && notnull2 )
+            {
+                arraymath_builder_add(&builder,
+                    FunctionCall2(&cache->operfmgrinfo, elt1, elt2), false);
+            }
+            else
+            {
+                arraymath_builder_add(&builder, (Datum) 0, true);
+            }
+
+            if ( ++i1 == nitems1 ) i1 = 0;
+            if ( ++i2 == nitems2 ) i2 = 0;
+        }
+    }
+
+    /* Build 1-d output array */
+    return arraymath_builder_finish(&builder);
+}
+
+/*
+* Compare two arrays.
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_compare_array)
+{
+    ArrayType *array1 = arraymath_getarg_array(fcinfo, 0);
+    ArrayType *array2 = arraymath_getarg_array(fcinfo, 1);
+    text *operator = PG_GETARG_TEXT_PP(2);
+    ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+    ArrayType *arrayout;
+
+    arrayout = arraymath_array_oper_array(array1, cache, operator, array2);
+
+    ARRAYMATH_FREE_IF_COPY(array1, 0);
+    ARRAYMATH_FREE_IF_COPY(array2, 1);
+
+    PG_RETURN_ARRAYTYPE_P(arrayout);
+}
+
+
+/*
+* Operator on two arrays.
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_math_array)
+{
+    ArrayType *array1;
+    ArrayType *array2 = arraymath_getarg_array(fcinfo, 1);
+    text *operator = PG_GETARG_TEXT_PP(2);
+    ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+    ArrayType *arrayout;
+
+    /* Update a read-write expanded first argument where we can */
+    if (ARR_NDIM(array2) == 1 && !arraymath_has_nulls(array2))
+    {
+        int nitems2 = ArrayGetNItems(1, ARR_DIMS(array2));
+        ExpandedArrayHeader *eah = arraymath_inplace_target(fcinfo, cache,
+            operator, ARR_ELEMTYPE(array2), nitems2);
+
+        if (eah)
+        {
+            arraymath_inplace_oper(eah, cache, ARR_DATA_PTR(array2), nitems2);
+            PG_RETURN_DATUM(EOHPGetRWDatum(&eah->hdr));
+        }
+    }
+
+    array1 = arraymath_getarg_array(fcinfo, 0);
+    arrayout = arraymath_array_oper_array(array1, cache, operator, array2);
+
+    ARRAYMATH_FREE_IF_COPY(array1, 0);
+    ARRAYMATH_FREE_IF_COPY(array2, 1);
+
+    PG_RETURN_ARRAYTYPE_P(arrayout);
+}
+
+
+
+/*
+* Compare an array to a constant element
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_compare_value)
+{
+    ArrayType *array1 = arraymath_getarg_array(fcinfo, 0);
+    Datum element2 = PG_GETARG_DATUM(1);
+    text *operator = PG_GETARG_TEXT_PP(2);
+    ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+    Oid element_type2;
+    ArrayType *arrayout;
+
+    element_type2 = get_fn_expr_argtype(fcinfo->flinfo, 1);
+    arrayout = arraymath_array_oper_elem(array1, cache, operator, element2, element_type2);
+
+    ARRAYMATH_FREE_IF_COPY(array1, 0);
+    PG_RETURN_ARRAYTYPE_P(arrayout);
+}
+
+/*
+* Do math on an array using a constant element
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_math_value)
+{
+    ArrayType *array1;
+    Datum element2 = PG_GETARG_DATUM(1);
+    text *operator = PG_GETARG_TEXT_PP(2);
+    ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+    Oid element_type2;
+    ExpandedArrayHeader *eah;
+    ArrayType *arrayout;
+
+    element_type2 = get_fn_expr_argtype(fcinfo->flinfo, 1);
+
+    /* Update a read-write expanded first argument where we can */
+    eah = arraymath_inplace_target(fcinfo, cache, operator, element_type2, 1);
+    if (eah)
+    {
+        ArrayMathNativeValue value2;
+        arraymath_native_value(element2, cache->native_type, &value2);
+        arraymath_inplace_oper(eah, cache, &value2, 1);
+        PG_RETURN_DATUM(EOHPGetRWDatum(&eah->hdr));
+    }
+
+    array1 = arraymath_getarg_array(fcinfo, 0);
+    arrayout = arraymath_array_oper_elem(array1, cache, operator, element2, element_type2);
+
+    ARRAYMATH_FREE_IF_COPY(array1, 0);
+    PG_RETURN_ARRAYTYPE_P(arrayout);
+}
+
+
+/*
+* Planner support for the operator functions. From PostgreSQL 18,
+* PL/pgSQL asks whether an assignment like "acc := acc @+ x" may
+* hand the function its variable as a read-write expanded array,
+* which array_math_array and array_math_value then update in
+* place instead of copying the whole array on every iteration.
+*/
+Datum array_math_support(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(array_math_support);
+Datum array_math_support(PG_FUNCTION_ARGS)
+{
+    Node *ret = NULL;
+#if PG_VERSION_NUM >= 180000
+    Node *rawreq = (Node *) PG_GETARG_POINTER(0);
+
+    if (IsA(rawreq, SupportRequestModifyInPlace))
+    {
+        /* Only the first argument is ever updated, and only */
+        /* after the other one has been read */
+        SupportRequestModifyInPlace *req = (SupportRequestModifyInPlace *) rawreq;
+        Param *arg = (Param *) linitial(req->args);
+
+        if (arg && IsA(arg, Param) &&
+            arg->paramkind == PARAM_EXTERN &&
+            arg->paramid == req->paramid)
+        {
+            ret = (Node *) arg;
+        }
+    }
+#endif
+    PG_RETURN_POINTER(ret);
+}
+
+
+static Datum
+arraymath_zero(Oid oid)
+{
+    /* Initialize result value */
+    if (oid == INT2OID ||
+        oid == INT4OID ||
+        oid == INT8OID ||
+        oid == FLOAT4OID ||
+        oid == FLOAT8OID)
+    {
+        /* Ints and Floats store value in the Datum */
+        return (Datum)0;
+    }
+    else if (oid == NUMERICOID)
+    {
+        /* Numeric type is varlena, requires special initialization */
+        return NumericGetDatum(arraymath_int64_to_numeric(0));
+    }
+    else
+    {
+        ereport(ERROR, (errmsg("Sum subject must be NUMERIC, SMALLINT, INTEGER, BIGINT, REAL, or DOUBLE PRECISION values")));
+    }
+}
+
+
+/*
+* Running total through the + operator a cache has looked up, for
+* the element types without a native accumulator. Intermediate
+* results go into a scratch context that is reset every so often,
+* rather than piling up until end of query; the total is copied out
+* first, and the copy made the time before let go of. Callers work
+* in the scratch context between init and finish, so whatever else
+* they leave there goes with it.
+*/
+#define ARRAYMATH_SUM_RESET 1024
+
+typedef struct ArrayMathOperSum
+{
+    FmgrInfo *oper;
+    int16 typlen;
+    bool typbyval;
+    MemoryContext scratch;
+    MemoryContext outer;
+    Datum value;
+    Pointer kept;
+    int64 n;
+} ArrayMathOperSum;
+
+static void
+arraymath_oper_sum_init(ArrayMathOperSum *sum, ArrayMathCache *cache, Oid sumType,
+                        const char *name)
+{
+    sum->oper = &cache->operfmgrinfo;
+    sum->typlen = cache->rinfo.typlen;
+    sum->typbyval = cache->rinfo.typbyval;
+    sum->value = arraymath_zero(sumType);
+    sum->kept = NULL;
+    sum->n = 0;
+    sum->outer = CurrentMemoryContext;
+    sum->scratch = AllocSetContextCreate(CurrentMemoryContext, name, ALLOCSET_SMALL_SIZES);
+    MemoryContextSwitchTo(sum->scratch);
+}
+
+static void
+arraymath_oper_sum_add(ArrayMathOperSum *sum, Datum elem)
+{
+    sum->value = FunctionCall2(sum->oper, elem, sum->value);
+
+    if (++sum->n % ARRAYMATH_SUM_RESET == 0 && !sum->typbyval)
+    {
+        /* The operator may have handed back kept itself, so copy first */
+        MemoryContextSwitchTo(sum->outer);
+        sum->value = datumCopy(sum->value, false, sum->typlen);
+        if (sum->kept)
+            pfree(sum->kept);
+        sum->kept = DatumGetPointer(sum->value);
+        MemoryContextReset(sum->scratch);
+        MemoryContextSwitchTo(sum->scratch);
+    }
+}
+
+/* Copy the total out to the caller's context, and drop the scratch */
+static Datum
+arraymath_oper_sum_finish(ArrayMathOperSum *sum)
+{
+    Datum v;
+
+    MemoryContextSwitchTo(sum->outer);
+    v = datumCopy(sum->value, sum->typbyval, sum->typlen);
+    MemoryContextDelete(sum->scratch);
+    return v;
+}
+
+/*
+* Generic sum through the + operator of sumType. Elements of another
+* type are cast first.
+*/
+static Datum
+arraymath_sum(ArrayType *vals, Oid sumType, ArrayMathCache *cache)
+{
+    /* Get + operator FmgrInfo */
+    const char* op = "+";
+    Oid valsType = ARR_ELEMTYPE(vals);
+    ArrayMathTypeInfo valsInfo;
+    ArrayMathOperSum sum;
+    ArrayIterator iterator;
+    Datum elem;
+    bool isnull;
+
+    arraymath_cache_oper(cache, op, strlen(op), sumType, sumType);
+    if (valsType != sumType)
+        arraymath_cache_cast(cache, valsType, sumType);
+
+    arraymath_typeinfo_from_type(valsType, &valsInfo);
+    iterator = arraymath_create_iterator(vals, &valsInfo);
+
+    arraymath_oper_sum_init(&sum, cache, sumType, "arraymath sum");
+    while (array_iterate(iterator, &elem, &isnull))
+    {
+        if (isnull)
+            continue;
+
+        if (valsType != sumType)
+            elem = FunctionCall1(&cache->castfmgrinfo, elem);
+
+        arraymath_oper_sum_add(&sum, elem);
+    }
+
+    return arraymath_oper_sum_finish(&sum);
+}
+
+/*
+* Sum of a native typed array in one pass over its data area.
+* Nulls take no space there, so the non-null values are simply
+* laid out back to back.
+*/
+static void
+arraymath_sum_native(ArrayType *vals, ArrayMathKernelType type, ArrayMathSumState *state)
+{
+    int nitems = ArrayGetNItems(ARR_NDIM(vals), ARR_DIMS(vals));
+
+    if (ARR_HASNULL(vals))
+        nitems = arraymath_bitmap_count(ARR_NULLBITMAP(vals), nitems);
+
+    arraymath_sum_init(state, type);
+    arraymath_sum_run(state, ARR_DATA_PTR(vals), nitems);
+}
+
+/*
+* Native sum as a Datum of sumType, raising the error the type's
+* own + operator would have if it does not fit.
+*/
+static Datum
+arraymath_sum_datum(const ArrayMathSumState *state, Oid sumType)
+{
+    ArrayMathKernelType type;
+    ArrayMathStatus status;
+    int64 i = 0;
+    float8 f = 0.0;
+    float4 f4;
+
+    if (!arraymath_native_type(sumType, &type))
+        type = state->type;
+
+    switch (sumType)
+    {
+        case INT2OID:
+        case INT4OID:
+        case INT8OID:
+            status = arraymath_sum_int64(state, &i);
+            if ((sumType == INT2OID && (i < PG_INT16_MIN || i > PG_INT16_MAX)) ||
+                (sumType == INT4OID && (i < PG_INT32_MIN || i > PG_INT32_MAX)))
+                status |= AM_ERR_OVERFLOW;
+            arraymath_kernel_error(status, type);
+            if (sumType == INT2OID)
+                return Int16GetDatum((int16) i);
+            else if (sumType == INT4OID)
+                return Int32GetDatum((int32) i);
+            return Int64GetDatum(i);
+
+        case FLOAT4OID:
+            status = arraymath_sum_float8(state, &f);
+            f4 = (float4) f;
+            if (isinf(f4) && !isinf(f))
+                status |= AM_ERR_OVERFLOW;
+            arraymath_kernel_error(status, type);
+            return Float4GetDatum(f4);
+
+        case FLOAT8OID:
+            status = arraymath_sum_float8(state, &f);
+            arraymath_kernel_error(status, type);
+            return Float8GetDatum(f);
+
+#ifdef HAVE_INT128
+        case NUMERICOID:
+            return NumericGetDatum(arraymath_int128_to_numeric(state->isum));
+#endif
+
+        default:
+            elog(ERROR, "unexpected sum type %u", sumType);
+    }
+    return (Datum) 0;
+}
+
+/*
+* Sum of the non-null elements as a sumType, natively when possible.
+*/
+static Datum
+arraymath_sum_array(ArrayType *vals, Oid sumType, ArrayMathCache *cache)
+{
+    ArrayMathKernelType type;
+    ArrayMathSumState state;
+    bool native = arraymath_native_type(ARR_ELEMTYPE(vals), &type);
+
+#ifndef HAVE_INT128
+    /* Without int128 an exact bigint total has to go through numeric */
+    if (sumType == NUMERICOID)
+        native = false;
+#endif
+
+    if (!native)
+        return arraymath_sum(vals, sumType, cache);
+
+    arraymath_sum_native(vals, type, &state);
+    return arraymath_sum_datum(&state, sumType);
+}
+
+/*
+* Type array_sum_wide() accumulates and returns for an element type.
+*/
+static Oid
+arraymath_sum_wide_type(Oid elmtype)
+{
+    switch (elmtype)
+    {
+        case INT2OID:
+        case INT4OID:
+            return INT8OID;
+        case INT8OID:
+        case NUMERICOID:
+            return NUMERICOID;
+        default:
+            return FLOAT8OID;
+    }
+}
+
+
+static float8
+arraymath_float8(Datum d, Oid typOid, ArrayMathCache *cache)
+{
+    Datum v;
+    arraymath_cache_cast(cache, typOid, FLOAT8OID);
+    v = FunctionCall1(&cache->castfmgrinfo, d);
+    return DatumGetFloat8(v);
+}
+
+
+/*
+* A large array of a native type that is stored out of line without
+* compression can be read a slice at a time, rather than being
+* fetched whole before the first element is looked at. Memory use
+* then stays at one slice however large the array is.
+*/
+#define ARRAYMATH_SLICE_BYTES (1024 * 1024)
+
+/*
+* A large array argument that can be read slice by slice. Slices
+* are whole sum parts, so a sum over them comes out the same as one
+* over the array in memory.
+*/
+typedef struct ArrayMathStream
+{
+    Datum datum;
+    Oid elmtype;
+    ArrayMathKernelType type;
+    int nitems;
+    int32 offset;
+    int32 extsize;
+} ArrayMathStream;
+
+StaticAssertDecl(ARRAYMATH_SLICE_BYTES % (ARRAYMATH_PARALLEL_PART * sizeof(int64)) == 0,
+    "slices must hold whole sum parts");
+
+/*
+* Check whether array argument argno is stored in a way that allows
+* it to be read slice by slice, returning false (having read nothing
+* much) if not. Sets the element type and the number of elements,
+* nulls included, for the caller to decide on before reading on.
+*/
+static bool
+arraymath_stream_open(FunctionCallInfo fcinfo, int argno, ArrayMathStream *stream)
+{
+    Datum d = PG_GETARG_DATUM(argno);
+    struct varlena *attr = (struct varlena *) DatumGetPointer(d);
+    struct varatt_external toast_pointer;
+    ArrayType *header;
+
+    if (!VARATT_IS_EXTERNAL_ONDISK(attr))
+        return false;
+
+    VARATT_EXTERNAL_GET_POINTER(toast_pointer, attr);
+    if (VARATT_EXTERNAL_IS_COMPRESSED(toast_pointer))
+        return false;
+
+    /* Not worth a separate fetch of the header for less than a slice */
+    stream->extsize = VARATT_EXTERNAL_GET_EXTSIZE(toast_pointer);
+    if (stream->extsize <= ARRAYMATH_SLICE_BYTES)
+        return false;
+
+    /*
+    * Slices are of the data after the varlena header, but come back
+    * with a header of their own, so the first slice reads as the
+    * start of the array, nulls bitmap aside.
+    */
+    header = (ArrayType *) PG_DETOAST_DATUM_SLICE(d, 0,
+        ARR_OVERHEAD_NONULLS(MAXDIM) - VARHDRSZ);
+    if (!arraymath_native_type(ARR_ELEMTYPE(header), &stream->type))
+    {
+        pfree(header);
+        return false;
+    }
+    stream->datum = d;
+    stream->elmtype = ARR_ELEMTYPE(header);
+    stream->nitems = ArrayGetNItems(ARR_NDIM(header), ARR_DIMS(header));
+    stream->offset = ARR_DATA_OFFSET(header) - VARHDRSZ;
+    pfree(header);
+    return true;
+}
+
+/*
+* Gather the accumulators of the summary statistics that are asked
+* for, slice by slice. A sum on its own goes through the same parts
+* as one over the array in memory.
+*/
+static void
+arraymath_stream_stats(ArrayMathStream *stream, int accums, ArrayMathStatsState *state)
+{
+    int32 offset = stream->offset;
+    int32 extsize = stream->extsize;
+    int32 typlen = arraymath_kernel_type_size[stream->type];
+
+    /*
+    * Nulls take no space, so the rest of the datum is exactly the
+    * non-null values. Each slice starts a header's width early, which
+    * puts its values at a maxaligned offset in the returned copy.
+    */
+    arraymath_stats_init(state, stream->type, accums);
+    while (offset < extsize)
+    {
+        int32 len = Min(ARRAYMATH_SLICE_BYTES, extsize - offset);
+        struct varlena *slice = PG_DETOAST_DATUM_SLICE(stream->datum,
+            offset - VARHDRSZ, len + VARHDRSZ);
+
+        if (VARSIZE(slice) != len + 2 * VARHDRSZ || len % typlen != 0)
+            elog(ERROR, "unexpected end of array data");
+
+        if (accums == AM_STATS_SUM)
+            arraymath_sum_run(&state->sum, VARDATA(slice) + VARHDRSZ, len / typlen);
+        else
+            arraymath_stats_accum(state, VARDATA(slice) + VARHDRSZ, len / typlen);
+        pfree(slice);
+        offset += len;
+
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    if (unlikely(arraymath_track_active))
+    {
+        arraymath_track_call.elements += stream->nitems;
+        arraymath_track_call.nulls += stream->nitems - state->sum.count;
+        arraymath_track_call.bytes += extsize;
+    }
+}
+
+/*
+* A reduction of all the elements of a non-empty array, of any
+* number of dimensions, to a single value. These back both the
+* whole-array functions and their per-axis variants.
+*/
+typedef Datum (*ArrayMathReducer)(ArrayType *vals, ArrayMathCache *cache, bool *isnull);
+
+static Datum
+arraymath_reduce_sum(ArrayType *vals, ArrayMathCache *cache, bool *isnull)
+{
+    *isnull = false;
+    return arraymath_sum_array(vals, ARR_ELEMTYPE(vals), cache);
+}
+
+/*
+* Do sum of an array
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_sum)
+{
+    ArrayType *vals;
+    Oid valsType;
+    Datum result;
+    bool isnull;
+    ArrayMathStream stream;
+    ArrayMathStatsState state;
+
+    if (arraymath_stream_open(fcinfo, 0, &stream))
+    {
+        arraymath_stream_stats(&stream, AM_STATS_SUM, &state);
+        PG_RETURN_DATUM(arraymath_sum_datum(&state.sum, stream.elmtype));
+    }
+
+    vals = arraymath_getarg_array(fcinfo, 0);
+    valsType = ARR_ELEMTYPE(vals);
+    arraymath_check_type(valsType);
+
+    if (ARR_NDIM(vals) == 0)
+        PG_RETURN_NULL();
+
+    result = arraymath_reduce_sum(vals, arraymath_cache_get(fcinfo), &isnull);
+    PG_RETURN_DATUM(result);
+}
+
+
+/*
+* Do sum of an array into a wider type that will not overflow
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_sum_wide)
+{
+    ArrayType *vals;
+    Oid valsType;
+    Oid sumType;
+    ArrayMathStream stream;
+    ArrayMathStatsState state;
+
+    if (arraymath_stream_open(fcinfo, 0, &stream))
+    {
+        sumType = arraymath_sum_wide_type(stream.elmtype);
+#ifndef HAVE_INT128
+        /* Without int128 an exact bigint total has to go through numeric */
+        if (sumType != NUMERICOID)
+#endif
+        {
+            arraymath_stream_stats(&stream, AM_STATS_SUM, &state);
+            PG_RETURN_DATUM(arraymath_sum_datum(&state.sum, sumType));
+        }
+    }
+
+    vals = arraymath_getarg_array(fcinfo, 0);
+    valsType = ARR_ELEMTYPE(vals);
+    arraymath_check_type(valsType);
+    sumType = arraymath_sum_wide_type(valsType);
+
+    if (ARR_NDIM(vals) == 0)
+        PG_RETURN_NULL();
+
+    PG_RETURN_DATUM(arraymath_sum_array(vals, sumType, arraymath_cache_get(fcinfo)));
+}
+
+
+static Datum
+arraymath_reduce_avg(ArrayType *vals, ArrayMathCache *cache, bool *isnull)
+{
+    Oid valsType = ARR_ELEMTYPE(vals);
+    ArrayMathKernelType type;
+    Datum sumDatum;
+    float8 sum, count;
+
+    if (arraymath_native_type(valsType, &type))
+    {
+        ArrayMathSumState state;
+
+        arraymath_sum_native(vals, type, &state);
+        arraymath_kernel_error(arraymath_sum_float8(&state, &sum), type);
+    }
+    else
+    {
+        sumDatum = arraymath_sum(vals, valsType, cache);
+        sum = arraymath_float8(sumDatum, valsType, cache);
+    }
+
+    /* array_avg(anyarray) => float8 */
+    count = (float8) ArrayGetNItems(ARR_NDIM(vals), ARR_DIMS(vals));
+
+    /* float8 argument should force float8 return */
+    *isnull = false;
+    return Float8GetDatum(sum / count);
+}
+
+/*
+* Do average of an array
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_avg)
+{
+    ArrayType *vals;
+    Datum result;
+    bool isnull;
+    ArrayMathStream stream;
+    ArrayMathStatsState state;
+
+    if (arraymath_stream_open(fcinfo, 0, &stream))
+    {
+        float8 sum;
+
+        /* Nulls count towards the average, as in arraymath_reduce_avg */
+        arraymath_stream_stats(&stream, AM_STATS_SUM, &state);
+        arraymath_kernel_error(arraymath_sum_float8(&state.sum, &sum), state.sum.type);
+        PG_RETURN_FLOAT8(sum / stream.nitems);
+    }
+
+    vals = arraymath_getarg_array(fcinfo, 0);
+    arraymath_check_type(ARR_ELEMTYPE(vals));
+
+    if (ARR_NDIM(vals) == 0)
+        PG_RETURN_NULL();
+
+    result = arraymath_reduce_avg(vals, arraymath_cache_get(fcinfo), &isnull);
+    PG_RETURN_DATUM(result);
+}
+
+
+static Datum
+arraymath_minmax(ArrayType *arr, int mode, ArrayMathCache *cache, bool *resultnull)
+{
+    Oid arrType = ARR_ELEMTYPE(arr);
+    Datum elem, result = (Datum)0, cmp;
+    bool isnull, first = true;
+    ArrayIterator iterator;
+
+    arraymath_check_type(arrType);
+    arraymath_cache_cmp(cache, arrType);
+
+    iterator = arraymath_create_iterator(arr, &cache->cmpinfo);
+    while (array_iterate(iterator, &elem, &isnull))
+    {
+        if (isnull) continue;
+
+        if (first)
+        {
+            result = elem;
+            first = false;
+            continue;
+        }
+
+        /* cmp_proc_finfo returns -1 for less than */
+        /* and 1 for greater than. Mode is -1 for min */
+        /* and 1 for max */
+        cmp = FunctionCall2(&cache->cmpfmgrinfo, elem, result);
+        if ((mode < 0 && DatumGetInt32(cmp) < 0) ||
+            (mode > 0 && DatumGetInt32(cmp) > 0))
+        {
+            result = elem;
+        }
+    }
+
+    /* Nothing but nulls */
+    *resultnull = first;
+    if (first)
+        return (Datum) 0;
+
+    /* Don't hand back a pointer into the array itself */
+    return datumCopy(result, cache->cmpinfo.typbyval, cache->cmpinfo.typlen);
+}
+
+static Datum
+arraymath_reduce_min(ArrayType *arr, ArrayMathCache *cache, bool *isnull)
+{
+    return arraymath_minmax(arr, -1, cache, isnull);
+}
+
+static Datum
+arraymath_reduce_max(ArrayType *arr, ArrayMathCache *cache, bool *isnull)
+{
+    return arraymath_minmax(arr, 1, cache, isnull);
+}
+
+
+/*
+* Do minimum of an array
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_min)
+{
+    ArrayType *arr;
+    Datum result;
+    bool isnull;
+    ArrayMathStream stream;
+    ArrayMathStatsState state;
+
+    if (arraymath_stream_open(fcinfo, 0, &stream))
+    {
+        arraymath_stream_stats(&stream, AM_STATS_RANGE, &state);
+        if (state.sum.count == 0)
+            PG_RETURN_NULL();
+        arraymath_native_to_datums(&state.min, 1, state.sum.type, &result);
+        PG_RETURN_DATUM(result);
+    }
+
+    arr = arraymath_getarg_array(fcinfo, 0);
+    if (ARR_NDIM(arr) == 0)
+        PG_RETURN_NULL();
+
+    result = arraymath_reduce_min(arr, arraymath_cache_get(fcinfo), &isnull);
+    if (isnull)
+        PG_RETURN_NULL();
+
+    PG_RETURN_DATUM(result);
+}
+
+/*
+* Do maximum of an array
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_max)
+{
+    ArrayType *arr;
+    Datum result;
+    bool isnull;
+    ArrayMathStream stream;
+    ArrayMathStatsState state;
+
+    if (arraymath_stream_open(fcinfo, 0, &stream))
+    {
+        arraymath_stream_stats(&stream, AM_STATS_RANGE, &state);
+        if (state.sum.count == 0)
+            PG_RETURN_NULL();
+        arraymath_native_to_datums(&state.max, 1, state.sum.type, &result);
+        PG_RETURN_DATUM(result);
+    }
+
+    arr = arraymath_getarg_array(fcinfo, 0);
+    if (ARR_NDIM(arr) == 0)
+        PG_RETURN_NULL();
+
+    result = arraymath_reduce_max(arr, arraymath_cache_get(fcinfo), &isnull);
+    if (isnull)
+        PG_RETURN_NULL();
+
+    PG_RETURN_DATUM(result);
+}
+
+
+static int
+arraymath_int_cmp(const void *a, const void *b)
+{
+    int ia = *(const int *) a;
+    int ib = *(const int *) b;
+
+    return (ia > ib) - (ia < ib);
+}
+
+/*
+* Comparator for types without a native sort, the sort support
+* travels with the call rather than in a global.
+*/
+static int
+arraymath_sort_cmp(const void *a, const void *b, void *arg)
+{
+    return ApplySortComparator(*(const Datum *) a, false,
+                               *(const Datum *) b, false,
+                               (SortSupport) arg);
+}
+
+/*
+* Mark elements [start, start + count) of a zeroed null bitmap as
+* not null.
+*/
+static void
+arraymath_bitmap_set_range(bits8 *bitmap, int start, int count)
+{
+    int end = start + count;
+    int i = start;
+
+    /* Bits up to the first byte boundary, whole bytes, then the rest */
+    for (; i < end && i % 8 != 0; i++)
+        bitmap[i / 8] |= (1 << (i % 8));
+    if (end - i >= 8)
+    {
+        memset(bitmap + i / 8, 0xFF, (end - i) / 8);
+        i += (end - i) & ~7;
+    }
+    for (; i < end; i++)
+        bitmap[i / 8] |= (1 << (i % 8));
+}
+
+/*
+* Sort an array, keeping the nulls together at one end. Native types
+* are radix sorted directly in the output array, everything else is
+* quicksorted through the type's sort support.
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_sort)
+{
+    ArrayType *arr = arraymath_getarg_array(fcinfo, 0);
+    bool reverse = PG_GETARG_BOOL(1);
+    /* Nulls have always gone first ascending and last descending */
+    bool nulls_first = (PG_NARGS() > 2) ? PG_GETARG_BOOL(2) : !reverse;
+    ArrayType *arrOut;
+    Oid elmtype = ARR_ELEMTYPE(arr);
+    ArrayMathKernelType type;
+    ArrayMathTypeInfo info;
+    int nelems, nvalues;
+
+    arraymath_check_type(elmtype);
+
+    if (ARR_NDIM(arr) > 1)
+        ereport(ERROR, (errmsg("only one-dimensional arrays are supported")));
+
+    nelems = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+    if (nelems == 0)
+        PG_RETURN_ARRAYTYPE_P(construct_empty_array(elmtype));
+
+    arraymath_typeinfo_from_type(elmtype, &info);
+
+    if (arraymath_native_type(elmtype, &type))
+    {
+        /* Nulls take no space, so the values are the whole data area */
+        nvalues = nelems;
+        if (ARR_HASNULL(arr))
+            nvalues = arraymath_bitmap_count(ARR_NULLBITMAP(arr), nelems);
+
+        arrOut = arraymath_new_array(&info, nelems, nvalues < nelems);
+        memcpy(ARR_DATA_PTR(arrOut), ARR_DATA_PTR(arr), (Size) nvalues * info.typlen);
+        arraymath_sort_native(type, ARR_DATA_PTR(arrOut),
+            palloc((Size) Max(nvalues, 1) * info.typlen), nvalues, reverse);
+
+        if (nvalues < nelems)
+        {
+            arraymath_bitmap_set_range(ARR_NULLBITMAP(arrOut),
+                nulls_first ? nelems - nvalues : 0, nvalues);
+            SET_VARSIZE(arrOut, ARR_DATA_OFFSET(arrOut) + (Size) nvalues * info.typlen);
+        }
+    }
+    else
+    {
+        TypeCacheEntry *typentry;
+        SortSupportData ssup;
+        Datum *elems, *values;
+        bool *nulls;
+        int nnulls, first;
+        int lbound = 1;
+
+        typentry = arraymath_typentry_from_type(elmtype, TYPECACHE_LT_OPR);
+        if (!OidIsValid(typentry->lt_opr))
+        {
+            elog(ERROR, "could not identify an ordering operator for type %s",
+                format_type_be(elmtype));
+        }
+
+        memset(&ssup, 0, sizeof(ssup));
+        ssup.ssup_cxt = CurrentMemoryContext;
+        ssup.ssup_collation = PG_GET_COLLATION();
+        ssup.ssup_reverse = reverse;
+        PrepareSortSupportFromOrderingOp(typentry->lt_opr, &ssup);
+
+        deconstruct_array(arr, elmtype,
+            info.typlen, info.typbyval, info.typalign,
+            &elems, &nulls, &nelems);
+
+        /* Sort just the values, then put the nulls back at one end */
+        values = palloc(sizeof(Datum) * nelems);
+        nvalues = 0;
+        for (int i = 0; i < nelems; i++)
+        {
+            if (!nulls[i])
+                values[nvalues++] = elems[i];
+        }
+        qsort_arg(values, nvalues, sizeof(Datum), arraymath_sort_cmp, &ssup);
+
+        nnulls = nelems - nvalues;
+        first = nulls_first ? nnulls : 0;
+        for (int i = 0; i < nelems; i++)
+        {
+            nulls[i] = (i < first || i >= first + nvalues);
+            elems[i] = nulls[i] ? (Datum) 0 : values[i - first];
+        }
+
+        arrOut = construct_md_array(elems, nulls,
+            1, &nelems, &lbound, elmtype,
+            info.typlen, info.typbyval, info.typalign);
+    }
+
+    ARRAYMATH_FREE_IF_COPY(arr, 0);
+    PG_RETURN_ARRAYTYPE_P(arrOut);
+}
+
+
+/*
+* Comparison state for ranking the values of a type without a
+* native kernel through its btree comparison function.
+*/
+typedef struct
+{
+    const Datum *values;
+    FmgrInfo *cmpfmgrinfo;
+    Oid collation;
+    bool largest;
+} ArrayMathRankState;
+
+static bool
+arraymath_rank_datum(const void *arg, int i, int j)
+{
+    const ArrayMathRankState *state = (const ArrayMathRankState *) arg;
+    int32 cmp = DatumGetInt32(FunctionCall2Coll(state->cmpfmgrinfo,
+        state->collation, state->values[i], state->values[j]));
+
+    if (state->largest)
+        cmp = -cmp;
+    return cmp < 0 || (cmp == 0 && i < j);
+}
+
+/*
+* The k largest (or smallest) values of a 1-d array, best first, or
+* with positions set their subscripts instead. Nulls are skipped, and
+* ties go to the earlier element. A bounded heap keeps this O(n log k)
+* rather than sorting the whole array.
+*/
+static ArrayType *
+arraymath_topk_array(FunctionCallInfo fcinfo, bool largest, bool positions)
+{
+    ArrayType *arr = arraymath_getarg_array(fcinfo, 0);
+    int k = PG_GETARG_INT32(1);
+    Oid elmtype = ARR_ELEMTYPE(arr);
+    ArrayMathKernelType type;
+    ArrayMathTypeInfo info, rinfo;
+    ArrayType *arrOut;
+    int nelems, nvalues, count;
+    int lbound = 1;
+    int *idx, *subscripts = NULL;
+    const char *data = NULL;
+    Datum *values = NULL;
+
+    arraymath_check_type(elmtype);
+
+    if (k < 0)
+    {
+        ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("k must not be negative")));
+    }
+
+    if (ARR_NDIM(arr) > 1)
+        ereport(ERROR, (errmsg("only one-dimensional arrays are supported")));
+
+    nelems = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+    if (ARR_NDIM(arr) == 1)
+        lbound = ARR_LBOUND(arr)[0];
+
+    arraymath_typeinfo_from_type(elmtype, &info);
+    arraymath_typeinfo_from_type(positions ? INT4OID : elmtype, &rinfo);
+
+    if (arraymath_native_type(elmtype, &type))
+    {
+        /* Nulls take no space, so the values are the whole data area */
+        nvalues = nelems;
+        if (ARR_HASNULL(arr))
+            nvalues = arraymath_bitmap_count(ARR_NULLBITMAP(arr), nelems);
+
+        data = ARR_DATA_PTR(arr);
+        idx = palloc(sizeof(int) * Max(Min(k, nvalues), 1));
+        count = arraymath_topk_native(type, data, nvalues, k, largest, idx);
+
+        /* Positions among the values are not subscripts once there are nulls */
+        if (positions && nvalues < nelems)
+        {
+            bits8 *bitmap = ARR_NULLBITMAP(arr);
+
+            subscripts = palloc(sizeof(int) * Max(nvalues, 1));
+            for (int i = 0, j = 0; i < nelems; i++)
+            {
+                if (bitmap[i / 8] & (1 << (i % 8)))
+                    subscripts[j++] = i;
+            }
+        }
+    }
+    else
+    {
+        ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+        ArrayMathRankState state;
+        Datum *elems;
+        bool *nulls;
+
+        arraymath_cache_cmp(cache, elmtype);
+        deconstruct_array(arr, elmtype, info.typlen, info.typbyval, info.typalign,
+            &elems, &nulls, &nelems);
+
+        values = palloc(sizeof(Datum) * Max(nelems, 1));
+        subscripts = palloc(sizeof(int) * Max(nelems, 1));
+        nvalues = 0;
+        for (int i = 0; i < nelems; i++)
+        {
+            if (nulls[i])
+                continue;
+            subscripts[nvalues] = i;
+            values[nvalues++] = elems[i];
+        }
+
+        state.values = values;
+        state.cmpfmgrinfo = &cache->cmpfmgrinfo;
+        state.collation = PG_GET_COLLATION();
+        state.largest = largest;
+
+        idx = palloc(sizeof(int) * Max(Min(k, nvalues), 1));
+        count = arraymath_topk(nvalues, k, arraymath_rank_datum, &state, idx);
+    }
+
+    if (count == 0)
+        return construct_empty_array(rinfo.type);
+
+    if (positions)
+    {
+        int32 *out;
+
+        arrOut = arraymath_new_array(&rinfo, count, false);
+        out = (int32 *) ARR_DATA_PTR(arrOut);
+        for (int i = 0; i < count; i++)
+            out[i] = lbound + (subscripts ? subscripts[idx[i]] : idx[i]);
+    }
+    else if (data)
+    {
+        int size = info.typlen;
+
+        arrOut = arraymath_new_array(&rinfo, count, false);
+        for (int i = 0; i < count; i++)
+            memcpy(ARR_DATA_PTR(arrOut) + (Size) i * size, data + (Size) idx[i] * size, size);
+    }
+    else
+    {
+        Datum *elems = palloc(sizeof(Datum) * Max(count, 1));
+        int lb = 1;
+
+        for (int i = 0; i < count; i++)
+            elems[i] = values[idx[i]];
+        arrOut = construct_md_array(elems, NULL, 1, &count, &lb,
+            rinfo.type, rinfo.typlen, rinfo.typbyval, rinfo.typalign);
+    }
+
+    return arrOut;
+}
+
+/*
+* Do k largest values of an array
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_topk)
+{
+    PG_RETURN_ARRAYTYPE_P(arraymath_topk_array(fcinfo, true, false));
+}
+
+/*
+* Do k smallest values of an array
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_bottomk)
+{
+    PG_RETURN_ARRAYTYPE_P(arraymath_topk_array(fcinfo, false, false));
+}
+
+/*
+* Do subscripts of the k largest values of an array
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_argtopk)
+{
+    PG_RETURN_ARRAYTYPE_P(arraymath_topk_array(fcinfo, true, true));
+}
+
+/*
+* Do subscripts of the k smallest values of an array
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_argbottomk)
+{
+    PG_RETURN_ARRAYTYPE_P(arraymath_topk_array(fcinfo, false, true));
+}
+
+
+/*
+* The non-null values of a one-dimensional array that the caller
+* says is in ascending order, as the packed data area of a native
+* type, or else as Datums.
+*/
+typedef struct
+{
+    bool native;
+    ArrayMathKernelType type;
+    const char *data;
+    Datum *values;
+    int nvalues;
+} ArrayMathSortedValues;
+
+static ArrayType *
+arraymath_sorted_arg(FunctionCallInfo fcinfo, int argno, ArrayMathSortedValues *sorted)
+{
+    ArrayType *arr = arraymath_getarg_array(fcinfo, argno);
+    Oid elmtype = ARR_ELEMTYPE(arr);
+    int nelems;
+
+    arraymath_check_type(elmtype);
+    if (ARR_NDIM(arr) > 1)
+        ereport(ERROR, (errmsg("only one-dimensional arrays are supported")));
+
+    nelems = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+    sorted->native = arraymath_native_type(elmtype, &sorted->type);
+    sorted->data = NULL;
+    sorted->values = NULL;
+
+    if (sorted->native)
+    {
+        /* Nulls take no space, so the values are the whole data area */
+        sorted->data = ARR_DATA_PTR(arr);
+        sorted->nvalues = nelems;
+        if (ARR_HASNULL(arr))
+            sorted->nvalues = arraymath_bitmap_count(ARR_NULLBITMAP(arr), nelems);
+    }
+    else
+    {
+        ArrayMathTypeInfo info;
+        bool *nulls;
+
+        arraymath_typeinfo_from_type(elmtype, &info);
+        deconstruct_array(arr, elmtype, info.typlen, info.typbyval, info.typalign,
+            &sorted->values, &nulls, &nelems);
+        sorted->nvalues = 0;
+        for (int i = 0; i < nelems; i++)
+        {
+            if (!nulls[i])
+                sorted->values[sorted->nvalues++] = sorted->values[i];
+        }
+    }
+    return arr;
+}
+
+/*
+* How many of n ascending Datums come before value, through the
+* btree comparison function, as arraymath_search_sorted() does it
+* for the native types.
+*/
+static int
+arraymath_search_datums(FmgrInfo *cmpfmgrinfo, Oid collation,
+                        const Datum *values, int n, Datum value, bool right)
+{
+    int lo = 0, hi = n;
+
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        int32 cmp = DatumGetInt32(FunctionCall2Coll(cmpfmgrinfo, collation,
+                                                    values[mid], value));
+
+        if (cmp < 0 || (right && cmp == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+* Merge, intersect or take the difference of two ascending lists
+* of Datums, as arraymath_sorted_combine() does it for the native
+* types.
+*/
+static int
+arraymath_combine_datums(FmgrInfo *cmpfmgrinfo, Oid collation, ArrayMathSortedOp op,
+                         const Datum *a, int na, const Datum *b, int nb, Datum *out)
+{
+    int i = 0, j = 0, k = 0;
+
+    while (i < na && j < nb)
+    {
+        int32 cmp = DatumGetInt32(FunctionCall2Coll(cmpfmgrinfo, collation, a[i], b[j]));
+
+        if (op == AM_SORTED_MERGE)
+        {
+            out[k++] = (cmp > 0) ? b[j++] : a[i++];
+            continue;
+        }
+        if (cmp == 0 ? op == AM_SORTED_INTERSECT : (cmp < 0 && op == AM_SORTED_EXCEPT))
+            out[k++] = a[i];
+        i += (cmp <= 0);
+        j += (cmp >= 0);
+    }
+
+    if (op != AM_SORTED_INTERSECT)
+    {
+        while (i < na)
+            out[k++] = a[i++];
+    }
+    if (op == AM_SORTED_MERGE)
+    {
+        while (j < nb)
+            out[k++] = b[j++];
+    }
+    return k;
+}
+
+/*
+* Count how many values of an ascending array come before a value:
+* the position it would be inserted at to keep the order, after any
+* equal values if rightmost is set. Nulls in the array are skipped.
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_searchsorted)
+{
+    ArrayMathSortedValues sorted;
+    ArrayType *arr = arraymath_sorted_arg(fcinfo, 0, &sorted);
+    Datum value = PG_GETARG_DATUM(1);
+    bool rightmost = PG_GETARG_BOOL(2);
+    int32 count;
+
+    if (sorted.native)
+    {
+        ArrayMathNativeValue v;
+
+        arraymath_native_value(value, sorted.type, &v);
+        arraymath_search_sorted(sorted.type, sorted.data, sorted.nvalues, &v, 1, rightmost, &count);
+    }
+    else
+    {
+        ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+
+        arraymath_cache_cmp(cache, ARR_ELEMTYPE(arr));
+        count = arraymath_search_datums(&cache->cmpfmgrinfo, PG_GET_COLLATION(),
+            sorted.values, sorted.nvalues, value, rightmost);
+    }
+
+    ARRAYMATH_FREE_IF_COPY(arr, 0);
+    PG_RETURN_INT32(count);
+}
+
+/*
+* The same for every element of an array of values, of any shape,
+* giving an int4 array of that shape and those bounds, with nulls
+* where it has them.
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_searchsorted_array)
+{
+    ArrayMathSortedValues sorted;
+    ArrayType *arr = arraymath_sorted_arg(fcinfo, 0, &sorted);
+    ArrayType *probes = arraymath_getarg_array(fcinfo, 1);
+    bool rightmost = PG_GETARG_BOOL(2);
+    ArrayMathTypeInfo rinfo;
+    ArrayType *arrOut;
+
+    if (ARR_NDIM(probes) == 0)
+        PG_RETURN_ARRAYTYPE_P(construct_empty_array(INT4OID));
+
+    arraymath_typeinfo_from_type(INT4OID, &rinfo);
+
+    if (sorted.native)
+    {
+        int nvalues;
+
+        /* Both sides are packed, so the kernel fills the output as it stands */
+        arrOut = arraymath_new_array_like(probes, &rinfo, &nvalues);
+        for (int d = 0; d < ARR_NDIM(probes); d++)
+            ARR_LBOUND(arrOut)[d] = ARR_LBOUND(probes)[d];
+        arraymath_search_sorted(sorted.type, sorted.data, sorted.nvalues,
+            ARR_DATA_PTR(probes), nvalues, rightmost, (int32 *) ARR_DATA_PTR(arrOut));
+    }
+    else
+    {
+        ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+        Oid collation = PG_GET_COLLATION();
+        ArrayMathTypeInfo info;
+        Datum *elems;
+        bool *nulls;
+        int nelems;
+
+        arraymath_cache_cmp(cache, ARR_ELEMTYPE(arr));
+        arraymath_typeinfo_from_type(ARR_ELEMTYPE(probes), &info);
+        deconstruct_array(probes, info.type, info.typlen, info.typbyval, info.typalign,
+            &elems, &nulls, &nelems);
+        for (int i = 0; i < nelems; i++)
+        {
+            if (!nulls[i])
+            {
+                elems[i] = Int32GetDatum(arraymath_search_datums(&cache->cmpfmgrinfo,
+                    collation, sorted.values, sorted.nvalues, elems[i], rightmost));
+            }
+        }
+        arrOut = construct_md_array(elems, nulls, ARR_NDIM(probes), ARR_DIMS(probes),
+            ARR_LBOUND(probes), rinfo.type, rinfo.typlen, rinfo.typbyval, rinfo.typalign);
+    }
+
+    ARRAYMATH_FREE_IF_COPY(arr, 0);
+    ARRAYMATH_FREE_IF_COPY(probes, 1);
+    PG_RETURN_ARRAYTYPE_P(arrOut);
+}
+
+/*
+* Combine two ascending arrays into a new one in one pass over both,
+* skipping nulls. Native types are written straight into an array
+* sized for the most the result can hold, which is then cut down.
+*/
+static ArrayType *
+arraymath_sorted_setop(FunctionCallInfo fcinfo, ArrayMathSortedOp op)
+{
+    ArrayMathSortedValues a, b;
+    ArrayType *arr1 = arraymath_sorted_arg(fcinfo, 0, &a);
+    ArrayType *arr2 = arraymath_sorted_arg(fcinfo, 1, &b);
+    Oid elmtype = ARR_ELEMTYPE(arr1);
+    int maxcount = (op == AM_SORTED_MERGE) ? a.nvalues + b.nvalues : a.nvalues;
+    ArrayMathTypeInfo info;
+    ArrayType *arrOut;
+    int count;
+
+    if (maxcount == 0)
+        return construct_empty_array(elmtype);
+
+    arraymath_typeinfo_from_type(elmtype, &info);
+
+    if (a.native)
+    {
+        arrOut = arraymath_new_array(&info, maxcount, false);
+        count = arraymath_sorted_combine(a.type, op, a.data, a.nvalues, b.data, b.nvalues,
+            ARR_DATA_PTR(arrOut));
+        if (count == 0)
+            return construct_empty_array(elmtype);
+        ARR_DIMS(arrOut)[0] = count;
+        SET_VARSIZE(arrOut, ARR_DATA_OFFSET(arrOut) + (Size) count * info.typlen);
+    }
+    else
+    {
+        ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+        Datum *out = palloc(sizeof(Datum) * maxcount);
+        int lbound = 1;
+
+        arraymath_cache_cmp(cache, elmtype);
+        count = arraymath_combine_datums(&cache->cmpfmgrinfo, PG_GET_COLLATION(), op,
+            a.values, a.nvalues, b.values, b.nvalues, out);
+        if (count == 0)
+            return construct_empty_array(elmtype);
+        arrOut = construct_md_array(out, NULL, 1, &count, &lbound, elmtype,
+            info.typlen, info.typbyval, info.typalign);
+    }
+
+    ARRAYMATH_FREE_IF_COPY(arr1, 0);
+    ARRAYMATH_FREE_IF_COPY(arr2, 1);
+    return arrOut;
+}
+
+/*
+* Do merge of two ascending arrays
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_merge_sorted)
+{
+    PG_RETURN_ARRAYTYPE_P(arraymath_sorted_setop(fcinfo, AM_SORTED_MERGE));
+}
+
+/*
+* Do values of an ascending array matched in another
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_intersect_sorted)
+{
+    PG_RETURN_ARRAYTYPE_P(arraymath_sorted_setop(fcinfo, AM_SORTED_INTERSECT));
+}
+
+/*
+* Do values of an ascending array not matched in another
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_except_sorted)
+{
+    PG_RETURN_ARRAYTYPE_P(arraymath_sorted_setop(fcinfo, AM_SORTED_EXCEPT));
+}
+
+
+/*
+* Group n Datums as arraymath_distinct_native() does the native
+* types, through a table of group numbers with the hash of each
+* group kept alongside, so equality is only called on a hash match.
+*/
+static int
+arraymath_distinct_datums(ArrayMathCache *cache, Oid collation, const Datum *values, int n,
+                          int *first, int *counts)
+{
+    int tablesize = arraymath_distinct_table_size(n);
+    int *table = palloc(sizeof(int) * tablesize);
+    uint32 *hashes = palloc(sizeof(uint32) * Max(n, 1));
+    int ngroups = 0;
+
+    memset(table, 0xff, sizeof(int) * tablesize);
+    for (int i = 0; i < n; i++)
+    {
+        uint32 hash = DatumGetUInt32(FunctionCall1Coll(&cache->hashfmgrinfo, collation, values[i]));
+        int slot = hash & (tablesize - 1);
+        int id;
+
+        while ((id = table[slot]) >= 0)
+        {
+            if (hashes[id] == hash &&
+                DatumGetBool(FunctionCall2Coll(&cache->eqfmgrinfo, collation,
+                                               values[first[id]], values[i])))
+                break;
+            slot = (slot + 1) & (tablesize - 1);
+        }
+        if (id < 0)
+        {
+            id = ngroups++;
+            table[slot] = id;
+            hashes[id] = hash;
+            first[id] = i;
+            if (counts)
+                counts[id] = 0;
+        }
+        if (counts)
+            counts[id]++;
+    }
+
+    pfree(table);
+    pfree(hashes);
+    return ngroups;
+}
+
+/*
+* The non-null values of an array of any shape grouped by equality,
+* in order of first appearance. Native types are hashed on their
+* bits by arraymath_distinct_native(), everything else through the
+* type's hash and equality functions.
+*/
+typedef struct
+{
+    ArrayType *arr;
+    ArrayMathTypeInfo info;
+    const char *data;   /* the packed values of a native type */
+    Datum *values;      /* or else the values as Datums */
+    int ngroups;
+    int *first;         /* position of the first value of each group */
+    int *counts;        /* values in each group, if asked for */
+} ArrayMathGroups;
+
+static void
+arraymath_group_values(FunctionCallInfo fcinfo, int argno, bool count, ArrayMathGroups *groups)
+{
+    ArrayType *arr = arraymath_getarg_array(fcinfo, argno);
+    Oid elmtype = ARR_ELEMTYPE(arr);
+    ArrayMathKernelType type;
+    int nelems, nvalues;
+
+    arraymath_check_type(elmtype);
+    arraymath_typeinfo_from_type(elmtype, &groups->info);
+    groups->arr = arr;
+    groups->data = NULL;
+    groups->values = NULL;
+    nelems = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+
+    if (arraymath_native_type(elmtype, &type))
+    {
+        /* Nulls take no space, so the values are the whole data area */
+        nvalues = nelems;
+        if (ARR_HASNULL(arr))
+            nvalues = arraymath_bitmap_count(ARR_NULLBITMAP(arr), nelems);
+
+        groups->data = ARR_DATA_PTR(arr);
+        groups->first = palloc(sizeof(int) * Max(nvalues, 1));
+        groups->counts = count ? palloc(sizeof(int) * Max(nvalues, 1)) : NULL;
+        groups->ngroups = arraymath_distinct_native(type, groups->data, nvalues,
+            groups->first, groups->counts,
+            MemoryContextAllocHuge(CurrentMemoryContext,
+                                   arraymath_distinct_workspace_size(nvalues)));
+    }
+    else
+    {
+        ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+        bool *nulls;
+
+        arraymath_cache_hash(cache, elmtype);
+        deconstruct_array(arr, elmtype,
+            groups->info.typlen, groups->info.typbyval, groups->info.typalign,
+            &groups->values, &nulls, &nelems);
+        nvalues = 0;
+        for (int i = 0; i < nelems; i++)
+        {
+            if (!nulls[i])
+                groups->values[nvalues++] = groups->values[i];
+        }
+
+        groups->first = palloc(sizeof(int) * Max(nvalues, 1));
+        groups->counts = count ? palloc(sizeof(int) * Max(nvalues, 1)) : NULL;
+        groups->ngroups = arraymath_distinct_datums(cache, PG_GET_COLLATION(),
+            groups->values, nvalues, groups->first, groups->counts);
+    }
+}
+
+/* The first value of group g */
+static Datum
+arraymath_group_value(const ArrayMathGroups *groups, int g)
+{
+    if (groups->data)
+    {
+        return fetch_att(groups->data + (Size) groups->first[g] * groups->info.typlen,
+                         groups->info.typbyval, groups->info.typlen);
+    }
+    return groups->values[groups->first[g]];
+}
+
+/* A 1-d array of the first value of every group */
+static ArrayType *
+arraymath_group_array(const ArrayMathGroups *groups)
+{
+    const ArrayMathTypeInfo *info = &groups->info;
+    ArrayType *arrOut;
+
+    if (groups->ngroups == 0)
+        return construct_empty_array(info->type);
+
+    if (groups->data)
+    {
+        char *out;
+
+        arrOut = arraymath_new_array(info, groups->ngroups, false);
+        out = ARR_DATA_PTR(arrOut);
+        for (int g = 0; g < groups->ngroups; g++)
+        {
+            memcpy(out + (Size) g * info->typlen,
+                   groups->data + (Size) groups->first[g] * info->typlen, info->typlen);
+        }
+    }
+    else
+    {
+        Datum *elems = palloc(sizeof(Datum) * groups->ngroups);
+        int nelems = groups->ngroups;
+        int lbound = 1;
+
+        for (int g = 0; g < groups->ngroups; g++)
+            elems[g] = groups->values[groups->first[g]];
+        arrOut = construct_md_array(elems, NULL, 1, &nelems, &lbound, info->type,
+            info->typlen, info->typbyval, info->typalign);
+    }
+    return arrOut;
+}
+
+/*
+* Do distinct values of an array, in order of first appearance
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_uniq)
+{
+    ArrayMathGroups groups;
+    ArrayType *arrOut;
+
+    arraymath_group_values(fcinfo, 0, false, &groups);
+    arrOut = arraymath_group_array(&groups);
+
+    ARRAYMATH_FREE_IF_COPY(groups.arr, 0);
+    PG_RETURN_ARRAYTYPE_P(arrOut);
+}
+
+/*
+* Do number of distinct values of an array
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_count_distinct)
+{
+    ArrayMathGroups groups;
+
+    arraymath_group_values(fcinfo, 0, false, &groups);
+
+    ARRAYMATH_FREE_IF_COPY(groups.arr, 0);
+    PG_RETURN_INT64((int64) groups.ngroups);
+}
+
+/*
+* Do most common value of an array, the first to appear of any that
+* are tied
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_mode)
+{
+    ArrayMathGroups groups;
+    Datum result;
+    int best = 0;
+
+    arraymath_group_values(fcinfo, 0, true, &groups);
+    if (groups.ngroups == 0)
+        PG_RETURN_NULL();
+
+    for (int g = 1; g < groups.ngroups; g++)
+    {
+        if (groups.counts[g] > groups.counts[best])
+            best = g;
+    }
+    result = datumCopy(arraymath_group_value(&groups, best),
+                       groups.info.typbyval, groups.info.typlen);
+
+    ARRAYMATH_FREE_IF_COPY(groups.arr, 0);
+    PG_RETURN_DATUM(result);
+}
+
+/*
+* Do distinct values of an array with how many times each appears,
+* as a pair of arrays in order of first appearance
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_value_counts)
+{
+    ArrayMathGroups groups;
+    ArrayMathTypeInfo cinfo;
+    TupleDesc tupdesc;
+    Datum values[2];
+    bool nulls[2] = {false, false};
+    ArrayType *counts;
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+    tupdesc = BlessTupleDesc(tupdesc);
+
+    arraymath_group_values(fcinfo, 0, true, &groups);
+
+    if (groups.ngroups == 0)
+        counts = construct_empty_array(INT8OID);
+    else
+    {
+        int64 *out;
+
+        arraymath_typeinfo_from_type(INT8OID, &cinfo);
+        counts = arraymath_new_array(&cinfo, groups.ngroups, false);
+        out = (int64 *) ARR_DATA_PTR(counts);
+        for (int g = 0; g < groups.ngroups; g++)
+            out[g] = groups.counts[g];
+    }
+    values[0] = PointerGetDatum(arraymath_group_array(&groups));
+    values[1] = PointerGetDatum(counts);
+
+    ARRAYMATH_FREE_IF_COPY(groups.arr, 0);
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+
+/*
+* The non-null values of an array as float8, in array order. Native
+* types are read straight off the data area, where nulls take no
+* space, everything else goes through the cast to float8.
+*/
+static float8 *
+arraymath_float8_values(ArrayType *arr, ArrayMathCache *cache, int *nvalues)
+{
+    Oid elmtype = ARR_ELEMTYPE(arr);
+    int nitems = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+    ArrayMathKernelType type;
+    float8 *values;
+    int n = nitems;
+
+    if (ARR_HASNULL(arr))
+        n = arraymath_bitmap_count(ARR_NULLBITMAP(arr), nitems);
+
+    values = palloc(sizeof(float8) * Max(n, 1));
+
+    if (arraymath_native_type(elmtype, &type))
+    {
+        arraymath_to_float8(type, ARR_DATA_PTR(arr), n, values);
+    }
+    else
+    {
+        ArrayMathTypeInfo info;
+        ArrayIterator iterator;
+        Datum elem;
+        bool isnull;
+        int i = 0;
+
+        arraymath_cache_cast(cache, elmtype, FLOAT8OID);
+        arraymath_typeinfo_from_type(elmtype, &info);
+        iterator = arraymath_create_iterator(arr, &info);
+        while (array_iterate(iterator, &elem, &isnull))
+        {
+            if (!isnull)
+                values[i++] = DatumGetFloat8(FunctionCall1(&cache->castfmgrinfo, elem));
+        }
+        array_free_iterator(iterator);
+    }
+
+    *nvalues = n;
+    return values;
+}
+
+
+static Datum
+arraymath_reduce_median(ArrayType *arr, ArrayMathCache *cache, bool *isnull)
+{
+    float8 *values;
+    int nelems, nvalues, nnulls;
+    int ranks[2];
+
+    nelems = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+    values = arraymath_float8_values(arr, cache, &nvalues);
+
+    /*
+    * The median has always been the middle of the whole array,
+    * with the nulls sorted to the front, so shift the ranks down
+    * past them. A middle that lands on a null has no value.
+    */
+    nnulls = nelems - nvalues;
+    ranks[0] = (nelems - 1) / 2 - nnulls;
+    ranks[1] = nelems / 2 - nnulls;
+    *isnull = (ranks[0] < 0);
+    if (*isnull)
+        return (Datum) 0;
+
+    arraymath_select_float8(values, nvalues, ranks, 2);
+
+    /* Odd number of elements */
+    if (ranks[0] == ranks[1])
+        return Float8GetDatum(values[ranks[0]]);
+
+    return Float8GetDatum((values[ranks[0]] + values[ranks[1]]) / 2.0);
+}
+
+/*
+* Do median of an array
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_median)
+{
+    ArrayType *arr = arraymath_getarg_array(fcinfo, 0);
+    Datum result;
+    bool isnull;
+
+    arraymath_check_type(ARR_ELEMTYPE(arr));
+
+    if (ARR_NDIM(arr) == 0)
+        PG_RETURN_NULL();
+
+    result = arraymath_reduce_median(arr, arraymath_cache_get(fcinfo), &isnull);
+    if (isnull)
+        PG_RETURN_NULL();
+
+    PG_RETURN_DATUM(result);
+}
+
+
+/*
+* The same reductions over one lane of n packed values of a native
+* type. Workspace has room for n float8 values.
+*/
+typedef Datum (*ArrayMathLaneReducer)(ArrayMathKernelType type, Oid elmtype,
+                                      const void *lane, int n, float8 *workspace);
+
+static Datum
+arraymath_lane_sum(ArrayMathKernelType type, Oid elmtype, const void *lane, int n,
+                   float8 *workspace)
+{
+    ArrayMathSumState state;
+
+    arraymath_sum_init(&state, type);
+    arraymath_sum_accum(&state, lane, n);
+    return arraymath_sum_datum(&state, elmtype);
+}
+
+static Datum
+arraymath_lane_avg(ArrayMathKernelType type, Oid elmtype, const void *lane, int n,
+                   float8 *workspace)
+{
+    ArrayMathSumState state;
+    float8 sum;
+
+    arraymath_sum_init(&state, type);
+    arraymath_sum_accum(&state, lane, n);
+    arraymath_kernel_error(arraymath_sum_float8(&state, &sum), type);
+    return Float8GetDatum(sum / n);
+}
+
+static Datum
+arraymath_lane_minmax(ArrayMathKernelType type, const void *lane, int n, bool greatest)
+{
+    ArrayMathStatsState state;
+    Datum result;
+
+    arraymath_stats_init(&state, type, AM_STATS_RANGE);
+    arraymath_stats_accum(&state, lane, n);
+    arraymath_native_to_datums(greatest ? &state.max : &state.min, 1, type, &result);
+    return result;
+}
+
+static Datum
+arraymath_lane_min(ArrayMathKernelType type, Oid elmtype, const void *lane, int n,
+                   float8 *workspace)
+{
+    return arraymath_lane_minmax(type, lane, n, false);
+}
+
+static Datum
+arraymath_lane_max(ArrayMathKernelType type, Oid elmtype, const void *lane, int n,
+                   float8 *workspace)
+{
+    return arraymath_lane_minmax(type, lane, n, true);
+}
+
+static Datum
+arraymath_lane_median(ArrayMathKernelType type, Oid elmtype, const void *lane, int n,
+                      float8 *workspace)
+{
+    int ranks[2];
+
+    ranks[0] = (n - 1) / 2;
+    ranks[1] = n / 2;
+    arraymath_to_float8(type, lane, n, workspace);
+    arraymath_select_float8(workspace, n, ranks, 2);
+
+    /* Odd number of elements */
+    if (ranks[0] == ranks[1])
+        return Float8GetDatum(workspace[ranks[0]]);
+
+    return Float8GetDatum((workspace[ranks[0]] + workspace[ranks[1]]) / 2.0);
+}
+
+/*
+* Apply a reduction along one axis of an array, giving an array with
+* that dimension taken out (a 1-d array keeps a single element).
+* Axes count from 0 for the outermost dimension as in NumPy, and
+* negative axes count back from the innermost.
+*
+* A native array without nulls is reduced in place: each block of
+* lanes is turned so that its lanes lie contiguous in the data, and
+* lanereduce runs over them there. Anything else has each lane
+* copied out into a 1-d array of its own and handed to the same
+* reduction the whole-array function uses, so they agree.
+*/
+static ArrayType *
+arraymath_reduce_axis(ArrayType *arr, int axis, ArrayMathReducer reduce,
+                      ArrayMathLaneReducer lanereduce, Oid rtype, ArrayMathCache *cache)
+{
+    int ndims = ARR_NDIM(arr);
+    int *dims = ARR_DIMS(arr);
+    int outdims[MAXDIM], lbs[MAXDIM];
+    int outndims = 0;
+    ArrayMathTypeInfo info, rinfo;
+    ArrayMathKernelType type;
+    Datum *results;
+    bool *resnulls;
+    int nelems, len, stride, nlanes, lane = 0;
+
+    if (ndims == 0)
+        return construct_empty_array(rtype);
+
+    if (axis < -ndims || axis >= ndims)
+    {
+        ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("axis %d is out of range for an array of %d dimensions",
+                axis, ndims)));
+    }
+    if (axis < 0)
+        axis += ndims;
+
+    arraymath_typeinfo_from_type(ARR_ELEMTYPE(arr), &info);
+    arraymath_typeinfo_from_type(rtype, &rinfo);
+    nelems = ArrayGetNItems(ndims, dims);
+
+    /* Elements of a lane are stride apart, and the lanes start at */
+    /* each of the first stride positions of every len * stride block */
+    len = dims[axis];
+    stride = 1;
+    for (int d = 0; d < ndims; d++)
+    {
+        if (d > axis)
+            stride *= dims[d];
+        if (d != axis)
+            outdims[outndims++] = dims[d];
+    }
+    if (outndims == 0)
+        outdims[outndims++] = 1;
+    for (int d = 0; d < outndims; d++)
+        lbs[d] = 1;
+    nlanes = nelems / len;
+
+    results = palloc(sizeof(Datum) * nlanes);
+    resnulls = palloc(sizeof(bool) * nlanes);
+
+    if (arraymath_native_type(info.type, &type) && !arraymath_has_nulls(arr))
+    {
+        int size = arraymath_kernel_type_size[type];
+        char *turned = (stride > 1) ? palloc((Size) len * stride * size) : NULL;
+        float8 *workspace = palloc(sizeof(float8) * len);
+
+        for (int block = 0; block < nelems; block += len * stride)
+        {
+            const char *lanes = ARR_DATA_PTR(arr) + (Size) block * size;
+
+            if (stride > 1)
+            {
+                arraymath_transpose(size, lanes, turned, len, stride);
+                lanes = turned;
+            }
+            for (int s = 0; s < stride; s++)
+            {
+                results[lane] = lanereduce(type, info.type,
+                    lanes + (Size) s * len * size, len, workspace);
+                resnulls[lane++] = false;
+            }
+        }
+    }
+    else
+    {
+        MemoryContext scratch, oldcontext;
+        Datum *elems, *lanevals;
+        bool *nulls, *lanenulls;
+        int lanelb = 1;
+
+        deconstruct_array(arr, info.type, info.typlen, info.typbyval, info.typalign,
+            &elems, &nulls, &nelems);
+        lanevals = palloc(sizeof(Datum) * len);
+        lanenulls = palloc(sizeof(bool) * len);
+
+        scratch = AllocSetContextCreate(CurrentMemoryContext,
+            "arraymath axis", ALLOCSET_DEFAULT_SIZES);
+
+        for (int block = 0; block < nelems; block += len * stride)
+        {
+            for (int s = 0; s < stride; s++)
+            {
+                ArrayType *lanearr;
+                Datum d;
+
+                for (int k = 0; k < len; k++)
+                {
+                    lanevals[k] = elems[block + s + k * stride];
+                    lanenulls[k] = nulls[block + s + k * stride];
+                }
+
+                oldcontext = MemoryContextSwitchTo(scratch);
+                lanearr = construct_md_array(lanevals, lanenulls, 1, &len, &lanelb,
+                    info.type, info.typlen, info.typbyval, info.typalign);
+                d = reduce(lanearr, cache, &resnulls[lane]);
+                MemoryContextSwitchTo(oldcontext);
+
+                results[lane] = resnulls[lane] ? (Datum) 0 :
+                    datumCopy(d, rinfo.typbyval, rinfo.typlen);
+                MemoryContextReset(scratch);
+                lane++;
+            }
+        }
+        MemoryContextDelete(scratch);
+    }
+
+    return construct_md_array(results, resnulls, outndims, outdims, lbs,
+        rinfo.type, rinfo.typlen, rinfo.typbyval, rinfo.typalign);
+}
+
+/*
+* Per-axis variants of the reductions, array_sum(arr, axis) and
+* so on. The result element type is rtype, or the input element
+* type when that is InvalidOid.
+*/
+static Datum
+arraymath_reduce_axis_call(FunctionCallInfo fcinfo, ArrayMathReducer reduce,
+                           ArrayMathLaneReducer lanereduce, Oid rtype)
+{
+    ArrayType *arr = arraymath_getarg_array(fcinfo, 0);
+    int axis = PG_GETARG_INT32(1);
+
+    arraymath_check_type(ARR_ELEMTYPE(arr));
+    if (!OidIsValid(rtype))
+        rtype = ARR_ELEMTYPE(arr);
+
+    PG_RETURN_ARRAYTYPE_P(arraymath_reduce_axis(arr, axis, reduce, lanereduce, rtype,
+        arraymath_cache_get(fcinfo)));
+}
+
+ARRAYMATH_TRACKED_FUNCTION(array_sum_axis)
+{
+    return arraymath_reduce_axis_call(fcinfo, arraymath_reduce_sum,
+        arraymath_lane_sum, InvalidOid);
+}
+
+ARRAYMATH_TRACKED_FUNCTION(array_avg_axis)
+{
+    return arraymath_reduce_axis_call(fcinfo, arraymath_reduce_avg,
+        arraymath_lane_avg, FLOAT8OID);
+}
+
+ARRAYMATH_TRACKED_FUNCTION(array_min_axis)
+{
+    return arraymath_reduce_axis_call(fcinfo, arraymath_reduce_min,
+        arraymath_lane_min, InvalidOid);
+}
+
+ARRAYMATH_TRACKED_FUNCTION(array_max_axis)
+{
+    return arraymath_reduce_axis_call(fcinfo, arraymath_reduce_max,
+        arraymath_lane_max, InvalidOid);
+}
+
+ARRAYMATH_TRACKED_FUNCTION(array_median_axis)
+{
+    return arraymath_reduce_axis_call(fcinfo, arraymath_reduce_median,
+        arraymath_lane_median, FLOAT8OID);
+}
+
+
+/*
+* Do percentiles of an array, interpolating between adjacent values
+* like percentile_cont(). The result has the shape of the fractions
+* array, and null fractions give null results.
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_percentile)
+{
+    ArrayType *arr = arraymath_getarg_array(fcinfo, 0);
+    ArrayType *fractions = arraymath_getarg_array(fcinfo, 1);
+    Oid elmtype = ARR_ELEMTYPE(arr);
+    ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+    ArrayType *arrOut;
+    float8 *values;
+    Datum *fracs;
+    bool *fracnulls;
+    int *ranks;
+    int nvalues, nfracs, nranks = 0;
+
+    arraymath_check_type(elmtype);
+
+    if (ARR_NDIM(arr) == 0)
+        PG_RETURN_NULL();
+
+    deconstruct_array(fractions, FLOAT8OID, sizeof(float8), FLOAT8PASSBYVAL, TYPALIGN_DOUBLE,
+        &fracs, &fracnulls, &nfracs);
+
+    /* Both neighbours of every wanted position, in one selection */
+    values = arraymath_float8_values(arr, cache, &nvalues);
+    if (nvalues == 0)
+        PG_RETURN_NULL();
+
+    ranks = palloc(sizeof(int) * Max(2 * nfracs, 1));
+    for (int i = 0; i < nfracs; i++)
+    {
+        float8 p, pos;
+
+        if (fracnulls[i])
+            continue;
+
+        p = DatumGetFloat8(fracs[i]);
+        if (p < 0 || p > 1 || isnan(p))
+            ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("percentile value %g is not between 0 and 1", p)));
+
+        pos = p * (nvalues - 1);
+        ranks[nranks++] = (int) floor(pos);
+        ranks[nranks++] = (int) ceil(pos);
+    }
+    qsort(ranks, nranks, sizeof(int), arraymath_int_cmp);
+    arraymath_select_float8(values, nvalues, ranks, nranks);
+
+    for (int i = 0; i < nfracs; i++)
+    {
+        float8 pos, lo, hi;
+
+        if (fracnulls[i])
+            continue;
+
+        pos = DatumGetFloat8(fracs[i]) * (nvalues - 1);
+        lo = values[(int) floor(pos)];
+        hi = values[(int) ceil(pos)];
+        fracs[i] = Float8GetDatum(lo == hi ? lo : lo + (pos - floor(pos)) * (hi - lo));
+    }
+
+    arrOut = construct_md_array(fracs, fracnulls,
+        ARR_NDIM(fractions), ARR_DIMS(fractions), ARR_LBOUND(fractions),
+        FLOAT8OID, sizeof(float8), FLOAT8PASSBYVAL, TYPALIGN_DOUBLE);
+
+    PG_RETURN_ARRAYTYPE_P(arrOut);
+}
+
+
+/*
+* Summary statistics of an array in one pass, as a record of
+* (count, nulls, sum, min, max, mean, variance, stddev). The sum,
+* min and max agree with array_sum, array_min and array_max, and the
+* variance is the sample variance, like variance() the aggregate.
+*/
+#define ARRAYMATH_STATS_NATTS 8
+
+ARRAYMATH_TRACKED_FUNCTION(array_stats)
+{
+    ArrayType *arr = NULL;
+    Oid elmtype;
+    ArrayMathKernelType type;
+    ArrayMathStatsState state;
+    TupleDesc tupdesc;
+    Datum values[ARRAYMATH_STATS_NATTS];
+    bool nulls[ARRAYMATH_STATS_NATTS];
+    int64 count = 0;
+    float8 mean = 0.0, m2 = 0.0;
+    ArrayMathStream stream;
+    int nitems;
+    bool streamed;
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+    tupdesc = BlessTupleDesc(tupdesc);
+
+    streamed = arraymath_stream_open(fcinfo, 0, &stream);
+    if (streamed)
+    {
+        arraymath_stream_stats(&stream, AM_STATS_ALL, &state);
+        elmtype = stream.elmtype;
+        nitems = stream.nitems;
+    }
+    else
+    {
+        arr = arraymath_getarg_array(fcinfo, 0);
+        elmtype = ARR_ELEMTYPE(arr);
+        nitems = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+    }
+    arraymath_check_type(elmtype);
+
+    memset(nulls, true, sizeof(nulls));
+
+    if (arraymath_native_type(elmtype, &type))
+    {
+        if (!streamed)
+        {
+            /* Nulls take no space, so the values are the whole data area */
+            int nvalues = nitems;
+
+            if (ARR_HASNULL(arr))
+                nvalues = arraymath_bitmap_count(ARR_NULLBITMAP(arr), nitems);
+
+            arraymath_stats_init(&state, type, AM_STATS_ALL);
+            arraymath_stats_accum(&state, ARR_DATA_PTR(arr), nvalues);
+        }
+        count = state.sum.count;
+
+        if (count > 0)
+        {
+            values[2] = arraymath_sum_datum(&state.sum, elmtype);
+            arraymath_native_to_datums(&state.min, 1, type, &values[3]);
+            arraymath_native_to_datums(&state.max, 1, type, &values[4]);
+            nulls[2] = nulls[3] = nulls[4] = false;
+        }
+        mean = state.mean;
+        m2 = state.m2;
+    }
+    else if (nitems > 0)
+    {
+        ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+        ArrayMathTypeInfo info;
+        ArrayIterator iterator;
+        ArrayMathOperSum sum;
+        Datum elem, total, min = (Datum) 0, max = (Datum) 0;
+        bool isnull;
+
+        arraymath_cache_oper(cache, "+", 1, elmtype, elmtype);
+        arraymath_cache_cast(cache, elmtype, FLOAT8OID);
+        arraymath_cache_cmp(cache, elmtype);
+
+        arraymath_typeinfo_from_type(elmtype, &info);
+        iterator = arraymath_create_iterator(arr, &info);
+
+        /* Min and max point into the array, only the sum is built up */
+        arraymath_oper_sum_init(&sum, cache, elmtype, "arraymath stats");
+        while (array_iterate(iterator, &elem, &isnull))
+        {
+            float8 x, delta;
+
+            if (isnull)
+                continue;
+
+            if (count == 0 ||
+                DatumGetInt32(FunctionCall2(&cache->cmpfmgrinfo, elem, min)) < 0)
+                min = elem;
+            if (count == 0 ||
+                DatumGetInt32(FunctionCall2(&cache->cmpfmgrinfo, elem, max)) > 0)
+                max = elem;
+
+            arraymath_oper_sum_add(&sum, elem);
+
+            /* Welford's running mean and sum of squared deviations */
+            x = DatumGetFloat8(FunctionCall1(&cache->castfmgrinfo, elem));
+            count++;
+            delta = x - mean;
+            mean += delta / count;
+            m2 += delta * (x - mean);
+        }
+        total = arraymath_oper_sum_finish(&sum);
+        array_free_iterator(iterator);
+
+        if (count > 0)
+        {
+            values[2] = total;
+            values[3] = datumCopy(min, false, info.typlen);
+            values[4] = datumCopy(max, false, info.typlen);
+            nulls[2] = nulls[3] = nulls[4] = false;
+        }
+    }
+
+    values[0] = Int64GetDatum(count);
+    values[1] = Int64GetDatum(nitems - count);
+    nulls[0] = nulls[1] = false;
+
+    if (count > 0)
+    {
+        values[5] = Float8GetDatum(mean);
+        nulls[5] = false;
+    }
+    if (count > 1)
+    {
+        float8 variance = m2 / (count - 1);
+
+        values[6] = Float8GetDatum(variance);
+        values[7] = Float8GetDatum(sqrt(variance));
+        nulls[6] = nulls[7] = false;
+    }
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+
+/**********************************************************************
+* Running and moving summaries
+*/
+
+/*
+* Read a one-dimensional array argument for the running and moving
+* functions, which only make sense along a single line of values.
+*/
+static ArrayType *
+arraymath_series_arg(FunctionCallInfo fcinfo, int *nelems)
+{
+    ArrayType *arr = arraymath_getarg_array(fcinfo, 0);
+
+    arraymath_check_type(ARR_ELEMTYPE(arr));
+    if (ARR_NDIM(arr) > 1)
+        ereport(ERROR, (errmsg("only one-dimensional arrays are supported")));
+
+    *nelems = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+    return arr;
+}
+
+/*
+* Running sum or product. Null elements stay null and are skipped
+* over, so the values out line up with the values in, and a native
+* array keeps its null bitmap as it is.
+*/
+static Datum
+arraymath_scan_array(FunctionCallInfo fcinfo, ArrayMathScanOp op)
+{
+    int nelems;
+    ArrayType *arr = arraymath_series_arg(fcinfo, &nelems);
+    Oid elmtype = ARR_ELEMTYPE(arr);
+    ArrayMathKernelType type;
+    ArrayMathTypeInfo info;
+    ArrayType *arrOut;
+
+    if (nelems == 0)
+        PG_RETURN_ARRAYTYPE_P(construct_empty_array(elmtype));
+
+    arraymath_typeinfo_from_type(elmtype, &info);
+
+    if (arraymath_native_type(elmtype, &type))
+    {
+        int nvalues;
+
+        arrOut = arraymath_new_array_like(arr, &info, &nvalues);
+        arraymath_kernel_error(
+            arraymath_scan(type, op, ARR_DATA_PTR(arr), nvalues, ARR_DATA_PTR(arrOut)),
+            type);
+    }
+    else
+    {
+        const char *opstr = (op == AM_SCAN_SUM) ? "+" : "*";
+        ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+        ArrayMathBuilder builder;
+        ArrayIterator iterator;
+        Datum elem, v = (Datum) 0;
+        bool isnull, first = true;
+
+        arraymath_cache_oper(cache, opstr, 1, elmtype, elmtype);
+        arraymath_builder_init(&builder, &cache->rinfo, nelems, true);
+        iterator = arraymath_create_iterator(arr, &info);
+        while (array_iterate(iterator, &elem, &isnull))
+        {
+            if (!isnull)
+            {
+                v = first ? elem : FunctionCall2(&cache->operfmgrinfo, v, elem);
+                first = false;
+            }
+            arraymath_builder_add(&builder, v, isnull);
+        }
+        arrOut = arraymath_builder_finish(&builder);
+    }
+
+    ARRAYMATH_FREE_IF_COPY(arr, 0);
+    PG_RETURN_ARRAYTYPE_P(arrOut);
+}
+
+/*
+* Do running sum of an array
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_cumsum)
+{
+    return arraymath_scan_array(fcinfo, AM_SCAN_SUM);
+}
+
+/*
+* Do running product of an array
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_cumprod)
+{
+    return arraymath_scan_array(fcinfo, AM_SCAN_PROD);
+}
+
+/*
+* Difference of each element from the one lag places before it, the
+* same length as the input. The first lag elements, and any with a
+* null on either side, are null.
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_diff)
+{
+    int nelems;
+    ArrayType *arr = arraymath_series_arg(fcinfo, &nelems);
+    int lag = PG_GETARG_INT32(1);
+    Oid elmtype = ARR_ELEMTYPE(arr);
+    ArrayMathKernelType type;
+    ArrayMathTypeInfo info;
+    ArrayType *arrOut;
+
+    if (lag < 1)
+    {
+        ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("lag must be greater than zero")));
+    }
+
+    if (nelems == 0)
+        PG_RETURN_ARRAYTYPE_P(construct_empty_array(elmtype));
+
+    lag = Min(lag, nelems);
+    arraymath_typeinfo_from_type(elmtype, &info);
+
+    if (arraymath_native_type(elmtype, &type))
+    {
+        int size = info.typlen;
+        int npairs = nelems - lag;
+        bits8 *bitmap = arraymath_has_nulls(arr) ? ARR_NULLBITMAP(arr) : NULL;
+        const char *cur = ARR_DATA_PTR(arr) + (Size) lag * size;
+        const char *prev = ARR_DATA_PTR(arr);
+        char *result = palloc((Size) nelems * size);
+        bits8 *valid;
+        int nvalid;
+
+        arrOut = arraymath_new_array(&info, nelems, true);
+        valid = ARR_NULLBITMAP(arrOut);
+
+        if (!bitmap)
+        {
+            for (int i = lag; i < nelems; i++)
+                valid[i / 8] |= 1 << (i % 8);
+        }
+        else
+        {
+            /*
+            * Lay both sides out in full, with 1 on each side of any pair
+            * that has a null, so that those never overflow.
+            */
+            char *full = palloc((Size) nelems * size);
+            bits8 *pairs = palloc0((npairs + 7) / 8);
+            char *curFull = palloc((Size) npairs * size);
+            char *prevFull = palloc((Size) npairs * size);
+
+            for (int j = 0; j < npairs; j++)
+            {
+                int i = j + lag;
+
+                if ((bitmap[i / 8] & (1 << (i % 8))) && (bitmap[j / 8] & (1 << (j % 8))))
+                {
+                    pairs[j / 8] |= 1 << (j % 8);
+                    valid[i / 8] |= 1 << (i % 8);
+                }
+            }
+
+            arraymath_spread(type, ARR_DATA_PTR(arr), bitmap, nelems, bitmap, nelems, full);
+            arraymath_spread(type, full + (Size) lag * size, NULL, npairs, pairs, npairs, curFull);
+            arraymath_spread(type, full, NULL, npairs, pairs, npairs, prevFull);
+            cur = curFull;
+            prev = prevFull;
+            pfree(full);
+            pfree(pairs);
+        }
+
+        if (npairs > 0)
+        {
+            arraymath_kernel_error(
+                arraymath_apply(AM_OP_SUB, type, cur, npairs, prev, npairs,
+                    result + (Size) lag * size),
+                type);
+        }
+
+        nvalid = arraymath_compact(size, result, valid, nelems, ARR_DATA_PTR(arrOut));
+        SET_VARSIZE(arrOut, ARR_DATA_OFFSET(arrOut) + (Size) nvalid * size);
+        pfree(result);
+    }
+    else
+    {
+        ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+        ArrayMathBuilder builder;
+        Datum *elems;
+        bool *nulls;
+
+        arraymath_cache_oper(cache, "-", 1, elmtype, elmtype);
+        deconstruct_array(arr, elmtype, info.typlen, info.typbyval, info.typalign,
+            &elems, &nulls, &nelems);
+
+        arraymath_builder_init(&builder, &cache->rinfo, nelems, true);
+        for (int i = 0; i < nelems; i++)
+        {
+            if (i < lag || nulls[i] || nulls[i - lag])
+                arraymath_builder_add(&builder, (Datum) 0, true);
+            else
+                arraymath_builder_add(&builder,
+                    FunctionCall2(&cache->operfmgrinfo, elems[i], elems[i - lag]), false);
+        }
+        arrOut = arraymath_builder_finish(&builder);
+    }
+
+    ARRAYMATH_FREE_IF_COPY(arr, 0);
+    PG_RETURN_ARRAYTYPE_P(arrOut);
+}
+
+/*
+* Combine two window values through fmgr: the operator for a sum,
+* the comparison for the least or greatest.
+*/
+static Datum
+arraymath_moving_combine(ArrayMathCache *cache, ArrayMathMovingOp op, Datum a, Datum b)
+{
+    int32 cmp;
+
+    if (op == AM_MOVING_SUM || op == AM_MOVING_AVG)
+        return FunctionCall2(&cache->operfmgrinfo, a, b);
+
+    cmp = DatumGetInt32(FunctionCall2(&cache->cmpfmgrinfo, a, b));
+    if (op == AM_MOVING_MAX)
+        return cmp >= 0 ? a : b;
+    return cmp <= 0 ? a : b;
+}
+
+/*
+* Moving summaries of a type without a kernel. Values are combined
+* without ever being taken out again, which would not work for NaN
+* or infinity: the window is split into a front part, for which the
+* combined value of every suffix is kept, and a back part, which is
+* one running value. When the front runs out, the back becomes the
+* new front. Each value is combined a bounded number of times.
+*/
+static void
+arraymath_moving_generic(ArrayMathCache *cache, ArrayMathMovingOp op,
+                         const Datum *elems, const bool *nulls, int nelems, int width,
+                         ArrayMathBuilder *builder)
+{
+    int *pos = palloc(sizeof(int) * nelems);
+    Datum *suffix = palloc(sizeof(Datum) * nelems);
+    Datum back = (Datum) 0;
+    int nvalues = 0;
+    int lo = 0, mid = 0;    /* front is [lo, mid), back is [mid, nvalues) */
+
+    for (int i = 0; i < nelems; i++)
+    {
+        Datum v;
+
+        if (!nulls[i])
+        {
+            pos[nvalues] = i;
+            back = (nvalues == mid) ? elems[i]
+                : arraymath_moving_combine(cache, op, back, elems[i]);
+            nvalues++;
+        }
+
+        while (lo < nvalues && pos[lo] <= i - width)
+            lo++;
+
+        if (lo == nvalues)
+        {
+            arraymath_builder_add(builder, (Datum) 0, true);
+            continue;
+        }
+
+        if (lo >= mid)
+        {
+            /* Turn the back into the front, suffix by suffix */
+            suffix[nvalues - 1] = elems[pos[nvalues - 1]];
+            for (int j = nvalues - 2; j >= lo; j--)
+                suffix[j] = arraymath_moving_combine(cache, op, elems[pos[j]], suffix[j + 1]);
+            mid = nvalues;
+        }
+
+        v = suffix[lo];
+        if (mid < nvalues)
+            v = arraymath_moving_combine(cache, op, v, back);
+
+        if (op == AM_MOVING_AVG)
+        {
+            float8 sum = DatumGetFloat8(FunctionCall1(&cache->castfmgrinfo, v));
+
+            v = Float8GetDatum(sum / (nvalues - lo));
+        }
+        arraymath_builder_add(builder, v, false);
+    }
+
+    pfree(pos);
+    pfree(suffix);
+}
+
+/*
+* Summary of each element and the width - 1 before it, so that the
+* result is as long as the input. Nulls are left out of a window,
+* and a window with nothing else in it is null. The average is
+* float8, the others have the input type.
+*/
+static Datum
+arraymath_moving_array(FunctionCallInfo fcinfo, ArrayMathMovingOp op)
+{
+    int nelems;
+    ArrayType *arr = arraymath_series_arg(fcinfo, &nelems);
+    int width = PG_GETARG_INT32(1);
+    Oid elmtype = ARR_ELEMTYPE(arr);
+    Oid rtype = (op == AM_MOVING_AVG) ? FLOAT8OID : elmtype;
+    ArrayMathKernelType type;
+    ArrayMathTypeInfo info, rinfo;
+    ArrayType *arrOut;
+
+    if (width < 1)
+    {
+        ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("window width must be greater than zero")));
+    }
+
+    if (nelems == 0)
+        PG_RETURN_ARRAYTYPE_P(construct_empty_array(rtype));
+
+    arraymath_typeinfo_from_type(elmtype, &info);
+    arraymath_typeinfo_from_type(rtype, &rinfo);
+
+    if (arraymath_native_type(elmtype, &type))
+    {
+        bits8 *bitmap = arraymath_has_nulls(arr) ? ARR_NULLBITMAP(arr) : NULL;
+        const char *data = ARR_DATA_PTR(arr);
+        int *queue = NULL;
+
+        if (op == AM_MOVING_MIN || op == AM_MOVING_MAX)
+            queue = palloc(sizeof(int) * nelems);
+
+        if (!bitmap)
+        {
+            arrOut = arraymath_new_array(&rinfo, nelems, false);
+            arraymath_kernel_error(
+                arraymath_moving(type, op, data, NULL, nelems, width, queue,
+                    ARR_DATA_PTR(arrOut), NULL),
+                type);
+        }
+        else
+        {
+            char *full = palloc((Size) nelems * info.typlen);
+            char *result = palloc((Size) nelems * rinfo.typlen);
+            int nvalid;
+
+            arraymath_spread(type, data, bitmap, nelems, bitmap, nelems, full);
+            arrOut = arraymath_new_array(&rinfo, nelems, true);
+            arraymath_kernel_error(
+                arraymath_moving(type, op, full, bitmap, nelems, width, queue,
+                    result, ARR_NULLBITMAP(arrOut)),
+                type);
+
+            nvalid = arraymath_compact(rinfo.typlen, result, ARR_NULLBITMAP(arrOut), nelems,
+                ARR_DATA_PTR(arrOut));
+            SET_VARSIZE(arrOut, ARR_DATA_OFFSET(arrOut) + (Size) nvalid * rinfo.typlen);
+            pfree(full);
+            pfree(result);
+        }
+    }
+    else
+    {
+        ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+        ArrayMathBuilder builder;
+        Datum *elems;
+        bool *nulls;
+
+        if (op == AM_MOVING_SUM || op == AM_MOVING_AVG)
+            arraymath_cache_oper(cache, "+", 1, elmtype, elmtype);
+        else
+            arraymath_cache_cmp(cache, elmtype);
+        if (op == AM_MOVING_AVG)
+            arraymath_cache_cast(cache, elmtype, FLOAT8OID);
+
+        deconstruct_array(arr, elmtype, info.typlen, info.typbyval, info.typalign,
+            &elems, &nulls, &nelems);
+        arraymath_builder_init(&builder, &rinfo, nelems, true);
+        arraymath_moving_generic(cache, op, elems, nulls, nelems, width, &builder);
+        arrOut = arraymath_builder_finish(&builder);
+    }
+
+    ARRAYMATH_FREE_IF_COPY(arr, 0);
+    PG_RETURN_ARRAYTYPE_P(arrOut);
+}
+
+/*
+* Do moving sum of an array
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_moving_sum)
+{
+    return arraymath_moving_array(fcinfo, AM_MOVING_SUM);
+}
+
+/*
+* Do moving average of an array
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_moving_avg)
+{
+    return arraymath_moving_array(fcinfo, AM_MOVING_AVG);
+}
+
+/*
+* Do moving minimum of an array
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_moving_min)
+{
+    return arraymath_moving_array(fcinfo, AM_MOVING_MIN);
+}
+
+/*
+* Do moving maximum of an array
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_moving_max)
+{
+    return arraymath_moving_array(fcinfo, AM_MOVING_MAX);
+}
+
+
+/**********************************************************************
+* Element functions
+*/
+
+/*
+* One element of a type without a kernel, which is to say numeric,
+* through the built-in function. Clamp compares with the cached
+* comparison against lo and hi in arg1 and arg2; round and pow take
+* arg1 as their second argument.
+*/
+static Datum
+arraymath_unary_datum(ArrayMathUnaryOp op, ArrayMathCache *cache, Datum d, Datum arg1, Datum arg2)
+{
+    switch (op)
+    {
+        case AM_UNARY_ABS:
+            return DirectFunctionCall1(numeric_abs, d);
+        case AM_UNARY_ROUND:
+            return DirectFunctionCall2(numeric_round, d, arg1);
+        case AM_UNARY_CLAMP:
+            if (DatumGetInt32(FunctionCall2(&cache->cmpfmgrinfo, d, arg1)) < 0)
+                return arg1;
+            if (DatumGetInt32(FunctionCall2(&cache->cmpfmgrinfo, d, arg2)) > 0)
+                return arg2;
+            return d;
+        case AM_UNARY_SQRT:
+            return DirectFunctionCall1(numeric_sqrt, d);
+        case AM_UNARY_EXP:
+            return DirectFunctionCall1(numeric_exp, d);
+        case AM_UNARY_LN:
+            return DirectFunctionCall1(numeric_ln, d);
+        case AM_UNARY_POW:
+            return DirectFunctionCall2(numeric_power, d, arg1);
+        default:
+            elog(ERROR, "unexpected unary function %d", op);
+    }
+    return (Datum) 0;
+}
+
+/*
+* Apply a function to every element of an array of any shape, which
+* keeps its nulls. sqrt, exp, ln and pow of the native types give
+* float8, as the built-in functions do, and everything else gives
+* the input type. Any other native arguments are in args, and the
+* clamp bounds or pow exponent are in arg1 and arg2, which are of the
+* element type, or float8 for the exponent of a native type. Those
+* types follow from the array, not from the call expression, which
+* a caller without one does not have.
+*/
+static Datum
+arraymath_unary_array(FunctionCallInfo fcinfo, ArrayMathUnaryOp op, ArrayMathUnaryArgs *args,
+                      Datum arg1, Datum arg2)
+{
+    ArrayType *arr = arraymath_getarg_array(fcinfo, 0);
+    Oid elmtype = ARR_ELEMTYPE(arr);
+    int nelems = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+    bool native;
+    Oid rtype;
+    ArrayMathKernelType type;
+    ArrayMathTypeInfo info, rinfo;
+    ArrayType *arrOut;
+
+    arraymath_check_type(elmtype);
+    native = arraymath_native_type(elmtype, &type);
+    rtype = (native && AM_UNARY_IS_FLOAT8(op)) ? FLOAT8OID : elmtype;
+
+    if (op == AM_UNARY_CLAMP)
+    {
+        ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+
+        arraymath_cache_cmp(cache, elmtype);
+        if (DatumGetInt32(FunctionCall2(&cache->cmpfmgrinfo, arg1, arg2)) > 0)
+        {
+            ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("lower bound must not be greater than upper bound")));
+        }
+    }
+    else if (op == AM_UNARY_POW && native)
+        args->exponent = DatumGetFloat8(arg1);
+
+    if (nelems == 0)
+        PG_RETURN_ARRAYTYPE_P(construct_empty_array(rtype));
+
+    arraymath_typeinfo_from_type(elmtype, &info);
+    arraymath_typeinfo_from_type(rtype, &rinfo);
+
+    if (native)
+    {
+        int nvalues;
+
+        if (op == AM_UNARY_CLAMP)
+        {
+            arraymath_native_value(arg1, type, &args->lo);
+            arraymath_native_value(arg2, type, &args->hi);
+        }
+
+        arrOut = arraymath_new_array_like(arr, &rinfo, &nvalues);
+        arraymath_kernel_error(
+            arraymath_unary(op, type, ARR_DATA_PTR(arr), args, ARR_DATA_PTR(arrOut), nvalues),
+            AM_UNARY_IS_FLOAT8(op) ? AM_TYPE_FLOAT8 : type);
+    }
+    else
+    {
+        ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+        ArrayMathBuilder builder;
+        ArrayIterator iterator;
+        Datum elem;
+        bool isnull;
+
+        arraymath_builder_init_md(&builder, &rinfo, ARR_NDIM(arr), ARR_DIMS(arr), true);
+        iterator = arraymath_create_iterator(arr, &info);
+        while (array_iterate(iterator, &elem, &isnull))
+        {
+            if (isnull)
+                arraymath_builder_add(&builder, (Datum) 0, true);
+            else
+                arraymath_builder_add(&builder,
+                    arraymath_unary_datum(op, cache, elem, arg1, arg2), false);
+        }
+        arrOut = arraymath_builder_finish(&builder);
+    }
+
+    ARRAYMATH_FREE_IF_COPY(arr, 0);
+    PG_RETURN_ARRAYTYPE_P(arrOut);
+}
+
+/*
+* Absolute value of every element
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_abs)
+{
+    ArrayMathUnaryArgs args = {0};
+
+    return arraymath_unary_array(fcinfo, AM_UNARY_ABS, &args, (Datum) 0, (Datum) 0);
+}
+
+/*
+* Round every element to a number of decimal places, or to a power
+* of ten when that is negative. Floats round half to even, the rest
+* half away from zero.
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_round)
+{
+    int32 digits = PG_GETARG_INT32(1);
+    ArrayMathUnaryArgs args = {0};
+
+    /* Past 10^308 a float8 scale is infinite */
+    args.digits = Max(digits, -308);
+    args.scale = pow(10.0, Abs(args.digits));
+    return arraymath_unary_array(fcinfo, AM_UNARY_ROUND, &args, Int32GetDatum(digits), (Datum) 0);
+}
+
+/*
+* Limit every element to the range lo .. hi
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_clamp)
+{
+    ArrayMathUnaryArgs args = {0};
+
+    return arraymath_unary_array(fcinfo, AM_UNARY_CLAMP, &args,
+                                 PG_GETARG_DATUM(1), PG_GETARG_DATUM(2));
+}
+
+/*
+* Square root of every element
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_sqrt)
+{
+    ArrayMathUnaryArgs args = {0};
+
+    return arraymath_unary_array(fcinfo, AM_UNARY_SQRT, &args, (Datum) 0, (Datum) 0);
+}
+
+/*
+* Exponential of every element
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_exp)
+{
+    ArrayMathUnaryArgs args = {0};
+
+    return arraymath_unary_array(fcinfo, AM_UNARY_EXP, &args, (Datum) 0, (Datum) 0);
+}
+
+/*
+* Natural logarithm of every element
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_ln)
+{
+    ArrayMathUnaryArgs args = {0};
+
+    return arraymath_unary_array(fcinfo, AM_UNARY_LN, &args, (Datum) 0, (Datum) 0);
+}
+
+/*
+* Every element raised to a power, which is float8 for the native
+* types and numeric for numeric
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_pow)
+{
+    ArrayMathUnaryArgs args = {0};
+
+    return arraymath_unary_array(fcinfo, AM_UNARY_POW, &args, PG_GETARG_DATUM(1), (Datum) 0);
+}
+
+
+/**********************************************************************
+* Masks
+*/
+
+/*
+* Native masks for the reductions are built this many values at a
+* time, a multiple of 64 so that every chunk but the last fills whole
+* words, and small enough to keep on the stack.
+*/
+#define ARRAYMATH_MASK_CHUNK 4096
+
+typedef enum
+{
+    ARRAYMATH_MASK_COUNT,
+    ARRAYMATH_MASK_ANY,
+    ARRAYMATH_MASK_ALL
+} ArrayMathMaskReduce;
+
+/*
+* Set up the condition "element op value" on the array arr, with the
+* operator name and value in the two arguments after argno. The
+* operator must give a boolean. Returns true, with the value in
+* native form, when a mask kernel can test the condition.
+*/
+static bool
+arraymath_mask_oper(FunctionCallInfo fcinfo, ArrayMathCache *cache, ArrayType *arr,
+                    int argno, ArrayMathNativeValue *value)
+{
+    text *opname = PG_GETARG_TEXT_PP(argno + 1);
+
+    arraymath_cache_oper(cache, VARDATA_ANY(opname), VARSIZE_ANY_EXHDR(opname),
+                         ARR_ELEMTYPE(arr), get_fn_expr_argtype(fcinfo->flinfo, argno + 2));
+    if (cache->rinfo.type != BOOLOID)
+    {
+        ereport(ERROR,
+            (errcode(ERRCODE_DATATYPE_MISMATCH),
+             errmsg("operator %s must return boolean", cache->opname)));
+    }
+
+    if (!cache->oper_native || !AM_OP_IS_COMPARISON(cache->native_op))
+        return false;
+
+    arraymath_native_value(PG_GETARG_DATUM(argno + 2), cache->native_type, value);
+    return true;
+}
+
+/*
+* Count the non-null elements of the first argument for which the
+* condition holds, and set *ntested to how many were tested. Testing
+* stops once the answer to any (a match) or all (a miss) is known.
+*/
+static int64
+arraymath_mask_reduce(FunctionCallInfo fcinfo, ArrayMathMaskReduce reduce, int64 *ntested)
+{
+    ArrayType *arr = arraymath_getarg_array(fcinfo, 0);
+    ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+    int nelems = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+    ArrayMathNativeValue value;
+    int64 count = 0;
+
+    *ntested = 0;
+    if (arraymath_mask_oper(fcinfo, cache, arr, 1, &value))
+    {
+        uint64 bits[ARRAYMATH_MASK_CHUNK / 64];
+        const char *data = ARR_DATA_PTR(arr);
+        int size = arraymath_kernel_type_size[cache->native_type];
+        int nvalues = nelems;
+
+        if (arraymath_has_nulls(arr))
+            nvalues = arraymath_bitmap_count(ARR_NULLBITMAP(arr), nelems);
+
+        for (int i = 0; i < nvalues; i += ARRAYMATH_MASK_CHUNK)
+        {
+            int chunk = Min(ARRAYMATH_MASK_CHUNK, nvalues - i);
+            int matches = arraymath_mask(cache->native_op, cache->native_type,
+                                         data + (Size) i * size, &value, bits, chunk);
+
+            count += matches;
+            *ntested += chunk;
+            if ((reduce == ARRAYMATH_MASK_ANY && matches > 0) ||
+                (reduce == ARRAYMATH_MASK_ALL && matches < chunk))
+                break;
+        }
+    }
+    else if (nelems > 0)
+    {
+        Datum element2 = PG_GETARG_DATUM(2);
+        ArrayIterator iterator = arraymath_create_iterator(arr, &cache->info1);
+        Datum elem;
+        bool isnull;
+
+        while (array_iterate(iterator, &elem, &isnull))
+        {
+            bool match;
+
+            if (isnull)
+                continue;
+
+            match = DatumGetBool(FunctionCall2Coll(&cache->operfmgrinfo,
+                PG_GET_COLLATION(), elem, element2));
+            count += match;
+            (*ntested)++;
+            if ((reduce == ARRAYMATH_MASK_ANY && match) ||
+                (reduce == ARRAYMATH_MASK_ALL && !match))
+                break;
+        }
+        array_free_iterator(iterator);
+    }
+
+    ARRAYMATH_FREE_IF_COPY(arr, 0);
+    return count;
+}
+
+/*
+* The zero-based flattened positions of the elements of the array
+* argument argno for which the condition holds, in order, with how
+* many there are in *npositions. The native mask covers the packed
+* non-null values, so with nulls each of its bits is matched up to
+* the next valid bit of the null bitmap.
+*/
+static int32 *
+arraymath_mask_positions(FunctionCallInfo fcinfo, ArrayType *arr, int argno, int *npositions)
+{
+    ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+    int nelems = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+    int32 *positions = palloc(sizeof(int32) * Max(nelems, 1));
+    ArrayMathNativeValue value;
+    int n = 0;
+
+    if (arraymath_mask_oper(fcinfo, cache, arr, argno, &value))
+    {
+        bits8 *bitmap = arraymath_has_nulls(arr) ? ARR_NULLBITMAP(arr) : NULL;
+        int nvalues = bitmap ? arraymath_bitmap_count(bitmap, nelems) : nelems;
+        uint64 *mask = palloc(sizeof(uint64) * ((nvalues + 63) / 64 + 1));
+        int pos = 0, k = 0;
+
+        arraymath_mask(cache->native_op, cache->native_type,
+                       ARR_DATA_PTR(arr), &value, mask, nvalues);
+
+        for (int i = 0; i < nelems; i += 64)
+        {
+            uint64 word;
+
+            if (!bitmap)
+            {
+                for (word = mask[i / 64]; word; word &= word - 1)
+                    positions[n++] = i + pg_rightmost_one_pos64(word);
+                continue;
+            }
+
+            word = arraymath_bitmap_word(bitmap, nelems, &pos, Min(64, nelems - i));
+            for (; word; word &= word - 1, k++)
+            {
+                if ((mask[k / 64] >> (k % 64)) & 1)
+                    positions[n++] = i + pg_rightmost_one_pos64(word);
+            }
+        }
+        pfree(mask);
+    }
+    else if (nelems > 0)
+    {
+        Datum element2 = PG_GETARG_DATUM(argno + 2);
+        ArrayIterator iterator = arraymath_create_iterator(arr, &cache->info1);
+        Datum elem;
+        bool isnull;
+
+        for (int i = 0; array_iterate(iterator, &elem, &isnull); i++)
+        {
+            if (!isnull &&
+                DatumGetBool(FunctionCall2Coll(&cache->operfmgrinfo,
+                    PG_GET_COLLATION(), elem, element2)))
+            {
+                positions[n++] = i;
+            }
+        }
+        array_free_iterator(iterator);
+    }
+
+    *npositions = n;
+    return positions;
+}
+
+/*
+* A 1-d array of the elements of vals at the given flattened
+* positions. Fixed-width elements without nulls are copied straight
+* across, anything else goes through the builder.
+*/
+static ArrayType *
+arraymath_mask_gather(ArrayType *vals, const int32 *positions, int n)
+{
+    Oid elmtype = ARR_ELEMTYPE(vals);
+    ArrayMathTypeInfo info;
+    ArrayMathBuilder builder;
+    Datum *elems;
+    bool *nulls;
+    int nelems;
+
+    if (n == 0)
+        return construct_empty_array(elmtype);
+
+    arraymath_typeinfo_from_type(elmtype, &info);
+    if (info.typlen > 0 && !arraymath_has_nulls(vals))
+    {
+        ArrayType *arrOut = arraymath_new_array(&info, n, false);
+        Size size = att_align_nominal(info.typlen, info.typalign);
+        const char *src = ARR_DATA_PTR(vals);
+        char *dst = ARR_DATA_PTR(arrOut);
+
+        for (int i = 0; i < n; i++)
+            memcpy(dst + i * size, src + positions[i] * size, info.typlen);
+        return arrOut;
+    }
+
+    deconstruct_array(vals, elmtype, info.typlen, info.typbyval, info.typalign,
+                      &elems, &nulls, &nelems);
+    arraymath_builder_init(&builder, &info, n, arraymath_has_nulls(vals));
+    for (int i = 0; i < n; i++)
+        arraymath_builder_add(&builder, elems[positions[i]], nulls[positions[i]]);
+    return arraymath_builder_finish(&builder);
+}
+
+/*
+* Number of elements for which "element op value" holds
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_count)
+{
+    int64 ntested;
+
+    PG_RETURN_INT64(arraymath_mask_reduce(fcinfo, ARRAYMATH_MASK_COUNT, &ntested));
+}
+
+/*
+* Does "element op value" hold for any element?
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_any)
+{
+    int64 ntested;
+
+    PG_RETURN_BOOL(arraymath_mask_reduce(fcinfo, ARRAYMATH_MASK_ANY, &ntested) > 0);
+}
+
+/*
+* Does "element op value" hold for every non-null element?
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_all)
+{
+    int64 ntested;
+
+    PG_RETURN_BOOL(arraymath_mask_reduce(fcinfo, ARRAYMATH_MASK_ALL, &ntested) == ntested);
+}
+
+/*
+* One-based flattened positions of the elements for which
+* "element op value" holds
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_where)
+{
+    ArrayType *arr = arraymath_getarg_array(fcinfo, 0);
+    int n;
+    int32 *positions = arraymath_mask_positions(fcinfo, arr, 0, &n);
+    ArrayMathTypeInfo info;
+    ArrayType *arrOut;
+
+    if (n == 0)
+    {
+        arrOut = construct_empty_array(INT4OID);
+    }
+    else
+    {
+        arraymath_typeinfo_from_type(INT4OID, &info);
+        arrOut = arraymath_new_array(&info, n, false);
+        for (int i = 0; i < n; i++)
+            ((int32 *) ARR_DATA_PTR(arrOut))[i] = positions[i] + 1;
+    }
+
+    ARRAYMATH_FREE_IF_COPY(arr, 0);
+    PG_RETURN_ARRAYTYPE_P(arrOut);
+}
+
+/*
+* The elements for which "element op value" holds
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_select)
+{
+    ArrayType *arr = arraymath_getarg_array(fcinfo, 0);
+    int n;
+    int32 *positions = arraymath_mask_positions(fcinfo, arr, 0, &n);
+    ArrayType *arrOut = arraymath_mask_gather(arr, positions, n);
+
+    ARRAYMATH_FREE_IF_COPY(arr, 0);
+    PG_RETURN_ARRAYTYPE_P(arrOut);
+}
+
+/*
+* The elements of vals at the positions where "element op value"
+* holds for the elements of a second array of the same length
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_select_values)
+{
+    ArrayType *vals = arraymath_getarg_array(fcinfo, 0);
+    ArrayType *arr = arraymath_getarg_array(fcinfo, 1);
+    int nvals = ArrayGetNItems(ARR_NDIM(vals), ARR_DIMS(vals));
+    int nelems = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+    int n;
+    int32 *positions;
+    ArrayType *arrOut;
+
+    if (nvals != nelems)
+    {
+        ereport(ERROR,
+            (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+             errmsg("arrays must have the same length (%d and %d)", nvals, nelems)));
+    }
+
+    positions = arraymath_mask_positions(fcinfo, arr, 1, &n);
+    arrOut = arraymath_mask_gather(vals, positions, n);
+
+    ARRAYMATH_FREE_IF_COPY(vals, 0);
+    ARRAYMATH_FREE_IF_COPY(arr, 1);
+    PG_RETURN_ARRAYTYPE_P(arrOut);
+}
+
+
+/**********************************************************************
+* Matrices
+*/
+
+/*
+* Read a matrix (ndims 2) or vector (ndims 1) argument: an array of
+* a type with arithmetic and without nulls, which have no place in a
+* product.
+*/
+static ArrayType *
+arraymath_matrix_arg(FunctionCallInfo fcinfo, int argno, int ndims)
+{
+    ArrayType *arr = arraymath_getarg_array(fcinfo, argno);
+
+    arraymath_check_type(ARR_ELEMTYPE(arr));
+    if (ARR_NDIM(arr) != ndims)
+    {
+        ereport(ERROR,
+            (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+             errmsg("argument %d must be a %s array", argno + 1,
+                ndims == 2 ? "two-dimensional" : "one-dimensional")));
+    }
+    if (arraymath_has_nulls(arr))
+    {
+        ereport(ERROR,
+            (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+             errmsg("argument %d must not contain nulls", argno + 1)));
+    }
+    return arr;
+}
+
+/* The elements of an array without nulls, in order */
+static Datum *
+arraymath_matrix_datums(ArrayType *arr, const ArrayMathTypeInfo *info)
+{
+    Datum *elems;
+    int nelems;
+
+    deconstruct_array(arr, info->type, info->typlen, info->typbyval, info->typalign,
+                      &elems, NULL, &nelems);
+    return elems;
+}
+
+/*
+* out (m x n) = a (m x k) times b (k x n) for a type without a kernel,
+* with the type's own "*" and "+", so integers still overflow as they
+* should and numeric is exact. Each result is summed over k in order,
+* in a scratch context that is reset after every one.
+*/
+static void
+arraymath_matmul_generic(const ArrayMathTypeInfo *info, const Datum *a, const Datum *b,
+                         Datum *out, int m, int k, int n)
+{
+    FmgrInfo mulfmgrinfo, addfmgrinfo;
+    Oid rtype;
+    MemoryContext scratch, oldcontext;
+
+    arraymath_fmgrinfo_from_optype("*", info->type, info->type, &mulfmgrinfo, &rtype,
+                                   CurrentMemoryContext);
+    arraymath_fmgrinfo_from_optype("+", info->type, info->type, &addfmgrinfo, &rtype,
+                                   CurrentMemoryContext);
+    scratch = AllocSetContextCreate(CurrentMemoryContext,
+                                    "arraymath matmul",
+                                    ALLOCSET_SMALL_SIZES);
+
+    for (int i = 0; i < m; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            Datum v;
+
+            oldcontext = MemoryContextSwitchTo(scratch);
+            v = FunctionCall2(&mulfmgrinfo, a[(Size) i * k], b[j]);
+            for (int p = 1; p < k; p++)
+            {
+                v = FunctionCall2(&addfmgrinfo, v,
+                    FunctionCall2(&mulfmgrinfo, a[(Size) i * k + p], b[(Size) p * n + j]));
+            }
+            MemoryContextSwitchTo(oldcontext);
+
+            out[(Size) i * n + j] = datumCopy(v, info->typbyval, info->typlen);
+            MemoryContextReset(scratch);
+        }
+        CHECK_FOR_INTERRUPTS();
+    }
+    MemoryContextDelete(scratch);
+}
+
+/*
+* The product of a (m x k) and b, which is k x n, or a vector of k
+* taken as a k x 1 column, as an array of the given shape. Rows
+* keep the lower bound of a's rows, and columns that of b's.
+*/
+static ArrayType *
+arraymath_matrix_product(ArrayType *a, ArrayType *b, int ndims, const int *dims, const int *lbs)
+{
+    Oid elmtype = ARR_ELEMTYPE(a);
+    int m = ARR_DIMS(a)[0];
+    int k = ARR_DIMS(a)[1];
+    int n = (ndims == 2) ? dims[1] : 1;
+    ArrayMathKernelType type;
+    ArrayMathTypeInfo info;
+    ArrayType *arrOut;
+
+    arraymath_typeinfo_from_type(elmtype, &info);
+
+    if (arraymath_native_type(elmtype, &type) && arraymath_kernels->matmul[type])
+    {
+        arrOut = arraymath_new_md_array(&info, ndims, dims, false);
+        arraymath_kernel_error(
+            arraymath_matmul(type, ARR_DATA_PTR(a), ARR_DATA_PTR(b), ARR_DATA_PTR(arrOut),
+                             m, k, n),
+            type);
+    }
+    else
+    {
+        Datum *out = palloc(sizeof(Datum) * m * n);
+
+        arraymath_matmul_generic(&info,
+            arraymath_matrix_datums(a, &info), arraymath_matrix_datums(b, &info),
+            out, m, k, n);
+        arrOut = construct_md_array(out, NULL, ndims, (int *) dims, (int *) lbs, elmtype,
+                                    info.typlen, info.typbyval, info.typalign);
+    }
+
+    for (int d = 0; d < ndims; d++)
+        ARR_LBOUND(arrOut)[d] = lbs[d];
+    return arrOut;
+}
+
+/*
+* Matrix product of two two-dimensional arrays
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_matmul)
+{
+    ArrayType *a = arraymath_matrix_arg(fcinfo, 0, 2);
+    ArrayType *b = arraymath_matrix_arg(fcinfo, 1, 2);
+    int dims[2], lbs[2];
+    ArrayType *arrOut;
+
+    if (ARR_DIMS(a)[1] != ARR_DIMS(b)[0])
+    {
+        ereport(ERROR,
+            (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+             errmsg("cannot multiply matrices of dimensions %s and %s",
+                arraymath_dims_string(a), arraymath_dims_string(b))));
+    }
+
+    dims[0] = ARR_DIMS(a)[0];
+    dims[1] = ARR_DIMS(b)[1];
+    lbs[0] = ARR_LBOUND(a)[0];
+    lbs[1] = ARR_LBOUND(b)[1];
+    arrOut = arraymath_matrix_product(a, b, 2, dims, lbs);
+
+    ARRAYMATH_FREE_IF_COPY(a, 0);
+    ARRAYMATH_FREE_IF_COPY(b, 1);
+    PG_RETURN_ARRAYTYPE_P(arrOut);
+}
+
+/*
+* Product of a two-dimensional array and a one-dimensional one
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_matvec)
+{
+    ArrayType *a = arraymath_matrix_arg(fcinfo, 0, 2);
+    ArrayType *v = arraymath_matrix_arg(fcinfo, 1, 1);
+    int dims[1], lbs[1];
+    ArrayType *arrOut;
+
+    if (ARR_DIMS(a)[1] != ARR_DIMS(v)[0])
+    {
+        ereport(ERROR,
+            (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+             errmsg("cannot multiply a matrix of dimensions %s by a vector of length %d",
+                arraymath_dims_string(a), ARR_DIMS(v)[0])));
+    }
+
+    dims[0] = ARR_DIMS(a)[0];
+    lbs[0] = ARR_LBOUND(a)[0];
+    arrOut = arraymath_matrix_product(a, v, 1, dims, lbs);
+
+    ARRAYMATH_FREE_IF_COPY(a, 0);
+    ARRAYMATH_FREE_IF_COPY(v, 1);
+    PG_RETURN_ARRAYTYPE_P(arrOut);
+}
+
+/*
+* Swap the rows and columns of a two-dimensional array of any type,
+* lower bounds included. Fixed-width elements without nulls are
+* moved as raw data, anything else one Datum at a time.
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_transpose)
+{
+    ArrayType *arr = arraymath_getarg_array(fcinfo, 0);
+    Oid elmtype = ARR_ELEMTYPE(arr);
+    int rows, cols;
+    int dims[2], lbs[2];
+    ArrayMathTypeInfo info;
+    ArrayType *arrOut;
+
+    if (ARR_NDIM(arr) != 2)
+    {
+        ereport(ERROR,
+            (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+             errmsg("argument %d must be a %s array", 1, "two-dimensional")));
+    }
+
+    rows = ARR_DIMS(arr)[0];
+    cols = ARR_DIMS(arr)[1];
+    dims[0] = cols;
+    dims[1] = rows;
+    lbs[0] = ARR_LBOUND(arr)[1];
+    lbs[1] = ARR_LBOUND(arr)[0];
+    arraymath_typeinfo_from_type(elmtype, &info);
+
+    if (info.typlen > 0 && !arraymath_has_nulls(arr))
+    {
+        arrOut = arraymath_new_md_array(&info, 2, dims, false);
+        arraymath_transpose(att_align_nominal(info.typlen, info.typalign),
+                            ARR_DATA_PTR(arr), ARR_DATA_PTR(arrOut), rows, cols);
+        ARR_LBOUND(arrOut)[0] = lbs[0];
+        ARR_LBOUND(arrOut)[1] = lbs[1];
+    }
+    else
+    {
+        Datum *elems, *out;
+        bool *nulls, *outnulls;
+        int nelems;
+
+        deconstruct_array(arr, elmtype, info.typlen, info.typbyval, info.typalign,
+                          &elems, &nulls, &nelems);
+        out = palloc(sizeof(Datum) * nelems);
+        outnulls = palloc(sizeof(bool) * nelems);
+        for (int i = 0; i < rows; i++)
+        {
+            for (int j = 0; j < cols; j++)
+            {
+                out[(Size) j * rows + i] = elems[(Size) i * cols + j];
+                outnulls[(Size) j * rows + i] = nulls[(Size) i * cols + j];
+            }
+        }
+        arrOut = construct_md_array(out, outnulls, 2, dims, lbs, elmtype,
+                                    info.typlen, info.typbyval, info.typalign);
+    }
+
+    ARRAYMATH_FREE_IF_COPY(arr, 0);
+    PG_RETURN_ARRAYTYPE_P(arrOut);
+}
+
+/*
+* Outer product of two one-dimensional arrays, a (m) and b (n), as
+* an m x n array. Native types run a row at a time through the
+* scalar-times-array multiply kernel.
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_outer)
+{
+    ArrayType *a = arraymath_matrix_arg(fcinfo, 0, 1);
+    ArrayType *b = arraymath_matrix_arg(fcinfo, 1, 1);
+    Oid elmtype = ARR_ELEMTYPE(a);
+    int m = ARR_DIMS(a)[0];
+    int n = ARR_DIMS(b)[0];
+    int dims[2], lbs[2];
+    ArrayMathKernelType type;
+    ArrayMathTypeInfo info;
+    ArrayType *arrOut;
+
+    dims[0] = m;
+    dims[1] = n;
+    lbs[0] = ARR_LBOUND(a)[0];
+    lbs[1] = ARR_LBOUND(b)[0];
+    arraymath_typeinfo_from_type(elmtype, &info);
+
+    if (arraymath_native_type(elmtype, &type))
+    {
+        int size = arraymath_kernel_type_size[type];
+        ArrayMathStatus status = AM_OK;
+
+        arrOut = arraymath_new_md_array(&info, 2, dims, false);
+        for (int i = 0; i < m; i++)
+        {
+            status |= arraymath_binary(AM_SHAPE_SCALAR_ARRAY, AM_OP_MUL, type,
+                ARR_DATA_PTR(a) + (Size) i * size, ARR_DATA_PTR(b),
+                ARR_DATA_PTR(arrOut) + (Size) i * n * size, n);
+        }
+        arraymath_kernel_error(status, type);
+        ARR_LBOUND(arrOut)[0] = lbs[0];
+        ARR_LBOUND(arrOut)[1] = lbs[1];
+    }
+    else
+    {
+        Datum *adatums = arraymath_matrix_datums(a, &info);
+        Datum *bdatums = arraymath_matrix_datums(b, &info);
+        Datum *out = palloc(sizeof(Datum) * m * n);
+        FmgrInfo mulfmgrinfo;
+        Oid rtype;
+
+        arraymath_fmgrinfo_from_optype("*", elmtype, elmtype, &mulfmgrinfo, &rtype,
+                                       CurrentMemoryContext);
+        for (int i = 0; i < m; i++)
+        {
+            for (int j = 0; j < n; j++)
+                out[(Size) i * n + j] = FunctionCall2(&mulfmgrinfo, adatums[i], bdatums[j]);
+        }
+        arrOut = construct_md_array(out, NULL, 2, dims, lbs, elmtype,
+                                    info.typlen, info.typbyval, info.typalign);
+    }
+
+    ARRAYMATH_FREE_IF_COPY(a, 0);
+    ARRAYMATH_FREE_IF_COPY(b, 1);
+    PG_RETURN_ARRAYTYPE_P(arrOut);
+}
+
+
+/**********************************************************************
+* Vector similarity
+*/
+
+/*
+* Run a vector kernel over two arrays taken as flat vectors of the
+* same length, filling in sums. Returns false, for a null result,
+* when either array is empty or has nulls. Native types go straight
+* to the kernel off the data areas, numeric is widened to float8.
+*/
+static bool
+arraymath_vector_reduce(FunctionCallInfo fcinfo, ArrayMathVectorOp op, float8 *sums)
+{
+    ArrayType *array1 = arraymath_getarg_array(fcinfo, 0);
+    ArrayType *array2 = arraymath_getarg_array(fcinfo, 1);
+    Oid elmtype = ARR_ELEMTYPE(array1);
+    ArrayMathKernelType type;
+    int nelems1, nelems2;
+
+    arraymath_check_type(elmtype);
+    arraymath_check_type(ARR_ELEMTYPE(array2));
+
+    nelems1 = ArrayGetNItems(ARR_NDIM(array1), ARR_DIMS(array1));
+    nelems2 = ArrayGetNItems(ARR_NDIM(array2), ARR_DIMS(array2));
+    if (nelems1 != nelems2)
+    {
+        ereport(ERROR,
+            (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+             errmsg("arrays must have the same length (%d and %d)",
+                nelems1, nelems2)));
+    }
+
+    if (nelems1 == 0 || arraymath_has_nulls(array1) || arraymath_has_nulls(array2))
+        return false;
+
+    if (arraymath_native_type(elmtype, &type))
+    {
+        arraymath_vector(op, type, ARR_DATA_PTR(array1),
+            ARR_DATA_PTR(array2), nelems1, sums);
+    }
+    else
+    {
+        ArrayMathCache *cache = arraymath_cache_get(fcinfo);
+        float8 *values1, *values2;
+        int n;
+
+        values1 = arraymath_float8_values(array1, cache, &n);
+        values2 = arraymath_float8_values(array2, cache, &n);
+        arraymath_vector(op, AM_TYPE_FLOAT8, values1, values2, n, sums);
+        pfree(values1);
+        pfree(values2);
+    }
+
+    return true;
+}
+
+static float8
+arraymath_cosine_similarity(const float8 *sums)
+{
+    float8 similarity;
+
+    /* A zero vector has no direction */
+    if (sums[1] == 0.0 || sums[2] == 0.0)
+        return get_float8_nan();
+
+    /* Keep rounding from taking it out of range */
+    similarity = sums[0] / sqrt(sums[1] * sums[2]);
+    return Max(-1.0, Min(1.0, similarity));
+}
+
+/*
+* Do dot product of two arrays
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_dot)
+{
+    float8 sums[3];
+
+    if (!arraymath_vector_reduce(fcinfo, AM_VEC_DOT, sums))
+        PG_RETURN_NULL();
+
+    PG_RETURN_FLOAT8(sums[0]);
+}
+
+/*
+* Negated dot product, so the most similar sort first in <#>
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_negative_dot)
+{
+    float8 sums[3];
+
+    if (!arraymath_vector_reduce(fcinfo, AM_VEC_DOT, sums))
+        PG_RETURN_NULL();
+
+    PG_RETURN_FLOAT8(-sums[0]);
+}
+
+ARRAYMATH_TRACKED_FUNCTION(array_l1_distance)
+{
+    float8 sums[3];
+
+    if (!arraymath_vector_reduce(fcinfo, AM_VEC_L1, sums))
+        PG_RETURN_NULL();
+
+    PG_RETURN_FLOAT8(sums[0]);
+}
+
+ARRAYMATH_TRACKED_FUNCTION(array_l2_distance)
+{
+    float8 sums[3];
+
+    if (!arraymath_vector_reduce(fcinfo, AM_VEC_L2, sums))
+        PG_RETURN_NULL();
+
+    PG_RETURN_FLOAT8(sqrt(sums[0]));
+}
+
+ARRAYMATH_TRACKED_FUNCTION(array_cosine_similarity)
+{
+    float8 sums[3];
+
+    if (!arraymath_vector_reduce(fcinfo, AM_VEC_COSINE, sums))
+        PG_RETURN_NULL();
+
+    PG_RETURN_FLOAT8(arraymath_cosine_similarity(sums));
+}
+
+ARRAYMATH_TRACKED_FUNCTION(array_cosine_distance)
+{
+    float8 sums[3];
+
+    if (!arraymath_vector_reduce(fcinfo, AM_VEC_COSINE, sums))
+        PG_RETURN_NULL();
+
+    PG_RETURN_FLOAT8(1.0 - arraymath_cosine_similarity(sums));
+}
+
+/*
+* Do Euclidean norm of an array
+*/
+ARRAYMATH_TRACKED_FUNCTION(array_norm)
+{
+    ArrayType *arr = arraymath_getarg_array(fcinfo, 0);
+    Oid elmtype = ARR_ELEMTYPE(arr);
+    ArrayMathKernelType type;
+    float8 sums[3];
+    int nelems;
+
+    arraymath_check_type(elmtype);
+
+    nelems = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+    if (nelems == 0 || arraymath_has_nulls(arr))
+        PG_RETURN_NULL();
+
+    if (arraymath_native_type(elmtype, &type))
+    {
+        arraymath_vector(AM_VEC_NORM, type, ARR_DATA_PTR(arr),
+            ARR_DATA_PTR(arr), nelems, sums);
+    }
+    else
+    {
+        float8 *values = arraymath_float8_values(arr, arraymath_cache_get(fcinfo), &nelems);
+
+        arraymath_vector(AM_VEC_NORM, AM_TYPE_FLOAT8, values, values, nelems, sums);
+        pfree(values);
+    }
+
+    PG_RETURN_FLOAT8(sqrt(sums[0]));
+}
+
+
+/**********************************************************************
+* Vector aggregates
+*/
+
+typedef enum
+{
+    ARRAYMATH_VAGG_SUM = 0,
+    ARRAYMATH_VAGG_AVG,
+    ARRAYMATH_VAGG_MIN,
+    ARRAYMATH_VAGG_MAX
+} ArrayMathVaggOp;
+
+/*
+* Running state of an element-wise aggregate: one value and one count
+* per position. Values are native, of the input type for sum, min and
+* max and float8 sums for avg. A position with a zero count has only
+* ever seen nulls.
+*/
+typedef struct
+{
+    ArrayMathVaggOp op;
+    Oid elmtype;
+    ArrayMathKernelType type;
+    int nelems;
+    int nempty;
+    int64 *counts;
+    char *values;
+} ArrayMathVaggState;
+
+#define ARRAYMATH_VAGG_IS_MINMAX(state) \
+    ((state)->op == ARRAYMATH_VAGG_MIN || (state)->op == ARRAYMATH_VAGG_MAX)
+
+static ArrayMathKernelType
+arraymath_vagg_value_type(const ArrayMathVaggState *state)
+{
+    return state->op == ARRAYMATH_VAGG_AVG ? AM_TYPE_FLOAT8 : state->type;
+}
+
+static ArrayMathVaggState *
+arraymath_vagg_new(MemoryContext aggcontext, ArrayMathVaggOp op, Oid elmtype, int nelems)
+{
+    ArrayMathVaggState *state;
+    int size;
+
+    state = MemoryContextAllocZero(aggcontext, sizeof(ArrayMathVaggState));
+    state->op = op;
+    state->elmtype = elmtype;
+    if (!arraymath_native_type(elmtype, &state->type))
+    {
+        ereport(ERROR, (
+            errmsg(
+                "Array type must be SMALLINT, INTEGER, BIGINT, REAL, or DOUBLE PRECISION"
+                )));
+    }
+    state->nelems = nelems;
+    state->nempty = nelems;
+
+    size = arraymath_kernel_type_size[arraymath_vagg_value_type(state)];
+    state->counts = MemoryContextAllocZero(aggcontext, sizeof(int64) * Max(nelems, 1));
+    state->values = MemoryContextAllocZero(aggcontext, (Size) size * Max(nelems, 1));
+    return state;
+}
+
+/*
+* Fold a dense vector of values into the state. incounts says how many
+* inputs each position stands for, or is NULL if every position holds
+* exactly one. Positions standing for nothing must already hold a
+* harmless value: zero for the sums, the state's own value for min
+* and max.
+*/
+static void
+arraymath_vagg_fold(ArrayMathVaggState *state, const char *in, const int64 *incounts)
+{
+    ArrayMathKernelType vtype = arraymath_vagg_value_type(state);
+    int size = arraymath_kernel_type_size[vtype];
+    int n = state->nelems;
+
+    if (!incounts && state->nempty == 0)
+    {
+        for (int i = 0; i < n; i++)
+            state->counts[i]++;
+    }
+    else
+    {
+        for (int i = 0; i < n; i++)
+        {
+            int64 inc = incounts ? incounts[i] : 1;
+
+            if (inc == 0)
+                continue;
+
+            /* First value at a position seeds min and max */
+            if (state->counts[i] == 0)
+            {
+                state->nempty--;
+                if (ARRAYMATH_VAGG_IS_MINMAX(state))
+                    memcpy(state->values + (Size) i * size, in + (Size) i * size, size);
+            }
+            state->counts[i] += inc;
+        }
+    }
+
+    if (ARRAYMATH_VAGG_IS_MINMAX(state))
+    {
+        arraymath_minmax_native(vtype, state->values, in, n,
+            state->op == ARRAYMATH_VAGG_MAX);
+    }
+    else if (n > 0)
+    {
+        arraymath_kernel_error(
+            arraymath_apply(AM_OP_ADD, vtype,
+                state->values, n, in, n, state->values),
+            vtype);
+    }
+}
+
+static Datum
+arraymath_vagg_accum(FunctionCallInfo fcinfo, ArrayMathVaggOp op)
+{
+    MemoryContext aggcontext;
+    ArrayMathVaggState *state;
+    ArrayType *arr;
+    const char *in;
+    int64 *incounts = NULL;
+    int nelems, size;
+
+    if (!AggCheckCallContext(fcinfo, &aggcontext))
+        elog(ERROR, "array vector aggregate called in non-aggregate context");
+
+    state = PG_ARGISNULL(0) ? NULL : (ArrayMathVaggState *) PG_GETARG_POINTER(0);
+
+    /* Null arrays are skipped altogether */
+    if (PG_ARGISNULL(1))
+    {
+        if (!state)
+            PG_RETURN_NULL();
+        PG_RETURN_POINTER(state);
+    }
+
+    arr = arraymath_getarg_array(fcinfo, 1);
+    if (ARR_NDIM(arr) > 1)
+        ereport(ERROR, (errmsg("only one-dimensional arrays are supported")));
+
+    nelems = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+    if (!state)
+        state = arraymath_vagg_new(aggcontext, op, ARR_ELEMTYPE(arr), nelems);
+    else if (nelems != state->nelems)
+    {
+        ereport(ERROR,
+            (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+             errmsg("arrays must all have the same length (%d and %d)",
+                state->nelems, nelems)));
+    }
+
+    in = ARR_DATA_PTR(arr);
+    size = arraymath_kernel_type_size[state->type];
+
+    /* Spread the values out to their positions, filling in the nulls */
+    if (arraymath_has_nulls(arr))
+    {
+        bits8 *bitmap = ARR_NULLBITMAP(arr);
+        char *dense = palloc0((Size) size * nelems);
+
+        incounts = palloc0(sizeof(int64) * nelems);
+        for (int i = 0; i < nelems; i++)
+        {
+            char *dst = dense + (Size) i * size;
+
+            if (bitmap[i / 8] & (1 << (i % 8)))
+            {
+                memcpy(dst, in, size);
+                in += size;
+                incounts[i] = 1;
+            }
+            else if (ARRAYMATH_VAGG_IS_MINMAX(state))
+            {
+                memcpy(dst, state->values + (Size) i * size, size);
+            }
+        }
+        in = dense;
+    }
+
+    if (op == ARRAYMATH_VAGG_AVG)
+    {
+        float8 *f = palloc(sizeof(float8) * Max(nelems, 1));
+
+        arraymath_to_float8(state->type, in, nelems, f);
+        in = (const char *) f;
+    }
+
+    arraymath_vagg_fold(state, in, incounts);
+    PG_RETURN_POINTER(state);
+}
+
+ARRAYMATH_TRACKED_FUNCTION(array_vsum_accum)
+{
+    return arraymath_vagg_accum(fcinfo, ARRAYMATH_VAGG_SUM);
+}
+
+ARRAYMATH_TRACKED_FUNCTION(array_vavg_accum)
+{
+    return arraymath_vagg_accum(fcinfo, ARRAYMATH_VAGG_AVG);
+}
+
+ARRAYMATH_TRACKED_FUNCTION(array_vmin_accum)
+{
+    return arraymath_vagg_accum(fcinfo, ARRAYMATH_VAGG_MIN);
+}
+
+ARRAYMATH_TRACKED_FUNCTION(array_vmax_accum)
+{
+    return arraymath_vagg_accum(fcinfo, ARRAYMATH_VAGG_MAX);
+}
+
+/*
+* Merge the state of one partial aggregate into another.
+*/
+Datum array_vagg_combine(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(array_vagg_combine);
+Datum array_vagg_combine(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    ArrayMathVaggState *state1, *state2;
+    const char *in;
+    int size;
+
+    if (!AggCheckCallContext(fcinfo, &aggcontext))
+        elog(ERROR, "array vector aggregate called in non-aggregate context");
+
+    state1 = PG_ARGISNULL(0) ? NULL : (ArrayMathVaggState *) PG_GETARG_POINTER(0);
+    state2 = PG_ARGISNULL(1) ? NULL : (ArrayMathVaggState *) PG_GETARG_POINTER(1);
+
+    if (!state2)
+    {
+        if (!state1)
+            PG_RETURN_NULL();
+        PG_RETURN_POINTER(state1);
+    }
+
+    if (!state1)
+        state1 = arraymath_vagg_new(aggcontext, state2->op, state2->elmtype, state2->nelems);
+    else if (state1->nelems != state2->nelems)
+    {
+        ereport(ERROR,
+            (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+             errmsg("arrays must all have the same length (%d and %d)",
+                state1->nelems, state2->nelems)));
+    }
+
+    in = state2->values;
+    size = arraymath_kernel_type_size[arraymath_vagg_value_type(state2)];
+
+    /* Positions the other side never saw must not move min or max */
+    if (ARRAYMATH_VAGG_IS_MINMAX(state2) && state2->nempty > 0)
+    {
+        char *filled = palloc((Size) size * Max(state2->nelems, 1));
+
+        memcpy(filled, state2->values, (Size) size * state2->nelems);
+        for (int i = 0; i < state2->nelems; i++)
+        {
+            if (state2->counts[i] == 0)
+                memcpy(filled + (Size) i * size, state1->values + (Size) i * size, size);
+        }
+        in = filled;
+    }
 
-    PG_RETURN_ARRAYTYPE_P(arrayout);
+    arraymath_vagg_fold(state1, in, state2->counts);
+    PG_RETURN_POINTER(state1);
 }
 
-
 /*
-* Operator on two arrays.
+* The serialized state only ever travels between processes of the
+* same server, so the native values are sent as they are.
 */
-Datum array_math_array(PG_FUNCTION_ARGS);
-PG_FUNCTION_INFO_V1(array_math_array);
-Datum array_math_array(PG_FUNCTION_ARGS)
+Datum array_vagg_serialize(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(array_vagg_serialize);
+Datum array_vagg_serialize(PG_FUNCTION_ARGS)
 {
-    ArrayType *array1 = PG_GETARG_ARRAYTYPE_P(0);
-    ArrayType *array2 = PG_GETARG_ARRAYTYPE_P(1);
-    text *operator = PG_GETARG_TEXT_P(2);
-    char *opname = text_to_cstring(operator);
-    ArrayType *arrayout;
-
-    arrayout = arraymath_array_oper_array(array1, opname, array2);
+    ArrayMathVaggState *state;
+    StringInfoData buf;
+    int size;
 
-    PG_FREE_IF_COPY(array1, 0);
-    PG_FREE_IF_COPY(array2, 1);
+    if (!AggCheckCallContext(fcinfo, NULL))
+        elog(ERROR, "array vector aggregate called in non-aggregate context");
 
-    PG_RETURN_ARRAYTYPE_P(arrayout);
-}
+    state = (ArrayMathVaggState *) PG_GETARG_POINTER(0);
+    size = arraymath_kernel_type_size[arraymath_vagg_value_type(state)];
 
+    pq_begintypsend(&buf);
+    pq_sendint32(&buf, state->op);
+    pq_sendint32(&buf, state->elmtype);
+    pq_sendint32(&buf, state->nelems);
+    for (int i = 0; i < state->nelems; i++)
+        pq_sendint64(&buf, state->counts[i]);
+    pq_sendbytes(&buf, state->values, size * state->nelems);
 
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
 
-/*
-* Compare an array to a constant element
-*/
-Datum array_compare_value(PG_FUNCTION_ARGS);
-PG_FUNCTION_INFO_V1(array_compare_value);
-Datum array_compare_value(PG_FUNCTION_ARGS)
+Datum array_vagg_deserialize(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(array_vagg_deserialize);
+Datum array_vagg_deserialize(PG_FUNCTION_ARGS)
 {
-    ArrayType *array1 = PG_GETARG_ARRAYTYPE_P(0);
-    Datum element2 = PG_GETARG_DATUM(1);
-    text *operator = PG_GETARG_TEXT_P(2);
-    char *opname = text_to_cstring(operator);
-    Oid element_type2;
-    ArrayType *arrayout;
-
-    element_type2 = get_fn_expr_argtype(fcinfo->flinfo, 1);
-    arrayout = arraymath_array_oper_elem(array1, opname, element2, element_type2);
+    MemoryContext aggcontext;
+    ArrayMathVaggState *state;
+    bytea *sstate;
+    StringInfoData buf;
+    ArrayMathVaggOp op;
+    Oid elmtype;
+    int nelems, size;
+
+    if (!AggCheckCallContext(fcinfo, &aggcontext))
+        elog(ERROR, "array vector aggregate called in non-aggregate context");
+
+    sstate = PG_GETARG_BYTEA_PP(0);
+    initStringInfo(&buf);
+    appendBinaryStringInfo(&buf, VARDATA_ANY(sstate), VARSIZE_ANY_EXHDR(sstate));
+
+    op = (ArrayMathVaggOp) pq_getmsgint(&buf, 4);
+    elmtype = (Oid) pq_getmsgint(&buf, 4);
+    nelems = pq_getmsgint(&buf, 4);
+
+    state = arraymath_vagg_new(aggcontext, op, elmtype, nelems);
+    size = arraymath_kernel_type_size[arraymath_vagg_value_type(state)];
+    for (int i = 0; i < nelems; i++)
+    {
+        state->counts[i] = pq_getmsgint64(&buf);
+        if (state->counts[i] > 0)
+            state->nempty--;
+    }
+    pq_copymsgbytes(&buf, state->values, size * nelems);
+    pq_getmsgend(&buf);
+    pfree(buf.data);
 
-    PG_FREE_IF_COPY(array1, 0);
-    PG_RETURN_ARRAYTYPE_P(arrayout);
+    PG_RETURN_POINTER(state);
 }
 
 /*
-* Do math on an array using a constant element
+* Final function for sum, min and max, an array of the input type
+* with nulls where only nulls were seen.
 */
-Datum array_math_value(PG_FUNCTION_ARGS);
-PG_FUNCTION_INFO_V1(array_math_value);
-Datum array_math_value(PG_FUNCTION_ARGS)
+Datum array_vagg_final(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(array_vagg_final);
+Datum array_vagg_final(PG_FUNCTION_ARGS)
 {
-    ArrayType *array1 = PG_GETARG_ARRAYTYPE_P(0);
-    Datum element2 = PG_GETARG_DATUM(1);
-    text *operator = PG_GETARG_TEXT_P(2);
-    char *opname = text_to_cstring(operator);
-    Oid element_type2;
-    ArrayType *arrayout;
-
-    element_type2 = get_fn_expr_argtype(fcinfo->flinfo, 1);
-    arrayout = arraymath_array_oper_elem(array1, opname, element2, element_type2);
+    ArrayMathVaggState *state;
+    ArrayMathTypeInfo info;
+    ArrayType *arrOut;
+    char *out;
+    int size;
 
-    PG_FREE_IF_COPY(array1, 0);
-    PG_RETURN_ARRAYTYPE_P(arrayout);
-}
+    if (PG_ARGISNULL(0))
+        PG_RETURN_NULL();
 
+    state = (ArrayMathVaggState *) PG_GETARG_POINTER(0);
+    if (state->nelems == 0)
+        PG_RETURN_ARRAYTYPE_P(construct_empty_array(state->elmtype));
+    arraymath_typeinfo_from_type(state->elmtype, &info);
+    size = arraymath_kernel_type_size[state->type];
 
-static Datum
-arraymath_zero(Oid oid)
-{
-    /* Initialize result value */
-    if (oid == INT2OID ||
-        oid == INT4OID ||
-        oid == INT8OID ||
-        oid == FLOAT4OID ||
-        oid == FLOAT8OID)
+    arrOut = arraymath_new_array(&info, state->nelems, state->nempty > 0);
+    out = ARR_DATA_PTR(arrOut);
+    if (state->nempty == 0)
     {
-        /* Ints and Floats store value in the Datum */
-        return (Datum)0;
-    }
-    else if (oid == NUMERICOID)
-    {
-        /* Numeric type is varlena, requires special initialization */
-        return NumericGetDatum(arraymath_int64_to_numeric(0));
+        memcpy(out, state->values, (Size) size * state->nelems);
     }
     else
     {
-        ereport(ERROR, (errmsg("Sum subject must be NUMERIC, SMALLINT, INTEGER, BIGINT, REAL, or DOUBLE PRECISION values")));
-    }
-}
-
-
-static Datum
-arraymath_sum(ArrayType *vals, Oid valsType)
-{
-    /* Get + operator FmgrInfo */
-    FmgrInfo operfmgrinfo;
-    Oid rtype;
-    const char* op = "+";
-    Datum v = arraymath_zero(valsType);
-    Datum elem;
-    ArrayIterator iterator;
-    bool isnull;
-
-    arraymath_fmgrinfo_from_optype(op, valsType, valsType, &operfmgrinfo, &rtype);
+        bits8 *bitmap = ARR_NULLBITMAP(arrOut);
 
-    iterator = arraymath_create_iterator(vals);
-    while (array_iterate(iterator, &elem, &isnull))
-    {
-        if (!isnull)
+        for (int i = 0; i < state->nelems; i++)
         {
-            /* Apply the operator */
-            v = FunctionCall2(&operfmgrinfo, elem, v);
+            if (state->counts[i] == 0)
+                continue;
+            memcpy(out, state->values + (Size) i * size, size);
+            out += size;
+            bitmap[i / 8] |= (1 << (i % 8));
         }
+        SET_VARSIZE(arrOut, out - (char *) arrOut);
     }
-    return v;
-}
 
-
-static float8
-arraymath_float8(Datum d, Oid typOid)
-{
-    FmgrInfo castfmgrinfo;
-    Datum v;
-    arraymath_fmgrinfo_from_cast(typOid, FLOAT8OID, &castfmgrinfo);
-    v = FunctionCall1(&castfmgrinfo, d);
-    return DatumGetFloat8(v);
+    PG_RETURN_ARRAYTYPE_P(arrOut);
 }
 
-
 /*
-* Do sum of an array
+* Final function for avg, always float8.
 */
-Datum array_sum(PG_FUNCTION_ARGS);
-PG_FUNCTION_INFO_V1(array_sum);
-Datum
-array_sum(PG_FUNCTION_ARGS)
+Datum array_vavg_final(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(array_vavg_final);
+Datum array_vavg_final(PG_FUNCTION_ARGS)
 {
-    ArrayType *vals = PG_GETARG_ARRAYTYPE_P(0);
-    Oid valsType = ARR_ELEMTYPE(vals);
-    Datum result = arraymath_zero(valsType);
-    size_t valsLength;
-
-    arraymath_check_type(valsType);
+    ArrayMathVaggState *state;
+    ArrayMathTypeInfo info;
+    ArrayType *arrOut;
+    const float8 *sums;
+    float8 *out;
 
-    if (ARR_NDIM(vals) == 0)
+    if (PG_ARGISNULL(0))
         PG_RETURN_NULL();
 
-    if (ARR_NDIM(vals) > 1)
-        ereport(ERROR, (errmsg("only one-dimensional arrays are supported")));
+    state = (ArrayMathVaggState *) PG_GETARG_POINTER(0);
+    if (state->nelems == 0)
+        PG_RETURN_ARRAYTYPE_P(construct_empty_array(FLOAT8OID));
+    sums = (const float8 *) state->values;
+    arraymath_typeinfo_from_type(FLOAT8OID, &info);
 
-    /* Empty length return 0 */
-    valsLength = (ARR_DIMS(vals))[0];
-    if (valsLength > 0)
-        result = arraymath_sum(vals, valsType);
+    arrOut = arraymath_new_array(&info, state->nelems, state->nempty > 0);
+    out = (float8 *) ARR_DATA_PTR(arrOut);
+    for (int i = 0; i < state->nelems; i++)
+    {
+        if (state->counts[i] == 0)
+            continue;
+        *out++ = sums[i] / state->counts[i];
+        if (state->nempty > 0)
+            ARR_NULLBITMAP(arrOut)[i / 8] |= (1 << (i % 8));
+    }
+    SET_VARSIZE(arrOut, (char *) out - (char *) arrOut);
 
-    PG_RETURN_DATUM(result);
+    PG_RETURN_ARRAYTYPE_P(arrOut);
 }
 
 
+/**********************************************************************
+* Expression evaluation
+*/
+
 /*
-* Do average of an array
+* An array_eval() expression is compiled once into a postfix program
+* over the inputs (a, b, c, ...), numeric literals and the four
+* arithmetic operators, then run over all the elements at once.
 */
-Datum array_avg(PG_FUNCTION_ARGS);
-PG_FUNCTION_INFO_V1(array_avg);
-Datum
-array_avg(PG_FUNCTION_ARGS)
+typedef enum
 {
-    ArrayType *vals = PG_GETARG_ARRAYTYPE_P(0);
-    Oid valsType = ARR_ELEMTYPE(vals);
-    Datum sumDatum;
-    float8 sum, count;
-    size_t valsLength;
-
-    arraymath_check_type(valsType);
-
-    if (ARR_NDIM(vals) == 0)
-        PG_RETURN_NULL();
+    ARRAYMATH_STEP_VAR,
+    ARRAYMATH_STEP_CONST,
+    ARRAYMATH_STEP_OPER
+} ArrayMathStepKind;
 
-    if (ARR_NDIM(vals) > 1)
-        ereport(ERROR, (errmsg("only one-dimensional arrays are supported")));
+typedef struct
+{
+    ArrayMathStepKind kind;
+    int var;                        /* VAR: input number */
+    ArrayMathKernelOp op;           /* OPER: one of + - * / */
+    Datum value;                    /* CONST */
+    ArrayMathNativeValue native;    /* CONST, for the kernels */
+} ArrayMathStep;
 
-    valsLength = (ARR_DIMS(vals))[0];
-    if (valsLength == 0)
-        PG_RETURN_NULL();
+#define ARRAYMATH_PLAN_OPERS 4
+static const char arraymath_plan_opchars[ARRAYMATH_PLAN_OPERS] = { '+', '-', '*', '/' };
 
-    sumDatum = arraymath_sum(vals, valsType);
-    sum = arraymath_float8(sumDatum, valsType);
+struct ArrayMathPlan
+{
+    MemoryContext mcxt;
+    char *expr;
+    Oid elmtype;
+    ArrayMathTypeInfo info;
+    bool native;
+    ArrayMathKernelType type;
+    FmgrInfo opers[ARRAYMATH_PLAN_OPERS];
+    int nsteps;
+    int maxsteps;
+    ArrayMathStep *steps;
+    int nvars;                      /* inputs referenced, highest + 1 */
+    int depth;                      /* deepest the stack gets */
+};
+
+/* Parser state */
+typedef struct
+{
+    ArrayMathPlan *plan;
+    const char *expr;
+    const char *p;
+    int sp;
+} ArrayMathParser;
 
-    /* array_avg(anyarray) => float8 */
-    count = (float8)valsLength;
+static void arraymath_parse_expr(ArrayMathParser *ps);
 
-    /* float8 argument should force float8 return */
-    PG_RETURN_FLOAT8(sum / count);
+static void
+arraymath_parse_error(ArrayMathParser *ps, const char *msg)
+{
+    ereport(ERROR,
+        (errcode(ERRCODE_SYNTAX_ERROR),
+         errmsg("invalid array expression \"%s\"", ps->expr),
+         errdetail("%s at character %d.", msg, (int) (ps->p - ps->expr) + 1)));
 }
 
-
-static Datum
-arraymath_minmax(ArrayType *arr, int mode)
+static void
+arraymath_parse_skip(ArrayMathParser *ps)
 {
-    Oid arrType = ARR_ELEMTYPE(arr);
-    Datum elem, result = (Datum)0, cmp;
-    bool isnull, first = true;
-    TypeCacheEntry *typeCache = arraymath_typentry_from_type(arrType, TYPECACHE_CMP_PROC_FINFO);
-    FmgrInfo cmpFmgrInfo = typeCache->cmp_proc_finfo;
-    ArrayIterator iterator;
+    while (*ps->p == ' ' || *ps->p == '\t' || *ps->p == '\n' || *ps->p == '\r')
+        ps->p++;
+}
 
-    arraymath_check_type(arrType);
+static ArrayMathStep *
+arraymath_plan_push(ArrayMathParser *ps, ArrayMathStepKind kind)
+{
+    ArrayMathPlan *plan = ps->plan;
+    ArrayMathStep *step;
 
-    iterator = arraymath_create_iterator(arr);
-    while (array_iterate(iterator, &elem, &isnull))
+    if (plan->nsteps == plan->maxsteps)
     {
-        if (isnull) continue;
-
-        if (first)
-        {
-            result = elem;
-            first = false;
-            continue;
-        }
-
-        /* cmp_proc_finfo returns -1 for less than */
-        /* and 1 for greater than. Mode is -1 for min */
-        /* and 1 for max */
-        cmp = FunctionCall2(&cmpFmgrInfo, elem, result);
-        if ((mode < 0 && DatumGetInt32(cmp) < 0) ||
-            (mode > 0 && DatumGetInt32(cmp) > 0))
-        {
-            result = elem;
-        }
+        plan->maxsteps *= 2;
+        plan->steps = repalloc(plan->steps, sizeof(ArrayMathStep) * plan->maxsteps);
     }
-    return result;
+    step = &plan->steps[plan->nsteps++];
+    memset(step, 0, sizeof(ArrayMathStep));
+    step->kind = kind;
+
+    if (kind == ARRAYMATH_STEP_OPER)
+        ps->sp--;
+    else
+        ps->sp++;
+    plan->depth = Max(plan->depth, ps->sp);
+    return step;
 }
 
+static void
+arraymath_plan_const(ArrayMathParser *ps, Datum value)
+{
+    ArrayMathStep *step = arraymath_plan_push(ps, ARRAYMATH_STEP_CONST);
+
+    step->value = value;
+    if (ps->plan->native)
+        arraymath_native_value(value, ps->plan->type, &step->native);
+}
 
 /*
-* Do minimum of an array
+* Emit an operator, folding it away if both operands are constants.
 */
-Datum array_min(PG_FUNCTION_ARGS);
-PG_FUNCTION_INFO_V1(array_min);
-Datum array_min(PG_FUNCTION_ARGS)
+static void
+arraymath_plan_oper(ArrayMathParser *ps, int opno)
 {
-    ArrayType *arr = PG_GETARG_ARRAYTYPE_P(0);
-    size_t arrLen;
+    ArrayMathPlan *plan = ps->plan;
+    ArrayMathStep *l = &plan->steps[plan->nsteps - 2];
+    ArrayMathStep *r = &plan->steps[plan->nsteps - 1];
 
-    if (ARR_NDIM(arr) == 0)
-        PG_RETURN_NULL();
-
-    if (ARR_NDIM(arr) > 1)
-        ereport(ERROR, (errmsg("only one-dimensional arrays are supported")));
+    if (l->kind == ARRAYMATH_STEP_CONST && r->kind == ARRAYMATH_STEP_CONST)
+    {
+        Datum value = FunctionCall2(&plan->opers[opno], l->value, r->value);
 
-    arrLen = (ARR_DIMS(arr))[0];
-    if (arrLen == 0)
-        PG_RETURN_NULL();
+        plan->nsteps -= 2;
+        ps->sp -= 2;
+        arraymath_plan_const(ps, datumCopy(value, plan->info.typbyval, plan->info.typlen));
+        return;
+    }
 
-    PG_RETURN_DATUM(arraymath_minmax(arr, -1));
+    arraymath_plan_push(ps, ARRAYMATH_STEP_OPER)->op = (ArrayMathKernelOp) opno;
 }
 
-/*
-* Do maximum of an array
-*/
-Datum array_max(PG_FUNCTION_ARGS);
-PG_FUNCTION_INFO_V1(array_max);
-Datum array_max(PG_FUNCTION_ARGS)
+static void
+arraymath_parse_primary(ArrayMathParser *ps)
 {
-    ArrayType *arr = PG_GETARG_ARRAYTYPE_P(0);
-    size_t arrLen;
+    ArrayMathPlan *plan = ps->plan;
+    const char *start;
 
-    if (ARR_NDIM(arr) == 0)
-        PG_RETURN_NULL();
+    arraymath_parse_skip(ps);
+    start = ps->p;
 
-    if (ARR_NDIM(arr) > 1)
-        ereport(ERROR, (errmsg("only one-dimensional arrays are supported")));
+    if (*ps->p == '(')
+    {
+        ps->p++;
+        arraymath_parse_expr(ps);
+        arraymath_parse_skip(ps);
+        if (*ps->p != ')')
+            arraymath_parse_error(ps, "Expected \")\"");
+        ps->p++;
+    }
+    else if (*ps->p >= 'a' && *ps->p <= 'z' && !isalnum((unsigned char) ps->p[1]))
+    {
+        ArrayMathStep *step = arraymath_plan_push(ps, ARRAYMATH_STEP_VAR);
 
-    arrLen = (ARR_DIMS(arr))[0];
-    if (arrLen == 0)
-        PG_RETURN_NULL();
+        step->var = *ps->p - 'a';
+        plan->nvars = Max(plan->nvars, step->var + 1);
+        ps->p++;
+    }
+    else if (isdigit((unsigned char) *ps->p) || *ps->p == '.')
+    {
+        Oid typinput, typioparam;
+        char *literal;
+
+        while (isalnum((unsigned char) *ps->p) || *ps->p == '.' ||
+               ((*ps->p == '+' || *ps->p == '-') && (ps->p[-1] == 'e' || ps->p[-1] == 'E')))
+            ps->p++;
+
+        /* Literals are read by the element type, as in SQL */
+        literal = pnstrdup(start, ps->p - start);
+        getTypeInputInfo(plan->elmtype, &typinput, &typioparam);
+        arraymath_plan_const(ps, OidInputFunctionCall(typinput, literal, typioparam, -1));
+    }
+    else
+    {
+        arraymath_parse_error(ps, *ps->p ? "Unexpected character" : "Unexpected end of expression");
+    }
+}
 
-    PG_RETURN_DATUM(arraymath_minmax(arr, 1));
+/* Unary minus is multiplication by -1, which keeps -0.0 and overflow right */
+static void
+arraymath_parse_unary(ArrayMathParser *ps)
+{
+    arraymath_parse_skip(ps);
+    if (*ps->p == '-')
+    {
+        Oid typinput, typioparam;
+
+        ps->p++;
+        getTypeInputInfo(ps->plan->elmtype, &typinput, &typioparam);
+        arraymath_plan_const(ps, OidInputFunctionCall(typinput, "-1", typioparam, -1));
+        arraymath_parse_unary(ps);
+        arraymath_plan_oper(ps, AM_OP_MUL);
+        return;
+    }
+    arraymath_parse_primary(ps);
 }
 
+static void
+arraymath_parse_term(ArrayMathParser *ps)
+{
+    arraymath_parse_unary(ps);
+    for (;;)
+    {
+        char c;
+
+        arraymath_parse_skip(ps);
+        c = *ps->p;
+        if (c != '*' && c != '/')
+            return;
+        ps->p++;
+        arraymath_parse_unary(ps);
+        arraymath_plan_oper(ps, c == '*' ? AM_OP_MUL : AM_OP_DIV);
+    }
+}
 
-static FmgrInfo* arraySortFmgrinfo;
+static void
+arraymath_parse_expr(ArrayMathParser *ps)
+{
+    arraymath_parse_term(ps);
+    for (;;)
+    {
+        char c;
+
+        arraymath_parse_skip(ps);
+        c = *ps->p;
+        if (c != '+' && c != '-')
+            return;
+        ps->p++;
+        arraymath_parse_term(ps);
+        arraymath_plan_oper(ps, c == '+' ? AM_OP_ADD : AM_OP_SUB);
+    }
+}
 
-static int
-arraySortCmp (const void *a, const void *b)
+/*
+* Compile an expression for an element type. Everything, including
+* the operator lookups, lives in a context of its own, so a plan that
+* is replaced can be thrown away whole. The context hangs off the
+* calling one until the expression has compiled, so one that fails to
+* parse goes away with the call rather than staying in parent.
+*/
+static ArrayMathPlan *
+arraymath_plan_compile(MemoryContext parent, const char *expr, Oid elmtype)
 {
-    int cmp;
-    Datum da = *((Datum*)a);
-    Datum db = *((Datum*)b);
+    MemoryContext mcxt, oldcontext;
+    ArrayMathPlan *plan;
+    ArrayMathParser ps;
+
+    mcxt = AllocSetContextCreate(CurrentMemoryContext, "arraymath plan", ALLOCSET_SMALL_SIZES);
+    oldcontext = MemoryContextSwitchTo(mcxt);
+
+    plan = palloc0(sizeof(ArrayMathPlan));
+    plan->mcxt = mcxt;
+    plan->expr = pstrdup(expr);
+    plan->elmtype = elmtype;
+    arraymath_typeinfo_from_type(elmtype, &plan->info);
+    plan->native = arraymath_native_type(elmtype, &plan->type);
+
+    /* The kernels only stand in for the built-in operator functions */
+    for (int i = 0; i < ARRAYMATH_PLAN_OPERS; i++)
+    {
+        const ArrayMathNativeOper *native;
+        char opstr[2] = { arraymath_plan_opchars[i], '\0' };
+        Oid rtype;
 
-    /* Do not try to sort if we don't have a cmp method */
-    if (!arraySortFmgrinfo) return 0;
+        arraymath_fmgrinfo_from_optype(opstr, elmtype, elmtype,
+                                       &plan->opers[i], &rtype, mcxt);
+        if (rtype != elmtype)
+        {
+            ereport(ERROR,
+                (errcode(ERRCODE_DATATYPE_MISMATCH),
+                 errmsg("operator %s for type %s does not return %s",
+                    opstr, format_type_be(elmtype), format_type_be(elmtype))));
+        }
 
-    /* Sort nulls to the start of the list */
-    if (! da) return -1;
-    if (! db) return  1;
+        native = arraymath_native_oper_lookup(plan->opers[i].fn_oid);
+        if (!native || native->op != (ArrayMathKernelOp) i || native->type != plan->type)
+            plan->native = false;
+    }
 
-    cmp = FunctionCall2(arraySortFmgrinfo, da, db);
-    return DatumGetInt32(cmp);
+    plan->maxsteps = 16;
+    plan->steps = palloc(sizeof(ArrayMathStep) * plan->maxsteps);
+
+    ps.plan = plan;
+    ps.expr = plan->expr;
+    ps.p = plan->expr;
+    ps.sp = 0;
+    arraymath_parse_expr(&ps);
+    arraymath_parse_skip(&ps);
+    if (*ps.p)
+        arraymath_parse_error(&ps, "Unexpected character");
+
+    MemoryContextSwitchTo(oldcontext);
+    MemoryContextSetParent(mcxt, parent);
+    return plan;
 }
 
-static int
-arrayRSortCmp (const void *a, const void *b)
+static ArrayMathPlan *
+arraymath_plan_get(ArrayMathCache *cache, const text *expr, Oid elmtype)
 {
-    return arraySortCmp(b, a);
-}
+    ArrayMathPlan *plan = cache->plan;
+    int len = VARSIZE_ANY_EXHDR(expr);
+    char *str;
 
+    if (plan && plan->elmtype == elmtype &&
+        (int) strlen(plan->expr) == len &&
+        memcmp(plan->expr, VARDATA_ANY(expr), len) == 0)
+    {
+        return plan;
+    }
 
-Datum array_sort(PG_FUNCTION_ARGS);
-PG_FUNCTION_INFO_V1(array_sort);
-Datum array_sort(PG_FUNCTION_ARGS)
-{
-    ArrayType *arr = PG_GETARG_ARRAYTYPE_P(0);
-    bool reverse = PG_GETARG_BOOL(1);
-    ArrayType *arrOut;
-    Oid elmtype = ARR_ELEMTYPE(arr);
-    TypeCacheEntry *typeCache = arraymath_typentry_from_type(elmtype, TYPECACHE_CMP_PROC_FINFO);
-    FmgrInfo cmpFmgrInfo = typeCache->cmp_proc_finfo;
+    if (plan)
+    {
+        cache->plan = NULL;
+        MemoryContextDelete(plan->mcxt);
+    }
 
-    int nelems;
-    Datum* elems;
-    bool* nulls;
+    str = text_to_cstring(expr);
+    cache->plan = arraymath_plan_compile(cache->mcxt, str, elmtype);
+    pfree(str);
+    return cache->plan;
+}
+
+/*
+* Run a plan over null-free native inputs, a chunk of elements at a
+* time. Inputs are read where they lie, intermediate results go into
+* one chunk-sized register per stack slot, and the last operator
+* writes straight into the output.
+*/
+#define ARRAYMATH_EVAL_CHUNK 256
 
-    int dims[1];
-    int lbs[1];
+typedef struct
+{
+    const char *ptr;
+    bool scalar;
+} ArrayMathOperand;
 
-    arraymath_check_type(elmtype);
+static void
+arraymath_eval_native(const ArrayMathPlan *plan, const char *inputs, int nelems, char *out)
+{
+    int size = arraymath_kernel_type_size[plan->type];
+    char *regs = palloc((Size) Max(plan->depth, 1) * ARRAYMATH_EVAL_CHUNK * size);
+    ArrayMathOperand *stack = palloc(sizeof(ArrayMathOperand) * Max(plan->depth, 1));
 
-    if (ARR_NDIM(arr) == 0)
-        PG_RETURN_ARRAYTYPE_P(arr);
+    for (int start = 0; start < nelems; start += ARRAYMATH_EVAL_CHUNK)
+    {
+        int n = Min(ARRAYMATH_EVAL_CHUNK, nelems - start);
+        char *dst = out + (Size) start * size;
+        int sp = 0;
 
-    if (ARR_NDIM(arr) > 1)
-        ereport(ERROR, (errmsg("only one-dimensional arrays are supported")));
+        for (int s = 0; s < plan->nsteps; s++)
+        {
+            const ArrayMathStep *step = &plan->steps[s];
+            ArrayMathOperand *l, *r;
+            ArrayMathKernelShape shape;
+            char *target;
+
+            switch (step->kind)
+            {
+                case ARRAYMATH_STEP_VAR:
+                    stack[sp].ptr = inputs + ((Size) step->var * nelems + start) * size;
+                    stack[sp].scalar = false;
+                    sp++;
+                    break;
+
+                case ARRAYMATH_STEP_CONST:
+                    stack[sp].ptr = (const char *) &step->native;
+                    stack[sp].scalar = true;
+                    sp++;
+                    break;
+
+                case ARRAYMATH_STEP_OPER:
+                    l = &stack[sp - 2];
+                    r = &stack[sp - 1];
+                    if (l->scalar)
+                        shape = AM_SHAPE_SCALAR_ARRAY;
+                    else if (r->scalar)
+                        shape = AM_SHAPE_ARRAY_SCALAR;
+                    else
+                        shape = AM_SHAPE_ARRAY_ARRAY;
+
+                    target = (s == plan->nsteps - 1) ? dst
+                        : regs + (Size) (sp - 2) * ARRAYMATH_EVAL_CHUNK * size;
+                    arraymath_kernel_error(
+                        arraymath_binary(shape, step->op, plan->type,
+                            l->ptr, r->ptr, target, n),
+                        plan->type);
+
+                    sp--;
+                    l->ptr = target;
+                    l->scalar = false;
+                    break;
+            }
+        }
 
-    nelems = (ARR_DIMS(arr))[0];
-    if (nelems == 0)
-        PG_RETURN_ARRAYTYPE_P(arr);
+        /* A plan with no operator at all is a single input or constant */
+        if (plan->steps[plan->nsteps - 1].kind != ARRAYMATH_STEP_OPER)
+        {
+            for (int i = 0; i < n; i++)
+                memcpy(dst + (Size) i * size, stack[0].scalar ? stack[0].ptr : stack[0].ptr + (Size) i * size, size);
+        }
+    }
+}
 
-    deconstruct_array(arr, elmtype,
-        typeCache->typlen, typeCache->typbyval, typeCache->typalign,
-        &elems, &nulls, &nelems);
+/*
+* Run a plan element by element through the operator functions, for
+* other types and for inputs with nulls. Any null operand gives null.
+*/
+static ArrayType *
+arraymath_eval_generic(ArrayMathPlan *plan, ArrayType *arr, int nelems)
+{
+    const ArrayMathTypeInfo *info = &plan->info;
+    Datum *elems, *values, *stack;
+    bool *nulls, *valnulls, *stacknulls;
+    int nitems;
+    int lbound = 1;
 
-    dims[0] = nelems;
-    lbs[0] = 1;
+    deconstruct_array(arr, plan->elmtype, info->typlen, info->typbyval, info->typalign,
+        &elems, &nulls, &nitems);
 
-    arraySortFmgrinfo = &cmpFmgrInfo;
-    if (reverse)
-        qsort(elems, nelems, sizeof(Datum), arrayRSortCmp);
-    else
-        qsort(elems, nelems, sizeof(Datum), arraySortCmp);
+    values = palloc(sizeof(Datum) * Max(nelems, 1));
+    valnulls = palloc(sizeof(bool) * Max(nelems, 1));
+    stack = palloc(sizeof(Datum) * Max(plan->depth, 1));
+    stacknulls = palloc(sizeof(bool) * Max(plan->depth, 1));
 
     for (int i = 0; i < nelems; i++)
     {
-        nulls[i] = (elems[i] == (Datum)0);
-    }
+        int sp = 0;
 
-    arrOut = construct_md_array(elems, nulls,
-        1, dims, lbs, elmtype,
-        typeCache->typlen, typeCache->typbyval, typeCache->typalign);
+        for (int s = 0; s < plan->nsteps; s++)
+        {
+            const ArrayMathStep *step = &plan->steps[s];
+
+            switch (step->kind)
+            {
+                case ARRAYMATH_STEP_VAR:
+                    stack[sp] = elems[step->var * nelems + i];
+                    stacknulls[sp] = nulls[step->var * nelems + i];
+                    sp++;
+                    break;
+
+                case ARRAYMATH_STEP_CONST:
+                    stack[sp] = step->value;
+                    stacknulls[sp] = false;
+                    sp++;
+                    break;
+
+                case ARRAYMATH_STEP_OPER:
+                    sp--;
+                    if (!stacknulls[sp - 1] && !stacknulls[sp])
+                    {
+                        stack[sp - 1] = FunctionCall2(&plan->opers[step->op],
+                            stack[sp - 1], stack[sp]);
+                    }
+                    stacknulls[sp - 1] |= stacknulls[sp];
+                    break;
+            }
+        }
+        values[i] = stack[0];
+        valnulls[i] = stacknulls[0];
+    }
 
-    PG_RETURN_ARRAYTYPE_P(arrOut);
+    return construct_md_array(values, valnulls, 1, &nelems, &lbound,
+        plan->elmtype, info->typlen, info->typbyval, info->typalign);
 }
 
-
 /*
-* Do average of an array
+* Evaluate an element-wise expression over the variadic arrays, which
+* arrive as the rows of one two-dimensional array: a is the first row,
+* b the second and so on. Called with plain values, each is an input
+* of one element.
 */
-Datum array_median(PG_FUNCTION_ARGS);
-PG_FUNCTION_INFO_V1(array_median);
-Datum
-array_median(PG_FUNCTION_ARGS)
+ARRAYMATH_TRACKED_FUNCTION(array_eval)
 {
-    Datum arrSorted = DirectFunctionCall2(array_sort,
-        PG_GETARG_DATUM(0), BoolGetDatum(false));
-    ArrayType *arr = DatumGetArrayTypeP(arrSorted);
+    text *expr = PG_GETARG_TEXT_PP(0);
+    ArrayType *arr = PG_GETARG_ARRAYTYPE_P(1);
     Oid elmtype = ARR_ELEMTYPE(arr);
-    TypeCacheEntry *typeCache = arraymath_typentry_from_type(elmtype, 0);
-    TypeCacheEntry *arrTypeCache = arraymath_typentry_from_type(get_fn_expr_argtype(fcinfo->flinfo, 0), 0);
-    size_t nelems;
-
-    Datum v0, v1;
-    FmgrInfo castfmgrinfo;
-    bool isnull;
-    int idx[1];
+    ArrayMathPlan *plan;
+    ArrayType *arrOut;
+    int ninputs, nelems;
 
     arraymath_check_type(elmtype);
+    arraymath_track_array(PG_GETARG_DATUM(1), arr);
+    plan = arraymath_plan_get(arraymath_cache_get(fcinfo), expr, elmtype);
 
-    if ((!arr) || ARR_NDIM(arr) == 0)
-        PG_RETURN_NULL();
+    switch (ARR_NDIM(arr))
+    {
+        case 0:
+            ninputs = 0;
+            nelems = 0;
+            break;
+        case 1:
+            ninputs = ARR_DIMS(arr)[0];
+            nelems = 1;
+            break;
+        case 2:
+            ninputs = ARR_DIMS(arr)[0];
+            nelems = ARR_DIMS(arr)[1];
+            break;
+        default:
+            ereport(ERROR, (errmsg("array_eval inputs must be one-dimensional arrays")));
+    }
 
-    if (ARR_NDIM(arr) > 1)
-        ereport(ERROR, (errmsg("only one-dimensional arrays are supported")));
+    if (plan->nvars > ninputs)
+    {
+        ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("array expression refers to input \"%c\", but only %d inputs were given",
+                'a' + plan->nvars - 1, ninputs)));
+    }
 
-    nelems = (ARR_DIMS(arr))[0];
     if (nelems == 0)
-        PG_RETURN_NULL();
+        PG_RETURN_ARRAYTYPE_P(construct_empty_array(elmtype));
 
-    arraymath_fmgrinfo_from_cast(elmtype, FLOAT8OID, &castfmgrinfo);
-
-    /* Odd number of elements */
-    if (nelems % 2)
-    {
-        idx[0] = (nelems + 1) / 2;
-        v0 = array_get_element(arrSorted, 1, idx, arrTypeCache->typlen,
-            typeCache->typlen, typeCache->typbyval, typeCache->typalign,
-            &isnull);
-        PG_RETURN_DATUM(FunctionCall1(&castfmgrinfo, v0));
-    }
-    else
-    {
-        float8 f0, f1, median;
-        idx[0] = (nelems / 2) + 1;
-        v0 = array_get_element(arrSorted, 1, idx, arrTypeCache->typlen,
-            typeCache->typlen, typeCache->typbyval, typeCache->typalign,
-            &isnull);
-        idx[0] = (nelems / 2);
-        v1 = array_get_element(arrSorted, 1, idx, arrTypeCache->typlen,
-            typeCache->typlen, typeCache->typbyval, typeCache->typalign,
-            &isnull);
-        f0 = DatumGetFloat8(FunctionCall1(&castfmgrinfo, v0));
-        f1 = DatumGetFloat8(FunctionCall1(&castfmgrinfo, v1));
-        median = (f0 + f1) / 2.0;
-        PG_RETURN_FLOAT8(median);
+    if (plan->native && !arraymath_has_nulls(arr))
+    {
+        arrOut = arraymath_new_array(&plan->info, nelems, false);
+        arraymath_eval_native(plan, ARR_DATA_PTR(arr), nelems, ARR_DATA_PTR(arrOut));
+    }
+    else
+    {
+        arrOut = arraymath_eval_generic(plan, arr, nelems);
     }
+
+    PG_RETURN_ARRAYTYPE_P(arrOut);
 }
@@ -0,0 +1,2426 @@
+/***********************************************************************
+ *
+ * Project:  Array Math
+ * Purpose:  Native element kernels for the built-in numeric types.
+ *
+ ***********************************************************************
+ * Copyright 2012 Paul Ramsey <pramsey@cleverelephant.ca>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ ***********************************************************************/
+
+#ifndef FRONTEND
+#include <postgres.h>
+#else
+#include <postgres_fe.h>
+#endif
+
+#include <math.h>
+#include <common/int.h>
+#include <port/pg_bitutils.h>
+#include <port/pg_bswap.h>
+
+#ifndef WIN32
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+#include "arraymath_kernels.h"
+
+/*
+* The element kernels and their dispatch table can be built again
+* with a wider instruction set enabled, by a wrapper file that names
+* the variant in ARRAYMATH_KERNELS_VARIANT and includes this one.
+* Everything else is only built once, in the plain scalar version.
+*/
+#define AM_CONCAT_(a, b) a##b
+#define AM_CONCAT(a, b) AM_CONCAT_(a, b)
+
+#ifdef ARRAYMATH_KERNELS_VARIANT
+#define AM_KERNELS_TABLE AM_CONCAT(arraymath_kernels_, ARRAYMATH_KERNELS_VARIANT)
+#define AM_KERNELS_NAME CppAsString2(ARRAYMATH_KERNELS_VARIANT)
+#else
+#define AM_KERNELS_TABLE arraymath_kernels_scalar
+#define AM_KERNELS_NAME "scalar"
+#endif
+
+
+/**********************************************************************
+* Kernel generators
+*/
+
+/*
+* Build the array/array, array/scalar and scalar/array versions of
+* a kernel from a single loop body. The body sees the operands as
+* x and y, writes out[i], and ORs any problems into status. Flags
+* are accumulated rather than returned early wherever possible, so
+* the loops stay free of branches and the compiler can vectorize.
+*/
+#define AM_BINARY_KERNEL(name, intype, outtype, body) \
+static ArrayMathStatus \
+name##_aa(const void *va, const void *vb, void *vout, int n) \
+{ \
+    const intype *a = (const intype *) va; \
+    const intype *b = (const intype *) vb; \
+    outtype *out = (outtype *) vout; \
+    ArrayMathStatus status = AM_OK; \
+    for (int i = 0; i < n; i++) \
+    { \
+        intype x = a[i]; \
+        intype y = b[i]; \
+        body \
+    } \
+    return status; \
+} \
+static ArrayMathStatus \
+name##_as(const void *va, const void *vb, void *vout, int n) \
+{ \
+    const intype *a = (const intype *) va; \
+    const intype y = *((const intype *) vb); \
+    outtype *out = (outtype *) vout; \
+    ArrayMathStatus status = AM_OK; \
+    for (int i = 0; i < n; i++) \
+    { \
+        intype x = a[i]; \
+        body \
+    } \
+    return status; \
+} \
+static ArrayMathStatus \
+name##_sa(const void *va, const void *vb, void *vout, int n) \
+{ \
+    const intype x = *((const intype *) va); \
+    const intype *b = (const intype *) vb; \
+    outtype *out = (outtype *) vout; \
+    ArrayMathStatus status = AM_OK; \
+    for (int i = 0; i < n; i++) \
+    { \
+        intype y = b[i]; \
+        body \
+    } \
+    return status; \
+}
+
+#define AM_FLAG(cond, flag) ((cond) ? (flag) : AM_OK)
+
+/* isinf() may return the sign, so normalize for bitwise use */
+#define AM_ISINF(v) (isinf(v) != 0)
+#define AM_ISNAN(v) (isnan(v) != 0)
+
+/*
+* int2 and int4 do their arithmetic one size up, where it cannot
+* overflow, and check that the result still fits.
+*/
+#define AM_NARROW_INT_KERNELS(T, ctype, wide, minval, maxval) \
+AM_BINARY_KERNEL(add_##T, ctype, ctype, { \
+    wide r = (wide) x + (wide) y; \
+    out[i] = (ctype) r; \
+    status |= AM_FLAG(r < (minval) || r > (maxval), AM_ERR_OVERFLOW); \
+}) \
+AM_BINARY_KERNEL(sub_##T, ctype, ctype, { \
+    wide r = (wide) x - (wide) y; \
+    out[i] = (ctype) r; \
+    status |= AM_FLAG(r < (minval) || r > (maxval), AM_ERR_OVERFLOW); \
+}) \
+AM_BINARY_KERNEL(mul_##T, ctype, ctype, { \
+    wide r = (wide) x * (wide) y; \
+    out[i] = (ctype) r; \
+    status |= AM_FLAG(r < (minval) || r > (maxval), AM_ERR_OVERFLOW); \
+}) \
+AM_BINARY_KERNEL(div_##T, ctype, ctype, { \
+    /* MIN / -1 is the one quotient that does not fit */ \
+    wide r = (y == 0) ? 0 : (wide) x / (wide) y; \
+    out[i] = (ctype) r; \
+    status |= AM_FLAG(y == 0, AM_ERR_DIVIDE_BY_ZERO); \
+    status |= AM_FLAG(r > (maxval), AM_ERR_OVERFLOW); \
+})
+
+/*
+* int8 has nothing wider to work in, so use the sign tricks for
+* addition and subtraction, and the overflow builtins otherwise.
+*/
+#define AM_INT8_KERNELS(T, ctype) \
+AM_BINARY_KERNEL(add_##T, ctype, ctype, { \
+    ctype r = (ctype) ((uint64) x + (uint64) y); \
+    out[i] = r; \
+    status |= AM_FLAG(((x ^ r) & (y ^ r)) < 0, AM_ERR_OVERFLOW); \
+}) \
+AM_BINARY_KERNEL(sub_##T, ctype, ctype, { \
+    ctype r = (ctype) ((uint64) x - (uint64) y); \
+    out[i] = r; \
+    status |= AM_FLAG(((x ^ y) & (x ^ r)) < 0, AM_ERR_OVERFLOW); \
+}) \
+AM_BINARY_KERNEL(mul_##T, ctype, ctype, { \
+    ctype r; \
+    status |= AM_FLAG(pg_mul_s64_overflow(x, y, &r), AM_ERR_OVERFLOW); \
+    out[i] = r; \
+}) \
+AM_BINARY_KERNEL(div_##T, ctype, ctype, { \
+    if (y == -1) \
+    { \
+        status |= AM_FLAG(x == PG_INT64_MIN, AM_ERR_OVERFLOW); \
+        out[i] = (ctype) (0 - (uint64) x); \
+    } \
+    else \
+    { \
+        status |= AM_FLAG(y == 0, AM_ERR_DIVIDE_BY_ZERO); \
+        out[i] = (y == 0) ? 0 : x / y; \
+    } \
+})
+
+#define AM_INT_COMPARE_KERNELS(T, ctype) \
+AM_BINARY_KERNEL(eq_##T, ctype, bool, { out[i] = (x == y); }) \
+AM_BINARY_KERNEL(lt_##T, ctype, bool, { out[i] = (x < y); }) \
+AM_BINARY_KERNEL(gt_##T, ctype, bool, { out[i] = (x > y); }) \
+AM_BINARY_KERNEL(le_##T, ctype, bool, { out[i] = (x <= y); }) \
+AM_BINARY_KERNEL(ge_##T, ctype, bool, { out[i] = (x >= y); })
+
+/*
+* Floating point follows utils/float.h: an infinite result from
+* finite inputs is an overflow, a zero result from non-zero inputs
+* is an underflow, and division by zero is an error unless the
+* dividend is NaN.
+*/
+#define AM_FLOAT_KERNELS(T, ctype) \
+AM_BINARY_KERNEL(add_##T, ctype, ctype, { \
+    ctype r = x + y; \
+    out[i] = r; \
+    status |= AM_FLAG(AM_ISINF(r) & !AM_ISINF(x) & !AM_ISINF(y), AM_ERR_OVERFLOW); \
+}) \
+AM_BINARY_KERNEL(sub_##T, ctype, ctype, { \
+    ctype r = x - y; \
+    out[i] = r; \
+    status |= AM_FLAG(AM_ISINF(r) & !AM_ISINF(x) & !AM_ISINF(y), AM_ERR_OVERFLOW); \
+}) \
+AM_BINARY_KERNEL(mul_##T, ctype, ctype, { \
+    ctype r = x * y; \
+    out[i] = r; \
+    status |= AM_FLAG(AM_ISINF(r) & !AM_ISINF(x) & !AM_ISINF(y), AM_ERR_OVERFLOW); \
+    status |= AM_FLAG((r == 0) & (x != 0) & (y != 0), AM_ERR_UNDERFLOW); \
+}) \
+AM_BINARY_KERNEL(div_##T, ctype, ctype, { \
+    ctype r = x / y; \
+    out[i] = r; \
+    status |= AM_FLAG((y == 0) & !AM_ISNAN(x), AM_ERR_DIVIDE_BY_ZERO); \
+    status |= AM_FLAG(AM_ISINF(r) & !AM_ISINF(x), AM_ERR_OVERFLOW); \
+    status |= AM_FLAG((r == 0) & (x != 0) & !AM_ISINF(y), AM_ERR_UNDERFLOW); \
+})
+
+/*
+* Float comparisons follow float8_cmp_internal, where NaN equals
+* NaN and sorts above every other value.
+*/
+#define AM_FLOAT_COMPARE_KERNELS(T, ctype) \
+AM_BINARY_KERNEL(eq_##T, ctype, bool, { \
+    out[i] = (x == y) | (AM_ISNAN(x) & AM_ISNAN(y)); \
+}) \
+AM_BINARY_KERNEL(lt_##T, ctype, bool, { \
+    out[i] = (x < y) | (!AM_ISNAN(x) & AM_ISNAN(y)); \
+}) \
+AM_BINARY_KERNEL(gt_##T, ctype, bool, { \
+    out[i] = (x > y) | (AM_ISNAN(x) & !AM_ISNAN(y)); \
+}) \
+AM_BINARY_KERNEL(le_##T, ctype, bool, { \
+    out[i] = !((x > y) | (AM_ISNAN(x) & !AM_ISNAN(y))); \
+}) \
+AM_BINARY_KERNEL(ge_##T, ctype, bool, { \
+    out[i] = !((x < y) | (!AM_ISNAN(x) & AM_ISNAN(y))); \
+})
+
+
+/*
+* Build a vector kernel from a body that folds x = a[i] and y = b[i]
+* into up to three sums. Each sum is kept in AM_LANES independent
+* partial sums, so the compiler can keep a vector register of them
+* without having to reorder floating point additions itself.
+*/
+#define AM_LANES 8
+
+#define AM_VECTOR_KERNEL(name, ctype, body) \
+static void \
+name(const void *va, const void *vb, int n, float8 *out) \
+{ \
+    const ctype *a = (const ctype *) va; \
+    const ctype *b = (const ctype *) vb; \
+    float8 s0[AM_LANES] = {0}, s1[AM_LANES] = {0}, s2[AM_LANES] = {0}; \
+    int i = 0; \
+    for (; i + AM_LANES <= n; i += AM_LANES) \
+    { \
+        for (int k = 0; k < AM_LANES; k++) \
+        { \
+            float8 x = (float8) a[i + k]; \
+            float8 y = (float8) b[i + k]; \
+            body(x, y, s0[k], s1[k], s2[k]); \
+        } \
+    } \
+    for (; i < n; i++) \
+    { \
+        float8 x = (float8) a[i]; \
+        float8 y = (float8) b[i]; \
+        body(x, y, s0[0], s1[0], s2[0]); \
+    } \
+    out[0] = am_lanes_sum(s0); \
+    out[1] = am_lanes_sum(s1); \
+    out[2] = am_lanes_sum(s2); \
+}
+
+static inline float8
+am_lanes_sum(const float8 *s)
+{
+    return ((s[0] + s[1]) + (s[2] + s[3])) + ((s[4] + s[5]) + (s[6] + s[7]));
+}
+
+#define AM_VEC_DOT_BODY(x, y, s0, s1, s2)    ((s0) += (x) * (y))
+#define AM_VEC_L1_BODY(x, y, s0, s1, s2)     ((s0) += fabs((x) - (y)))
+#define AM_VEC_L2_BODY(x, y, s0, s1, s2)     ((s0) += ((x) - (y)) * ((x) - (y)))
+#define AM_VEC_COSINE_BODY(x, y, s0, s1, s2) \
+    ((s0) += (x) * (y), (s1) += (x) * (x), (s2) += (y) * (y))
+#define AM_VEC_NORM_BODY(x, y, s0, s1, s2)   ((void) (y), (s0) += (x) * (x))
+
+#define AM_VECTOR_KERNELS(T, ctype) \
+AM_VECTOR_KERNEL(vdot_##T, ctype, AM_VEC_DOT_BODY) \
+AM_VECTOR_KERNEL(vl1_##T, ctype, AM_VEC_L1_BODY) \
+AM_VECTOR_KERNEL(vl2_##T, ctype, AM_VEC_L2_BODY) \
+AM_VECTOR_KERNEL(vcosine_##T, ctype, AM_VEC_COSINE_BODY) \
+AM_VECTOR_KERNEL(vnorm_##T, ctype, AM_VEC_NORM_BODY)
+
+/*
+* Build a unary kernel from a loop body that sees in[i] as x. The
+* arguments are copied in first, so the loop reads them from
+* registers rather than through a pointer out[] might alias.
+*/
+#define AM_UNARY_KERNEL(name, intype, outtype, body) \
+static ArrayMathStatus \
+name(const void *vin, const ArrayMathUnaryArgs *vargs, void *vout, int n) \
+{ \
+    const intype *in = (const intype *) vin; \
+    const ArrayMathUnaryArgs args = *vargs; \
+    outtype *out = (outtype *) vout; \
+    ArrayMathStatus status = AM_OK; \
+    (void) args; \
+    for (int i = 0; i < n; i++) \
+    { \
+        intype x = in[i]; \
+        body \
+    } \
+    return status; \
+}
+
+/*
+* Build a mask kernel from a comparison of x = a[i] with the single
+* value y: bit i of the mask is set where it holds, and the kernel
+* returns how many bits it set. The comparisons of each 64 elements
+* go to a byte apiece first, so they vectorize, and the bytes are
+* then packed eight at a time with a multiply that gathers the low
+* bit of each byte into the top byte of the product.
+*/
+#ifdef WORDS_BIGENDIAN
+#define AM_MASK_BYTES(v) pg_bswap64(v)
+#else
+#define AM_MASK_BYTES(v) (v)
+#endif
+
+#define AM_MASK_PACK UINT64CONST(0x0102040810204080)
+
+#define AM_MASK_KERNEL(name, ctype, cmp) \
+static int \
+name(const void *va, const void *vb, uint64 *bits, int n) \
+{ \
+    const ctype *a = (const ctype *) va; \
+    const ctype y = *((const ctype *) vb); \
+    int count = 0; \
+    for (int w = 0; w * 64 < n; w++) \
+    { \
+        const ctype *aw = a + w * 64; \
+        int chunk = Min(64, n - w * 64); \
+        uint8 m[64]; \
+        uint64 word = 0; \
+        int j; \
+        for (j = 0; j < chunk; j++) \
+        { \
+            ctype x = aw[j]; \
+            m[j] = (cmp); \
+        } \
+        for (; j < 64; j++) \
+            m[j] = 0; \
+        for (j = 0; j < 64; j += 8) \
+        { \
+            uint64 v; \
+            memcpy(&v, m + j, sizeof(v)); \
+            word |= ((AM_MASK_BYTES(v) * AM_MASK_PACK) >> 56) << j; \
+        } \
+        bits[w] = word; \
+        count += pg_popcount64(word); \
+    } \
+    return count; \
+}
+
+#define AM_INT_MASK_KERNELS(T, ctype) \
+AM_MASK_KERNEL(mask_eq_##T, ctype, x == y) \
+AM_MASK_KERNEL(mask_lt_##T, ctype, x < y) \
+AM_MASK_KERNEL(mask_gt_##T, ctype, x > y) \
+AM_MASK_KERNEL(mask_le_##T, ctype, x <= y) \
+AM_MASK_KERNEL(mask_ge_##T, ctype, x >= y)
+
+/* As AM_FLOAT_COMPARE_KERNELS, NaN equal to NaN and above the rest */
+#define AM_FLOAT_MASK_KERNELS(T, ctype) \
+AM_MASK_KERNEL(mask_eq_##T, ctype, (x == y) | (AM_ISNAN(x) & AM_ISNAN(y))) \
+AM_MASK_KERNEL(mask_lt_##T, ctype, (x < y) | (!AM_ISNAN(x) & AM_ISNAN(y))) \
+AM_MASK_KERNEL(mask_gt_##T, ctype, (x > y) | (AM_ISNAN(x) & !AM_ISNAN(y))) \
+AM_MASK_KERNEL(mask_le_##T, ctype, !((x > y) | (AM_ISNAN(x) & !AM_ISNAN(y)))) \
+AM_MASK_KERNEL(mask_ge_##T, ctype, !((x < y) | (!AM_ISNAN(x) & AM_ISNAN(y))))
+
+/*
+* Build a matrix product kernel, out (m x n) = a (m x k) times
+* b (k x n), all row-major. The output is worked on a tile of rows
+* and columns at a time, kept in float8 while the whole of k streams
+* through it a block at a time, so the block of b stays in cache for
+* every row of the tile and the innermost loop runs along a row of b
+* and vectorizes. Each result is still summed over k in order. A
+* result that is infinite only flags an overflow if its row of a and
+* column of b are finite.
+*/
+#define AM_MATMUL_ROWS 16
+#define AM_MATMUL_COLS 256
+#define AM_MATMUL_DEPTH 128
+
+#define AM_MATMUL_KERNEL(name, ctype) \
+static ArrayMathStatus \
+name(const void *va, const void *vb, void *vout, int m, int k, int n, bool *inf) \
+{ \
+    const ctype *a = (const ctype *) va; \
+    const ctype *b = (const ctype *) vb; \
+    ctype *out = (ctype *) vout; \
+    ArrayMathStatus status = AM_OK; \
+    float8 tile[AM_MATMUL_ROWS][AM_MATMUL_COLS]; \
+    bool *ainf = inf; \
+    bool *binf = inf + m; \
+    /* An infinite result is only an overflow if its row and column are finite */ \
+    for (int i = 0; i < m; i++) \
+    { \
+        bool rowinf = false; \
+        for (int p = 0; p < k; p++) \
+            rowinf |= AM_ISINF(a[(Size) i * k + p]); \
+        ainf[i] = rowinf; \
+    } \
+    for (int j = 0; j < n; j++) \
+        binf[j] = false; \
+    for (int p = 0; p < k; p++) \
+        for (int j = 0; j < n; j++) \
+            binf[j] |= AM_ISINF(b[(Size) p * n + j]); \
+    for (int i0 = 0; i0 < m; i0 += AM_MATMUL_ROWS) \
+    { \
+        int rows = Min(AM_MATMUL_ROWS, m - i0); \
+        for (int j0 = 0; j0 < n; j0 += AM_MATMUL_COLS) \
+        { \
+            int cols = Min(AM_MATMUL_COLS, n - j0); \
+            for (int i = 0; i < rows; i++) \
+                for (int j = 0; j < cols; j++) \
+                    tile[i][j] = 0; \
+            for (int k0 = 0; k0 < k; k0 += AM_MATMUL_DEPTH) \
+            { \
+                int depth = Min(AM_MATMUL_DEPTH, k - k0); \
+                for (int i = 0; i < rows; i++) \
+                { \
+                    const ctype *arow = a + (Size) (i0 + i) * k + k0; \
+                    float8 *trow = tile[i]; \
+                    for (int p = 0; p < depth; p++) \
+                    { \
+                        const ctype *brow = b + (Size) (k0 + p) * n + j0; \
+                        float8 x = arow[p]; \
+                        for (int j = 0; j < cols; j++) \
+                            trow[j] += x * (float8) brow[j]; \
+                    } \
+                } \
+            } \
+            for (int i = 0; i < rows; i++) \
+            { \
+                ctype *orow = out + (Size) (i0 + i) * n + j0; \
+                for (int j = 0; j < cols; j++) \
+                { \
+                    orow[j] = (ctype) tile[i][j]; \
+                    status |= AM_FLAG(AM_ISINF(orow[j]) & !ainf[i0 + i] & !binf[j0 + j], \
+                                      AM_ERR_OVERFLOW); \
+                } \
+            } \
+        } \
+    } \
+    return status; \
+}
+
+/*
+* Round an integer to a power of ten, half away from zero as
+* round(numeric, int) does, noting whether the result fits.
+*/
+static inline int64
+am_round_int(int64 x, int digits, bool *overflow)
+{
+    uint64 ux = (x < 0) ? (uint64) 0 - (uint64) x : (uint64) x;
+    uint64 scale = 1, q, m;
+
+    if (digits >= 0)
+        return x;
+
+    /* Past 10^19 every int64 rounds to 0, or out of range */
+    if (digits < -19)
+        return 0;
+    for (int d = digits; d < 0; d++)
+        scale *= 10;
+
+    q = ux / scale;
+    if (ux % scale >= scale - ux % scale)
+        q++;
+    if (q > PG_UINT64_MAX / scale)
+    {
+        *overflow = true;
+        return 0;
+    }
+    m = q * scale;
+    if (m > (uint64) PG_INT64_MAX + (x < 0))
+    {
+        *overflow = true;
+        return 0;
+    }
+    return (x < 0) ? (int64) ((uint64) 0 - m) : (int64) m;
+}
+
+/*
+* Integers: abs overflows only at the most negative value, and
+* round only to a negative number of digits changes anything.
+*/
+#define AM_INT_UNARY_KERNELS(T, ctype, field, minval, maxval) \
+AM_UNARY_KERNEL(abs_##T, ctype, ctype, { \
+    out[i] = (ctype) ((x < 0) ? (uint64) 0 - (uint64) x : (uint64) x); \
+    status |= AM_FLAG(x == (minval), AM_ERR_OVERFLOW); \
+}) \
+AM_UNARY_KERNEL(round_##T, ctype, ctype, { \
+    bool overflow = false; \
+    int64 r = am_round_int(x, args.digits, &overflow); \
+    out[i] = (ctype) r; \
+    status |= AM_FLAG(overflow | (r < (minval)) | (r > (maxval)), AM_ERR_OVERFLOW); \
+}) \
+AM_UNARY_KERNEL(clamp_##T, ctype, ctype, { \
+    ctype r = (x < args.lo.field) ? args.lo.field : x; \
+    out[i] = (r > args.hi.field) ? args.hi.field : r; \
+})
+
+/*
+* Floats: round works in float8 like round(float8), to even on a
+* tie, scaling by 10^|digits| first. Values too large to have any
+* fraction at that many digits are left alone. Clamp orders NaN
+* above everything else.
+*/
+#define AM_FLOAT8_INTEGRAL 4503599627370496.0   /* 2^52 */
+
+#define AM_FLOAT_UNARY_KERNELS(T, ctype, field) \
+AM_UNARY_KERNEL(abs_##T, ctype, ctype, { \
+    out[i] = (ctype) fabs(x); \
+}) \
+AM_UNARY_KERNEL(round_##T, ctype, ctype, { \
+    float8 v = (float8) x; \
+    float8 r; \
+    if (args.digits < 0) \
+        r = rint(v / args.scale) * args.scale; \
+    else if (fabs(v) * args.scale < AM_FLOAT8_INTEGRAL) \
+        r = rint(v * args.scale) / args.scale; \
+    else \
+        r = v; \
+    out[i] = (ctype) r; \
+    status |= AM_FLAG(AM_ISINF(out[i]) & !AM_ISINF(x), AM_ERR_OVERFLOW); \
+}) \
+AM_UNARY_KERNEL(clamp_##T, ctype, ctype, { \
+    ctype lo = args.lo.field; \
+    ctype hi = args.hi.field; \
+    ctype r = ((lo > x) | (AM_ISNAN(lo) & !AM_ISNAN(x))) ? lo : x; \
+    out[i] = ((r > hi) | (AM_ISNAN(r) & !AM_ISNAN(hi))) ? hi : r; \
+})
+
+/*
+* sqrt, exp, ln and pow of any native type are taken in float8,
+* with the checks float.c makes in the functions of those names.
+*/
+#define AM_FLOAT8_UNARY_KERNELS(T, ctype) \
+AM_UNARY_KERNEL(sqrt_##T, ctype, float8, { \
+    float8 v = (float8) x; \
+    out[i] = sqrt(v); \
+    status |= AM_FLAG(v < 0, AM_ERR_SQRT_NEGATIVE); \
+}) \
+AM_UNARY_KERNEL(exp_##T, ctype, float8, { \
+    float8 v = (float8) x; \
+    float8 r = exp(v); \
+    out[i] = r; \
+    status |= AM_FLAG(AM_ISINF(r) & !AM_ISINF(v), AM_ERR_OVERFLOW); \
+    status |= AM_FLAG((r == 0) & !AM_ISINF(v), AM_ERR_UNDERFLOW); \
+}) \
+AM_UNARY_KERNEL(ln_##T, ctype, float8, { \
+    float8 v = (float8) x; \
+    out[i] = log(v); \
+    status |= AM_FLAG(v == 0, AM_ERR_LOG_ZERO); \
+    status |= AM_FLAG(v < 0, AM_ERR_LOG_NEGATIVE); \
+}) \
+AM_UNARY_KERNEL(pow_##T, ctype, float8, { \
+    float8 v = (float8) x; \
+    float8 p = args.exponent; \
+    float8 r = pow(v, p); \
+    bool finite = !AM_ISINF(v) & !AM_ISINF(p); \
+    out[i] = r; \
+    status |= AM_FLAG((v == 0) & (p < 0), AM_ERR_POWER_ZERO); \
+    status |= AM_FLAG((v < 0) & !AM_ISNAN(p) & (floor(p) != p), AM_ERR_POWER_COMPLEX); \
+    status |= AM_FLAG(AM_ISINF(r) & finite & (v != 0), AM_ERR_OVERFLOW); \
+    status |= AM_FLAG((r == 0) & finite & (v != 0), AM_ERR_UNDERFLOW); \
+})
+
+
+
+/**********************************************************************
+* Kernels
+*/
+
+AM_NARROW_INT_KERNELS(int2, int16, int32, PG_INT16_MIN, PG_INT16_MAX)
+AM_INT_COMPARE_KERNELS(int2, int16)
+
+AM_NARROW_INT_KERNELS(int4, int32, int64, PG_INT32_MIN, PG_INT32_MAX)
+AM_INT_COMPARE_KERNELS(int4, int32)
+
+AM_INT8_KERNELS(int8, int64)
+AM_INT_COMPARE_KERNELS(int8, int64)
+
+AM_FLOAT_KERNELS(float4, float4)
+AM_FLOAT_COMPARE_KERNELS(float4, float4)
+
+AM_FLOAT_KERNELS(float8, float8)
+AM_FLOAT_COMPARE_KERNELS(float8, float8)
+
+AM_VECTOR_KERNELS(int2, int16)
+AM_VECTOR_KERNELS(int4, int32)
+AM_VECTOR_KERNELS(int8, int64)
+AM_VECTOR_KERNELS(float4, float4)
+AM_VECTOR_KERNELS(float8, float8)
+
+AM_INT_UNARY_KERNELS(int2, int16, i2, PG_INT16_MIN, PG_INT16_MAX)
+AM_INT_UNARY_KERNELS(int4, int32, i4, PG_INT32_MIN, PG_INT32_MAX)
+AM_INT_UNARY_KERNELS(int8, int64, i8, PG_INT64_MIN, PG_INT64_MAX)
+AM_FLOAT_UNARY_KERNELS(float4, float4, f4)
+AM_FLOAT_UNARY_KERNELS(float8, float8, f8)
+
+AM_FLOAT8_UNARY_KERNELS(int2, int16)
+AM_FLOAT8_UNARY_KERNELS(int4, int32)
+AM_FLOAT8_UNARY_KERNELS(int8, int64)
+AM_FLOAT8_UNARY_KERNELS(float4, float4)
+AM_FLOAT8_UNARY_KERNELS(float8, float8)
+
+AM_INT_MASK_KERNELS(int2, int16)
+AM_INT_MASK_KERNELS(int4, int32)
+AM_INT_MASK_KERNELS(int8, int64)
+AM_FLOAT_MASK_KERNELS(float4, float4)
+AM_FLOAT_MASK_KERNELS(float8, float8)
+
+AM_MATMUL_KERNEL(matmul_float4, float4)
+AM_MATMUL_KERNEL(matmul_float8, float8)
+
+
+/**********************************************************************
+* Dispatch tables
+*/
+
+#ifndef ARRAYMATH_KERNELS_VARIANT
+const int arraymath_kernel_type_size[AM_TYPE_COUNT] = {
+    sizeof(int16),
+    sizeof(int32),
+    sizeof(int64),
+    sizeof(float4),
+    sizeof(float8)
+};
+#endif
+
+#define AM_TYPE_ROW(op, shape) \
+    { op##_int2_##shape, op##_int4_##shape, op##_int8_##shape, op##_float4_##shape, op##_float8_##shape }
+
+#define AM_OP_TABLE(shape) \
+    { \
+        AM_TYPE_ROW(add, shape), \
+        AM_TYPE_ROW(sub, shape), \
+        AM_TYPE_ROW(mul, shape), \
+        AM_TYPE_ROW(div, shape), \
+        AM_TYPE_ROW(eq, shape), \
+        AM_TYPE_ROW(lt, shape), \
+        AM_TYPE_ROW(gt, shape), \
+        AM_TYPE_ROW(le, shape), \
+        AM_TYPE_ROW(ge, shape) \
+    }
+
+#define AM_VECTOR_ROW(op) \
+    { v##op##_int2, v##op##_int4, v##op##_int8, v##op##_float4, v##op##_float8 }
+
+#define AM_VECTOR_TABLE \
+    { \
+        AM_VECTOR_ROW(dot), \
+        AM_VECTOR_ROW(l1), \
+        AM_VECTOR_ROW(l2), \
+        AM_VECTOR_ROW(cosine), \
+        AM_VECTOR_ROW(norm) \
+    }
+
+#define AM_UNARY_ROW(op) \
+    { op##_int2, op##_int4, op##_int8, op##_float4, op##_float8 }
+
+#define AM_UNARY_TABLE \
+    { \
+        AM_UNARY_ROW(abs), \
+        AM_UNARY_ROW(round), \
+        AM_UNARY_ROW(clamp), \
+        AM_UNARY_ROW(sqrt), \
+        AM_UNARY_ROW(exp), \
+        AM_UNARY_ROW(ln), \
+        AM_UNARY_ROW(pow) \
+    }
+
+#define AM_MASK_ROW(op) \
+    { mask_##op##_int2, mask_##op##_int4, mask_##op##_int8, mask_##op##_float4, mask_##op##_float8 }
+
+#define AM_MASK_TABLE \
+    { \
+        AM_MASK_ROW(eq), \
+        AM_MASK_ROW(lt), \
+        AM_MASK_ROW(gt), \
+        AM_MASK_ROW(le), \
+        AM_MASK_ROW(ge) \
+    }
+
+const ArrayMathKernels AM_KERNELS_TABLE = {
+    AM_KERNELS_NAME,
+    {
+        AM_OP_TABLE(aa),
+        AM_OP_TABLE(as),
+        AM_OP_TABLE(sa)
+    },
+    AM_VECTOR_TABLE,
+    AM_UNARY_TABLE,
+    AM_MASK_TABLE,
+    { NULL, NULL, NULL, matmul_float4, matmul_float8 }
+};
+
+
+#ifndef ARRAYMATH_KERNELS_VARIANT
+
+/**********************************************************************
+* Drivers
+*/
+
+/*
+* Apply a binary kernel over two arrays, producing as many outputs
+* as the longer one holds. The shorter input wraps back to its
+* start whenever it runs out, matching the element-by-element
+* operators. Single-element inputs use the scalar shapes so they
+* run as one long loop instead of many one-element calls.
+*/
+ArrayMathStatus
+arraymath_kernel_apply(const ArrayMathKernels *kernels,
+    ArrayMathKernelOp op, ArrayMathKernelType type,
+    const void *a, int na, const void *b, int nb, void *out)
+{
+    const char *pa = (const char *) a;
+    const char *pb = (const char *) b;
+    char *pout = (char *) out;
+    int elsize = arraymath_kernel_type_size[type];
+    int outsize = arraymath_kernel_out_size(op, type);
+    int n = Max(na, nb);
+    int i = 0, i1 = 0, i2 = 0;
+    ArrayMathStatus status = AM_OK;
+
+    if (nb == 1)
+        return kernels->binary[AM_SHAPE_ARRAY_SCALAR][op][type](a, b, out, na);
+
+    if (na == 1)
+        return kernels->binary[AM_SHAPE_SCALAR_ARRAY][op][type](a, b, out, nb);
+
+    while (i < n)
+    {
+        int chunk = Min(na - i1, nb - i2);
+
+        chunk = Min(chunk, n - i);
+        status |= kernels->binary[AM_SHAPE_ARRAY_ARRAY][op][type](
+            pa + (Size) i1 * elsize, pb + (Size) i2 * elsize,
+            pout + (Size) i * outsize, chunk);
+
+        i += chunk;
+        i1 += chunk;
+        i2 += chunk;
+        if (i1 == na) i1 = 0;
+        if (i2 == nb) i2 = 0;
+    }
+    return status;
+}
+
+
+/**********************************************************************
+* Sums
+*/
+
+void
+arraymath_sum_init(ArrayMathSumState *state, ArrayMathKernelType type)
+{
+    memset(state, 0, sizeof(ArrayMathSumState));
+    state->type = type;
+}
+
+/*
+* Integer chunks are summed into a local accumulator first, which
+* cannot overflow for anything that fits in one array, so the inner
+* loop is a plain widening add.
+*/
+#define AM_SUM_INT_LOOP(ctype, acctype) \
+    do { \
+        const ctype *v = (const ctype *) data; \
+        acctype acc = 0; \
+        for (int i = 0; i < n; i++) \
+            acc += v[i]; \
+        state->isum += acc; \
+    } while (0)
+
+/*
+* Floats use Neumaier's variant of Kahan summation, which also
+* holds up when the next value is larger than the running sum.
+* Infinities poison the compensation term, so note them and let
+* the plain sum speak for itself at the end.
+*/
+#define AM_SUM_FLOAT_LOOP(ctype) \
+    do { \
+        const ctype *v = (const ctype *) data; \
+        float8 sum = state->fsum; \
+        float8 comp = state->fcomp; \
+        bool inf = false; \
+        for (int i = 0; i < n; i++) \
+        { \
+            float8 x = (float8) v[i]; \
+            float8 t = sum + x; \
+            comp += (fabs(sum) >= fabs(x)) ? ((sum - t) + x) : ((x - t) + sum); \
+            sum = t; \
+            inf |= AM_ISINF(x); \
+        } \
+        state->fsum = sum; \
+        state->fcomp = comp; \
+        state->finf |= inf; \
+    } while (0)
+
+void
+arraymath_sum_accum(ArrayMathSumState *state, const void *data, int n)
+{
+    state->count += n;
+
+    switch (state->type)
+    {
+        case AM_TYPE_INT2:
+            AM_SUM_INT_LOOP(int16, int64);
+            break;
+        case AM_TYPE_INT4:
+            AM_SUM_INT_LOOP(int32, int64);
+            break;
+        case AM_TYPE_INT8:
+#ifdef HAVE_INT128
+            AM_SUM_INT_LOOP(int64, int128);
+#else
+        {
+            const int64 *v = (const int64 *) data;
+            int64 acc = state->isum;
+            for (int i = 0; i < n; i++)
+            {
+                if (pg_add_s64_overflow(acc, v[i], &acc))
+                    state->status |= AM_ERR_OVERFLOW;
+            }
+            state->isum = acc;
+        }
+#endif
+            break;
+        case AM_TYPE_FLOAT4:
+            AM_SUM_FLOAT_LOOP(float4);
+            break;
+        case AM_TYPE_FLOAT8:
+            AM_SUM_FLOAT_LOOP(float8);
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+* Integer total, flagged as an overflow if it does not fit an int64.
+*/
+ArrayMathStatus
+arraymath_sum_int64(const ArrayMathSumState *state, int64 *result)
+{
+    if (state->status != AM_OK)
+        return state->status;
+#ifdef HAVE_INT128
+    if (state->isum < PG_INT64_MIN || state->isum > PG_INT64_MAX)
+        return AM_ERR_OVERFLOW;
+#endif
+    *result = (int64) state->isum;
+    return AM_OK;
+}
+
+/*
+* Total as a float8. Integer totals are simply converted, float
+* totals are an overflow if they went infinite from finite inputs.
+*/
+ArrayMathStatus
+arraymath_sum_float8(const ArrayMathSumState *state, float8 *result)
+{
+    float8 sum;
+
+    if (state->status != AM_OK)
+        return state->status;
+
+    if (state->type != AM_TYPE_FLOAT4 && state->type != AM_TYPE_FLOAT8)
+    {
+        *result = (float8) state->isum;
+        return AM_OK;
+    }
+
+    sum = state->fsum;
+    if (!isinf(sum) && !isnan(sum))
+        sum += state->fcomp;
+    else if (isinf(sum) && !state->finf)
+        return AM_ERR_OVERFLOW;
+
+    *result = sum;
+    return AM_OK;
+}
+
+/*
+* Fold the sum of a later run of values into state, as if state had
+* gone on to accumulate them itself. Float totals meet through one
+* more compensated add, so the same runs merged in the same order
+* always give the same answer.
+*/
+void
+arraymath_sum_merge(ArrayMathSumState *state, const ArrayMathSumState *part)
+{
+    float8 t = state->fsum + part->fsum;
+
+    state->fcomp += (fabs(state->fsum) >= fabs(part->fsum)) ?
+        ((state->fsum - t) + part->fsum) : ((part->fsum - t) + state->fsum);
+    state->fcomp += part->fcomp;
+    state->fsum = t;
+    state->finf |= part->finf;
+    state->count += part->count;
+    state->status |= part->status;
+#ifdef HAVE_INT128
+    state->isum += part->isum;
+#else
+    if (pg_add_s64_overflow(state->isum, part->isum, &state->isum))
+        state->status |= AM_ERR_OVERFLOW;
+#endif
+}
+
+
+/**********************************************************************
+* Null bitmaps
+*/
+
+int
+arraymath_bitmap_count(const uint8 *bitmap, int nitems)
+{
+    int nbytes = nitems / 8;
+    int count = (int) pg_popcount((const char *) bitmap, nbytes);
+
+    /* Trailing partial byte */
+    for (int i = nbytes * 8; i < nitems; i++)
+    {
+        if (bitmap[i / 8] & (1 << (i % 8)))
+            count++;
+    }
+    return count;
+}
+
+/*
+* nbits (1 to 64) bits of a bitmap starting at bit pos, first bit
+* lowest, reading no byte past the last bit wanted.
+*/
+static inline uint64
+am_bitmap_bits(const uint8 *bitmap, int pos, int nbits)
+{
+    const uint8 *p = bitmap + (pos >> 3);
+    int shift = pos & 7;
+    int nbytes = (shift + nbits + 7) >> 3;
+    uint64 word = 0;
+
+    for (int i = 0; i < Min(nbytes, 8); i++)
+        word |= (uint64) p[i] << (8 * i);
+    word >>= shift;
+    if (nbytes > 8)
+        word |= (uint64) p[8] << (64 - shift);
+
+    return nbits < 64 ? word & ((UINT64CONST(1) << nbits) - 1) : word;
+}
+
+uint64
+arraymath_bitmap_word(const uint8 *bitmap, int nitems, int *pos, int nbits)
+{
+    uint64 word = 0;
+    int got = 0;
+
+    while (got < nbits)
+    {
+        int take = Min(nbits - got, nitems - *pos);
+
+        if (bitmap)
+            word |= am_bitmap_bits(bitmap, *pos, take) << got;
+        else
+            word |= (take < 64 ? (UINT64CONST(1) << take) - 1 : ~UINT64CONST(0)) << got;
+
+        got += take;
+        *pos += take;
+        if (*pos == nitems)
+            *pos = 0;
+    }
+    return word;
+}
+
+void
+arraymath_bitmap_and(const uint8 *a, int na, const uint8 *b, int nb, uint8 *out, int n)
+{
+    int pa = 0, pb = 0;
+
+    for (int i = 0; i < n; i += 64)
+    {
+        int chunk = Min(64, n - i);
+        uint64 word = arraymath_bitmap_word(a, na, &pa, chunk) &
+                      arraymath_bitmap_word(b, nb, &pb, chunk);
+
+        for (int j = 0; j < (chunk + 7) / 8; j++)
+            out[i / 8 + j] = (uint8) (word >> (8 * j));
+    }
+}
+
+/*
+* The packed (null-free) values follow the input bitmap, so the
+* value index only moves on at a non-null input, and starts over
+* with the input at every wrap-around.
+*/
+#define AM_SPREAD(ctype) \
+    do { \
+        const ctype *in = (const ctype *) data; \
+        ctype *o = (ctype *) out; \
+        int inpos = 0, validpos = 0, p = 0, k = 0; \
+        for (int i = 0; i < n; i += 64) \
+        { \
+            int chunk = Min(64, n - i); \
+            uint64 inbits = arraymath_bitmap_word(bitmap, nitems, &inpos, chunk); \
+            uint64 validbits = arraymath_bitmap_word(valid, n, &validpos, chunk); \
+            for (int j = 0; j < chunk; j++) \
+            { \
+                o[i + j] = ((validbits >> j) & 1) ? in[k] : (ctype) 1; \
+                k += (int) ((inbits >> j) & 1); \
+                if (++p == nitems) \
+                    p = k = 0; \
+            } \
+        } \
+    } while (0)
+
+void
+arraymath_spread(ArrayMathKernelType type, const void *data, const uint8 *bitmap,
+                 int nitems, const uint8 *valid, int n, void *out)
+{
+    switch (type)
+    {
+        case AM_TYPE_INT2:   AM_SPREAD(int16); break;
+        case AM_TYPE_INT4:   AM_SPREAD(int32); break;
+        case AM_TYPE_INT8:   AM_SPREAD(int64); break;
+        case AM_TYPE_FLOAT4: AM_SPREAD(float4); break;
+        case AM_TYPE_FLOAT8: AM_SPREAD(float8); break;
+        default:
+            break;
+    }
+}
+
+int
+arraymath_compact(int size, const void *in, const uint8 *valid, int n, void *out)
+{
+    const char *src = (const char *) in;
+    char *dst = (char *) out;
+    int pos = 0, count = 0;
+
+    for (int i = 0; i < n; i += 64)
+    {
+        int chunk = Min(64, n - i);
+        uint64 bits = arraymath_bitmap_word(valid, n, &pos, chunk);
+        uint64 all = chunk < 64 ? (UINT64CONST(1) << chunk) - 1 : ~UINT64CONST(0);
+
+        /* Whole words of non-nulls go across in one copy */
+        if (bits == all)
+        {
+            memcpy(dst + (Size) count * size, src + (Size) i * size, (Size) chunk * size);
+            count += chunk;
+            continue;
+        }
+
+        while (bits)
+        {
+            int j = pg_rightmost_one_pos64(bits);
+            memcpy(dst + (Size) count * size, src + (Size) (i + j) * size, size);
+            count++;
+            bits &= bits - 1;
+        }
+    }
+    return count;
+}
+
+
+/**********************************************************************
+* Element-wise least / greatest
+*/
+
+#define AM_INT_GT(x, y)   ((x) > (y))
+#define AM_FLOAT_GT(x, y) (((x) > (y)) | (AM_ISNAN(x) & !AM_ISNAN(y)))
+
+#define AM_MINMAX_LOOP(ctype, gt) \
+    do { \
+        ctype *a = (ctype *) acc; \
+        const ctype *b = (const ctype *) in; \
+        if (greatest) \
+        { \
+            for (int i = 0; i < n; i++) \
+                a[i] = gt(b[i], a[i]) ? b[i] : a[i]; \
+        } \
+        else \
+        { \
+            for (int i = 0; i < n; i++) \
+                a[i] = gt(a[i], b[i]) ? b[i] : a[i]; \
+        } \
+    } while (0)
+
+void
+arraymath_minmax_native(ArrayMathKernelType type, void *acc, const void *in,
+    int n, bool greatest)
+{
+    switch (type)
+    {
+        case AM_TYPE_INT2:   AM_MINMAX_LOOP(int16, AM_INT_GT); break;
+        case AM_TYPE_INT4:   AM_MINMAX_LOOP(int32, AM_INT_GT); break;
+        case AM_TYPE_INT8:   AM_MINMAX_LOOP(int64, AM_INT_GT); break;
+        case AM_TYPE_FLOAT4: AM_MINMAX_LOOP(float4, AM_FLOAT_GT); break;
+        case AM_TYPE_FLOAT8: AM_MINMAX_LOOP(float8, AM_FLOAT_GT); break;
+        default:
+            break;
+    }
+}
+
+/**********************************************************************
+* Conversion
+*/
+
+#define AM_TO_FLOAT8_LOOP(ctype) \
+    do { \
+        const ctype *v = (const ctype *) data; \
+        for (int i = 0; i < n; i++) \
+            out[i] = (float8) v[i]; \
+    } while (0)
+
+void
+arraymath_to_float8(ArrayMathKernelType type, const void *data, int n, float8 *out)
+{
+    switch (type)
+    {
+        case AM_TYPE_INT2:   AM_TO_FLOAT8_LOOP(int16); break;
+        case AM_TYPE_INT4:   AM_TO_FLOAT8_LOOP(int32); break;
+        case AM_TYPE_INT8:   AM_TO_FLOAT8_LOOP(int64); break;
+        case AM_TYPE_FLOAT4: AM_TO_FLOAT8_LOOP(float4); break;
+        case AM_TYPE_FLOAT8: memcpy(out, data, sizeof(float8) * n); break;
+        default:
+            break;
+    }
+}
+
+
+/**********************************************************************
+* Selection
+*/
+
+/* Ranges this small are finished off with an insertion sort */
+#define AM_SELECT_SMALL 16
+
+static inline void
+am_swap(float8 *v, int i, int j)
+{
+    float8 t = v[i];
+    v[i] = v[j];
+    v[j] = t;
+}
+
+static void
+am_insertion_sort(float8 *v, int lo, int hi)
+{
+    for (int i = lo + 1; i <= hi; i++)
+    {
+        float8 x = v[i];
+        int j = i - 1;
+
+        while (j >= lo && v[j] > x)
+        {
+            v[j + 1] = v[j];
+            j--;
+        }
+        v[j + 1] = x;
+    }
+}
+
+static void
+am_sift_down(float8 *v, int root, int n)
+{
+    for (;;)
+    {
+        int child = 2 * root + 1;
+
+        if (child >= n)
+            break;
+        if (child + 1 < n && v[child + 1] > v[child])
+            child++;
+        if (v[root] >= v[child])
+            break;
+        am_swap(v, root, child);
+        root = child;
+    }
+}
+
+static void
+am_heap_sort(float8 *v, int n)
+{
+    for (int i = n / 2 - 1; i >= 0; i--)
+        am_sift_down(v, i, n);
+    for (int i = n - 1; i > 0; i--)
+    {
+        am_swap(v, 0, i);
+        am_sift_down(v, 0, i);
+    }
+}
+
+/*
+* Introselect: three-way quickselect around a median of three, only
+* descending into the sides that still hold a wanted rank, so all the
+* ranks share the partitioning work. Runs of equal values land in the
+* middle partition and are never looked at again. If the recursion
+* gets too deep the range is heap sorted instead, which bounds the
+* worst case at O(n log n).
+*/
+static void
+am_select(float8 *v, int lo, int hi, const int *ranks, int nranks, int depth)
+{
+    while (nranks > 0 && hi - lo >= AM_SELECT_SMALL)
+    {
+        int mid = lo + (hi - lo) / 2;
+        int lt = lo, gt = hi, i = lo;
+        int nleft, nmid;
+        float8 pivot;
+
+        if (depth-- == 0)
+        {
+            am_heap_sort(v + lo, hi - lo + 1);
+            return;
+        }
+
+        if (v[mid] < v[lo])
+            am_swap(v, lo, mid);
+        if (v[hi] < v[lo])
+            am_swap(v, lo, hi);
+        if (v[hi] < v[mid])
+            am_swap(v, mid, hi);
+        pivot = v[mid];
+
+        while (i <= gt)
+        {
+            if (v[i] < pivot)
+                am_swap(v, lt++, i++);
+            else if (v[i] > pivot)
+                am_swap(v, i, gt--);
+            else
+                i++;
+        }
+
+        /* Ranks below lt go left, ranks up to gt are done, the rest go right */
+        for (nleft = 0; nleft < nranks && ranks[nleft] < lt; nleft++)
+            ;
+        for (nmid = nleft; nmid < nranks && ranks[nmid] <= gt; nmid++)
+            ;
+
+        if (nleft > 0)
+            am_select(v, lo, lt - 1, ranks, nleft, depth);
+
+        ranks += nmid;
+        nranks -= nmid;
+        lo = gt + 1;
+    }
+
+    if (nranks > 0 && hi > lo)
+        am_insertion_sort(v, lo, hi);
+}
+
+void
+arraymath_select_float8(float8 *v, int n, const int *ranks, int nranks)
+{
+    int m = n, i = 0, depth = 0;
+
+    /* NaN sorts above everything, so just move them all to the end */
+    while (i < m)
+    {
+        if (AM_ISNAN(v[i]))
+            am_swap(v, i, --m);
+        else
+            i++;
+    }
+
+    while (nranks > 0 && ranks[nranks - 1] >= m)
+        nranks--;
+
+    for (i = m; i > 1; i >>= 1)
+        depth += 2;
+
+    am_select(v, 0, m - 1, ranks, nranks, depth);
+}
+
+
+/**********************************************************************
+* Sorting
+*/
+
+/* Below this many values an insertion sort beats setting up a radix pass */
+#define AM_RADIX_MIN 64
+
+/*
+* LSD radix sort of unsigned keys, a byte at a time. All the byte
+* histograms come from one read of the keys, and a byte that is the
+* same in every key is skipped. Returns whichever of the two buffers
+* ended up holding the sorted keys.
+*/
+#define AM_RADIX_SORT(name, utype) \
+static utype * \
+name(utype *keys, utype *tmp, int n) \
+{ \
+    uint32 counts[sizeof(utype)][256]; \
+    memset(counts, 0, sizeof(counts)); \
+    for (int i = 0; i < n; i++) \
+    { \
+        for (int b = 0; b < (int) sizeof(utype); b++) \
+            counts[b][(keys[i] >> (8 * b)) & 0xff]++; \
+    } \
+    for (int b = 0; b < (int) sizeof(utype); b++) \
+    { \
+        uint32 offsets[256], sum = 0; \
+        utype *swap; \
+        if (counts[b][(keys[0] >> (8 * b)) & 0xff] == (uint32) n) \
+            continue; \
+        for (int d = 0; d < 256; d++) \
+        { \
+            offsets[d] = sum; \
+            sum += counts[b][d]; \
+        } \
+        for (int i = 0; i < n; i++) \
+            tmp[offsets[(keys[i] >> (8 * b)) & 0xff]++] = keys[i]; \
+        swap = keys; \
+        keys = tmp; \
+        tmp = swap; \
+    } \
+    return keys; \
+} \
+\
+static utype * \
+name##_small(utype *keys, int n) \
+{ \
+    for (int i = 1; i < n; i++) \
+    { \
+        utype k = keys[i]; \
+        int j = i - 1; \
+        while (j >= 0 && keys[j] > k) \
+        { \
+            keys[j + 1] = keys[j]; \
+            j--; \
+        } \
+        keys[j + 1] = k; \
+    } \
+    return keys; \
+}
+
+AM_RADIX_SORT(am_radix_sort16, uint16)
+AM_RADIX_SORT(am_radix_sort32, uint32)
+AM_RADIX_SORT(am_radix_sort64, uint64)
+
+/*
+* Sort keys are the bits of each value rearranged so that unsigned
+* integer order is SQL order. For integers that is just flipping the
+* sign bit. For floats, negative values also have their other bits
+* inverted, and every NaN first becomes the one positive quiet NaN,
+* whose key sorts above that of +Infinity.
+*/
+#define AM_INT_KEY(u, sign)     ((u) ^ (sign))
+#define AM_INT_UNKEY(k, sign)   ((k) ^ (sign))
+#define AM_FLOAT_KEY(u, sign)   (((u) & (sign)) ? ~(u) : ((u) | (sign)))
+#define AM_FLOAT_UNKEY(k, sign) (((k) & (sign)) ? ((k) & ~(sign)) : ~(k))
+
+/*
+* Encode in place, sort, then decode back into data, reversing on
+* the way out if asked to. infbits is zero for the integer types.
+*/
+#define AM_SORT_FUNCTION(name, utype, radix, key, unkey, sign, infbits, nanbits) \
+static void \
+name(void *data, void *scratch, int n, bool reverse) \
+{ \
+    utype *keys = (utype *) data; \
+    utype *sorted; \
+    for (int i = 0; i < n; i++) \
+    { \
+        utype u = keys[i]; \
+        if ((infbits) != 0 && (u & ~(sign)) > (utype) (infbits)) \
+            u = (nanbits); \
+        keys[i] = key(u, (sign)); \
+    } \
+    if (n < AM_RADIX_MIN) \
+        sorted = radix##_small(keys, n); \
+    else \
+        sorted = radix(keys, (utype *) scratch, n); \
+    if (sorted == keys && reverse) \
+    { \
+        for (int i = 0, j = n - 1; i < j; i++, j--) \
+        { \
+            utype t = keys[i]; \
+            keys[i] = keys[j]; \
+            keys[j] = t; \
+        } \
+        reverse = false; \
+    } \
+    for (int i = 0; i < n; i++) \
+    { \
+        utype k = sorted[reverse ? n - 1 - i : i]; \
+        keys[i] = unkey(k, (sign)); \
+    } \
+}
+
+AM_SORT_FUNCTION(am_sort_int2, uint16, am_radix_sort16, AM_INT_KEY, AM_INT_UNKEY,
+    (uint16) 0x8000, 0, 0)
+AM_SORT_FUNCTION(am_sort_int4, uint32, am_radix_sort32, AM_INT_KEY, AM_INT_UNKEY,
+    (uint32) 0x80000000, 0, 0)
+AM_SORT_FUNCTION(am_sort_int8, uint64, am_radix_sort64, AM_INT_KEY, AM_INT_UNKEY,
+    UINT64CONST(0x8000000000000000), 0, 0)
+AM_SORT_FUNCTION(am_sort_float4, uint32, am_radix_sort32, AM_FLOAT_KEY, AM_FLOAT_UNKEY,
+    (uint32) 0x80000000, (uint32) 0x7f800000, (uint32) 0x7fc00000)
+AM_SORT_FUNCTION(am_sort_float8, uint64, am_radix_sort64, AM_FLOAT_KEY, AM_FLOAT_UNKEY,
+    UINT64CONST(0x8000000000000000), UINT64CONST(0x7ff0000000000000),
+    UINT64CONST(0x7ff8000000000000))
+
+void
+arraymath_sort_native(ArrayMathKernelType type, void *data, void *scratch,
+    int n, bool reverse)
+{
+    if (n < 2)
+        return;
+
+    switch (type)
+    {
+        case AM_TYPE_INT2:   am_sort_int2(data, scratch, n, reverse); break;
+        case AM_TYPE_INT4:   am_sort_int4(data, scratch, n, reverse); break;
+        case AM_TYPE_INT8:   am_sort_int8(data, scratch, n, reverse); break;
+        case AM_TYPE_FLOAT4: am_sort_float4(data, scratch, n, reverse); break;
+        case AM_TYPE_FLOAT8: am_sort_float8(data, scratch, n, reverse); break;
+        default:
+            break;
+    }
+}
+
+/**********************************************************************
+* Top-k selection
+*/
+
+/*
+* Bounded heap of the k best positions seen so far, with the worst of
+* them at the root, so each new value only has to beat the root to
+* get in. Ties go to the earlier position. Kept static inline so each
+* native type gets its own copy with the comparison inlined.
+*/
+static inline void
+am_topk_sift_down(int *heap, int root, int n, ArrayMathRankFn before, const void *arg)
+{
+    for (;;)
+    {
+        int child = 2 * root + 1;
+        int tmp;
+
+        if (child >= n)
+            break;
+        /* Follow the worse child, which is the one ranked later */
+        if (child + 1 < n && before(arg, heap[child], heap[child + 1]))
+            child++;
+        if (!before(arg, heap[root], heap[child]))
+            break;
+        tmp = heap[root]; heap[root] = heap[child]; heap[child] = tmp;
+        root = child;
+    }
+}
+
+static inline int
+am_topk(int n, int k, ArrayMathRankFn before, const void *arg, int *heap)
+{
+    int count = 0;
+
+    if (k > n)
+        k = n;
+
+    for (int i = 0; i < k; i++)
+    {
+        int c = count++;
+
+        heap[c] = i;
+        while (c > 0)
+        {
+            int p = (c - 1) / 2;
+            int tmp;
+
+            if (!before(arg, heap[p], heap[c]))
+                break;
+            tmp = heap[p]; heap[p] = heap[c]; heap[c] = tmp;
+            c = p;
+        }
+    }
+
+    for (int i = k; i < n; i++)
+    {
+        if (k > 0 && before(arg, i, heap[0]))
+        {
+            heap[0] = i;
+            am_topk_sift_down(heap, 0, count, before, arg);
+        }
+    }
+
+    /* Pop the worst off to the end in turn, leaving the best first */
+    for (int m = count - 1; m > 0; m--)
+    {
+        int tmp = heap[0];
+
+        heap[0] = heap[m];
+        heap[m] = tmp;
+        am_topk_sift_down(heap, 0, m, before, arg);
+    }
+
+    return count;
+}
+
+int
+arraymath_topk(int n, int k, ArrayMathRankFn before, const void *arg, int *idx)
+{
+    return am_topk(n, k, before, arg, idx);
+}
+
+#define AM_TOPK_RANK(T, ctype, gt) \
+static bool \
+am_rank_largest_##T(const void *arg, int i, int j) \
+{ \
+    const ctype *v = (const ctype *) arg; \
+    return gt(v[i], v[j]) || (!gt(v[j], v[i]) && i < j); \
+} \
+static bool \
+am_rank_smallest_##T(const void *arg, int i, int j) \
+{ \
+    const ctype *v = (const ctype *) arg; \
+    return gt(v[j], v[i]) || (!gt(v[i], v[j]) && i < j); \
+}
+
+AM_TOPK_RANK(int2, int16, AM_INT_GT)
+AM_TOPK_RANK(int4, int32, AM_INT_GT)
+AM_TOPK_RANK(int8, int64, AM_INT_GT)
+AM_TOPK_RANK(float4, float4, AM_FLOAT_GT)
+AM_TOPK_RANK(float8, float8, AM_FLOAT_GT)
+
+#define AM_TOPK_CASE(T) \
+    return largest ? am_topk(n, k, am_rank_largest_##T, data, idx) : \
+                     am_topk(n, k, am_rank_smallest_##T, data, idx)
+
+int
+arraymath_topk_native(ArrayMathKernelType type, const void *data, int n, int k,
+    bool largest, int *idx)
+{
+    switch (type)
+    {
+        case AM_TYPE_INT2:   AM_TOPK_CASE(int2);
+        case AM_TYPE_INT4:   AM_TOPK_CASE(int4);
+        case AM_TYPE_INT8:   AM_TOPK_CASE(int8);
+        case AM_TYPE_FLOAT4: AM_TOPK_CASE(float4);
+        case AM_TYPE_FLOAT8: AM_TOPK_CASE(float8);
+        default:
+            return 0;
+    }
+}
+
+/**********************************************************************
+* Summary statistics
+*/
+
+/*
+* Values are taken a cache-sized chunk at a time, and each chunk is
+* read for the sum, the range and the moments while it is still in
+* cache, so memory is only streamed through once.
+*/
+#define AM_STATS_CHUNK 1024
+
+#define AM_RANGE_LOOP(ctype, field, gt) \
+    do { \
+        const ctype *v = (const ctype *) data; \
+        ctype lo = v[0], hi = v[0]; \
+        if (state->sum.count > 0) \
+        { \
+            lo = state->min.field; \
+            hi = state->max.field; \
+        } \
+        for (int i = 0; i < n; i++) \
+        { \
+            lo = gt(lo, v[i]) ? v[i] : lo; \
+            hi = gt(v[i], hi) ? v[i] : hi; \
+        } \
+        state->min.field = lo; \
+        state->max.field = hi; \
+    } while (0)
+
+static void
+am_stats_range(ArrayMathStatsState *state, const void *data, int n)
+{
+    switch (state->sum.type)
+    {
+        case AM_TYPE_INT2:   AM_RANGE_LOOP(int16, i2, AM_INT_GT); break;
+        case AM_TYPE_INT4:   AM_RANGE_LOOP(int32, i4, AM_INT_GT); break;
+        case AM_TYPE_INT8:   AM_RANGE_LOOP(int64, i8, AM_INT_GT); break;
+        case AM_TYPE_FLOAT4: AM_RANGE_LOOP(float4, f4, AM_FLOAT_GT); break;
+        case AM_TYPE_FLOAT8: AM_RANGE_LOOP(float8, f8, AM_FLOAT_GT); break;
+        default:
+            break;
+    }
+}
+
+/*
+* Moments of a chunk by the two-pass method, which is both accurate
+* and easy to vectorize, then merged into the running totals with
+* the pairwise form of Welford's update (Chan et al).
+*/
+static void
+am_stats_moments(ArrayMathStatsState *state, const void *data, int n)
+{
+    float8 x[AM_STATS_CHUNK];
+    float8 sum = 0.0, m2 = 0.0, mean, delta;
+    int64 count = state->sum.count;
+    int64 total = count + n;
+
+    arraymath_to_float8(state->sum.type, data, n, x);
+    for (int i = 0; i < n; i++)
+        sum += x[i];
+    mean = sum / n;
+    for (int i = 0; i < n; i++)
+        m2 += (x[i] - mean) * (x[i] - mean);
+
+    delta = mean - state->mean;
+    state->mean += delta * n / total;
+    state->m2 += m2 + delta * delta * ((float8) count * n / total);
+}
+
+void
+arraymath_stats_init(ArrayMathStatsState *state, ArrayMathKernelType type, int accums)
+{
+    memset(state, 0, sizeof(ArrayMathStatsState));
+    state->accums = accums;
+    arraymath_sum_init(&state->sum, type);
+}
+
+void
+arraymath_stats_accum(ArrayMathStatsState *state, const void *data, int n)
+{
+    const char *p = (const char *) data;
+    int size = arraymath_kernel_type_size[state->sum.type];
+
+    while (n > 0)
+    {
+        int m = Min(n, AM_STATS_CHUNK);
+
+        /* Range and moments look at the count before the sum moves it on */
+        if (state->accums & AM_STATS_RANGE)
+            am_stats_range(state, p, m);
+        if (state->accums & AM_STATS_MOMENTS)
+            am_stats_moments(state, p, m);
+        if (state->accums & AM_STATS_SUM)
+            arraymath_sum_accum(&state->sum, p, m);
+        else
+            state->sum.count += m;
+
+        p += (Size) m * size;
+        n -= m;
+    }
+}
+
+
+/**********************************************************************
+* Prefix scans
+*/
+
+/*
+* Each output depends on the one before, so a scan is one pass
+* through a running value. Narrow integers run in int64, which no
+* array can overflow, and have their range checked on the way out,
+* without a branch; int8 is checked on every step.
+*/
+#define AM_SCAN_NARROW_SUM(ctype, minval, maxval) \
+    do { \
+        const ctype *v = (const ctype *) data; \
+        ctype *o = (ctype *) out; \
+        int64 sum = 0; \
+        bool bad = false; \
+        for (int i = 0; i < n; i++) \
+        { \
+            sum += v[i]; \
+            bad |= (sum < (minval)) | (sum > (maxval)); \
+            o[i] = (ctype) sum; \
+        } \
+        if (bad) \
+            return AM_ERR_OVERFLOW; \
+    } while (0)
+
+/* A product can leave int64 in two steps, so stop at the first overflow */
+#define AM_SCAN_NARROW_PROD(ctype, minval, maxval) \
+    do { \
+        const ctype *v = (const ctype *) data; \
+        ctype *o = (ctype *) out; \
+        int64 prod = 1; \
+        for (int i = 0; i < n; i++) \
+        { \
+            prod *= v[i]; \
+            if (prod < (minval) || prod > (maxval)) \
+                return AM_ERR_OVERFLOW; \
+            o[i] = (ctype) prod; \
+        } \
+    } while (0)
+
+/*
+* Float sums are compensated as in AM_SUM_FLOAT_LOOP, so the last
+* running total is exactly what array_sum() gives. Float4 runs in
+* float8 too. As with the operators, a total that goes infinite
+* from finite inputs is an overflow.
+*/
+#define AM_SCAN_FLOAT_SUM(ctype) \
+    do { \
+        const ctype *v = (const ctype *) data; \
+        ctype *o = (ctype *) out; \
+        float8 sum = 0, comp = 0; \
+        bool inf = false; \
+        for (int i = 0; i < n; i++) \
+        { \
+            float8 x = (float8) v[i]; \
+            float8 t = sum + x; \
+            comp += (fabs(sum) >= fabs(x)) ? ((sum - t) + x) : ((x - t) + sum); \
+            sum = t; \
+            inf |= AM_ISINF(x); \
+            o[i] = (ctype) (AM_ISINF(sum) || AM_ISNAN(sum) ? sum : sum + comp); \
+            if (unlikely(AM_ISINF(o[i])) && !inf) \
+                return AM_ERR_OVERFLOW; \
+        } \
+    } while (0)
+
+/* ...and one that goes to zero without a zero input is an underflow */
+#define AM_SCAN_FLOAT_PROD(ctype) \
+    do { \
+        const ctype *v = (const ctype *) data; \
+        ctype *o = (ctype *) out; \
+        float8 prod = 1; \
+        bool inf = false, zero = false; \
+        for (int i = 0; i < n; i++) \
+        { \
+            prod *= (float8) v[i]; \
+            inf |= AM_ISINF(v[i]); \
+            zero |= (v[i] == 0); \
+            o[i] = (ctype) prod; \
+            if (unlikely(AM_ISINF(o[i])) && !inf) \
+                return AM_ERR_OVERFLOW; \
+            if (unlikely(o[i] == 0) && !zero) \
+                return AM_ERR_UNDERFLOW; \
+        } \
+    } while (0)
+
+ArrayMathStatus
+arraymath_scan(ArrayMathKernelType type, ArrayMathScanOp op, const void *data, int n, void *out)
+{
+    switch (type)
+    {
+        case AM_TYPE_INT2:
+            if (op == AM_SCAN_SUM)
+                AM_SCAN_NARROW_SUM(int16, PG_INT16_MIN, PG_INT16_MAX);
+            else
+                AM_SCAN_NARROW_PROD(int16, PG_INT16_MIN, PG_INT16_MAX);
+            break;
+        case AM_TYPE_INT4:
+            if (op == AM_SCAN_SUM)
+                AM_SCAN_NARROW_SUM(int32, PG_INT32_MIN, PG_INT32_MAX);
+            else
+                AM_SCAN_NARROW_PROD(int32, PG_INT32_MIN, PG_INT32_MAX);
+            break;
+        case AM_TYPE_INT8:
+        {
+            const int64 *v = (const int64 *) data;
+            int64 *o = (int64 *) out;
+            int64 acc = (op == AM_SCAN_SUM) ? 0 : 1;
+
+            for (int i = 0; i < n; i++)
+            {
+                if (op == AM_SCAN_SUM ? pg_add_s64_overflow(acc, v[i], &acc)
+                                      : pg_mul_s64_overflow(acc, v[i], &acc))
+                    return AM_ERR_OVERFLOW;
+                o[i] = acc;
+            }
+            break;
+        }
+        case AM_TYPE_FLOAT4:
+            if (op == AM_SCAN_SUM)
+                AM_SCAN_FLOAT_SUM(float4);
+            else
+                AM_SCAN_FLOAT_PROD(float4);
+            break;
+        case AM_TYPE_FLOAT8:
+            if (op == AM_SCAN_SUM)
+                AM_SCAN_FLOAT_SUM(float8);
+            else
+                AM_SCAN_FLOAT_PROD(float8);
+            break;
+        default:
+            break;
+    }
+    return AM_OK;
+}
+
+
+/**********************************************************************
+* Moving windows
+*/
+
+#define AM_BIT(bitmap, i) (!(bitmap) || ((bitmap)[(i) >> 3] & (1 << ((i) & 7))))
+
+/*
+* Mark whether window i has any values, answering the same.
+*/
+static inline bool
+am_moving_valid(uint8 *valid, int i, int count)
+{
+    if (valid && count > 0)
+        valid[i >> 3] |= 1 << (i & 7);
+    else if (valid)
+        valid[i >> 3] &= ~(1 << (i & 7));
+    return count > 0;
+}
+
+/*
+* Sums and averages add the value coming into the window and take
+* off the one leaving, so the cost does not depend on the width.
+* Integers are exact in a wide accumulator.
+*/
+#ifdef HAVE_INT128
+typedef int128 am_wide;
+#define AM_WIDE_ADD(s, x) ((s) += (x), false)
+#define AM_WIDE_SUB(s, x) ((s) -= (x), false)
+#else
+typedef int64 am_wide;
+#define AM_WIDE_ADD(s, x) pg_add_s64_overflow((s), (x), &(s))
+#define AM_WIDE_SUB(s, x) pg_sub_s64_overflow((s), (x), &(s))
+#endif
+
+#define AM_MOVING_INT_SUM(ctype, minval, maxval) \
+    do { \
+        const ctype *v = (const ctype *) data; \
+        am_wide sum = 0; \
+        int count = 0; \
+        for (int i = 0; i < n; i++) \
+        { \
+            if (AM_BIT(bitmap, i)) \
+            { \
+                if (AM_WIDE_ADD(sum, v[i])) \
+                    return AM_ERR_OVERFLOW; \
+                count++; \
+            } \
+            if (i >= width && AM_BIT(bitmap, i - width)) \
+            { \
+                if (AM_WIDE_SUB(sum, v[i - width])) \
+                    return AM_ERR_OVERFLOW; \
+                count--; \
+            } \
+            if (!am_moving_valid(valid, i, count)) \
+                continue; \
+            if (op == AM_MOVING_AVG) \
+                ((float8 *) out)[i] = (float8) sum / count; \
+            else if (sum < (minval) || sum > (maxval)) \
+                return AM_ERR_OVERFLOW; \
+            else \
+                ((ctype *) out)[i] = (ctype) sum; \
+        } \
+    } while (0)
+
+/*
+* Floats keep a compensated sum of the finite values, and counts of
+* the infinities and NaNs, which could never be taken off again once
+* they had been added in.
+*/
+typedef struct AmWindowSum
+{
+    float8 sum;
+    float8 comp;
+    int nans;
+    int pinfs;
+    int ninfs;
+} AmWindowSum;
+
+static inline void
+am_window_add(AmWindowSum *w, float8 x, int sign)
+{
+    float8 t;
+
+    if (AM_ISNAN(x))
+        w->nans += sign;
+    else if (AM_ISINF(x) && x > 0)
+        w->pinfs += sign;
+    else if (AM_ISINF(x))
+        w->ninfs += sign;
+    else
+    {
+        x *= sign;
+        t = w->sum + x;
+        w->comp += (fabs(w->sum) >= fabs(x)) ? ((w->sum - t) + x) : ((x - t) + w->sum);
+        w->sum = t;
+    }
+}
+
+static inline float8
+am_window_sum(const AmWindowSum *w)
+{
+    if (w->nans || (w->pinfs && w->ninfs))
+        return NAN;
+    if (w->pinfs)
+        return INFINITY;
+    if (w->ninfs)
+        return -INFINITY;
+    return w->sum + w->comp;
+}
+
+#define AM_MOVING_FLOAT_SUM(ctype) \
+    do { \
+        const ctype *v = (const ctype *) data; \
+        AmWindowSum w = {0}; \
+        int count = 0; \
+        for (int i = 0; i < n; i++) \
+        { \
+            float8 r; \
+            if (AM_BIT(bitmap, i)) \
+            { \
+                am_window_add(&w, v[i], 1); \
+                count++; \
+            } \
+            if (i >= width && AM_BIT(bitmap, i - width)) \
+            { \
+                am_window_add(&w, v[i - width], -1); \
+                count--; \
+            } \
+            if (!am_moving_valid(valid, i, count)) \
+                continue; \
+            r = am_window_sum(&w); \
+            if (op == AM_MOVING_AVG) \
+                r /= count; \
+            if ((AM_ISINF(r) || AM_ISINF((ctype) r)) && !w.pinfs && !w.ninfs) \
+                return AM_ERR_OVERFLOW; \
+            if (op == AM_MOVING_AVG) \
+                ((float8 *) out)[i] = r; \
+            else \
+                ((ctype *) out)[i] = (ctype) r; \
+        } \
+    } while (0)
+
+/*
+* Least and greatest keep a queue of the positions that could still
+* be the answer for some window, in order of both position and value:
+* a value that a later, better one arrives behind can never be the
+* answer again. Each position joins and leaves the queue once.
+*/
+#define AM_MOVING_MINMAX(ctype, gt) \
+    do { \
+        const ctype *v = (const ctype *) data; \
+        ctype *o = (ctype *) out; \
+        bool greatest = (op == AM_MOVING_MAX); \
+        int head = 0, tail = 0; \
+        for (int i = 0; i < n; i++) \
+        { \
+            if (AM_BIT(bitmap, i)) \
+            { \
+                while (tail > head && (greatest ? !gt(v[queue[tail - 1]], v[i]) \
+                                                : !gt(v[i], v[queue[tail - 1]]))) \
+                    tail--; \
+                queue[tail++] = i; \
+            } \
+            if (head < tail && queue[head] <= i - width) \
+                head++; \
+            if (am_moving_valid(valid, i, tail - head)) \
+                o[i] = v[queue[head]]; \
+        } \
+    } while (0)
+
+ArrayMathStatus
+arraymath_moving(ArrayMathKernelType type, ArrayMathMovingOp op, const void *data,
+    const uint8 *bitmap, int n, int width, int *queue, void *out, uint8 *valid)
+{
+    if (op == AM_MOVING_MIN || op == AM_MOVING_MAX)
+    {
+        switch (type)
+        {
+            case AM_TYPE_INT2:   AM_MOVING_MINMAX(int16, AM_INT_GT); break;
+            case AM_TYPE_INT4:   AM_MOVING_MINMAX(int32, AM_INT_GT); break;
+            case AM_TYPE_INT8:   AM_MOVING_MINMAX(int64, AM_INT_GT); break;
+            case AM_TYPE_FLOAT4: AM_MOVING_MINMAX(float4, AM_FLOAT_GT); break;
+            case AM_TYPE_FLOAT8: AM_MOVING_MINMAX(float8, AM_FLOAT_GT); break;
+            default:
+                break;
+        }
+        return AM_OK;
+    }
+
+    switch (type)
+    {
+        case AM_TYPE_INT2:   AM_MOVING_INT_SUM(int16, PG_INT16_MIN, PG_INT16_MAX); break;
+        case AM_TYPE_INT4:   AM_MOVING_INT_SUM(int32, PG_INT32_MIN, PG_INT32_MAX); break;
+        case AM_TYPE_INT8:   AM_MOVING_INT_SUM(int64, PG_INT64_MIN, PG_INT64_MAX); break;
+        case AM_TYPE_FLOAT4: AM_MOVING_FLOAT_SUM(float4); break;
+        case AM_TYPE_FLOAT8: AM_MOVING_FLOAT_SUM(float8); break;
+        default:
+            break;
+    }
+    return AM_OK;
+}
+
+
+/**********************************************************************
+* Sorted arrays
+*/
+
+/*
+* Searching and combining compare sort keys as above, except that
+* -0 becomes 0 first, so the two are equal as they are in SQL.
+*
+* Binary searches take the same steps whatever the probe, so a group
+* of probes is searched in lockstep and their loads from the sorted
+* values are in flight together. Each step is a conditional add
+* rather than a branch, which would be mispredicted half the time.
+*/
+#define AM_SEARCH_GROUP 8
+#define AM_SEARCH_BEFORE(k, x, right) (((k) < (x)) | ((right) & ((k) == (x))))
+
+#define AM_SORTED_FUNCTIONS(suffix, utype, sign, infbits, nanbits) \
+static inline utype \
+am_sorted_key_##suffix(utype u) \
+{ \
+    utype neg; \
+    if ((infbits) == 0) \
+        return AM_INT_KEY(u, (sign)); \
+    u = ((u & ~(sign)) > (utype) (infbits)) ? (nanbits) : u; \
+    u &= -(utype) (u != (sign)); \
+    neg = -(u >> (8 * sizeof(utype) - 1)); \
+    return u ^ (neg | (sign)); \
+} \
+\
+static void \
+am_search_sorted_##suffix(const void *sorted, int n, const void *probes, int nprobes, \
+    bool right, int32 *out) \
+{ \
+    const utype *v = (const utype *) sorted; \
+    const utype *p = (const utype *) probes; \
+    for (int i0 = 0; i0 < nprobes; i0 += AM_SEARCH_GROUP) \
+    { \
+        int m = Min(AM_SEARCH_GROUP, nprobes - i0); \
+        utype x[AM_SEARCH_GROUP]; \
+        int base[AM_SEARCH_GROUP]; \
+        for (int g = 0; g < m; g++) \
+        { \
+            x[g] = am_sorted_key_##suffix(p[i0 + g]); \
+            base[g] = 0; \
+        } \
+        if (n == 0) \
+        { \
+            for (int g = 0; g < m; g++) \
+                out[i0 + g] = 0; \
+            continue; \
+        } \
+        for (int len = n; len > 1; len -= len / 2) \
+        { \
+            int half = len / 2; \
+            for (int g = 0; g < m; g++) \
+            { \
+                utype k = am_sorted_key_##suffix(v[base[g] + half]); \
+                base[g] += half & -(int) AM_SEARCH_BEFORE(k, x[g], right); \
+            } \
+        } \
+        for (int g = 0; g < m; g++) \
+        { \
+            utype k = am_sorted_key_##suffix(v[base[g]]); \
+            out[i0 + g] = base[g] + AM_SEARCH_BEFORE(k, x[g], right); \
+        } \
+    } \
+} \
+\
+static int \
+am_sorted_combine_##suffix(ArrayMathSortedOp op, const void *a, int na, \
+    const void *b, int nb, void *out) \
+{ \
+    const utype *va = (const utype *) a; \
+    const utype *vb = (const utype *) b; \
+    utype *o = (utype *) out; \
+    int i = 0, j = 0, k = 0; \
+    switch (op) \
+    { \
+        case AM_SORTED_MERGE: \
+            while (i < na && j < nb) \
+            { \
+                utype ka = am_sorted_key_##suffix(va[i]); \
+                utype kb = am_sorted_key_##suffix(vb[j]); \
+                int takeb = kb < ka; \
+                o[k++] = takeb ? vb[j] : va[i]; \
+                j += takeb; \
+                i += 1 - takeb; \
+            } \
+            memcpy(o + k, va + i, (Size) (na - i) * sizeof(utype)); \
+            k += na - i; \
+            memcpy(o + k, vb + j, (Size) (nb - j) * sizeof(utype)); \
+            k += nb - j; \
+            break; \
+        case AM_SORTED_INTERSECT: \
+        case AM_SORTED_EXCEPT: \
+            while (i < na && j < nb) \
+            { \
+                utype ka = am_sorted_key_##suffix(va[i]); \
+                utype kb = am_sorted_key_##suffix(vb[j]); \
+                o[k] = va[i]; \
+                k += (op == AM_SORTED_INTERSECT) ? (ka == kb) : (ka < kb); \
+                i += ka <= kb; \
+                j += kb <= ka; \
+            } \
+            if (op == AM_SORTED_EXCEPT) \
+            { \
+                memcpy(o + k, va + i, (Size) (na - i) * sizeof(utype)); \
+                k += na - i; \
+            } \
+            break; \
+    } \
+    return k; \
+}
+
+AM_SORTED_FUNCTIONS(int2, uint16, (uint16) 0x8000, 0, 0)
+AM_SORTED_FUNCTIONS(int4, uint32, (uint32) 0x80000000, 0, 0)
+AM_SORTED_FUNCTIONS(int8, uint64, UINT64CONST(0x8000000000000000), 0, 0)
+AM_SORTED_FUNCTIONS(float4, uint32, (uint32) 0x80000000, (uint32) 0x7f800000, (uint32) 0x7fc00000)
+AM_SORTED_FUNCTIONS(float8, uint64, UINT64CONST(0x8000000000000000),
+    UINT64CONST(0x7ff0000000000000), UINT64CONST(0x7ff8000000000000))
+
+void
+arraymath_search_sorted(ArrayMathKernelType type, const void *sorted, int n,
+    const void *probes, int nprobes, bool right, int32 *out)
+{
+    switch (type)
+    {
+        case AM_TYPE_INT2:   am_search_sorted_int2(sorted, n, probes, nprobes, right, out); break;
+        case AM_TYPE_INT4:   am_search_sorted_int4(sorted, n, probes, nprobes, right, out); break;
+        case AM_TYPE_INT8:   am_search_sorted_int8(sorted, n, probes, nprobes, right, out); break;
+        case AM_TYPE_FLOAT4: am_search_sorted_float4(sorted, n, probes, nprobes, right, out); break;
+        case AM_TYPE_FLOAT8: am_search_sorted_float8(sorted, n, probes, nprobes, right, out); break;
+        default:
+            break;
+    }
+}
+
+int
+arraymath_sorted_combine(ArrayMathKernelType type, ArrayMathSortedOp op,
+    const void *a, int na, const void *b, int nb, void *out)
+{
+    switch (type)
+    {
+        case AM_TYPE_INT2:   return am_sorted_combine_int2(op, a, na, b, nb, out);
+        case AM_TYPE_INT4:   return am_sorted_combine_int4(op, a, na, b, nb, out);
+        case AM_TYPE_INT8:   return am_sorted_combine_int8(op, a, na, b, nb, out);
+        case AM_TYPE_FLOAT4: return am_sorted_combine_float4(op, a, na, b, nb, out);
+        case AM_TYPE_FLOAT8: return am_sorted_combine_float8(op, a, na, b, nb, out);
+        default:
+            break;
+    }
+    return 0;
+}
+
+/**********************************************************************
+* Distinct values
+*/
+
+/*
+* Open addressing with linear probing over the sort keys, which are
+* the same for values that are equal in SQL and different otherwise.
+* The table holds group numbers, and the key of each group sits in a
+* dense array beside it, so a probe that hits compares one word. The
+* slot is the top bits of the key times the golden ratio, which
+* spreads out runs of consecutive integers. The table starts small
+* and doubles whenever it is half full, so it only outgrows the cache
+* when there are that many distinct values.
+*/
+#define AM_DISTINCT_SLOT(k, shift) \
+    ((int) (((k) * UINT64CONST(0x9e3779b97f4a7c15)) >> (shift)))
+
+#define AM_DISTINCT_FUNCTION(suffix, utype) \
+static int \
+am_distinct_##suffix(const void *data, int n, int *first, int *counts, \
+    int *table, uint64 *keys) \
+{ \
+    const utype *v = (const utype *) data; \
+    int tablesize = 16; \
+    int shift = 64 - 4; \
+    int ndistinct = 0; \
+    memset(table, 0xff, sizeof(int) * tablesize); \
+    for (int i = 0; i < n; i++) \
+    { \
+        uint64 k = am_sorted_key_##suffix(v[i]); \
+        int slot = AM_DISTINCT_SLOT(k, shift); \
+        int id; \
+        while ((id = table[slot]) >= 0 && keys[id] != k) \
+            slot = (slot + 1) & (tablesize - 1); \
+        if (id < 0) \
+        { \
+            id = ndistinct++; \
+            table[slot] = id; \
+            keys[id] = k; \
+            if (first) \
+                first[id] = i; \
+            if (counts) \
+                counts[id] = 0; \
+            if (2 * ndistinct > tablesize) \
+            { \
+                tablesize *= 2; \
+                shift--; \
+                memset(table, 0xff, sizeof(int) * tablesize); \
+                for (int g = 0; g < ndistinct; g++) \
+                { \
+                    int s = AM_DISTINCT_SLOT(keys[g], shift); \
+                    while (table[s] >= 0) \
+                        s = (s + 1) & (tablesize - 1); \
+                    table[s] = g; \
+                } \
+            } \
+        } \
+        if (counts) \
+            counts[id]++; \
+    } \
+    return ndistinct; \
+}
+
+AM_DISTINCT_FUNCTION(int2, uint16)
+AM_DISTINCT_FUNCTION(int4, uint32)
+AM_DISTINCT_FUNCTION(int8, uint64)
+AM_DISTINCT_FUNCTION(float4, uint32)
+AM_DISTINCT_FUNCTION(float8, uint64)
+
+int
+arraymath_distinct_native(ArrayMathKernelType type, const void *data, int n,
+    int *first, int *counts, void *workspace)
+{
+    int *table = (int *) workspace;
+    uint64 *keys = (uint64 *) (table + arraymath_distinct_table_size(n));
+
+    switch (type)
+    {
+        case AM_TYPE_INT2:   return am_distinct_int2(data, n, first, counts, table, keys);
+        case AM_TYPE_INT4:   return am_distinct_int4(data, n, first, counts, table, keys);
+        case AM_TYPE_INT8:   return am_distinct_int8(data, n, first, counts, table, keys);
+        case AM_TYPE_FLOAT4: return am_distinct_float4(data, n, first, counts, table, keys);
+        case AM_TYPE_FLOAT8: return am_distinct_float8(data, n, first, counts, table, keys);
+        default:
+            break;
+    }
+    return 0;
+}
+
+/**********************************************************************
+* Transposition
+*/
+
+/*
+* Square blocks of the matrix go across one at a time, so both the
+* rows read and the rows written stay in cache while a block is done.
+*/
+#define AM_TRANSPOSE_BLOCK 32
+
+#define AM_TRANSPOSE_LOOP(ctype) \
+    do { \
+        const ctype *src = (const ctype *) in; \
+        ctype *dst = (ctype *) out; \
+        for (int i0 = 0; i0 < rows; i0 += AM_TRANSPOSE_BLOCK) \
+            for (int j0 = 0; j0 < cols; j0 += AM_TRANSPOSE_BLOCK) \
+                for (int i = i0; i < Min(i0 + AM_TRANSPOSE_BLOCK, rows); i++) \
+                    for (int j = j0; j < Min(j0 + AM_TRANSPOSE_BLOCK, cols); j++) \
+                        dst[(Size) j * rows + i] = src[(Size) i * cols + j]; \
+    } while (0)
+
+void
+arraymath_transpose(int size, const void *in, void *out, int rows, int cols)
+{
+    switch (size)
+    {
+        case 1: AM_TRANSPOSE_LOOP(uint8); break;
+        case 2: AM_TRANSPOSE_LOOP(uint16); break;
+        case 4: AM_TRANSPOSE_LOOP(uint32); break;
+        case 8: AM_TRANSPOSE_LOOP(uint64); break;
+        default:
+            for (int i0 = 0; i0 < rows; i0 += AM_TRANSPOSE_BLOCK)
+                for (int j0 = 0; j0 < cols; j0 += AM_TRANSPOSE_BLOCK)
+                    for (int i = i0; i < Min(i0 + AM_TRANSPOSE_BLOCK, rows); i++)
+                        for (int j = j0; j < Min(j0 + AM_TRANSPOSE_BLOCK, cols); j++)
+                            memcpy((char *) out + ((Size) j * rows + i) * size,
+                                   (const char *) in + ((Size) i * cols + j) * size, size);
+            break;
+    }
+}
+
+/**********************************************************************
+* Worker threads
+*/
+
+#ifndef WIN32
+
+/*
+* A pool of threads, started as they are first needed and kept for
+* the life of the process. Each job is a number of parts handed out
+* in turn to the caller and as many workers as it asked for, and the
+* caller only returns once every part is done. The workers block all
+* signals, so the server's handlers only ever run in the main thread.
+*/
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* workers wait here for a job */
+    pthread_cond_t done;        /* the caller waits here for the workers */
+    int nworkers;               /* started so far */
+    uint64 generation;          /* bumped for every job */
+    ArrayMathParallelFn fn;
+    void *arg;
+    int nparts;
+    int next;                   /* next part to hand out */
+    int joining;                /* workers wanted on the current job */
+    int active;                 /* of which still working */
+} am_pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
+/* Run parts of the current job until there are none left; lock held */
+static void
+am_pool_drain(void)
+{
+    while (am_pool.next < am_pool.nparts)
+    {
+        int part = am_pool.next++;
+
+        pthread_mutex_unlock(&am_pool.lock);
+        am_pool.fn(am_pool.arg, part);
+        pthread_mutex_lock(&am_pool.lock);
+    }
+}
+
+/*
+* A worker joins every job that wants at least index + 1 workers.
+* It starts with generation 0 unseen, which is the job it was
+* started for.
+*/
+static void *
+am_pool_worker(void *arg)
+{
+    int index = (int) (intptr_t) arg;
+    uint64 seen = 0;
+
+    pthread_mutex_lock(&am_pool.lock);
+    for (;;)
+    {
+        while (am_pool.generation == seen)
+            pthread_cond_wait(&am_pool.work, &am_pool.lock);
+        seen = am_pool.generation;
+        if (index >= am_pool.joining)
+            continue;
+
+        am_pool_drain();
+        if (--am_pool.active == 0)
+            pthread_cond_signal(&am_pool.done);
+    }
+    return NULL;
+}
+
+int
+arraymath_parallel_run(ArrayMathParallelFn fn, void *arg, int nparts, int nthreads)
+{
+    int nworkers = Min(nthreads, nparts) - 1;
+
+    pthread_mutex_lock(&am_pool.lock);
+
+    /* Start any more workers needed, or as many as we can */
+    if (am_pool.nworkers < nworkers)
+    {
+        sigset_t all, old;
+
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        while (am_pool.nworkers < nworkers)
+        {
+            pthread_t thread;
+
+            if (pthread_create(&thread, NULL, am_pool_worker,
+                               (void *) (intptr_t) am_pool.nworkers) != 0)
+                break;
+            pthread_detach(thread);
+            am_pool.nworkers++;
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+    nworkers = Max(Min(nworkers, am_pool.nworkers), 0);
+
+    am_pool.fn = fn;
+    am_pool.arg = arg;
+    am_pool.nparts = nparts;
+    am_pool.next = 0;
+    am_pool.joining = nworkers;
+    am_pool.active = nworkers;
+    am_pool.generation++;
+    if (nworkers > 0)
+        pthread_cond_broadcast(&am_pool.work);
+
+    am_pool_drain();
+    while (am_pool.active > 0)
+        pthread_cond_wait(&am_pool.done, &am_pool.lock);
+
+    pthread_mutex_unlock(&am_pool.lock);
+    return nworkers + 1;
+}
+
+#else
+
+/* No threads here, the caller does all the work */
+int
+arraymath_parallel_run(ArrayMathParallelFn fn, void *arg, int nparts, int nthreads)
+{
+    for (int part = 0; part < nparts; part++)
+        fn(arg, part);
+    return 1;
+}
+
+#endif /* WIN32 */
+
+#endif /* ARRAYMATH_KERNELS_VARIANT */
@@ -0,0 +1,435 @@
+/***********************************************************************
+ *
+ * Project:  Array Math
+ * Purpose:  Native element kernels for the built-in numeric types.
+ *
+ ***********************************************************************
+ * Copyright 2012 Paul Ramsey <pramsey@cleverelephant.ca>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ ***********************************************************************/
+
+#ifndef ARRAYMATH_KERNELS_H
+#define ARRAYMATH_KERNELS_H
+
+/*
+* The kernels work on raw C buffers only: no palloc, no ereport,
+* no fmgr. Problems are handed back as status flags and turned
+* into errors by the caller, so the same code can run anywhere.
+*/
+
+/* Element types with native kernels */
+typedef enum
+{
+    AM_TYPE_INT2 = 0,
+    AM_TYPE_INT4,
+    AM_TYPE_INT8,
+    AM_TYPE_FLOAT4,
+    AM_TYPE_FLOAT8,
+    AM_TYPE_COUNT
+} ArrayMathKernelType;
+
+/* Element operators with native kernels */
+typedef enum
+{
+    AM_OP_ADD = 0,
+    AM_OP_SUB,
+    AM_OP_MUL,
+    AM_OP_DIV,
+    AM_OP_EQ,
+    AM_OP_LT,
+    AM_OP_GT,
+    AM_OP_LE,
+    AM_OP_GE,
+    AM_OP_COUNT
+} ArrayMathKernelOp;
+
+#define AM_OP_IS_COMPARISON(op) ((op) >= AM_OP_EQ)
+
+/* A single value of any native type */
+typedef union
+{
+    int16 i2;
+    int32 i4;
+    int64 i8;
+    float4 f4;
+    float8 f8;
+} ArrayMathNativeValue;
+
+/* Kernel status flags, AM_OK unless something went wrong */
+typedef int ArrayMathStatus;
+
+#define AM_OK                  0x00
+#define AM_ERR_OVERFLOW        0x01
+#define AM_ERR_UNDERFLOW       0x02
+#define AM_ERR_DIVIDE_BY_ZERO  0x04
+#define AM_ERR_SQRT_NEGATIVE   0x08
+#define AM_ERR_LOG_ZERO        0x10
+#define AM_ERR_LOG_NEGATIVE    0x20
+#define AM_ERR_POWER_ZERO      0x40
+#define AM_ERR_POWER_COMPLEX   0x80
+
+/*
+* Binary kernel, out[i] = a[i] op b[i] for n elements. Depending on
+* the shape, either a or b may instead point at a single value that
+* is applied to every element of the other. Comparisons write bool.
+*/
+typedef ArrayMathStatus (*ArrayMathBinaryKernel)(const void *a, const void *b, void *out, int n);
+
+typedef enum
+{
+    AM_SHAPE_ARRAY_ARRAY = 0,
+    AM_SHAPE_ARRAY_SCALAR,
+    AM_SHAPE_SCALAR_ARRAY,
+    AM_SHAPE_COUNT
+} ArrayMathKernelShape;
+
+/* Whole-vector reductions over a pair of equal-length arrays */
+typedef enum
+{
+    AM_VEC_DOT = 0,     /* sum of a[i] * b[i] */
+    AM_VEC_L1,          /* sum of |a[i] - b[i]| */
+    AM_VEC_L2,          /* sum of (a[i] - b[i])^2 */
+    AM_VEC_COSINE,      /* dot, then sums of a[i]^2 and b[i]^2 */
+    AM_VEC_NORM,        /* sum of a[i]^2, b is ignored */
+    AM_VEC_COUNT
+} ArrayMathVectorOp;
+
+/*
+* Vector kernel, accumulating in float8 whatever the input type
+* and writing up to three sums to out.
+*/
+typedef void (*ArrayMathVectorKernel)(const void *a, const void *b, int n, float8 *out);
+
+/* Element-wise functions of a single array */
+typedef enum
+{
+    AM_UNARY_ABS = 0,   /* |x| */
+    AM_UNARY_ROUND,     /* x rounded to digits decimal places */
+    AM_UNARY_CLAMP,     /* x limited to lo .. hi, NaN greatest */
+    AM_UNARY_SQRT,      /* the rest work in and write float8 */
+    AM_UNARY_EXP,
+    AM_UNARY_LN,
+    AM_UNARY_POW,       /* x raised to exponent */
+    AM_UNARY_COUNT
+} ArrayMathUnaryOp;
+
+#define AM_UNARY_IS_FLOAT8(op) ((op) >= AM_UNARY_SQRT)
+
+/* The constant arguments of a unary function, as it needs them */
+typedef struct ArrayMathUnaryArgs
+{
+    int digits;
+    float8 scale;       /* 10^|digits|, for rounding floats */
+    float8 exponent;
+    ArrayMathNativeValue lo;
+    ArrayMathNativeValue hi;
+} ArrayMathUnaryArgs;
+
+/*
+* Unary kernel, out[i] = f(in[i]) for n elements, following the
+* domain rules of the built-in function of the same name.
+*/
+typedef ArrayMathStatus (*ArrayMathUnaryKernel)(const void *in, const ArrayMathUnaryArgs *args,
+    void *out, int n);
+
+/*
+* Mask kernel, comparing n elements of a with the single value at b
+* and setting bit i of bits (a word per 64 elements, first element
+* lowest) wherever a[i] op b holds. Returns the number of matches.
+* There is one for each comparison operator, AM_OP_EQ onwards.
+*/
+typedef int (*ArrayMathMaskKernel)(const void *a, const void *b, uint64 *bits, int n);
+
+#define AM_CMP_COUNT (AM_OP_COUNT - AM_OP_EQ)
+
+/*
+* Matrix product kernel, out (m x n) = a (m x k) times b (k x n), all
+* row-major and of the same type, summing in float8. Only the float
+* types have one. inf is room for m + n flags, where the kernel notes
+* which rows of a and columns of b hold an infinity.
+*/
+typedef ArrayMathStatus (*ArrayMathMatmulKernel)(const void *a, const void *b, void *out,
+    int m, int k, int n, bool *inf);
+
+typedef struct ArrayMathKernels
+{
+    const char *name;
+    ArrayMathBinaryKernel binary[AM_SHAPE_COUNT][AM_OP_COUNT][AM_TYPE_COUNT];
+    ArrayMathVectorKernel vector[AM_VEC_COUNT][AM_TYPE_COUNT];
+    ArrayMathUnaryKernel unary[AM_UNARY_COUNT][AM_TYPE_COUNT];
+    ArrayMathMaskKernel mask[AM_CMP_COUNT][AM_TYPE_COUNT];
+    ArrayMathMatmulKernel matmul[AM_TYPE_COUNT];
+} ArrayMathKernels;
+
+/* Kernels for each instruction set the build has */
+extern const ArrayMathKernels arraymath_kernels_scalar;
+#ifdef ARRAYMATH_X86_KERNELS
+extern const ArrayMathKernels arraymath_kernels_avx2;
+extern const ArrayMathKernels arraymath_kernels_avx512;
+#endif
+
+/* Storage size of each native type */
+extern const int arraymath_kernel_type_size[AM_TYPE_COUNT];
+
+static inline int
+arraymath_kernel_out_size(ArrayMathKernelOp op, ArrayMathKernelType type)
+{
+    return AM_OP_IS_COMPARISON(op) ? (int) sizeof(bool) : arraymath_kernel_type_size[type];
+}
+
+static inline int
+arraymath_unary_out_size(ArrayMathUnaryOp op, ArrayMathKernelType type)
+{
+    return AM_UNARY_IS_FLOAT8(op) ? (int) sizeof(float8) : arraymath_kernel_type_size[type];
+}
+
+extern ArrayMathStatus arraymath_kernel_apply(const ArrayMathKernels *kernels,
+    ArrayMathKernelOp op, ArrayMathKernelType type,
+    const void *a, int na, const void *b, int nb, void *out);
+
+/*
+* Running sum over any number of chunks of one native type.
+* Integers accumulate exactly in the widest integer available,
+* floats in float8 with Neumaier compensation.
+*/
+typedef struct ArrayMathSumState
+{
+    ArrayMathKernelType type;
+    int64 count;
+#ifdef HAVE_INT128
+    int128 isum;
+#else
+    int64 isum;
+#endif
+    float8 fsum;
+    float8 fcomp;
+    bool finf;
+    ArrayMathStatus status;
+} ArrayMathSumState;
+
+extern void arraymath_sum_init(ArrayMathSumState *state, ArrayMathKernelType type);
+extern void arraymath_sum_accum(ArrayMathSumState *state, const void *data, int n);
+extern ArrayMathStatus arraymath_sum_int64(const ArrayMathSumState *state, int64 *result);
+extern ArrayMathStatus arraymath_sum_float8(const ArrayMathSumState *state, float8 *result);
+extern void arraymath_sum_merge(ArrayMathSumState *state, const ArrayMathSumState *part);
+
+/*
+* Everything array_stats() reports, gathered in one pass over any
+* number of chunks of one native type: the exact sum as above, the
+* least and greatest values (NaN greatest), and the mean and sum of
+* squared deviations from it in float8. Only the accumulators asked
+* for at init are kept up, though the count always is.
+*/
+#define AM_STATS_SUM     0x01
+#define AM_STATS_RANGE   0x02
+#define AM_STATS_MOMENTS 0x04
+#define AM_STATS_ALL     (AM_STATS_SUM | AM_STATS_RANGE | AM_STATS_MOMENTS)
+
+typedef struct ArrayMathStatsState
+{
+    int accums;
+    ArrayMathSumState sum;
+    ArrayMathNativeValue min;
+    ArrayMathNativeValue max;
+    float8 mean;
+    float8 m2;
+} ArrayMathStatsState;
+
+extern void arraymath_stats_init(ArrayMathStatsState *state, ArrayMathKernelType type,
+    int accums);
+extern void arraymath_stats_accum(ArrayMathStatsState *state, const void *data, int n);
+
+/*
+* Null bitmaps, worked on 64 bits at a time. A NULL bitmap stands
+* for one with every bit set, as in an array without nulls.
+*/
+
+/* Number of set (non-null) bits among the first nitems of a bitmap */
+extern int arraymath_bitmap_count(const uint8 *bitmap, int nitems);
+
+/*
+* The next nbits (up to 64) bits of an nitems bitmap from bit *pos,
+* first bit lowest, wrapping around at the end. Moves *pos on.
+*/
+extern uint64 arraymath_bitmap_word(const uint8 *bitmap, int nitems, int *pos, int nbits);
+
+/* out = a & b for n bits, each of a and b wrapping at its own length */
+extern void arraymath_bitmap_and(const uint8 *a, int na, const uint8 *b, int nb,
+    uint8 *out, int n);
+
+/*
+* Lay a packed run of nitems values (nulls take no space) out as n
+* values, wrapping around, with 1 wherever the n-bit valid bitmap
+* has a null. The 1 keeps a kernel over null positions harmless.
+*/
+extern void arraymath_spread(ArrayMathKernelType type, const void *data, const uint8 *bitmap,
+    int nitems, const uint8 *valid, int n, void *out);
+
+/* Pack the n values of size bytes whose valid bit is set, returning how many */
+extern int arraymath_compact(int size, const void *in, const uint8 *valid, int n, void *out);
+
+/* acc[i] = least (or greatest) of acc[i] and in[i], NaN greatest */
+extern void arraymath_minmax_native(ArrayMathKernelType type, void *acc, const void *in,
+    int n, bool greatest);
+
+/* Widen n values of a native type to float8 */
+extern void arraymath_to_float8(ArrayMathKernelType type, const void *data, int n, float8 *out);
+
+/*
+* Partially order v so each of the (ascending) ranks holds the value
+* a full sort would have put there, with NaN above everything else.
+*/
+extern void arraymath_select_float8(float8 *v, int n, const int *ranks, int nranks);
+
+/*
+* Sort n values of a native type in place, NaN above everything else.
+* The scratch buffer needs room for another n values.
+*/
+extern void arraymath_sort_native(ArrayMathKernelType type, void *data, void *scratch,
+    int n, bool reverse);
+
+/*
+* For each of the nprobes values, how many of the n ascending values
+* in sorted come before it: those less than it, or with right those
+* not greater. NaN is above everything else and equal to itself, and
+* -0 is equal to 0.
+*/
+extern void arraymath_search_sorted(ArrayMathKernelType type, const void *sorted, int n,
+    const void *probes, int nprobes, bool right, int32 *out);
+
+/* Ways to combine two ascending arrays, keeping duplicates */
+typedef enum
+{
+    AM_SORTED_MERGE = 0,
+    AM_SORTED_INTERSECT,
+    AM_SORTED_EXCEPT
+} ArrayMathSortedOp;
+
+/*
+* Merge a (na values) and b (nb values), both ascending, or keep the
+* values of a that are (or are not) matched by one of b, each value
+* of b matching at most once. The result is ascending, in out, which
+* needs room for na + nb values to merge and na otherwise. Returns
+* how many values it holds. Equality is as for searching.
+*/
+extern int arraymath_sorted_combine(ArrayMathKernelType type, ArrayMathSortedOp op,
+    const void *a, int na, const void *b, int nb, void *out);
+
+/* Hash table slots for n values, a power of two at most half full */
+static inline int
+arraymath_distinct_table_size(int n)
+{
+    int size = 16;
+
+    while (size < 2 * n)
+        size <<= 1;
+    return size;
+}
+
+/* Bytes of workspace arraymath_distinct_native() needs for n values */
+static inline Size
+arraymath_distinct_workspace_size(int n)
+{
+    return (Size) arraymath_distinct_table_size(n) * sizeof(int) + (Size) n * sizeof(uint64);
+}
+
+/*
+* Group n values of a native type by equality, numbering the groups
+* in order of first appearance, and return how many there are. The
+* position of the first value of each group goes in first, and the
+* number of values in it in counts; either may be NULL. Equality is
+* as for searching sorted arrays.
+*/
+extern int arraymath_distinct_native(ArrayMathKernelType type, const void *data, int n,
+    int *first, int *counts, void *workspace);
+
+/*
+* Does position i rank strictly before position j? Used to pick
+* the top k positions out of whatever arg holds.
+*/
+typedef bool (*ArrayMathRankFn)(const void *arg, int i, int j);
+
+/*
+* Fill idx with the (up to) k positions out of n that rank first, in
+* rank order, returning how many. Runs in O(n log k).
+*/
+extern int arraymath_topk(int n, int k, ArrayMathRankFn before, const void *arg, int *idx);
+
+/*
+* The same for n values of a native type, ranking the largest (or
+* smallest) first, NaN above everything else and ties by position.
+*/
+extern int arraymath_topk_native(ArrayMathKernelType type, const void *data, int n, int k,
+    bool largest, int *idx);
+
+/* Running totals */
+typedef enum
+{
+    AM_SCAN_SUM = 0,
+    AM_SCAN_PROD
+} ArrayMathScanOp;
+
+/*
+* out[i] = a[0] + ... + a[i] (or the product) for n values of a
+* native type, into out of the same type.
+*/
+extern ArrayMathStatus arraymath_scan(ArrayMathKernelType type, ArrayMathScanOp op,
+    const void *data, int n, void *out);
+
+/* Summaries of a window sliding along an array */
+typedef enum
+{
+    AM_MOVING_SUM = 0,
+    AM_MOVING_AVG,
+    AM_MOVING_MIN,
+    AM_MOVING_MAX
+} ArrayMathMovingOp;
+
+/*
+* out[i] = the summary of the values from i - width + 1 to i, so the
+* first windows are short. Positions clear in the n-bit bitmap (if
+* not NULL) are left out, and where that leaves a window empty its
+* bit in valid is cleared and out[i] is not set; valid may be NULL
+* when bitmap is. Averages are written as float8, everything else
+* in the input type. Least and greatest need room for n ints in
+* queue. The cost does not depend on the width.
+*/
+extern ArrayMathStatus arraymath_moving(ArrayMathKernelType type, ArrayMathMovingOp op,
+    const void *data, const uint8 *bitmap, int n, int width, int *queue,
+    void *out, uint8 *valid);
+
+/* out (cols x rows) = the transpose of in (rows x cols), elements of size bytes */
+extern void arraymath_transpose(int size, const void *in, void *out, int rows, int cols);
+
+/*
+* Run fn(arg, part) for every part from 0 to nparts - 1, on the
+* calling thread and up to nthreads - 1 worker threads, returning
+* once all are done. Parts run in no particular order, so each must
+* write only its own share of the results, and must not call back
+* into the server: no palloc, no ereport. Returns the number of
+* threads that took part, which is 1 where threads are unavailable.
+*/
+typedef void (*ArrayMathParallelFn)(void *arg, int part);
+
+extern int arraymath_parallel_run(ArrayMathParallelFn fn, void *arg, int nparts, int nthreads);
+
+#endif /* ARRAYMATH_KERNELS_H */
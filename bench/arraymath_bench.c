@@ -0,0 +1,537 @@
+/***********************************************************************
+ *
+ * Project:  Array Math
+ * Purpose:  Microbenchmarks of the native element kernels.
+ *
+ ***********************************************************************
+ * Copyright 2012 Paul Ramsey <pramsey@cleverelephant.ca>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ ***********************************************************************/
+
+/*
+* A standalone program that times the native kernels directly, with
+* no server involved, over every native type and a range of lengths,
+* null densities and array-versus-array length ratios. Each result is
+* one line of CSV (or JSON) on stdout, so runs before and after a
+* change can be compared with a script.
+*
+*   arraymath_bench [-f csv|json] [-n max_length] [-t batch_ms] [-k kernels]
+*/
+
+#include <postgres_fe.h>
+
+#include <time.h>
+#include <unistd.h>
+
+#include "arraymath_kernels.h"
+
+static const int bench_lengths[] = { 8, 64, 1024, 65536, 1048576, 10000000 };
+
+/* Lengths of the second array, as the length of the first over this */
+static const int bench_ratios[] = { 1, 2, 0 };   /* 0 is a single value */
+
+static const double bench_null_fractions[] = { 0.1, 0.5 };
+
+static const ArrayMathKernelOp bench_ops[] = { AM_OP_ADD, AM_OP_MUL, AM_OP_DIV, AM_OP_LT };
+
+static const char *const bench_op_names[AM_OP_COUNT] = {
+    "add", "sub", "mul", "div", "eq", "lt", "gt", "le", "ge"
+};
+
+static const char *const bench_vec_names[AM_VEC_COUNT] = {
+    "dot", "l1", "l2", "cosine", "norm"
+};
+
+static const char *const bench_unary_names[AM_UNARY_COUNT] = {
+    "abs", "round", "clamp", "sqrt", "exp", "ln", "pow"
+};
+
+static const char *const bench_type_names[AM_TYPE_COUNT] = {
+    "int2", "int4", "int8", "float4", "float8"
+};
+
+#define BENCH_BATCHES 5
+#define BENCH_TOPK 10
+
+/* Options */
+static bool bench_json = false;
+static int bench_max_length = 10000000;
+static double bench_batch_ns = 10e6;
+static const char *bench_kernels_only = NULL;
+
+/* Everything one case needs, allocated for the longest length */
+typedef struct BenchBuffers
+{
+    void *a;
+    void *b;
+    void *out;
+    void *full1;
+    void *full2;
+    void *scratch;
+    void *workspace;
+    uint8 *bitmap1;
+    uint8 *bitmap2;
+    uint8 *valid;
+    int idx[BENCH_TOPK];
+} BenchBuffers;
+
+/* One case: what it ran, and on what */
+typedef struct BenchCase
+{
+    const ArrayMathKernels *kernels;
+    const char *bench;
+    const char *op;
+    int opcode;         /* ArrayMathKernelOp, ArrayMathVectorOp or ArrayMathUnaryOp */
+    ArrayMathKernelType type;
+    int length;
+    int blength;
+    double nulls;
+} BenchCase;
+
+typedef void (*BenchFn)(const BenchCase *c, BenchBuffers *buf);
+
+static double
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* xorshift64, so every run sees the same data */
+static uint64 bench_seed = UINT64CONST(0x9E3779B97F4A7C15);
+
+static uint64
+bench_random(void)
+{
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return bench_seed;
+}
+
+/*
+* Fill n values with numbers from 1 to max, small enough that no
+* kernel in the suite overflows, and never zero so division works.
+*/
+static void
+bench_fill(ArrayMathKernelType type, void *data, int n, int max)
+{
+    for (int i = 0; i < n; i++)
+    {
+        int64 v = 1 + (int64) (bench_random() % (uint64) max);
+
+        switch (type)
+        {
+            case AM_TYPE_INT2:   ((int16 *) data)[i] = (int16) v; break;
+            case AM_TYPE_INT4:   ((int32 *) data)[i] = (int32) v; break;
+            case AM_TYPE_INT8:   ((int64 *) data)[i] = v; break;
+            case AM_TYPE_FLOAT4: ((float4 *) data)[i] = (float4) v / 7; break;
+            case AM_TYPE_FLOAT8: ((float8 *) data)[i] = (float8) v / 7; break;
+            default:
+                break;
+        }
+    }
+}
+
+/* A null bitmap of n bits, each one null with the given chance */
+static void
+bench_fill_bitmap(uint8 *bitmap, int n, double nulls)
+{
+    memset(bitmap, 0, (n + 7) / 8);
+    for (int i = 0; i < n; i++)
+    {
+        if ((double) (bench_random() % 1000000) / 1000000 >= nulls)
+            bitmap[i / 8] |= 1 << (i % 8);
+    }
+}
+
+static void
+bench_binary(const BenchCase *c, BenchBuffers *buf)
+{
+    arraymath_kernel_apply(c->kernels, c->opcode, c->type,
+        buf->a, c->length, buf->b, c->blength, buf->out);
+}
+
+/*
+* The path an operator takes over arrays with nulls: AND the bitmaps,
+* lay both inputs out in full, run the kernel, pack the results.
+*/
+static void
+bench_binary_nulls(const BenchCase *c, BenchBuffers *buf)
+{
+    int n = c->length;
+
+    arraymath_bitmap_and(buf->bitmap1, n, buf->bitmap2, n, buf->valid, n);
+    arraymath_spread(c->type, buf->a, buf->bitmap1, n, buf->valid, n, buf->full1);
+    arraymath_spread(c->type, buf->b, buf->bitmap2, n, buf->valid, n, buf->full2);
+    arraymath_kernel_apply(c->kernels, c->opcode, c->type,
+        buf->full1, n, buf->full2, n, buf->full1);
+    arraymath_compact(arraymath_kernel_type_size[c->type], buf->full1, buf->valid, n, buf->out);
+}
+
+static void
+bench_sum(const BenchCase *c, BenchBuffers *buf)
+{
+    ArrayMathSumState state;
+
+    arraymath_sum_init(&state, c->type);
+    arraymath_sum_accum(&state, buf->a, c->length);
+}
+
+static void
+bench_stats(const BenchCase *c, BenchBuffers *buf)
+{
+    ArrayMathStatsState state;
+
+    arraymath_stats_init(&state, c->type, AM_STATS_ALL);
+    arraymath_stats_accum(&state, buf->a, c->length);
+}
+
+/* Sorting works in place, so each call sorts a fresh copy */
+static void
+bench_sort(const BenchCase *c, BenchBuffers *buf)
+{
+    memcpy(buf->out, buf->a, (Size) c->length * arraymath_kernel_type_size[c->type]);
+    arraymath_sort_native(c->type, buf->out, buf->scratch, c->length, false);
+}
+
+static void
+bench_topk(const BenchCase *c, BenchBuffers *buf)
+{
+    arraymath_topk_native(c->type, buf->a, c->length, BENCH_TOPK, true, buf->idx);
+}
+
+/* Search and intersect the sorted copy of a left in full1 */
+static void
+bench_search(const BenchCase *c, BenchBuffers *buf)
+{
+    arraymath_search_sorted(c->type, buf->full1, c->length, buf->a, c->length, false,
+        (int32 *) buf->out);
+}
+
+static void
+bench_intersect(const BenchCase *c, BenchBuffers *buf)
+{
+    arraymath_sorted_combine(c->type, AM_SORTED_INTERSECT, buf->full1, c->length,
+        buf->full1, c->length, buf->out);
+}
+
+/* Group a with counts, the work of array_value_counts */
+static void
+bench_distinct(const BenchCase *c, BenchBuffers *buf)
+{
+    arraymath_distinct_native(c->type, buf->a, c->length, (int *) buf->full2, (int *) buf->out,
+        buf->workspace);
+}
+
+static void
+bench_vector(const BenchCase *c, BenchBuffers *buf)
+{
+    float8 sums[3];
+
+    c->kernels->vector[c->opcode][c->type](buf->a, buf->b, c->length, sums);
+}
+
+/* Round to tens, clamp to 10 .. 500, raise to the power 1.5 */
+static void
+bench_unary(const BenchCase *c, BenchBuffers *buf)
+{
+    ArrayMathUnaryArgs args = {0};
+
+    args.digits = -1;
+    args.scale = 10;
+    args.exponent = 1.5;
+    switch (c->type)
+    {
+        case AM_TYPE_INT2:   args.lo.i2 = 10; args.hi.i2 = 500; break;
+        case AM_TYPE_INT4:   args.lo.i4 = 10; args.hi.i4 = 500; break;
+        case AM_TYPE_INT8:   args.lo.i8 = 10; args.hi.i8 = 500; break;
+        case AM_TYPE_FLOAT4: args.lo.f4 = 10; args.hi.f4 = 500; break;
+        case AM_TYPE_FLOAT8: args.lo.f8 = 10; args.hi.f8 = 500; break;
+        default:
+            break;
+    }
+    c->kernels->unary[c->opcode][c->type](buf->a, &args, buf->out, c->length);
+}
+
+/* Compare with the single value b[0] into a bit mask */
+static void
+bench_mask(const BenchCase *c, BenchBuffers *buf)
+{
+    c->kernels->mask[c->opcode - AM_OP_EQ][c->type](buf->a, buf->b, (uint64 *) buf->out, c->length);
+}
+
+/*
+* Time a case: size a batch to take about the batch time, run a few
+* batches, and keep the fastest, which is the least disturbed.
+*/
+static void
+bench_run(const BenchCase *c, BenchFn fn, BenchBuffers *buf)
+{
+    double start, elapsed, best = 0;
+    long calls = 1;
+
+    start = bench_now();
+    fn(c, buf);
+    elapsed = bench_now() - start;
+    if (elapsed < bench_batch_ns)
+        calls = (long) (bench_batch_ns / Max(elapsed, 1.0));
+
+    for (int batch = 0; batch < BENCH_BATCHES; batch++)
+    {
+        start = bench_now();
+        for (long i = 0; i < calls; i++)
+            fn(c, buf);
+        elapsed = (bench_now() - start) / calls;
+        if (batch == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    if (bench_json)
+    {
+        printf("{\"kernels\": \"%s\", \"bench\": \"%s\", \"op\": \"%s\", \"type\": \"%s\", "
+               "\"length\": %d, \"ratio\": %g, \"null_fraction\": %g, \"calls\": %ld, "
+               "\"ns_per_call\": %.1f, \"ns_per_element\": %.4f}\n",
+               c->kernels->name, c->bench, c->op, bench_type_names[c->type],
+               c->length, (double) c->length / c->blength, c->nulls, calls * BENCH_BATCHES,
+               best, best / c->length);
+    }
+    else
+    {
+        printf("%s,%s,%s,%s,%d,%g,%g,%ld,%.1f,%.4f\n",
+               c->kernels->name, c->bench, c->op, bench_type_names[c->type],
+               c->length, (double) c->length / c->blength, c->nulls, calls * BENCH_BATCHES,
+               best, best / c->length);
+    }
+    fflush(stdout);
+}
+
+/* Square matrices of the largest side that fits in the length */
+static void
+bench_matmul(const BenchCase *c, BenchBuffers *buf)
+{
+    int side = 1;
+
+    while ((side + 1) * (side + 1) <= c->length)
+        side++;
+    c->kernels->matmul[c->type](buf->a, buf->b, buf->out, side, side, side,
+                                (bool *) buf->scratch);
+}
+
+static void
+bench_kernels(const ArrayMathKernels *kernels, BenchBuffers *buf)
+{
+    for (int type = 0; type < AM_TYPE_COUNT; type++)
+    {
+        for (int l = 0; l < lengthof(bench_lengths); l++)
+        {
+            int n = bench_lengths[l];
+            BenchCase c = { kernels, NULL, NULL, 0, type, n, n, 0 };
+
+            if (n > bench_max_length)
+                break;
+
+            bench_fill(type, buf->a, n, type == AM_TYPE_INT2 ? 1000 : 1000000);
+            bench_fill(type, buf->b, n, 7);
+
+            c.bench = "binary";
+            for (int i = 0; i < lengthof(bench_ops); i++)
+            {
+                c.opcode = bench_ops[i];
+                c.op = bench_op_names[c.opcode];
+                for (int r = 0; r < lengthof(bench_ratios); r++)
+                {
+                    c.blength = bench_ratios[r] ? Max(n / bench_ratios[r], 1) : 1;
+                    bench_run(&c, bench_binary, buf);
+                }
+            }
+            c.blength = n;
+
+            c.bench = "binary_nulls";
+            c.opcode = AM_OP_ADD;
+            c.op = bench_op_names[c.opcode];
+            for (int i = 0; i < lengthof(bench_null_fractions); i++)
+            {
+                c.nulls = bench_null_fractions[i];
+                bench_fill_bitmap(buf->bitmap1, n, c.nulls);
+                bench_fill_bitmap(buf->bitmap2, n, c.nulls);
+                bench_run(&c, bench_binary_nulls, buf);
+            }
+            c.nulls = 0;
+
+            c.bench = "reduce";
+            c.op = "sum";
+            bench_run(&c, bench_sum, buf);
+            c.op = "stats";
+            bench_run(&c, bench_stats, buf);
+            c.op = "sort";
+            bench_run(&c, bench_sort, buf);
+            c.op = "topk";
+            bench_run(&c, bench_topk, buf);
+
+            memcpy(buf->full1, buf->a, (Size) n * arraymath_kernel_type_size[type]);
+            arraymath_sort_native(type, buf->full1, buf->scratch, n, false);
+            c.op = "searchsorted";
+            bench_run(&c, bench_search, buf);
+            c.op = "intersect";
+            bench_run(&c, bench_intersect, buf);
+            c.op = "distinct";
+            bench_run(&c, bench_distinct, buf);
+
+            c.bench = "vector";
+            for (int op = 0; op < AM_VEC_COUNT; op++)
+            {
+                c.opcode = op;
+                c.op = bench_vec_names[op];
+                bench_run(&c, bench_vector, buf);
+            }
+
+            c.bench = "unary";
+            for (int op = 0; op < AM_UNARY_COUNT; op++)
+            {
+                c.opcode = op;
+                c.op = bench_unary_names[op];
+                bench_run(&c, bench_unary, buf);
+            }
+
+            c.bench = "mask";
+            for (int op = AM_OP_EQ; op < AM_OP_COUNT; op++)
+            {
+                c.opcode = op;
+                c.op = bench_op_names[op];
+                bench_run(&c, bench_mask, buf);
+            }
+
+            if (kernels->matmul[type])
+            {
+                c.bench = "matmul";
+                c.op = "*";
+                bench_run(&c, bench_matmul, buf);
+            }
+        }
+    }
+}
+
+static void *
+bench_alloc(Size size)
+{
+    void *p = malloc(Max(size, 1));
+
+    if (!p)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    /* Touch every page now, rather than inside the first timing */
+    memset(p, 0, size);
+    return p;
+}
+
+static void
+bench_usage(const char *progname)
+{
+    fprintf(stderr,
+            "Usage: %s [-f csv|json] [-n max_length] [-t batch_ms] [-k kernels]\n"
+            "  -f  output format, csv (the default) or json, one object per line\n"
+            "  -n  longest array to time, up to %d\n"
+            "  -t  milliseconds each timed batch should take, 10 by default\n"
+            "  -k  only time one set of kernels: scalar, avx2 or avx512\n",
+            progname, bench_lengths[lengthof(bench_lengths) - 1]);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    const ArrayMathKernels *kernels[3];
+    int nkernels = 0;
+    BenchBuffers buf;
+    Size bytes;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:n:t:k:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'f':
+                if (strcmp(optarg, "json") == 0)
+                    bench_json = true;
+                else if (strcmp(optarg, "csv") != 0)
+                    bench_usage(argv[0]);
+                break;
+            case 'n':
+                bench_max_length = atoi(optarg);
+                if (bench_max_length < 1)
+                    bench_usage(argv[0]);
+                break;
+            case 't':
+                bench_batch_ns = atof(optarg) * 1e6;
+                if (bench_batch_ns <= 0)
+                    bench_usage(argv[0]);
+                break;
+            case 'k':
+                bench_kernels_only = optarg;
+                break;
+            default:
+                bench_usage(argv[0]);
+        }
+    }
+
+    /* The same choice of kernels as arraymath.simd offers */
+    kernels[nkernels++] = &arraymath_kernels_scalar;
+#ifdef ARRAYMATH_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        kernels[nkernels++] = &arraymath_kernels_avx2;
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512dq") &&
+        __builtin_cpu_supports("avx512vl"))
+        kernels[nkernels++] = &arraymath_kernels_avx512;
+#endif
+
+    bytes = (Size) Min(bench_max_length, bench_lengths[lengthof(bench_lengths) - 1]) * sizeof(int64);
+    buf.a = bench_alloc(bytes);
+    buf.b = bench_alloc(bytes);
+    buf.out = bench_alloc(bytes);
+    buf.full1 = bench_alloc(bytes);
+    buf.full2 = bench_alloc(bytes);
+    buf.scratch = bench_alloc(bytes);
+    buf.workspace = bench_alloc(arraymath_distinct_workspace_size((int) (bytes / sizeof(int64))));
+    buf.bitmap1 = bench_alloc(bytes / 64 + 1);
+    buf.bitmap2 = bench_alloc(bytes / 64 + 1);
+    buf.valid = bench_alloc(bytes / 64 + 1);
+
+    if (!bench_json)
+        printf("kernels,bench,op,type,length,ratio,null_fraction,calls,ns_per_call,ns_per_element\n");
+
+    for (int i = 0; i < nkernels; i++)
+    {
+        if (bench_kernels_only && strcmp(bench_kernels_only, kernels[i]->name) != 0)
+            continue;
+        bench_kernels(kernels[i], &buf);
+    }
+
+    return 0;
+}
@@ -0,0 +1,2 @@
+\set id random(1, :rows)
+SELECT cardinality(f8 @+ f8b) FROM arraymath_bench WHERE id = :id;
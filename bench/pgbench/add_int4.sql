@@ -0,0 +1,2 @@
+\set id random(1, :rows)
+SELECT cardinality(i4 @+ i4b) FROM arraymath_bench WHERE id = :id;
@@ -0,0 +1,2 @@
+\set id random(1, :rows)
+SELECT cardinality(num @+ num) FROM arraymath_bench WHERE id = :id;
@@ -0,0 +1,2 @@
+\set id random(1, :rows)
+SELECT cardinality(f8 @* 1.5::float8) FROM arraymath_bench WHERE id = :id;
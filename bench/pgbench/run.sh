@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# Run each pgbench workload in this directory against an installed
+# arraymath, printing one CSV line per workload.
+#
+#   run.sh [dbname]
+#
+# BENCH_ROWS and BENCH_LENGTH size the table (10000 rows of 1000
+# elements by default), BENCH_TIME is the seconds per workload (10)
+# and BENCH_CLIENTS the number of pgbench clients (1). The usual
+# libpq variables (PGHOST, PGUSER...) pick the server.
+#
+
+set -e
+
+dir=$(dirname "$0")
+db=${1:-${PGDATABASE:-postgres}}
+rows=${BENCH_ROWS:-10000}
+len=${BENCH_LENGTH:-1000}
+secs=${BENCH_TIME:-10}
+clients=${BENCH_CLIENTS:-1}
+
+psql -X -q -v ON_ERROR_STOP=1 -v rows="$rows" -v len="$len" \
+	-d "$db" -f "$dir/setup.sql" >&2
+
+echo "workload,rows,length,clients,seconds,transactions,tps,latency_ms"
+
+for script in "$dir"/*.sql; do
+	name=$(basename "$script" .sql)
+	[ "$name" = setup ] && continue
+
+	pgbench -n -T "$secs" -c "$clients" -D rows="$rows" -f "$script" "$db" 2>&1 |
+	awk -v name="$name" -v rows="$rows" -v len="$len" -v clients="$clients" -v secs="$secs" '
+		/^number of transactions actually processed:/ { split($NF, t, "/"); xacts = t[1] }
+		/^latency average =/ { lat = $4 }
+		/^tps =/ { tps = $3 }
+		END { printf "%s,%s,%s,%s,%s,%s,%s,%s\n", name, rows, len, clients, secs, xacts, tps, lat }'
+done
@@ -0,0 +1,2 @@
+-- The whole table in one statement
+SELECT sum(array_sum(i4)) FROM arraymath_bench;
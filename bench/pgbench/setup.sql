@@ -0,0 +1,23 @@
+--
+-- Table for the pgbench workloads, rebuilt on every run. Takes the
+-- psql variables rows (number of rows) and len (elements per array).
+--
+
+CREATE EXTENSION IF NOT EXISTS arraymath;
+
+DROP TABLE IF EXISTS arraymath_bench;
+
+CREATE TABLE arraymath_bench AS
+	SELECT g.id,
+		array_agg((random() * 1000)::int4) AS i4,
+		array_agg((random() * 1000)::int4 + 1) AS i4b,
+		array_agg(CASE WHEN random() < 0.1 THEN NULL ELSE (random() * 1000)::int4 END) AS i4n,
+		array_agg(random() * 1000) AS f8,
+		array_agg(random() * 1000) AS f8b,
+		array_agg(round((random() * 1000)::numeric, 2)) AS num
+	FROM generate_series(1, :rows) g(id),
+		generate_series(1, :len) e
+	GROUP BY g.id;
+
+ALTER TABLE arraymath_bench ADD PRIMARY KEY (id);
+VACUUM ANALYZE arraymath_bench;
@@ -0,0 +1,2 @@
+\set id random(1, :rows)
+SELECT cardinality(array_sort(f8)) FROM arraymath_bench WHERE id = :id;
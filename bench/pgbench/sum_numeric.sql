@@ -0,0 +1,2 @@
+\set id random(1, :rows)
+SELECT array_sum(num) FROM arraymath_bench WHERE id = :id;
@@ -59,3 +59,540 @@ SELECT
 	FROM a;
 
 
+SELECT op, array_math_array(ARRAY[1,2], ARRAY[3,4], op)
+	AS array_math_array_ops
+	FROM (VALUES ('+'), ('-'), ('*'), ('+')) AS v(op);
+
+SELECT ARRAY[1.5,2.5,3.5]::float8[] @+ ARRAY[1,2]::float8[]
+	AS array_plus_array_float8;
+
+SELECT ARRAY[1.5,2.5]::float4[] @- 0.5::float4
+	AS array_minus_value_float4;
+
+SELECT ARRAY[10,20,30]::int8[] @/ ARRAY[3,-7]::int8[]
+	AS array_div_array_int8;
+
+SELECT ARRAY['NaN',1,2]::float8[] @< ARRAY['NaN','NaN',1]::float8[]
+	AS array_lt_array_nan;
+
+SELECT ARRAY['NaN',1,2]::float8[] @= ARRAY['NaN','NaN',2]::float8[]
+	AS array_eq_array_nan;
+
+SELECT ARRAY[2147483647,1] @+ 1
+	AS array_plus_value_overflow;
+
+SELECT ARRAY[-9223372036854775808]::int8[] @/ (-1)::int8
+	AS array_div_value_overflow;
+
+SELECT ARRAY[1,2]::int2[] @/ ARRAY[1,0]::int2[]
+	AS array_div_array_zero;
+SELECT ARRAY[-32768,1]::int2[] @/ ARRAY[-1,0]::int2[]
+	AS array_div_array_zero_before_overflow;
+
+SELECT ARRAY[1e308]::float8[] @* 10::float8
+	AS array_times_value_float8_overflow;
+
+SELECT ARRAY[1,NULL,3] @* ARRAY[2,2]
+	AS array_times_array_null;
+
+SELECT ARRAY[1.5,NULL,3.5] @> 2.0
+	AS array_gt_value_numeric_null;
+
+SELECT ARRAY[1.5,NULL] @+ 1.0
+	AS array_plus_value_numeric_null;
+
+
+SELECT array_sum(ARRAY[1,NULL,3]::int2[])
+	AS array_sum_int2_null;
+
+SELECT array_sum(ARRAY[2147483647, 1])
+	AS array_sum_int4_overflow;
+
+SELECT array_sum_wide(ARRAY[2147483647, 1])
+	AS array_sum_wide_int4;
+
+SELECT array_sum_wide(ARRAY[9223372036854775807, 9223372036854775807]::int8[])
+	AS array_sum_wide_int8;
+
+SELECT array_sum(ARRAY[1e20, 1, -1e20]::float8[])
+	AS array_sum_float8_compensated;
+
+SELECT array_sum(ARRAY[1e308, 1e308]::float8[])
+	AS array_sum_float8_overflow;
+
+SELECT array_sum(ARRAY[1.5,NULL,2.25])
+	AS array_sum_numeric_null;
+
+SELECT array_avg(ARRAY[1.5,2.5]::float8[])
+	AS array_avg_float8;
+
+SELECT array_median(ARRAY[-1,0,-3])
+	AS array_median_zero;
+
+SELECT array_median(ARRAY[4,1,3,2]::float8[])
+	AS array_median_float8;
+
+SELECT array_percentile(ARRAY[50,10,NULL,40,20,30], ARRAY[0.5,0.125,1,NULL]::float8[])
+	AS array_percentile;
+
+SELECT array_percentile(ARRAY[1.0,2.0,4.0], ARRAY[0.75])
+	AS array_percentile_numeric;
+
+SELECT array_percentile(ARRAY[1,2], ARRAY[1.5])
+	AS array_percentile_range;
+
+SELECT array_sort(ARRAY[3,0,-2,NULL,1])
+	AS array_sort_zero;
+
+SELECT array_sort(ARRAY[3,0,-2,NULL,1], true)
+	AS array_rsort_zero;
+
+SELECT array_sort(ARRAY[3,0,-2,NULL,1], false, false)
+	AS array_sort_nulls_last;
+
+SELECT ROW(array_sort(ARRAY[3,NULL,1])) *= ROW('{NULL,1,3}'::int[]) AS array_sort_nulls_image,
+	ROW(array_sort(ARRAY[3,NULL,1]::float8[], false, false)) *= ROW('{1,3,NULL}'::float8[])
+	AS array_sort_nulls_last_image;
+
+SELECT array_sort(ARRAY['NaN',1.5,'-Infinity',-0.5,'Infinity']::float8[])
+	AS array_sort_float8;
+
+SELECT array_sort(ARRAY[2.5,NULL,-1.0,10], true, true)
+	AS array_rsort_numeric_nulls_first;
+
+SELECT array_sort(b) = (SELECT array_agg(x ORDER BY x) FROM unnest(b) x)
+	AS array_sort_radix_int4,
+	array_sort(b::float8[], true) = (SELECT array_agg(x ORDER BY x DESC) FROM unnest(b::float8[]) x)
+	AS array_rsort_radix_float8
+	FROM (SELECT array_agg((i * 7919) % 1000 - 500) AS b FROM generate_series(1,1000) i) a;
+
+SELECT array_sort(b) = (SELECT array_agg(x ORDER BY x NULLS FIRST) FROM unnest(b) x)
+	AS array_sort_radix_nulls_first,
+	array_sort(b, false, false) = (SELECT array_agg(x ORDER BY x NULLS LAST) FROM unnest(b) x)
+	AS array_sort_radix_nulls_last
+	FROM (SELECT array_agg(CASE WHEN i % 7 = 3 THEN NULL ELSE (i * 7919) % 1000 - 500 END) AS b
+		FROM generate_series(1,1000) i) a;
+
+SELECT array_vsum(a), array_vavg(a), array_vmin(a), array_vmax(a)
+	FROM (VALUES (ARRAY[1,2,NULL]), (ARRAY[3,NULL,NULL]), (NULL), (ARRAY[-1,4,NULL])) v(a);
+
+SELECT array_vmin(a), array_vmax(a)
+	FROM (VALUES (ARRAY[1.5,'NaN']::float8[]), (ARRAY[2.5,0]::float8[])) v(a);
+
+SELECT array_vsum(a)
+	FROM (VALUES (ARRAY[1,2]), (ARRAY[1,2,3])) v(a);
+
+SELECT array_vsum(a)
+	FROM (VALUES (ARRAY[2147483647]), (ARRAY[1])) v(a);
+
+SELECT array_vsum(a) = '{}' AS array_vsum_empty, array_vavg(a) = '{}' AS array_vavg_empty,
+	array_vmin(a), array_vavg(a)
+	FROM (VALUES ('{}'::int[]), ('{}'::int[])) v(a);
+
+CREATE TABLE vagg AS
+	SELECT ARRAY[i, i % 7, -i]::int8[] AS a FROM generate_series(1,10000) i;
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+
+EXPLAIN (COSTS OFF)
+SELECT array_vsum(a) FROM vagg;
+
+SELECT array_vsum(a), array_vavg(a), array_vmin(a), array_vmax(a)
+	FROM vagg;
+
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET min_parallel_table_scan_size;
+RESET max_parallel_workers_per_gather;
+DROP TABLE vagg;
+
+SELECT array_eval('a * b + c', VARIADIC ARRAY[ARRAY[1,2,3], ARRAY[4,5,6], ARRAY[7,8,9]])
+	AS array_eval_int4;
+
+SELECT array_eval('-(a - 0.5) * 2', VARIADIC ARRAY[ARRAY[1.5,2.5]::float8[]])
+	AS array_eval_float8;
+
+SELECT array_eval('a / b', VARIADIC ARRAY[ARRAY[1.0,3.0], ARRAY[4.0,NULL]])
+	AS array_eval_numeric;
+
+SELECT array_eval('a + 1', VARIADIC ARRAY[ARRAY[1,NULL,3]])
+	AS array_eval_null;
+
+SELECT array_eval('a * 2 - b', VARIADIC ARRAY[x, x]) = (x @* 2) @- x
+	AS array_eval_chunks
+	FROM (SELECT array_agg(i) AS x FROM generate_series(1,1000) i) s;
+
+SELECT array_eval('1 + 2', VARIADIC '{}'::int[]) = '{}' AS array_eval_empty,
+	array_eval('1 + 2', VARIADIC '{}'::numeric[]) = '{}' AS array_eval_empty_numeric;
+
+SELECT array_eval('a + d', VARIADIC ARRAY[ARRAY[1], ARRAY[2]])
+	AS array_eval_missing;
+
+SELECT array_eval('a + * b', VARIADIC ARRAY[ARRAY[1], ARRAY[2]])
+	AS array_eval_syntax;
+
+SELECT array_eval('a / (b - b)', VARIADIC ARRAY[ARRAY[1], ARRAY[2]])
+	AS array_eval_div_zero;
+
+CREATE FUNCTION arraymath_loop(n int) RETURNS int4[] AS $$
+DECLARE
+	acc int4[] := ARRAY[0,0,0];
+BEGIN
+	FOR i IN 1..n LOOP
+		acc := acc @+ ARRAY[1,2,3];
+		acc := acc @* 2;
+	END LOOP;
+	RETURN acc;
+END
+$$ LANGUAGE plpgsql;
+
+SELECT arraymath_loop(10) AS array_inplace_loop;
+
+CREATE FUNCTION arraymath_loop_alias() RETURNS text AS $$
+DECLARE
+	acc float8[] := ARRAY[1,2,3];
+	saved float8[];
+BEGIN
+	saved := acc;
+	acc := acc @+ acc;
+	acc[2] := 0;
+	acc := acc @- 1::float8;
+	RETURN saved::text || ' ' || acc::text;
+END
+$$ LANGUAGE plpgsql;
+
+SELECT arraymath_loop_alias() AS array_inplace_alias;
+
+CREATE FUNCTION arraymath_loop_error() RETURNS int2[] AS $$
+DECLARE
+	acc int2[] := ARRAY[1,32767];
+BEGIN
+	BEGIN
+		acc := acc @+ 1::int2;
+	EXCEPTION WHEN others THEN
+		RAISE NOTICE 'caught: %', SQLERRM;
+	END;
+	RETURN acc;
+END
+$$ LANGUAGE plpgsql;
+
+SELECT arraymath_loop_error() AS array_inplace_error;
+
+DROP FUNCTION arraymath_loop(int);
+DROP FUNCTION arraymath_loop_alias();
+DROP FUNCTION arraymath_loop_error();
+
+SELECT ARRAY[[1,2,3],[4,5,6]] @+ ARRAY[10,20,30]
+	AS array_broadcast_row;
+
+SELECT ARRAY[[1],[2]] @* ARRAY[[1,2,3]]
+	AS array_broadcast_outer;
+
+SELECT ARRAY[[[1,2],[3,4]],[[5,6],[7,8]]] @- ARRAY[[1],[2]]
+	AS array_broadcast_3d;
+
+SELECT ARRAY[[1.5,NULL],[2.5,3.5]] @- ARRAY[0.5,1.5]
+	AS array_broadcast_numeric;
+
+SELECT ARRAY[[1,2],[3,4]] @< 3
+	AS array_2d_value;
+
+SELECT ARRAY[[1,2,3],[4,5,6]] @+ ARRAY[1,2]
+	AS array_broadcast_err;
+
+SELECT array_sum(ARRAY[[1,2,3],[4,5,6]]) AS array_sum_2d,
+	array_sum(ARRAY[[1,2,3],[4,5,6]], axis => 1) AS array_sum_rows,
+	array_sum(ARRAY[[1,2,3],[4,5,6]], axis => 0) AS array_sum_cols;
+
+SELECT array_max(ARRAY[[1,NULL],[NULL,NULL]]::int4[], -1) AS array_max_axis,
+	array_avg(ARRAY[[1,2],[3,5]], 0) AS array_avg_axis,
+	array_median(ARRAY[[[1,2],[3,4]],[[5,6],[7,8]]], 2) AS array_median_axis,
+	array_sum(ARRAY[1,2,3], 0) AS array_sum_axis_1d;
+
+SELECT array_min(ARRAY[[[1,8],[3,4]],[[5,2],[7,6]]], 1) AS array_min_axis_middle,
+	array_avg(ARRAY[[[1,8],[3,4]],[[5,2],[7,6]]]::float4[], 1) AS array_avg_axis_middle;
+
+SELECT array_sum(ARRAY[[1,2],[3,4]], 2)
+	AS array_axis_err;
+
+SELECT ARRAY[2147483647,1,NULL,4] @+ ARRAY[NULL,2]
+	AS array_nulls_no_overflow;
+
+SELECT ARRAY[[1,NULL],[3,4]]::float8[] @/ 2::float8
+	AS array_nulls_2d_value;
+
+SELECT ARRAY[1,NULL,3] @< 2
+	AS array_nulls_compare;
+
+SELECT x @* y = (x::numeric[] @* y::numeric[])::int8[] AS array_nulls_words,
+	array_length(x @* y, 1) AS array_nulls_words_len
+	FROM (SELECT array_agg(CASE WHEN i % 7 = 0 THEN NULL ELSE i END)::int8[] AS x
+		FROM generate_series(1,200) i) a,
+	(SELECT array_agg(CASE WHEN i % 5 = 0 THEN NULL ELSE i END)::int8[] AS y
+		FROM generate_series(1,30) i) b;
+
+SELECT array_dot(ARRAY[1,2,3]::float4[], ARRAY[4,5,6]::float4[]) AS array_dot,
+	array_dot(ARRAY[1.5,2.5], ARRAY[2,4]::numeric[]) AS array_dot_numeric,
+	array_l1_distance(ARRAY[1,2,3], ARRAY[4,6,8]) AS array_l1_distance,
+	array_l2_distance(ARRAY[0,0]::float8[], ARRAY[3,4]::float8[]) AS array_l2_distance,
+	array_norm(ARRAY[3,4]::float4[]) AS array_norm;
+
+SELECT array_cosine_similarity(ARRAY[1,0]::float8[], ARRAY[0,1]::float8[]) AS array_cosine_orthogonal,
+	array_cosine_similarity(ARRAY[1,2]::float8[], ARRAY[2,4]::float8[]) AS array_cosine_parallel,
+	ARRAY[1,0]::float8[] <=> ARRAY[-1,0]::float8[] AS array_cosine_opposite;
+
+SELECT array_agg(id ORDER BY a <-> ARRAY[2,2]::float8[]) AS array_order_l2,
+	array_agg(id ORDER BY a <#> ARRAY[1,1]::float8[]) AS array_order_dot
+	FROM (VALUES (1, ARRAY[1,1]::float8[]), (2, ARRAY[5,5]::float8[]),
+		(3, ARRAY[2,3]::float8[])) v(id, a);
+
+SELECT array_dot(ARRAY[1,NULL]::float8[], ARRAY[1,2]::float8[])
+	AS array_dot_null;
+
+SELECT array_dot((ARRAY[3,4,NULL]::float8[])[1:2], ARRAY[1,1]::float8[]) AS array_dot_bitmap,
+	array_norm((ARRAY[3,4,NULL]::float8[])[1:2]) AS array_norm_bitmap;
+
+SELECT array_dot(ARRAY[1,2,3], ARRAY[1,2])
+	AS array_dot_err;
+
+SELECT array_topk(ARRAY[5,1,9,NULL,3,9,7], 3) AS array_topk,
+	array_bottomk(ARRAY[5,1,9,NULL,3,9,7], 2) AS array_bottomk,
+	array_argtopk(ARRAY[5,1,9,NULL,3,9,7], 3) AS array_argtopk,
+	array_argbottomk(ARRAY[5,1,9,NULL,3,9,7], 2) AS array_argbottomk;
+
+SELECT array_topk(ARRAY[1.5,NULL,0.5,2.5], 10) AS array_topk_numeric,
+	array_argtopk(ARRAY[1.5,NULL,0.5,2.5], 2) AS array_argtopk_numeric,
+	array_topk(ARRAY['NaN',1,2]::float8[], 2) AS array_topk_nan,
+	array_topk(ARRAY[1,2,3], 0) AS array_topk_zero;
+
+SELECT array_topk(ARRAY[1,2,3], -1)
+	AS array_topk_err;
+
+SELECT * FROM array_stats(ARRAY[2,4,NULL,4,4,5,5,7,9]);
+
+SELECT * FROM array_stats(ARRAY[1.5,NULL,2.5]);
+
+SELECT (array_stats(ARRAY[NULL,3]::float8[])).*;
+
+WITH v AS (SELECT array_agg(i * 7 % 1000) AS a FROM generate_series(1,5000) i)
+SELECT s.sum = array_sum(a) AND s.min = array_min(a) AND s.max = array_max(a) AS array_stats_agree,
+	round(s.mean::numeric, 9) = round(array_avg(a)::numeric, 9) AS array_stats_mean,
+	round(s.stddev::numeric, 6) = (SELECT round(stddev(x), 6) FROM unnest(a) x) AS array_stats_stddev
+	FROM v, LATERAL array_stats(a) s;
+
+CREATE TABLE arraymath_toast (a float8[], b int8[]);
+ALTER TABLE arraymath_toast ALTER COLUMN a SET STORAGE EXTERNAL,
+	ALTER COLUMN b SET STORAGE EXTERNAL;
+INSERT INTO arraymath_toast
+	SELECT array_agg(i), array_agg(CASE WHEN i % 10 = 0 THEN NULL ELSE i END)
+	FROM generate_series(1,200000) i;
+
+SELECT pg_column_compression(a) IS NULL AND pg_column_size(a) > 1000000
+	AS array_toast_external
+	FROM arraymath_toast;
+
+SELECT array_sum(a), array_avg(a), array_min(a), array_max(a)
+	FROM arraymath_toast;
+
+SELECT array_sum(b), array_sum_wide(b), array_avg(b), array_min(b), array_max(b)
+	FROM arraymath_toast;
+
+SELECT s.count, s.nulls, s.sum, s.min, s.max,
+	round(s.mean::numeric, 6) AS mean, round(s.stddev::numeric, 6) AS stddev
+	FROM arraymath_toast, LATERAL array_stats(b) s;
+
+UPDATE arraymath_toast SET a = (SELECT array_agg(CASE i WHEN 1 THEN 1e17 WHEN 65537 THEN -1e17 ELSE 0.1 END::float8)
+	FROM generate_series(1, 200000) i);
+SELECT array_sum(a) AS array_sum_toast_parts,
+	array_sum(a) = array_sum(a[1:200000]) AS array_sum_toast_in_memory
+	FROM arraymath_toast;
+
+DROP TABLE arraymath_toast;
+
+SET arraymath.simd = scalar;
+SELECT ARRAY[1,2,3]::float8[] @* 2::float8 AS array_simd_scalar,
+	array_dot(ARRAY[1,2,3]::float4[], ARRAY[4,5,6]::float4[]) AS array_simd_dot;
+RESET arraymath.simd;
+
+SET arraymath.simd = bogus;
+
+SHOW arraymath.track;
+SET arraymath.track = on;
+SELECT array_sum(ARRAY[1,2,3]) AS array_track_sum;
+RESET arraymath.track;
+
+SELECT array_cumsum(ARRAY[1,2,NULL,3,4]) AS array_cumsum_int,
+	array_cumprod(ARRAY[1.5,NULL,2,-1]::float8[]) AS array_cumprod_float8,
+	array_cumsum('{}'::int4[]) AS array_cumsum_empty;
+SELECT array_cumsum(ARRAY[1.5,2.25,NULL,3]) AS array_cumsum_numeric,
+	array_cumprod(ARRAY[2,3,NULL,0.5]) AS array_cumprod_numeric;
+SELECT array_cumsum(ARRAY[32767,1]::int2[]);
+
+SELECT array_diff(ARRAY[1,4,9,16,25]) AS array_diff_int,
+	array_diff(ARRAY[1,4,9,16,25], 2) AS array_diff_lag,
+	array_diff(ARRAY[1,NULL,9,16]::float8[]) AS array_diff_nulls,
+	array_diff(ARRAY[1.5,2,NULL,4]) AS array_diff_numeric;
+SELECT array_diff(ARRAY[1,2], 0);
+
+SELECT array_moving_sum(ARRAY[1,2,3,4,5], 3) AS array_moving_sum_int,
+	array_moving_avg(ARRAY[1,2,3,4,5], 2) AS array_moving_avg_int,
+	array_moving_min(ARRAY[5,3,NULL,4,1,2], 2) AS array_moving_min_nulls,
+	array_moving_max(ARRAY[5,3,NULL,4,1,2], 2) AS array_moving_max_nulls;
+SELECT array_moving_sum(ARRAY[1,'NaN',2,3,NULL,NULL]::float8[], 2) AS array_moving_sum_nan,
+	array_moving_avg(ARRAY[1,2,NULL,'NaN',4]::numeric[], 2) AS array_moving_avg_numeric,
+	array_moving_max(ARRAY[1,5,2,NULL,3]::numeric[], 3) AS array_moving_max_numeric;
+SELECT array_moving_sum(ARRAY[1], 0);
+
+SELECT array_abs(ARRAY[-3,0,NULL,7]) AS array_abs_int,
+	array_abs(ARRAY[-1.5,2.5]::float4[]) AS array_abs_float4,
+	array_abs(ARRAY[[-1.5,2],[NULL,-3]]) AS array_abs_numeric;
+SELECT array_abs(ARRAY[-32768]::int2[]);
+SELECT array_round(ARRAY[1.25,2.5,-3.75]::float8[], 1) AS array_round_float8,
+	array_round(ARRAY[1.5,2.5]::float8[]) AS array_round_even,
+	array_round(ARRAY[1234,-1250,NULL], -2) AS array_round_int,
+	array_round(ARRAY[1.25,2.5,-3.75], 1) AS array_round_numeric;
+SELECT array_clamp(ARRAY[-5,0,5,10], 0, 6) AS array_clamp_int,
+	array_clamp(ARRAY[-1,'NaN',0.5]::float8[], 0, 1) AS array_clamp_nan,
+	array_clamp(ARRAY[1.5,NULL,-2], -1, 1) AS array_clamp_numeric;
+SELECT array_clamp(ARRAY[1,2], 5, 1);
+SELECT array_sqrt(ARRAY[4,NULL,2.25]::float8[]) AS array_sqrt_float8,
+	array_sqrt(ARRAY[[1,4],[9,16]]) AS array_sqrt_int,
+	array_sqrt(ARRAY[2.25]) AS array_sqrt_numeric;
+SELECT array_sqrt(ARRAY[1,-4]);
+SELECT array_exp(ARRAY[0,1]::float8[]) AS array_exp,
+	array_ln(ARRAY[1,NULL,'Infinity']::float8[]) AS array_ln;
+SELECT array_ln(ARRAY[0]);
+SELECT array_ln(ARRAY[-1,0]);
+SELECT array_exp(ARRAY[1000]::float8[]);
+SELECT array_pow(ARRAY[2,3,NULL], 2) AS array_pow_int,
+	array_pow(ARRAY[4,9]::float4[], 0.5) AS array_pow_float4;
+SELECT array_pow(ARRAY[-8]::float8[], 1.0/3);
+SELECT array_pow(ARRAY[0]::float8[], -1);
+
+SELECT array_count(ARRAY[1,5,NULL,7,3], '>', 2) AS array_count,
+	array_any(ARRAY[1,5,NULL,7,3], '=', 7) AS array_any,
+	array_all(ARRAY[1,5,NULL,7,3], '>', 0) AS array_all,
+	array_all(ARRAY[1,5,NULL,7,3], '<', 7) AS array_all_miss;
+SELECT array_count(ARRAY[1,'NaN',2,NULL]::float8[], '>=', '2') AS array_count_nan,
+	array_count(ARRAY[1.5,2.5,NULL], '<', 2.0) AS array_count_numeric,
+	array_any(ARRAY[]::int4[], '=', 1) AS array_any_empty,
+	array_all(ARRAY[NULL]::int4[], '=', 1) AS array_all_nulls;
+SELECT array_count(arr, '<', 1000) AS array_count_large,
+	array_any(arr, '=', 4999) AS array_any_large,
+	array_all(arr, '>', 0) AS array_all_large,
+	array_where(arr, '>', 4997) AS array_where_large
+	FROM (SELECT array_agg(CASE WHEN i % 10 = 0 THEN NULL ELSE i END) AS arr
+		FROM generate_series(1, 5000) i) s;
+SELECT array_count(ARRAY[1,2], '+', 1);
+SELECT array_where(ARRAY[[1,5],[NULL,7]], '>', 2) AS array_where,
+	array_where(ARRAY[3,1,2]::int2[], '<', 0::int2) AS array_where_none,
+	array_select(ARRAY[4,NULL,9,1,16]::float8[], '>', '2') AS array_select,
+	array_select(ARRAY[1.5,NULL,3.5], '>', 2.0) AS array_select_numeric;
+SELECT array_select(ARRAY['pear','fig','plum'], '>', 'kiwi') AS array_select_text,
+	array_select(ARRAY['a','b','c','d'], ARRAY[1,5,NULL,7], '>=', 5) AS array_select_values;
+SELECT array_select(ARRAY[1,2,3], ARRAY[1,2], '=', 1);
+
+SELECT array_sum(a) AS array_sum_parts
+	FROM (SELECT array_agg(CASE i WHEN 1 THEN 1e17 WHEN 65537 THEN -1e17 ELSE 0.1 END::float8) AS a
+		FROM generate_series(1, 200000) i) s;
+
+SET arraymath.max_threads = 4;
+SET arraymath.parallel_threshold = 65536;
+SELECT array_sum(a) AS array_sum_parts
+	FROM (SELECT array_agg(CASE i WHEN 1 THEN 1e17 WHEN 65537 THEN -1e17 ELSE 0.1 END::float8) AS a
+		FROM generate_series(1, 200000) i) s;
+SELECT array_sum(arr) AS array_sum_threads,
+	array_sum(arr @* 2::int8) AS array_math_threads,
+	array_sum(array_abs(arr @- 100000::int8)) AS array_abs_threads,
+	array_sum(array_fill(0.1::float8, ARRAY[200000])) AS array_sum_float8
+	FROM (SELECT array_agg(i) AS arr FROM generate_series(1, 200000::int8) i) s;
+SELECT array_sum(array_fill(2000000000, ARRAY[200000]) @+ 2000000000);
+RESET arraymath.max_threads;
+RESET arraymath.parallel_threshold;
+
+SELECT array_matmul(ARRAY[[1,2],[3,4]]::float8[], ARRAY[[5,6],[7,8]]::float8[]) AS array_matmul_float8,
+	array_matmul(ARRAY[[1,2]]::float4[], ARRAY[[3],[4]]::float4[]) AS array_matmul_float4,
+	array_matmul(ARRAY[[1,2,3],[4,5,6]], ARRAY[[1],[2],[3]]) AS array_matmul_int,
+	array_matmul(ARRAY[[1.5,2],[0.5,1]], ARRAY[[2,0],[0,2]]::numeric[]) AS array_matmul_numeric;
+SELECT array_matmul('[0:1][5:6]={{1,0},{0,1}}'::int4[], '[1:2][3:4]={{1,2},{3,4}}'::int4[]) AS array_matmul_bounds,
+	array_matvec(ARRAY[[1,2],[3,4]]::float8[], ARRAY[1,1]::float8[]) AS array_matvec_float8,
+	array_matvec(ARRAY[[1,2,3],[4,5,6]], ARRAY[1,0,-1]) AS array_matvec_int;
+SELECT array_matmul(ARRAY[[1,2]], ARRAY[[1,2]]);
+SELECT array_matmul(ARRAY[1,2], ARRAY[[1],[2]]);
+SELECT array_matvec(ARRAY[[1,2]], ARRAY[1,2,3]);
+SELECT array_matvec(ARRAY[[1,2]], ARRAY[1,NULL]);
+SELECT array_matmul(ARRAY[[2000000000]], ARRAY[[2]]);
+SELECT array_matmul(ARRAY[[1e308,1e308]]::float8[], ARRAY[[10],[1]]::float8[]);
+SELECT array_matmul(a, b) = array_matmul(a::numeric[], b::numeric[])::float8[] AS array_matmul_tiles,
+	array_dims(array_matmul(a, b)) AS array_matmul_tiles_dims,
+	array_matmul(ARRAY[['Infinity',1]]::float8[], ARRAY[[1],[1]]::float8[]) AS array_matmul_inf
+	FROM (SELECT array_agg(r ORDER BY i) AS a
+		FROM (SELECT i, array_agg(((i * j) % 7)::float8 ORDER BY j) AS r
+			FROM generate_series(1, 17) i, generate_series(1, 130) j GROUP BY i) s) sa,
+	(SELECT array_agg(r ORDER BY i) AS b
+		FROM (SELECT i, array_agg(((i + j) % 5 - 2)::float8 ORDER BY j) AS r
+			FROM generate_series(1, 130) i, generate_series(1, 257) j GROUP BY i) s) sb;
+SELECT array_transpose(ARRAY[[1,2,3],[4,5,6]]) AS array_transpose,
+	array_transpose(ARRAY[[1,NULL],[3,4]]) AS array_transpose_nulls,
+	array_transpose(ARRAY[['a','b'],['c','d'],['e','f']]) AS array_transpose_text,
+	array_transpose('[2:3][0:1]={{1,2},{3,4}}'::int2[]) AS array_transpose_bounds;
+SELECT array_outer(ARRAY[1,2,3], ARRAY[10,20]) AS array_outer_int,
+	array_outer(ARRAY[0.5,2]::float8[], ARRAY[4,-1]::float8[]) AS array_outer_float8,
+	array_outer(ARRAY[1.5], ARRAY[2.0,3]) AS array_outer_numeric;
+SELECT array_outer(ARRAY[100000], ARRAY[100000]);
+
+SELECT array_searchsorted(ARRAY[10,20,30], 20) AS array_searchsorted,
+	array_searchsorted(ARRAY[10,20,30], 20, true) AS array_searchsorted_rightmost,
+	array_searchsorted(ARRAY[10,20,30], 5) AS array_searchsorted_first,
+	array_searchsorted(ARRAY[10,20,30], 35) AS array_searchsorted_last,
+	array_searchsorted(array_sort(ARRAY[3,NULL,1,2]::int2[]), 2::int2) AS array_searchsorted_nulls;
+SELECT array_searchsorted(ARRAY[0,10,20]::float8[], ARRAY[[-1,0],[15,NULL]]::float8[], true) AS array_searchsorted_2d,
+	array_searchsorted(ARRAY['-Infinity',0,1,'NaN']::float8[], ARRAY['-0','NaN',2]::float8[]) AS array_searchsorted_float8,
+	array_searchsorted(ARRAY[1.5,2.5,NULL], 2.5, true) AS array_searchsorted_numeric,
+	array_searchsorted(ARRAY[1.5,2.5], ARRAY[0,2,3]::numeric[]) AS array_searchsorted_numerics;
+SELECT array_searchsorted(ARRAY[10,20,30], '[0:1]={15,25}'::int[]) AS array_searchsorted_bounds,
+	array_searchsorted(ARRAY[1.5,2.5], '[0:1]={2,3}'::numeric[]) AS array_searchsorted_numeric_bounds;
+SELECT array_merge_sorted(ARRAY[1,3,5], ARRAY[2,3,NULL,6]) AS array_merge_sorted,
+	array_intersect_sorted(ARRAY[1,2,2,3,5], ARRAY[2,2,2,5,7]) AS array_intersect_sorted,
+	array_except_sorted(ARRAY[1,2,2,3,5], ARRAY[2,5,7]) AS array_except_sorted,
+	array_intersect_sorted(ARRAY['-0',1,'NaN']::float8[], ARRAY[0,'NaN']::float8[]) AS array_intersect_float8;
+SELECT array_merge_sorted(ARRAY[1.0,2.5], ARRAY[1,3]::numeric[]) AS array_merge_numeric,
+	array_except_sorted(ARRAY[1.0,2.5,3], ARRAY[1,3]::numeric[]) AS array_except_numeric,
+	array_intersect_sorted(ARRAY[1,2], ARRAY[]::int4[]) AS array_intersect_empty,
+	array_merge_sorted(ARRAY[]::int8[], ARRAY[]::int8[]) AS array_merge_empty;
+SELECT array_sum(array_searchsorted(evens, probes)) AS array_searchsorted_large,
+	array_sum(array_searchsorted(evens, probes, true)) AS array_searchsorted_rightmost_large,
+	array_merge_sorted(evens, odds) = all_values AS array_merge_large,
+	array_length(array_intersect_sorted(evens, threes), 1) AS array_intersect_large,
+	array_length(array_except_sorted(evens, threes), 1) AS array_except_large
+	FROM (SELECT array_agg(i ORDER BY i) FILTER (WHERE i % 2 = 0) AS evens,
+			array_agg(i ORDER BY i) FILTER (WHERE i % 2 = 1) AS odds,
+			array_agg(i ORDER BY i) FILTER (WHERE i % 3 = 0) AS threes,
+			array_agg(i ORDER BY i) AS all_values
+		FROM generate_series(0, 19999) i) s,
+	(SELECT array_agg(i ORDER BY i) AS probes FROM generate_series(-5, 20005) i) p;
+SELECT array_merge_sorted(ARRAY[[1]], ARRAY[1]);
+
+SELECT array_uniq(ARRAY[3,1,3,NULL,2,1]) AS array_uniq,
+	array_count_distinct(ARRAY[3,1,3,NULL,2,1]) AS array_count_distinct,
+	array_mode(ARRAY[3,1,3,NULL,2,1]) AS array_mode,
+	array_mode(ARRAY[NULL]::int4[]) AS array_mode_nulls;
+SELECT array_uniq(ARRAY[0,'-0','NaN',1,'NaN']::float8[]) AS array_uniq_float8,
+	array_count_distinct(ARRAY['-0',0,'NaN','NaN',1.5]::float4[]) AS array_count_distinct_float4,
+	array_uniq(ARRAY[1.0,2,1,NULL,2.50,2.5]) AS array_uniq_numeric,
+	array_mode(ARRAY[1.0,2.5,1,2.50,2.500]) AS array_mode_numeric;
+SELECT array_count_distinct(ARRAY[[1,2],[2,NULL]]::int2[]) AS array_count_distinct_2d,
+	array_uniq(ARRAY[[1,2],[2,3]]::int8[]) AS array_uniq_2d,
+	array_uniq(ARRAY[]::int4[]) AS array_uniq_empty,
+	array_count_distinct(ARRAY[]::numeric[]) AS array_count_distinct_empty;
+SELECT * FROM array_value_counts(ARRAY[5,3,5,NULL,5,3,9]);
+SELECT * FROM array_value_counts(ARRAY[]::float8[]);
+SELECT u.value, u.count
+	FROM array_value_counts(ARRAY[2.5,1,2.50]) v, unnest(v.vals, v.counts) AS u(value, count);
+SELECT array_count_distinct(arr) AS array_count_distinct_large,
+	array_mode(arr) AS array_mode_large,
+	array_mode(arr::float8[]) AS array_mode_float8_large,
+	array_length(array_uniq(arr::int8[]), 1) AS array_uniq_large
+	FROM (SELECT array_agg((i * 7919) % 10007) AS arr FROM generate_series(1, 100000) i) s;
@@ -0,0 +1,17 @@
+SET client_min_messages = warning;
+CREATE EXTENSION IF NOT EXISTS arraymath;
+RESET client_min_messages;
+
+SET arraymath.track = on;
+SELECT arraymath_stats_reset() IS NOT NULL AS t;
+
+SELECT array_sum(ARRAY[1,2,NULL,4]) AS array_track_sum;
+SELECT ARRAY[1,2,3] @+ ARRAY[4,5,6] AS array_track_add;
+
+SELECT ARRAY[1,2] @/ ARRAY[1,0] AS array_track_div_zero;
+
+SELECT array_sum(ARRAY[5,6]) AS array_track_sum_again;
+
+SELECT kind, name, calls, elements, nulls FROM arraymath_stats ORDER BY kind, name;
+
+RESET arraymath.track;